@@ -0,0 +1,594 @@
+#include "stdafx.h"
+#include "BoundingVolumeHierarchy.h"
+#include "FrustumCuller.h"
+#include "CpuTimer.h"
+
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+
+#define BVH_MAX_LEAF_BOUNDS 4
+#define BVH_NUM_BINS 16
+
+namespace RenderLab
+{
+  BoundingVolumeHierarchy::BoundingVolumeHierarchy() :
+    m_numBounds(0),
+    m_built(false),
+    m_stats()
+  {
+  }
+
+  BoundingVolumeHierarchy::~BoundingVolumeHierarchy()
+  {
+  }
+
+  void BoundingVolumeHierarchy::setNumBounds(uint32_t numBounds)
+  {
+    m_numBounds = numBounds;
+    m_centers.resize(numBounds);
+    m_extents.resize(numBounds);
+    m_built = false;
+  }
+
+  void BoundingVolumeHierarchy::setBounds(uint32_t index, const vec3& center, const vec3& extent)
+  {
+    m_centers[index] = center;
+    m_extents[index] = extent;
+
+    if (m_built)
+    {
+      uint32_t leaf = m_leafNodes[index];
+      if (!m_dirty[leaf])
+      {
+        m_dirty[leaf] = 1;
+        m_dirtyNodes.push_back(leaf);
+      }
+    }
+  }
+
+  void BoundingVolumeHierarchy::build()
+  {
+    CpuTimer timer;
+    timer.start();
+
+    m_nodes.clear();
+    m_nodes.reserve(std::max(m_numBounds * 2, 1u));
+    m_boundIndices.resize(m_numBounds);
+    m_leafNodes.resize(m_numBounds);
+    for (uint32_t i = 0; i < m_numBounds; i++)
+    {
+      m_boundIndices[i] = i;
+    }
+
+    m_stats = Stats();
+    Node root;
+    root.m_firstBound = 0;
+    root.m_numBounds = m_numBounds;
+    root.m_left = 0;
+    root.m_parent = 0;
+    m_nodes.push_back(root);
+    buildNode(0, 1);
+
+    m_dirty.assign(m_nodes.size(), 0);
+    m_dirtyNodes.clear();
+    m_built = true;
+
+    m_stats.m_numBounds = m_numBounds;
+    m_stats.m_numNodes = (uint32_t)m_nodes.size();
+    m_stats.m_buildMicro = timer.elapsedMicro();
+  }
+
+  void BoundingVolumeHierarchy::buildNode(uint32_t nodeIndex, uint32_t depth)
+  {
+    uint32_t first = m_nodes[nodeIndex].m_firstBound;
+    uint32_t count = m_nodes[nodeIndex].m_numBounds;
+
+    vec3 boxMin(FLT_MAX);
+    vec3 boxMax(-FLT_MAX);
+    vec3 centroidMin(FLT_MAX);
+    vec3 centroidMax(-FLT_MAX);
+    for (uint32_t i = first; i < first + count; i++)
+    {
+      uint32_t bound = m_boundIndices[i];
+      boxMin = glm::min(boxMin, m_centers[bound] - m_extents[bound]);
+      boxMax = glm::max(boxMax, m_centers[bound] + m_extents[bound]);
+      centroidMin = glm::min(centroidMin, m_centers[bound]);
+      centroidMax = glm::max(centroidMax, m_centers[bound]);
+    }
+    if (count == 0)
+    {
+      boxMin = boxMax = vec3(0.0f);
+    }
+    m_nodes[nodeIndex].m_min = boxMin;
+    m_nodes[nodeIndex].m_max = boxMax;
+    m_stats.m_maxDepth = std::max(m_stats.m_maxDepth, depth);
+
+    if (count <= BVH_MAX_LEAF_BOUNDS)
+    {
+      m_nodes[nodeIndex].m_left = 0;
+      for (uint32_t i = first; i < first + count; i++)
+      {
+        m_leafNodes[m_boundIndices[i]] = nodeIndex;
+      }
+      m_stats.m_numLeaves++;
+      return;
+    }
+
+    // Split on the axis the centroids spread furthest along
+    vec3 centroidExtent = centroidMax - centroidMin;
+    int axis = 0;
+    if (centroidExtent.y > centroidExtent[axis])
+    {
+      axis = 1;
+    }
+    if (centroidExtent.z > centroidExtent[axis])
+    {
+      axis = 2;
+    }
+
+    uint32_t middle = first + count / 2;
+    if (centroidExtent[axis] > 0.0f)
+    {
+      // Drop the centroids into bins, then sweep the bin boundaries for the
+      // split with the lowest surface area cost. Areas are summed in double
+      // since unbounded meshes use extents near the float limit.
+      uint32_t binCounts[BVH_NUM_BINS] = {};
+      vec3 binMin[BVH_NUM_BINS];
+      vec3 binMax[BVH_NUM_BINS];
+      for (uint32_t b = 0; b < BVH_NUM_BINS; b++)
+      {
+        binMin[b] = vec3(FLT_MAX);
+        binMax[b] = vec3(-FLT_MAX);
+      }
+
+      float binScale = BVH_NUM_BINS / centroidExtent[axis];
+      for (uint32_t i = first; i < first + count; i++)
+      {
+        uint32_t bound = m_boundIndices[i];
+        uint32_t bin = std::min((uint32_t)((m_centers[bound][axis] - centroidMin[axis]) * binScale), (uint32_t)BVH_NUM_BINS - 1);
+        binCounts[bin]++;
+        binMin[bin] = glm::min(binMin[bin], m_centers[bound] - m_extents[bound]);
+        binMax[bin] = glm::max(binMax[bin], m_centers[bound] + m_extents[bound]);
+      }
+
+      double rightCost[BVH_NUM_BINS];
+      vec3 sweepMin(FLT_MAX);
+      vec3 sweepMax(-FLT_MAX);
+      uint32_t sweepCount = 0;
+      for (uint32_t b = BVH_NUM_BINS - 1; b > 0; b--)
+      {
+        if (binCounts[b] > 0)
+        {
+          sweepMin = glm::min(sweepMin, binMin[b]);
+          sweepMax = glm::max(sweepMax, binMax[b]);
+          sweepCount += binCounts[b];
+        }
+        vec3 size = sweepMax - sweepMin;
+        rightCost[b] = sweepCount == 0 ? 0.0 : sweepCount * ((double)size.x * size.y + (double)size.y * size.z + (double)size.z * size.x);
+      }
+
+      double bestCost = DBL_MAX;
+      uint32_t bestSplit = 0;
+      sweepMin = vec3(FLT_MAX);
+      sweepMax = vec3(-FLT_MAX);
+      sweepCount = 0;
+      for (uint32_t b = 1; b < BVH_NUM_BINS; b++)
+      {
+        if (binCounts[b - 1] > 0)
+        {
+          sweepMin = glm::min(sweepMin, binMin[b - 1]);
+          sweepMax = glm::max(sweepMax, binMax[b - 1]);
+          sweepCount += binCounts[b - 1];
+        }
+        if (sweepCount == 0 || sweepCount == count)
+        {
+          continue;
+        }
+        vec3 size = sweepMax - sweepMin;
+        double cost = sweepCount * ((double)size.x * size.y + (double)size.y * size.z + (double)size.z * size.x) + rightCost[b];
+        if (cost < bestCost)
+        {
+          bestCost = cost;
+          bestSplit = b;
+        }
+      }
+
+      if (bestSplit > 0)
+      {
+        uint32_t* split = std::partition(&m_boundIndices[first], &m_boundIndices[first] + count, [&](uint32_t bound)
+        {
+          uint32_t bin = std::min((uint32_t)((m_centers[bound][axis] - centroidMin[axis]) * binScale), (uint32_t)BVH_NUM_BINS - 1);
+          return bin < bestSplit;
+        });
+        middle = (uint32_t)(split - &m_boundIndices[0]);
+      }
+      else
+      {
+        std::nth_element(&m_boundIndices[first], &m_boundIndices[middle], &m_boundIndices[first] + count, [&](uint32_t a, uint32_t b)
+        {
+          return m_centers[a][axis] < m_centers[b][axis];
+        });
+      }
+    }
+
+    // Both children are added together so the right one is always left + 1
+    uint32_t left = (uint32_t)m_nodes.size();
+    Node child;
+    child.m_left = 0;
+    child.m_parent = nodeIndex;
+    child.m_firstBound = first;
+    child.m_numBounds = middle - first;
+    m_nodes.push_back(child);
+    child.m_firstBound = middle;
+    child.m_numBounds = first + count - middle;
+    m_nodes.push_back(child);
+    m_nodes[nodeIndex].m_left = left;
+
+    buildNode(left, depth + 1);
+    buildNode(left + 1, depth + 1);
+  }
+
+  void BoundingVolumeHierarchy::refitNode(uint32_t nodeIndex)
+  {
+    Node& node = m_nodes[nodeIndex];
+    if (node.m_left == 0)
+    {
+      if (node.m_numBounds == 0)
+      {
+        return;
+      }
+      vec3 boxMin(FLT_MAX);
+      vec3 boxMax(-FLT_MAX);
+      for (uint32_t i = node.m_firstBound; i < node.m_firstBound + node.m_numBounds; i++)
+      {
+        uint32_t bound = m_boundIndices[i];
+        boxMin = glm::min(boxMin, m_centers[bound] - m_extents[bound]);
+        boxMax = glm::max(boxMax, m_centers[bound] + m_extents[bound]);
+      }
+      node.m_min = boxMin;
+      node.m_max = boxMax;
+    }
+    else
+    {
+      node.m_min = glm::min(m_nodes[node.m_left].m_min, m_nodes[node.m_left + 1].m_min);
+      node.m_max = glm::max(m_nodes[node.m_left].m_max, m_nodes[node.m_left + 1].m_max);
+    }
+  }
+
+  void BoundingVolumeHierarchy::refit()
+  {
+    if (!m_built)
+    {
+      build();
+      return;
+    }
+
+    CpuTimer timer;
+    timer.start();
+    m_stats.m_numRefitNodes = 0;
+
+    if (m_dirtyNodes.size() * 4 > m_nodes.size())
+    {
+      // Children always come after their parent, so a backwards pass refits everything
+      for (size_t i = m_nodes.size(); i-- > 0;)
+      {
+        refitNode((uint32_t)i);
+      }
+      m_stats.m_numRefitNodes = (uint32_t)m_nodes.size();
+    }
+    else
+    {
+      // Walk up from each moved leaf until a parent box comes out unchanged
+      for (size_t i = 0; i < m_dirtyNodes.size(); i++)
+      {
+        uint32_t nodeIndex = m_dirtyNodes[i];
+        refitNode(nodeIndex);
+        m_stats.m_numRefitNodes++;
+        while (nodeIndex != 0)
+        {
+          nodeIndex = m_nodes[nodeIndex].m_parent;
+          vec3 oldMin = m_nodes[nodeIndex].m_min;
+          vec3 oldMax = m_nodes[nodeIndex].m_max;
+          refitNode(nodeIndex);
+          m_stats.m_numRefitNodes++;
+          if (m_nodes[nodeIndex].m_min == oldMin && m_nodes[nodeIndex].m_max == oldMax)
+          {
+            break;
+          }
+        }
+      }
+    }
+
+    for (size_t i = 0; i < m_dirtyNodes.size(); i++)
+    {
+      m_dirty[m_dirtyNodes[i]] = 0;
+    }
+    m_dirtyNodes.clear();
+    m_stats.m_refitMicro = timer.elapsedMicro();
+  }
+
+  bool BoundingVolumeHierarchy::isBuilt()
+  {
+    return m_built;
+  }
+
+  uint32_t BoundingVolumeHierarchy::getNumBounds()
+  {
+    return m_numBounds;
+  }
+
+  void BoundingVolumeHierarchy::getStats(Stats& stats)
+  {
+    stats = m_stats;
+  }
+
+  void BoundingVolumeHierarchy::appendNode(const Node& node, vector<uint32_t>& indices)
+  {
+    indices.insert(indices.end(), m_boundIndices.begin() + node.m_firstBound, m_boundIndices.begin() + node.m_firstBound + node.m_numBounds);
+  }
+
+  uint32_t BoundingVolumeHierarchy::queryFrustum(const mat4& viewProjection, vector<uint32_t>& indices)
+  {
+    size_t numIndices = indices.size();
+    if (!m_built || m_numBounds == 0)
+    {
+      return 0;
+    }
+
+    vec4 planes[6];
+    vec3 absNormals[6];
+    FrustumCuller::getFrustumPlanes(viewProjection, planes);
+    for (uint32_t p = 0; p < 6; p++)
+    {
+      absNormals[p] = glm::abs(vec3(planes[p]));
+    }
+
+    // Each entry carries the planes its parent was not already inside of
+    m_stack.clear();
+    m_stack.push_back(0);
+    m_stack.push_back(0x3f);
+    while (!m_stack.empty())
+    {
+      uint32_t planeMask = m_stack.back();
+      m_stack.pop_back();
+      const Node& node = m_nodes[m_stack.back()];
+      m_stack.pop_back();
+
+      vec3 center = (node.m_min + node.m_max) * 0.5f;
+      vec3 extent = (node.m_max - node.m_min) * 0.5f;
+      bool outside = false;
+      for (uint32_t p = 0; p < 6; p++)
+      {
+        if ((planeMask & (1 << p)) == 0)
+        {
+          continue;
+        }
+        float d = glm::dot(vec3(planes[p]), center) + planes[p].w;
+        float r = glm::dot(absNormals[p], extent);
+        if (d + r < 0.0f)
+        {
+          outside = true;
+          break;
+        }
+        if (d - r >= 0.0f)
+        {
+          planeMask &= ~(1 << p);
+        }
+      }
+
+      if (outside)
+      {
+        continue;
+      }
+      if (planeMask == 0)
+      {
+        appendNode(node, indices);
+      }
+      else if (node.m_left == 0)
+      {
+        // Same test the FrustumCuller makes for each box
+        for (uint32_t i = node.m_firstBound; i < node.m_firstBound + node.m_numBounds; i++)
+        {
+          uint32_t bound = m_boundIndices[i];
+          const vec3& c = m_centers[bound];
+          const vec3& e = m_extents[bound];
+          bool visible = true;
+          for (uint32_t p = 0; p < 6 && visible; p++)
+          {
+            float d = (planes[p].x * c.x + planes[p].y * c.y) + (planes[p].z * c.z + planes[p].w);
+            float r = (absNormals[p].x * e.x + absNormals[p].y * e.y) + absNormals[p].z * e.z;
+            visible = d + r >= 0.0f;
+          }
+          if (visible)
+          {
+            indices.push_back(bound);
+          }
+        }
+      }
+      else
+      {
+        m_stack.push_back(node.m_left);
+        m_stack.push_back(planeMask);
+        m_stack.push_back(node.m_left + 1);
+        m_stack.push_back(planeMask);
+      }
+    }
+
+    return (uint32_t)(indices.size() - numIndices);
+  }
+
+  uint32_t BoundingVolumeHierarchy::queryBox(const vec3& center, const vec3& extent, vector<uint32_t>& indices)
+  {
+    size_t numIndices = indices.size();
+    if (!m_built || m_numBounds == 0)
+    {
+      return 0;
+    }
+
+    vec3 queryMin = center - extent;
+    vec3 queryMax = center + extent;
+    m_stack.clear();
+    m_stack.push_back(0);
+    while (!m_stack.empty())
+    {
+      const Node& node = m_nodes[m_stack.back()];
+      m_stack.pop_back();
+
+      if (glm::any(glm::lessThan(node.m_max, queryMin)) || glm::any(glm::greaterThan(node.m_min, queryMax)))
+      {
+        continue;
+      }
+      if (glm::all(glm::greaterThanEqual(node.m_min, queryMin)) && glm::all(glm::lessThanEqual(node.m_max, queryMax)))
+      {
+        appendNode(node, indices);
+      }
+      else if (node.m_left == 0)
+      {
+        for (uint32_t i = node.m_firstBound; i < node.m_firstBound + node.m_numBounds; i++)
+        {
+          uint32_t bound = m_boundIndices[i];
+          vec3 distance = glm::abs(m_centers[bound] - center);
+          if (glm::all(glm::lessThanEqual(distance, m_extents[bound] + extent)))
+          {
+            indices.push_back(bound);
+          }
+        }
+      }
+      else
+      {
+        m_stack.push_back(node.m_left);
+        m_stack.push_back(node.m_left + 1);
+      }
+    }
+
+    return (uint32_t)(indices.size() - numIndices);
+  }
+
+  uint32_t BoundingVolumeHierarchy::querySphere(const vec3& center, float radius, vector<uint32_t>& indices)
+  {
+    size_t numIndices = indices.size();
+    if (!m_built || m_numBounds == 0)
+    {
+      return 0;
+    }
+
+    float radiusSquared = radius * radius;
+    m_stack.clear();
+    m_stack.push_back(0);
+    while (!m_stack.empty())
+    {
+      const Node& node = m_nodes[m_stack.back()];
+      m_stack.pop_back();
+
+      // Closest point of the box against the sphere, farthest corner for containment
+      vec3 closest = glm::clamp(center, node.m_min, node.m_max) - center;
+      if (glm::dot(closest, closest) > radiusSquared)
+      {
+        continue;
+      }
+      vec3 farthest = glm::max(glm::abs(node.m_min - center), glm::abs(node.m_max - center));
+      if (glm::dot(farthest, farthest) <= radiusSquared)
+      {
+        appendNode(node, indices);
+      }
+      else if (node.m_left == 0)
+      {
+        for (uint32_t i = node.m_firstBound; i < node.m_firstBound + node.m_numBounds; i++)
+        {
+          uint32_t bound = m_boundIndices[i];
+          vec3 offset = glm::max(glm::abs(m_centers[bound] - center) - m_extents[bound], vec3(0.0f));
+          if (glm::dot(offset, offset) <= radiusSquared)
+          {
+            indices.push_back(bound);
+          }
+        }
+      }
+      else
+      {
+        m_stack.push_back(node.m_left);
+        m_stack.push_back(node.m_left + 1);
+      }
+    }
+
+    return (uint32_t)(indices.size() - numIndices);
+  }
+
+  bool BoundingVolumeHierarchy::queryRay(const vec3& origin, const vec3& direction, float maxDistance, uint32_t& index, float& distance)
+  {
+    if (!m_built || m_numBounds == 0)
+    {
+      return false;
+    }
+
+    vec3 inverseDirection = vec3(1.0f) / direction;
+    float closest = maxDistance;
+    bool hit = false;
+
+    // Slab test, giving the distance the ray enters the box at or -1 for a miss
+    auto intersect = [&](const vec3& boxMin, const vec3& boxMax) -> float
+    {
+      vec3 t0 = (boxMin - origin) * inverseDirection;
+      vec3 t1 = (boxMax - origin) * inverseDirection;
+      vec3 tNear = glm::min(t0, t1);
+      vec3 tFar = glm::max(t0, t1);
+      float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+      float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, closest));
+      return enter <= exit ? enter : -1.0f;
+    };
+
+    m_stack.clear();
+    m_stack.push_back(0);
+    while (!m_stack.empty())
+    {
+      const Node& node = m_nodes[m_stack.back()];
+      m_stack.pop_back();
+
+      if (intersect(node.m_min, node.m_max) < 0.0f)
+      {
+        continue;
+      }
+      if (node.m_left == 0)
+      {
+        for (uint32_t i = node.m_firstBound; i < node.m_firstBound + node.m_numBounds; i++)
+        {
+          uint32_t bound = m_boundIndices[i];
+          float t = intersect(m_centers[bound] - m_extents[bound], m_centers[bound] + m_extents[bound]);
+          if (t >= 0.0f && (!hit || t < closest))
+          {
+            closest = t;
+            index = bound;
+            hit = true;
+          }
+        }
+      }
+      else
+      {
+        // Visit the nearer child first so its hits shorten the ray for the other
+        float leftDistance = intersect(m_nodes[node.m_left].m_min, m_nodes[node.m_left].m_max);
+        float rightDistance = intersect(m_nodes[node.m_left + 1].m_min, m_nodes[node.m_left + 1].m_max);
+        uint32_t nearChild = node.m_left;
+        uint32_t farChild = node.m_left + 1;
+        if (leftDistance < 0.0f || (rightDistance >= 0.0f && rightDistance < leftDistance))
+        {
+          std::swap(nearChild, farChild);
+          std::swap(leftDistance, rightDistance);
+        }
+        if (rightDistance >= 0.0f)
+        {
+          m_stack.push_back(farChild);
+        }
+        if (leftDistance >= 0.0f)
+        {
+          m_stack.push_back(nearChild);
+        }
+      }
+    }
+
+    if (hit)
+    {
+      distance = closest;
+    }
+    return hit;
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+using std::vector;
+
+namespace RenderLab
+{
+  // Binary tree of boxes over world space bounds, built with a binned surface
+  // area heuristic. Moving bounds only refit the boxes above them, the tree
+  // itself is kept until the next build.
+  class BoundingVolumeHierarchy
+  {
+  public:
+    struct Stats {
+      uint32_t            m_numBounds;
+      uint32_t            m_numNodes;
+      uint32_t            m_numLeaves;
+      uint32_t            m_maxDepth;
+      uint32_t            m_numRefitNodes;
+      unsigned long long  m_buildMicro;
+      unsigned long long  m_refitMicro;
+    };
+
+    BoundingVolumeHierarchy();
+    ~BoundingVolumeHierarchy();
+
+    void      setNumBounds(uint32_t numBounds);
+    void      setBounds(uint32_t index, const vec3& center, const vec3& extent);
+    void      build();
+    void      refit();
+    bool      isBuilt();
+    uint32_t  getNumBounds();
+    void      getStats(Stats& stats);
+
+    // Queries append the indices of the bounds they touch
+    uint32_t  queryFrustum(const mat4& viewProjection, vector<uint32_t>& indices);
+    uint32_t  queryBox(const vec3& center, const vec3& extent, vector<uint32_t>& indices);
+    uint32_t  querySphere(const vec3& center, float radius, vector<uint32_t>& indices);
+    bool      queryRay(const vec3& origin, const vec3& direction, float maxDistance, uint32_t& index, float& distance);
+
+  private:
+    struct Node {
+      vec3      m_min;
+      uint32_t  m_firstBound;
+      vec3      m_max;
+      uint32_t  m_numBounds;
+      uint32_t  m_left;
+      uint32_t  m_parent;
+    };
+
+    void      buildNode(uint32_t nodeIndex, uint32_t depth);
+    void      refitNode(uint32_t nodeIndex);
+    void      appendNode(const Node& node, vector<uint32_t>& indices);
+
+    uint32_t              m_numBounds;
+    vector<vec3>          m_centers;
+    vector<vec3>          m_extents;
+
+    // Leaves hold ranges of m_boundIndices, the children of a node are stored
+    // next to each other after it
+    vector<Node>          m_nodes;
+    vector<uint32_t>      m_boundIndices;
+    vector<uint32_t>      m_leafNodes;
+    vector<uint32_t>      m_dirtyNodes;
+    vector<uint8_t>       m_dirty;
+    vector<uint32_t>      m_stack;
+    bool                  m_built;
+    Stats                 m_stats;
+  };
+}
@@ -0,0 +1,187 @@
+#include "stdafx.h"
+#include "ClusterBinner.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__AVX__)
+#define CLUSTER_BINNER_WIDTH 8
+#else
+#define CLUSTER_BINNER_WIDTH 4
+#endif
+
+namespace RenderLab
+{
+  ClusterBinner::ClusterBinner(uint32_t numClusters) :
+    m_numClusters(numClusters),
+    m_numLights(0),
+    m_lightCapacity(0),
+    m_radius(0.0f),
+    m_lightX(nullptr),
+    m_lightY(nullptr),
+    m_lightZ(nullptr)
+  {
+    size_t planeSize = numClusters * 6 * sizeof(float);
+    m_planeX = (float*)_mm_malloc(planeSize, 32);
+    m_planeY = (float*)_mm_malloc(planeSize, 32);
+    m_planeZ = (float*)_mm_malloc(planeSize, 32);
+    m_planeW = (float*)_mm_malloc(planeSize, 32);
+    memset(m_planeX, 0, planeSize);
+    memset(m_planeY, 0, planeSize);
+    memset(m_planeZ, 0, planeSize);
+    memset(m_planeW, 0, planeSize);
+  }
+
+  ClusterBinner::~ClusterBinner()
+  {
+    _mm_free(m_planeX);
+    _mm_free(m_planeY);
+    _mm_free(m_planeZ);
+    _mm_free(m_planeW);
+    _mm_free(m_lightX);
+    _mm_free(m_lightY);
+    _mm_free(m_lightZ);
+  }
+
+  void ClusterBinner::setClusterPlanes(uint32_t clusterIndex, vec4* planes)
+  {
+    uint32_t base = clusterIndex * 6;
+    for (uint32_t i = 0; i < 6; i++)
+    {
+      // Normalize once here so the per-light test is a plain dot product
+      float invLength = 1.0f / sqrtf(planes[i].x * planes[i].x + planes[i].y * planes[i].y + planes[i].z * planes[i].z);
+      m_planeX[base + i] = planes[i].x * invLength;
+      m_planeY[base + i] = planes[i].y * invLength;
+      m_planeZ[base + i] = planes[i].z * invLength;
+      m_planeW[base + i] = planes[i].w * invLength;
+    }
+  }
+
+  void ClusterBinner::setLights(vec3* positions, uint32_t numLights, float radius)
+  {
+    uint32_t paddedLights = (numLights + CLUSTER_BINNER_WIDTH - 1) & ~(CLUSTER_BINNER_WIDTH - 1);
+    if (paddedLights > m_lightCapacity)
+    {
+      _mm_free(m_lightX);
+      _mm_free(m_lightY);
+      _mm_free(m_lightZ);
+      m_lightX = (float*)_mm_malloc(paddedLights * sizeof(float), 32);
+      m_lightY = (float*)_mm_malloc(paddedLights * sizeof(float), 32);
+      m_lightZ = (float*)_mm_malloc(paddedLights * sizeof(float), 32);
+      m_lightCapacity = paddedLights;
+    }
+
+    for (uint32_t i = 0; i < numLights; i++)
+    {
+      m_lightX[i] = positions[i].x;
+      m_lightY[i] = positions[i].y;
+      m_lightZ[i] = positions[i].z;
+    }
+    for (uint32_t i = numLights; i < paddedLights; i++)
+    {
+      m_lightX[i] = 0.0f;
+      m_lightY[i] = 0.0f;
+      m_lightZ[i] = 0.0f;
+    }
+
+    m_numLights = numLights;
+    m_radius = radius;
+  }
+
+  uint32_t ClusterBinner::binCluster(uint32_t clusterIndex, uint32_t* lightIndices)
+  {
+    const float* planeX = m_planeX + clusterIndex * 6;
+    const float* planeY = m_planeY + clusterIndex * 6;
+    const float* planeZ = m_planeZ + clusterIndex * 6;
+    const float* planeW = m_planeW + clusterIndex * 6;
+    uint32_t numBinned = 0;
+
+#if defined(__AVX__)
+    __m256 nx[6];
+    __m256 ny[6];
+    __m256 nz[6];
+    __m256 nw[6];
+    for (uint32_t p = 0; p < 6; p++)
+    {
+      nx[p] = _mm256_set1_ps(planeX[p]);
+      ny[p] = _mm256_set1_ps(planeY[p]);
+      nz[p] = _mm256_set1_ps(planeZ[p]);
+      nw[p] = _mm256_set1_ps(planeW[p]);
+    }
+    __m256 negRadius = _mm256_set1_ps(-m_radius);
+
+    for (uint32_t l = 0; l < m_numLights; l += 8)
+    {
+      __m256 x = _mm256_load_ps(m_lightX + l);
+      __m256 y = _mm256_load_ps(m_lightY + l);
+      __m256 z = _mm256_load_ps(m_lightZ + l);
+
+      int mask = 0xff;
+      for (uint32_t p = 0; p < 6 && mask != 0; p++)
+      {
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx[p], x), _mm256_mul_ps(ny[p], y)), _mm256_add_ps(_mm256_mul_ps(nz[p], z), nw[p]));
+        mask &= _mm256_movemask_ps(_mm256_cmp_ps(d, negRadius, _CMP_GE_OQ));
+      }
+#else
+    __m128 nx[6];
+    __m128 ny[6];
+    __m128 nz[6];
+    __m128 nw[6];
+    for (uint32_t p = 0; p < 6; p++)
+    {
+      nx[p] = _mm_set1_ps(planeX[p]);
+      ny[p] = _mm_set1_ps(planeY[p]);
+      nz[p] = _mm_set1_ps(planeZ[p]);
+      nw[p] = _mm_set1_ps(planeW[p]);
+    }
+    __m128 negRadius = _mm_set1_ps(-m_radius);
+
+    for (uint32_t l = 0; l < m_numLights; l += 4)
+    {
+      __m128 x = _mm_load_ps(m_lightX + l);
+      __m128 y = _mm_load_ps(m_lightY + l);
+      __m128 z = _mm_load_ps(m_lightZ + l);
+
+      int mask = 0xf;
+      for (uint32_t p = 0; p < 6 && mask != 0; p++)
+      {
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], x), _mm_mul_ps(ny[p], y)), _mm_add_ps(_mm_mul_ps(nz[p], z), nw[p]));
+        mask &= _mm_movemask_ps(_mm_cmpge_ps(d, negRadius));
+      }
+#endif
+
+      // Drop the padding lanes past the last light
+      uint32_t remaining = m_numLights - l;
+      if (remaining < CLUSTER_BINNER_WIDTH)
+      {
+        mask &= (1 << remaining) - 1;
+      }
+
+      for (uint32_t b = 0; mask != 0; b++, mask >>= 1)
+      {
+        if (mask & 1)
+        {
+          lightIndices[numBinned++] = l + b;
+        }
+      }
+    }
+
+    return numBinned;
+  }
+
+  uint32_t ClusterBinner::getNumClusters()
+  {
+    return m_numClusters;
+  }
+
+  uint32_t ClusterBinner::getNumLights()
+  {
+    return m_numLights;
+  }
+
+  uint32_t ClusterBinner::getSimdWidth()
+  {
+    return CLUSTER_BINNER_WIDTH;
+  }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <stdint.h>
+
+using glm::vec3;
+using glm::vec4;
+
+namespace RenderLab
+{
+  // Bins sphere lights into clusters. Planes and light positions are kept as
+  // structure-of-arrays so the plane tests can run on 4 (SSE) or 8 (AVX)
+  // lights at a time.
+  class ClusterBinner
+  {
+  public:
+    ClusterBinner(uint32_t numClusters);
+    ~ClusterBinner();
+
+    void      setClusterPlanes(uint32_t clusterIndex, vec4* planes);
+    void      setLights(vec3* positions, uint32_t numLights, float radius);
+    uint32_t  binCluster(uint32_t clusterIndex, uint32_t* lightIndices);
+    uint32_t  getNumClusters();
+    uint32_t  getNumLights();
+    uint32_t  getSimdWidth();
+
+  private:
+    uint32_t  m_numClusters;
+    uint32_t  m_numLights;
+    uint32_t  m_lightCapacity;
+    float     m_radius;
+
+    // Six normalized planes per cluster, indexed by clusterIndex * 6 + plane
+    float*    m_planeX;
+    float*    m_planeY;
+    float*    m_planeZ;
+    float*    m_planeW;
+
+    // Light positions padded to a multiple of the SIMD width
+    float*    m_lightX;
+    float*    m_lightY;
+    float*    m_lightZ;
+  };
+}
@@ -0,0 +1,114 @@
+#include "stdafx.h"
+#include "DrawList.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace RenderLab
+{
+  DrawList::DrawList()
+  {
+  }
+
+  DrawList::~DrawList()
+  {
+  }
+
+  uint64_t DrawList::makeKey(uint32_t pass, uint32_t pipelineId, uint32_t materialId, float depth)
+  {
+    const uint32_t maxDepth = (1u << DEPTH_BITS) - 1;
+    uint64_t quantizedDepth = (uint64_t)(std::min(std::max(depth, 0.0f), 1.0f) * maxDepth);
+    uint64_t key = std::min(pass, (1u << PASS_BITS) - 1);
+    key = (key << PIPELINE_BITS) | std::min(pipelineId, (1u << PIPELINE_BITS) - 1);
+    key = (key << MATERIAL_BITS) | std::min(materialId, (1u << MATERIAL_BITS) - 1);
+    key = (key << DEPTH_BITS) | std::min(quantizedDepth, (uint64_t)maxDepth);
+    return key;
+  }
+
+  uint32_t DrawList::getPipelineId(uint64_t key)
+  {
+    return (uint32_t)(key >> (MATERIAL_BITS + DEPTH_BITS)) & ((1u << PIPELINE_BITS) - 1);
+  }
+
+  uint32_t DrawList::getMaterialId(uint64_t key)
+  {
+    return (uint32_t)(key >> DEPTH_BITS) & ((1u << MATERIAL_BITS) - 1);
+  }
+
+  void DrawList::clear()
+  {
+    m_keys.clear();
+    m_indices.clear();
+  }
+
+  void DrawList::add(uint64_t key, uint32_t index)
+  {
+    m_keys.push_back(key);
+    m_indices.push_back(index);
+  }
+
+  // Eight passes of a byte each. The counts for every pass come from one walk
+  // over the keys, and a pass is skipped when all keys share that byte, which
+  // is the case for the pass field and the high pipeline and material bits.
+  void DrawList::sort()
+  {
+    size_t numKeys = m_keys.size();
+    if (numKeys < 2)
+    {
+      return;
+    }
+
+    uint32_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < numKeys; i++)
+    {
+      uint64_t key = m_keys[i];
+      for (uint32_t pass = 0; pass < 8; pass++)
+      {
+        counts[pass][(key >> (pass * 8)) & 0xff]++;
+      }
+    }
+
+    m_sortKeys.resize(numKeys);
+    m_sortIndices.resize(numKeys);
+    for (uint32_t pass = 0; pass < 8; pass++)
+    {
+      uint32_t shift = pass * 8;
+      if (counts[pass][(m_keys[0] >> shift) & 0xff] == numKeys)
+      {
+        continue;
+      }
+
+      uint32_t offsets[256];
+      uint32_t offset = 0;
+      for (uint32_t bucket = 0; bucket < 256; bucket++)
+      {
+        offsets[bucket] = offset;
+        offset += counts[pass][bucket];
+      }
+      for (size_t i = 0; i < numKeys; i++)
+      {
+        uint32_t destination = offsets[(m_keys[i] >> shift) & 0xff]++;
+        m_sortKeys[destination] = m_keys[i];
+        m_sortIndices[destination] = m_indices[i];
+      }
+      m_keys.swap(m_sortKeys);
+      m_indices.swap(m_sortIndices);
+    }
+  }
+
+  size_t DrawList::size()
+  {
+    return m_keys.size();
+  }
+
+  uint64_t DrawList::getKey(size_t i)
+  {
+    return m_keys[i];
+  }
+
+  uint32_t DrawList::getIndex(size_t i)
+  {
+    return m_indices[i];
+  }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+using std::vector;
+
+namespace RenderLab
+{
+  // The draws of a pass in the order they should be recorded. Each draw has a
+  // 64 bit key, from the top: pass, pipeline, material and quantized depth, so
+  // sorting the keys groups draws by pipeline, then by material, then front to
+  // back. The sort is an LSD radix sort and stable, draws with equal keys keep
+  // the order they were added in.
+  class DrawList
+  {
+  public:
+    static const uint32_t PASS_BITS = 4;
+    static const uint32_t PIPELINE_BITS = 16;
+    static const uint32_t MATERIAL_BITS = 20;
+    static const uint32_t DEPTH_BITS = 24;
+
+    DrawList();
+    ~DrawList();
+
+    // Ids past the width of their field are clamped, they still sort but may
+    // share a key with other draws. Depth runs from 0 at the eye to 1 at the far plane.
+    static uint64_t makeKey(uint32_t pass, uint32_t pipelineId, uint32_t materialId, float depth);
+    static uint32_t getPipelineId(uint64_t key);
+    static uint32_t getMaterialId(uint64_t key);
+
+    void      clear();
+    void      add(uint64_t key, uint32_t index);
+    void      sort();
+    size_t    size();
+    uint64_t  getKey(size_t i);
+    uint32_t  getIndex(size_t i);
+
+  private:
+    vector<uint64_t>  m_keys;
+    vector<uint32_t>  m_indices;
+    vector<uint64_t>  m_sortKeys;
+    vector<uint32_t>  m_sortIndices;
+  };
+}
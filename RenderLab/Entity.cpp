@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "Entity.h"
 #include "LightComponent.h"
+#include "TransformStore.h"
 
 using std::static_pointer_cast;
 
@@ -8,7 +9,9 @@ namespace RenderLab
 {
   Entity::Entity(string name) : 
     m_name(name),
-    m_castShadow(true)
+    m_castShadow(true),
+    m_transformStore(nullptr),
+    m_transformIndex(TransformStore::INVALID_INDEX)
   {
   }
 
@@ -63,6 +66,10 @@ namespace RenderLab
   void Entity::addChild(shared_ptr<Entity> entity)
   {
     m_children.push_back(entity);
+    if (m_transformStore != nullptr)
+    {
+      m_transformStore->addEntity(entity, m_transformIndex);
+    }
   }
 
   void Entity::removeChild(shared_ptr<Entity> entity)
@@ -71,6 +78,10 @@ namespace RenderLab
     {
       if (*it == entity)
       {
+        if (m_transformStore != nullptr)
+        {
+          m_transformStore->removeEntity(entity);
+        }
         m_children.erase(it);
         return;
       }
@@ -89,7 +100,14 @@ namespace RenderLab
 
   void Entity::setTransform(const mat4& transform)
   {
-    m_transform = transform;
+    if (m_transformStore != nullptr)
+    {
+      m_transformStore->setLocalTransform(m_transformIndex, transform);
+    }
+    else
+    {
+      m_transform = transform;
+    }
     for (size_t i = 0; i < m_components.size(); ++i)
     {
       if (m_components[i]->getType() == Component::LIGHT)
@@ -101,16 +119,51 @@ namespace RenderLab
 
   void Entity::getTransform(mat4& transform)
   {
+    if (m_transformStore != nullptr)
+    {
+      m_transformStore->getLocalTransform(m_transformIndex, transform);
+      return;
+    }
     transform = m_transform;
   }
 
   void Entity::getCompositeTransform(mat4& transform)
   {
+    if (m_transformStore != nullptr)
+    {
+      m_transformStore->getWorldTransform(m_transformIndex, transform);
+      return;
+    }
     transform = m_compositeTransform;
   }
 
-  void Entity::updateCompositeTransform(mat4& parent)
+  // Only for entities outside a world, the TransformStore updates the rest
+  void Entity::updateCompositeTransform(const mat4& parent)
   {
     m_compositeTransform = parent * m_transform;
   }
+
+  void Entity::attachTransformStore(TransformStore* transformStore, uint32_t transformIndex)
+  {
+    m_transformStore = transformStore;
+    m_transformIndex = transformIndex;
+  }
+
+  void Entity::detachTransformStore(const mat4& transform, const mat4& compositeTransform)
+  {
+    m_transform = transform;
+    m_compositeTransform = compositeTransform;
+    m_transformStore = nullptr;
+    m_transformIndex = TransformStore::INVALID_INDEX;
+  }
+
+  void Entity::setTransformIndex(uint32_t transformIndex)
+  {
+    m_transformIndex = transformIndex;
+  }
+
+  uint32_t Entity::getTransformIndex()
+  {
+    return m_transformIndex;
+  }
 }
@@ -11,6 +11,8 @@
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <stdint.h>
+
 using glm::mat4;
 
 using std::string;
@@ -21,7 +23,10 @@ using std::enable_shared_from_this;
 namespace RenderLab
 {
   class Component;
+  class TransformStore;
 
+  // Once added to a world an entity is a handle into its TransformStore, which
+  // owns the local and composite transforms. Until then they are kept here.
   class Entity: public enable_shared_from_this<Entity>
   {
   public:
@@ -44,7 +49,12 @@ namespace RenderLab
     void                    getTransform(mat4& transform);
     void                    getCompositeTransform(mat4& transform);
 
-    void                    updateCompositeTransform(mat4& parent);
+    void                    updateCompositeTransform(const mat4& parent);
+
+    void                    attachTransformStore(TransformStore* transformStore, uint32_t transformIndex);
+    void                    detachTransformStore(const mat4& transform, const mat4& compositeTransform);
+    void                    setTransformIndex(uint32_t transformIndex);
+    uint32_t                getTransformIndex();
 
   private:
     string                          m_name;
@@ -55,6 +65,8 @@ namespace RenderLab
 
     mat4                            m_transform;
     mat4                            m_compositeTransform; 
+    TransformStore*                 m_transformStore;
+    uint32_t                        m_transformIndex;
   };
 }
 
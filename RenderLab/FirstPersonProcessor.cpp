@@ -1,7 +1,9 @@
 #include "stdafx.h"
 #include "FirstPersonProcessor.h"
 
+#ifdef _WIN32
 #include <WindowsX.h>
+#endif
 
 namespace RenderLab
 {
@@ -140,9 +142,6 @@ namespace RenderLab
 
   void FirstPersonProcessor::printLog(string s)
   {
-    string st = s + "\n";
-    TCHAR name[256];
-    _tcscpy_s(name, CA2T(st.c_str()));
-    OutputDebugString(name);
+    printDebugString(s + "\n");
   }
 }
@@ -9,8 +9,6 @@
 
 #include <string>
 
-#include <atlstr.h>
-
 using std::string;
 using glm::mat4;
 using glm::vec3;
@@ -0,0 +1,218 @@
+#include "stdafx.h"
+#include "FrustumCuller.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__AVX__)
+#define FRUSTUM_CULLER_WIDTH 8
+#else
+#define FRUSTUM_CULLER_WIDTH 4
+#endif
+
+namespace RenderLab
+{
+  FrustumCuller::FrustumCuller() :
+    m_numBounds(0),
+    m_capacity(0),
+    m_centerX(nullptr),
+    m_centerY(nullptr),
+    m_centerZ(nullptr),
+    m_extentX(nullptr),
+    m_extentY(nullptr),
+    m_extentZ(nullptr)
+  {
+    // Everything passes until a view is set
+    for (uint32_t p = 0; p < 6; p++)
+    {
+      m_planes[p] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+      m_absNormals[p] = vec3(0.0f);
+    }
+  }
+
+  FrustumCuller::~FrustumCuller()
+  {
+    _mm_free(m_centerX);
+    _mm_free(m_centerY);
+    _mm_free(m_centerZ);
+    _mm_free(m_extentX);
+    _mm_free(m_extentY);
+    _mm_free(m_extentZ);
+  }
+
+  void FrustumCuller::setNumBounds(uint32_t numBounds)
+  {
+    uint32_t paddedBounds = (numBounds + FRUSTUM_CULLER_WIDTH - 1) / FRUSTUM_CULLER_WIDTH * FRUSTUM_CULLER_WIDTH;
+    if (paddedBounds > m_capacity)
+    {
+      _mm_free(m_centerX);
+      _mm_free(m_centerY);
+      _mm_free(m_centerZ);
+      _mm_free(m_extentX);
+      _mm_free(m_extentY);
+      _mm_free(m_extentZ);
+      m_centerX = (float*)_mm_malloc(paddedBounds * sizeof(float), 32);
+      m_centerY = (float*)_mm_malloc(paddedBounds * sizeof(float), 32);
+      m_centerZ = (float*)_mm_malloc(paddedBounds * sizeof(float), 32);
+      m_extentX = (float*)_mm_malloc(paddedBounds * sizeof(float), 32);
+      m_extentY = (float*)_mm_malloc(paddedBounds * sizeof(float), 32);
+      m_extentZ = (float*)_mm_malloc(paddedBounds * sizeof(float), 32);
+      m_capacity = paddedBounds;
+    }
+
+    // Padding lanes are empty boxes at the origin, their results are dropped
+    for (uint32_t i = numBounds; i < paddedBounds; i++)
+    {
+      m_centerX[i] = m_centerY[i] = m_centerZ[i] = 0.0f;
+      m_extentX[i] = m_extentY[i] = m_extentZ[i] = 0.0f;
+    }
+    m_numBounds = numBounds;
+  }
+
+  void FrustumCuller::setBounds(uint32_t index, const vec3& center, const vec3& extent)
+  {
+    m_centerX[index] = center.x;
+    m_centerY[index] = center.y;
+    m_centerZ[index] = center.z;
+    m_extentX[index] = extent.x;
+    m_extentY[index] = extent.y;
+    m_extentZ[index] = extent.z;
+  }
+
+  void FrustumCuller::setFrustum(const mat4& viewProjection)
+  {
+    getFrustumPlanes(viewProjection, m_planes);
+    for (uint32_t p = 0; p < 6; p++)
+    {
+      m_absNormals[p] = glm::abs(vec3(m_planes[p]));
+    }
+  }
+
+  void FrustumCuller::getFrustumPlanes(const mat4& viewProjection, vec4* planes)
+  {
+    // Rows of the clip transform. The near plane is taken as -w <= z, which
+    // also holds for a 0..1 depth range, only looser.
+    vec4 row0(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+    vec4 row1(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+    vec4 row2(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+    vec4 row3(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+    planes[0] = row3 + row0;
+    planes[1] = row3 - row0;
+    planes[2] = row3 + row1;
+    planes[3] = row3 - row1;
+    planes[4] = row3 + row2;
+    planes[5] = row3 - row2;
+
+    for (uint32_t p = 0; p < 6; p++)
+    {
+      float length = glm::length(vec3(planes[p]));
+      if (length > 0.0f)
+      {
+        planes[p] = planes[p] * (1.0f / length);
+      }
+    }
+  }
+
+  uint32_t FrustumCuller::cull(uint8_t* visible)
+  {
+    uint32_t numVisible = 0;
+
+    // A box is outside once its center is further behind a plane than its
+    // extent reaches along the plane normal
+#if defined(__AVX__)
+    __m256 nx[6];
+    __m256 ny[6];
+    __m256 nz[6];
+    __m256 nw[6];
+    __m256 ax[6];
+    __m256 ay[6];
+    __m256 az[6];
+    for (uint32_t p = 0; p < 6; p++)
+    {
+      nx[p] = _mm256_set1_ps(m_planes[p].x);
+      ny[p] = _mm256_set1_ps(m_planes[p].y);
+      nz[p] = _mm256_set1_ps(m_planes[p].z);
+      nw[p] = _mm256_set1_ps(m_planes[p].w);
+      ax[p] = _mm256_set1_ps(m_absNormals[p].x);
+      ay[p] = _mm256_set1_ps(m_absNormals[p].y);
+      az[p] = _mm256_set1_ps(m_absNormals[p].z);
+    }
+    __m256 zero = _mm256_setzero_ps();
+
+    for (uint32_t b = 0; b < m_numBounds; b += 8)
+    {
+      __m256 cx = _mm256_load_ps(m_centerX + b);
+      __m256 cy = _mm256_load_ps(m_centerY + b);
+      __m256 cz = _mm256_load_ps(m_centerZ + b);
+      __m256 ex = _mm256_load_ps(m_extentX + b);
+      __m256 ey = _mm256_load_ps(m_extentY + b);
+      __m256 ez = _mm256_load_ps(m_extentZ + b);
+
+      int mask = 0xff;
+      for (uint32_t p = 0; p < 6 && mask != 0; p++)
+      {
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx[p], cx), _mm256_mul_ps(ny[p], cy)), _mm256_add_ps(_mm256_mul_ps(nz[p], cz), nw[p]));
+        __m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax[p], ex), _mm256_mul_ps(ay[p], ey)), _mm256_mul_ps(az[p], ez));
+        mask &= _mm256_movemask_ps(_mm256_cmp_ps(_mm256_add_ps(d, r), zero, _CMP_GE_OQ));
+      }
+#else
+    __m128 nx[6];
+    __m128 ny[6];
+    __m128 nz[6];
+    __m128 nw[6];
+    __m128 ax[6];
+    __m128 ay[6];
+    __m128 az[6];
+    for (uint32_t p = 0; p < 6; p++)
+    {
+      nx[p] = _mm_set1_ps(m_planes[p].x);
+      ny[p] = _mm_set1_ps(m_planes[p].y);
+      nz[p] = _mm_set1_ps(m_planes[p].z);
+      nw[p] = _mm_set1_ps(m_planes[p].w);
+      ax[p] = _mm_set1_ps(m_absNormals[p].x);
+      ay[p] = _mm_set1_ps(m_absNormals[p].y);
+      az[p] = _mm_set1_ps(m_absNormals[p].z);
+    }
+    __m128 zero = _mm_setzero_ps();
+
+    for (uint32_t b = 0; b < m_numBounds; b += 4)
+    {
+      __m128 cx = _mm_load_ps(m_centerX + b);
+      __m128 cy = _mm_load_ps(m_centerY + b);
+      __m128 cz = _mm_load_ps(m_centerZ + b);
+      __m128 ex = _mm_load_ps(m_extentX + b);
+      __m128 ey = _mm_load_ps(m_extentY + b);
+      __m128 ez = _mm_load_ps(m_extentZ + b);
+
+      int mask = 0xf;
+      for (uint32_t p = 0; p < 6 && mask != 0; p++)
+      {
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], cx), _mm_mul_ps(ny[p], cy)), _mm_add_ps(_mm_mul_ps(nz[p], cz), nw[p]));
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[p], ex), _mm_mul_ps(ay[p], ey)), _mm_mul_ps(az[p], ez));
+        mask &= _mm_movemask_ps(_mm_cmpge_ps(_mm_add_ps(d, r), zero));
+      }
+#endif
+
+      uint32_t count = m_numBounds - b < FRUSTUM_CULLER_WIDTH ? m_numBounds - b : FRUSTUM_CULLER_WIDTH;
+      for (uint32_t i = 0; i < count; i++)
+      {
+        visible[b + i] = (uint8_t)((mask >> i) & 1);
+        numVisible += visible[b + i];
+      }
+    }
+
+    return numVisible;
+  }
+
+  uint32_t FrustumCuller::getNumBounds()
+  {
+    return m_numBounds;
+  }
+
+  uint32_t FrustumCuller::getSimdWidth()
+  {
+    return FRUSTUM_CULLER_WIDTH;
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <stdint.h>
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+
+namespace RenderLab
+{
+  // Tests world space boxes against the six planes of a view. Boxes are kept
+  // as structure-of-arrays centers and extents so the plane tests run on 4
+  // (SSE) or 8 (AVX) boxes at a time, the same layout as the ClusterBinner.
+  class FrustumCuller
+  {
+  public:
+    FrustumCuller();
+    ~FrustumCuller();
+
+    void      setNumBounds(uint32_t numBounds);
+    void      setBounds(uint32_t index, const vec3& center, const vec3& extent);
+    void      setFrustum(const mat4& viewProjection);
+    uint32_t  cull(uint8_t* visible);
+    uint32_t  getNumBounds();
+    uint32_t  getSimdWidth();
+
+    static void getFrustumPlanes(const mat4& viewProjection, vec4* planes);
+
+  private:
+    uint32_t  m_numBounds;
+    uint32_t  m_capacity;
+
+    // Normalized planes pointing inwards, and the absolute normals for the extents
+    vec4      m_planes[6];
+    vec3      m_absNormals[6];
+
+    // Padded to a multiple of the SIMD width
+    float*    m_centerX;
+    float*    m_centerY;
+    float*    m_centerZ;
+    float*    m_extentX;
+    float*    m_extentY;
+    float*    m_extentZ;
+  };
+}
@@ -3,10 +3,8 @@
 
 namespace RenderLab
 {
-  Graphics::Graphics(string name, HINSTANCE hinstance, HWND window):
+  Graphics::Graphics(string name):
     m_name(name),
-    m_hinstance(hinstance),
-    m_window(window),
     m_onscreenView(nullptr)
   {
   }
@@ -42,6 +40,10 @@ namespace RenderLab
   {
   }
 
+  void Graphics::compilePipelines()
+  {
+  }
+
   void Graphics::setOnscreenView(shared_ptr<View> view)
   {
     m_onscreenView = view;
@@ -80,14 +82,41 @@ namespace RenderLab
   {
   }
 
+  uint32_t Graphics::getPipelineId(shared_ptr<Mesh> mesh, shared_ptr<View> view, bool depthPrepass)
+  {
+    return 0;
+  }
+
   void Graphics::endDepthPrepass(shared_ptr<View> view, uint32_t frameIndex)
   {
   }
 
+  bool Graphics::supportsParallelRecording()
+  {
+    return false;
+  }
+
+  void Graphics::beginMeshPass(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
+  {
+  }
+
+  void Graphics::endMeshSlice(shared_ptr<View> view, uint32_t frameIndex, uint32_t slice)
+  {
+  }
+
+  void Graphics::endMeshPass(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
+  {
+  }
+
   void Graphics::render(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
   {
   }
 
+  void Graphics::renderShadowCaster(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, uint32_t faceMask)
+  {
+    render(mesh, meshOffset, view, frameIndex, false);
+  }
+
   float Graphics::getGPUFrameTime()
   {
     return 0.0f;
@@ -98,6 +127,11 @@ namespace RenderLab
     return 0.0f;
   }
 
+  bool Graphics::readBackBuffer(shared_ptr<View> view, vector<uint8_t>& pixels, uint32_t& width, uint32_t& height)
+  {
+    return false;
+  }
+
   void Graphics::swapBackBuffer(shared_ptr<View> view, uint32_t frameIndex)
   {
   }
@@ -22,7 +22,7 @@ namespace RenderLab
   class Graphics
   {
   public:
-    Graphics(string name, HINSTANCE hinstance, HWND window);
+    Graphics(string name);
     ~Graphics();
 
     virtual void                initialize(uint32_t numFrames);
@@ -31,6 +31,7 @@ namespace RenderLab
     virtual size_t              getBufferAlignment();
     virtual void                build(shared_ptr<UniformBuffer> buffer);
     virtual void                build(shared_ptr<View> view, size_t numFrames);
+    virtual void                compilePipelines();
     virtual void                setOnscreenView(shared_ptr<View> view);
     virtual void                resize(shared_ptr<View> view, uint32_t width, uint32_t height);
     virtual void                setDepthBias(float constant, float slope);
@@ -43,17 +44,34 @@ namespace RenderLab
     virtual void                renderEnd(shared_ptr<View> view, shared_ptr<View> lastView, bool lastLight, shared_ptr<UniformBuffer> frameDataUniformBuffer, shared_ptr<UniformBuffer> objectDataUniformBuffer, uint32_t frameIndex);
     virtual void                swapBackBuffer(shared_ptr<View> view, uint32_t frameIndex);
     virtual void                bindPipeline(shared_ptr<Mesh> mesh, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
+
+    // Names the pipeline bindPipeline would bind. Meshes that share a pipeline
+    // get the same id, so draws can be ordered by it and binding a pipeline
+    // that is already bound can be skipped.
+    virtual uint32_t            getPipelineId(shared_ptr<Mesh> mesh, shared_ptr<View> view, bool depthPrepass);
     virtual void                endDepthPrepass(shared_ptr<View> view, uint32_t frameIndex);
+
+    // The bindPipeline and render calls of a mesh pass sit between beginMeshPass
+    // and endMeshPass. Backends that support it take them from several threads at once.
+    // Each thread closes the contiguous slice of the pass it recorded with
+    // endMeshSlice, and the slices are submitted in slice order.
+    virtual bool                supportsParallelRecording();
+    virtual void                beginMeshPass(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
+    virtual void                endMeshSlice(shared_ptr<View> view, uint32_t frameIndex, uint32_t slice);
+    virtual void                endMeshPass(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
     virtual void                render(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
+
+    // Draws a shadow caster into the cube faces set in faceMask, bit n for face n
+    // of the light's view projections. Backends that can't skip faces draw all six.
+    virtual void                renderShadowCaster(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, uint32_t faceMask);
     virtual float				        getGPUFrameTime();
     virtual float				        getGPUFrameTime2();
+    virtual bool                readBackBuffer(shared_ptr<View> view, vector<uint8_t>& pixels, uint32_t& width, uint32_t& height);
 
     shared_ptr<GraphicsContext> getGraphicsContext();
 
   protected:
     shared_ptr<GraphicsContext>   m_graphicsContext;
-    HINSTANCE                     m_hinstance;
-    HWND                          m_window;
     shared_ptr<View>              m_onscreenView;
     shared_ptr<RenderTechnique>   m_renderTechnique;
 
@@ -4,7 +4,7 @@
 
 namespace RenderLab
 {
-  GraphicsOpenGL::GraphicsOpenGL(string name, HINSTANCE hinstance, HWND window) : Graphics(name, hinstance, window),
+  GraphicsOpenGL::GraphicsOpenGL(string name, HINSTANCE hinstance, HWND window) : Graphics(name),
     m_frameIndex(0),
     m_hinstance(hinstance),
     m_window(window)
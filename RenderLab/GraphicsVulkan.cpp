@@ -3,7 +3,22 @@
 
 namespace RenderLab
 {
-  GraphicsVulkan::GraphicsVulkan(string name, HINSTANCE hinstance, HWND window): Graphics(name, hinstance, window),
+  GraphicsVulkan::GraphicsVulkan(string name, HINSTANCE hinstance, HWND window): Graphics(name),
+    m_hinstance(hinstance),
+    m_window(window),
+    m_headless(false),
+    m_numFrames(2),
+    m_pipelineCacheHits(0),
+    m_pipelineCacheMisses(0),
+    m_meshBuildTime(0),
+    m_materialBuildTime(0),
+    m_pipelineCompileTime(0),
+    m_pipelineCompileThreads(0),
+    m_driverPipelineCache(VK_NULL_HANDLE),
+    m_pipelineCacheFile("pipeline_cache.bin"),
+    m_pipelineCacheWarm(false),
+    m_numPipelinesCreated(0),
+    m_pipelineCreateTime(0),
     m_shadowMaterial(nullptr),
     m_depthPrepassMaterial(nullptr),
     m_constantDepthBias(3.0f),
@@ -11,6 +26,50 @@ namespace RenderLab
     m_lightFences(nullptr),
     m_lightFenceIndex(0),
     m_allocatedImageMemory(0),
+    m_unifiedMemory(false),
+    m_stagingBuffer(VK_NULL_HANDLE),
+    m_stagingMemory(VK_NULL_HANDLE),
+    m_stagingData(nullptr),
+    m_stagingSize(0),
+    m_stagingHead(0),
+    m_stagingUsed(0),
+    m_stagingPending(0),
+    m_deferred(true),
+    m_depthPrepass(false)
+  {
+  }
+
+  GraphicsVulkan::GraphicsVulkan(string name): Graphics(name),
+    m_hinstance(nullptr),
+    m_window(nullptr),
+    m_headless(true),
+    m_numFrames(2),
+    m_pipelineCacheHits(0),
+    m_pipelineCacheMisses(0),
+    m_meshBuildTime(0),
+    m_materialBuildTime(0),
+    m_pipelineCompileTime(0),
+    m_pipelineCompileThreads(0),
+    m_driverPipelineCache(VK_NULL_HANDLE),
+    m_pipelineCacheFile("pipeline_cache.bin"),
+    m_pipelineCacheWarm(false),
+    m_numPipelinesCreated(0),
+    m_pipelineCreateTime(0),
+    m_shadowMaterial(nullptr),
+    m_depthPrepassMaterial(nullptr),
+    m_constantDepthBias(3.0f),
+    m_slopeDepthBias(0.0f),
+    m_lightFences(nullptr),
+    m_lightFenceIndex(0),
+    m_allocatedImageMemory(0),
+    m_unifiedMemory(false),
+    m_stagingBuffer(VK_NULL_HANDLE),
+    m_stagingMemory(VK_NULL_HANDLE),
+    m_stagingData(nullptr),
+    m_stagingSize(0),
+    m_stagingHead(0),
+    m_stagingUsed(0),
+    m_stagingPending(0),
     m_deferred(true),
     m_depthPrepass(false)
   {
@@ -19,14 +78,23 @@ namespace RenderLab
 
   GraphicsVulkan::~GraphicsVulkan()
   {
+    if (m_driverPipelineCache != VK_NULL_HANDLE)
+    {
+      savePipelineCache();
+    }
   }
 
   void GraphicsVulkan::initialize(uint32_t numFrames)
   {
+    m_numFrames = numFrames;
+    memset(m_currentTimestamp, 0, sizeof(m_currentTimestamp));
     initializeInstance();
     initializeVirtualDevice();
     initializeProperties();
+    m_allocator = make_shared<VulkanAllocator>(m_device, m_physicalDevice, 64 * 1024 * 1024);
     initializeQueues(numFrames);
+    initializeStaging();
+    initializePipelineCache();
   }
 
 
@@ -35,6 +103,42 @@ namespace RenderLab
     vkViewData* viewData = (vkViewData*)view->getGraphicsData();
     vkBackBuffer &backBuffer = viewData->m_backBuffers.front();
 
+    // Meshes built outside RenderTechnique::build still need their pipelines
+    if (!m_pendingPipelines.empty())
+    {
+      compilePipelines();
+    }
+
+    if (view->getType() == View::SCREEN || view->getType() == View::OFFSCREEN)
+    {
+      // Meshes built since the last frame are copied ahead of this frame's commands
+      reclaimStaging(false);
+      flushUploads();
+
+      // The frame that last used these command and uniform buffers has to be
+      // done before they are rewritten, the frames in between can still be in flight.
+      vkWaitForFences(m_device, 1, &backBuffer.m_renderFence, true, UINT64_MAX);
+      vkResetFences(m_device, 1, &backBuffer.m_renderFence);
+
+      for (size_t i = 0; i < m_threadRecorders.size(); i++)
+      {
+        vkResetCommandPool(m_device, m_threadRecorders[i]->m_commandPools[backBuffer.m_frameIndex], 0);
+        m_threadRecorders[i]->m_numUsed[backBuffer.m_frameIndex] = 0;
+      }
+
+      // Its timestamps are ready now too, so reading them doesn't stall
+      if (backBuffer.m_timestampsWritten)
+      {
+        uint64_t timestamps[NUM_FRAME_TIMESTAMPS];
+        VkResult result = vkGetQueryPoolResults(m_device, m_queryPool, backBuffer.m_frameIndex * NUM_FRAME_TIMESTAMPS, NUM_FRAME_TIMESTAMPS,
+          sizeof(timestamps), (void*)timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+        if (result == VK_SUCCESS)
+        {
+          memcpy(m_currentTimestamp, timestamps, sizeof(m_currentTimestamp));
+        }
+      }
+    }
+
     if (view->getType() == View::SCREEN)
     {
       // wait until acquire and render semaphores are waited/unsignaled
@@ -46,7 +150,10 @@ namespace RenderLab
 
     viewData->m_acquiredBackBuffer = backBuffer;
     viewData->m_backBuffers.pop();
-    return backBuffer.m_imageIndex;
+
+    // The swapchain can have more images than there are frames in flight, so
+    // per frame resources are picked by frame and only the framebuffer by image
+    return backBuffer.m_frameIndex;
   }
 
   void GraphicsVulkan::setDepthBias(float constant, float slope)
@@ -65,6 +172,136 @@ namespace RenderLab
     return (m_currentTimestamp[2] - m_currentTimestamp[1]) * m_physicalDeviceProperties.limits.timestampPeriod;
   }
 
+  void GraphicsVulkan::getMemoryStats(VulkanAllocator::Stats& stats)
+  {
+    m_allocator->getStats(stats);
+  }
+
+  void GraphicsVulkan::setPipelineCacheFile(const string& filename)
+  {
+    m_pipelineCacheFile = filename;
+  }
+
+  bool GraphicsVulkan::savePipelineCache()
+  {
+    if (m_driverPipelineCache == VK_NULL_HANDLE)
+    {
+      return false;
+    }
+
+    size_t dataSize = 0;
+    if (vkGetPipelineCacheData(m_device, m_driverPipelineCache, &dataSize, nullptr) != VK_SUCCESS)
+    {
+      return false;
+    }
+
+    vector<char> data(sizeof(vkPipelineCacheFileHeader) + dataSize);
+    if (vkGetPipelineCacheData(m_device, m_driverPipelineCache, &dataSize, data.data() + sizeof(vkPipelineCacheFileHeader)) != VK_SUCCESS)
+    {
+      return false;
+    }
+
+    vkPipelineCacheFileHeader header = {};
+    header.m_magic = PIPELINE_CACHE_MAGIC;
+    header.m_version = PIPELINE_CACHE_VERSION;
+    header.m_vendorID = m_physicalDeviceProperties.vendorID;
+    header.m_deviceID = m_physicalDeviceProperties.deviceID;
+    header.m_driverVersion = m_physicalDeviceProperties.driverVersion;
+    memcpy(header.m_pipelineCacheUUID, m_physicalDeviceProperties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.m_dataSize = dataSize;
+    memcpy(data.data(), &header, sizeof(header));
+
+    ofstream file(m_pipelineCacheFile, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+    {
+      return false;
+    }
+    file.write(data.data(), sizeof(header) + dataSize);
+    return file.good();
+  }
+
+  void GraphicsVulkan::getPipelineStats(uint32_t& numPipelines, unsigned long long& createMicro, bool& warmCache, uint32_t& cacheHits, uint32_t& cacheMisses)
+  {
+    numPipelines = m_numPipelinesCreated;
+    createMicro = m_pipelineCreateTime;
+    warmCache = m_pipelineCacheWarm;
+    cacheHits = m_pipelineCacheHits;
+    cacheMisses = m_pipelineCacheMisses;
+  }
+
+  void GraphicsVulkan::getStartupTimes(StartupTimes& times)
+  {
+    times.m_meshMicro = m_meshBuildTime;
+    times.m_materialMicro = m_materialBuildTime;
+    times.m_pipelineCompileMicro = m_pipelineCompileTime;
+    times.m_pipelineCreateMicro = m_pipelineCreateTime;
+    times.m_compileThreads = m_pipelineCompileThreads;
+  }
+
+  bool GraphicsVulkan::readBackBuffer(shared_ptr<View> view, vector<uint8_t>& pixels, uint32_t& width, uint32_t& height)
+  {
+    // Swapchain images are gone once presented, only offscreen views can be read
+    if (view->getType() != View::OFFSCREEN)
+    {
+      return false;
+    }
+
+    vkViewData* viewData = (vkViewData*)view->getGraphicsData();
+    width = viewData->m_extent.width;
+    height = viewData->m_extent.height;
+    VkDeviceSize size = (VkDeviceSize)width * height * 4;
+
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VkBuffer buffer;
+    vkCreateBuffer(m_device, &bufferInfo, nullptr, &buffer);
+
+    VkMemoryRequirements memReqs;
+    vkGetBufferMemoryRequirements(m_device, buffer, &memReqs);
+
+    VkMemoryAllocateInfo memoryAllocateInfo = {};
+    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memoryAllocateInfo.allocationSize = memReqs.size;
+    memory_type_from_properties(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &memoryAllocateInfo.memoryTypeIndex);
+
+    VkDeviceMemory memory;
+    vkAllocateMemory(m_device, &memoryAllocateInfo, nullptr, &memory);
+    vkBindBufferMemory(m_device, buffer, memory, 0);
+
+    VkCommandBuffer commandBuffer = beginOneTimeCommands();
+
+    // The render pass left the last frame's image in TRANSFER_SRC_OPTIMAL
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+    VkBufferImageCopy region = {};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = width;
+    region.imageExtent.height = height;
+    region.imageExtent.depth = 1;
+    vkCmdCopyImageToBuffer(commandBuffer, viewData->m_images[viewData->m_acquiredBackBuffer.m_imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer, 1, &region);
+
+    endOneTimeCommands(commandBuffer);
+
+    void* data;
+    vkMapMemory(m_device, memory, 0, size, 0, &data);
+    pixels.resize((size_t)size);
+    memcpy(pixels.data(), data, (size_t)size);
+    vkUnmapMemory(m_device, memory);
+
+    vkDestroyBuffer(m_device, buffer, nullptr);
+    vkFreeMemory(m_device, memory, nullptr);
+    return true;
+  }
+
   void GraphicsVulkan::renderBegin(shared_ptr<View> view, shared_ptr<View> lastView, shared_ptr<UniformBuffer> frameDataUniformBuffer, shared_ptr<UniformBuffer> objectDataUniformBuffer, uint32_t frameIndex)
   {
     vkViewData* viewData = (vkViewData*)view->getGraphicsData();
@@ -79,17 +316,20 @@ namespace RenderLab
       m_lightFences = new VkFence[m_shadowViewData.size()];
     }
 
-    //vkWaitForFences(m_device, 1, &lastBackBuffer.m_renderFence, true, UINT64_MAX);
-    vkResetFences(m_device, 1, &backBuffer.m_renderFence);
+    uint32_t firstQuery = frameIndex * NUM_FRAME_TIMESTAMPS;
 
     VkCommandBufferBeginInfo commandBufferBeginInfo = {};
     commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     commandBufferBeginInfo.flags = 0; // VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     vkBeginCommandBuffer(viewData->m_commandBuffer[frameIndex], &commandBufferBeginInfo);
+    viewData->m_commandState.m_commandBuffer = viewData->m_commandBuffer[frameIndex];
+    viewData->m_commandState.m_boundVertexBuffer = VK_NULL_HANDLE;
+    viewData->m_commandState.m_boundIndexBuffer = VK_NULL_HANDLE;
+    viewData->m_secondaryPass = false;
 
-	  vkCmdResetQueryPool(viewData->m_commandBuffer[frameIndex], m_queryPool, 0, 3);
+	  vkCmdResetQueryPool(viewData->m_commandBuffer[frameIndex], m_queryPool, firstQuery, NUM_FRAME_TIMESTAMPS);
 	  
-    vkCmdWriteTimestamp(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, 0);
+    vkCmdWriteTimestamp(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, firstQuery);
     vkCmdSetViewport(viewData->m_commandBuffer[frameIndex], 0, 1, &viewData->m_viewport);
     vkCmdSetScissor(viewData->m_commandBuffer[frameIndex], 0, 1, &viewData->m_scissor);
 
@@ -125,7 +365,7 @@ namespace RenderLab
 
     array<VkClearValue, 8> clearValues = {};
     array<VkClearValue, 1> shadowClearValues = {};
-    if (view->getType() == View::SCREEN)
+    if (view->getType() == View::SCREEN || view->getType() == View::OFFSCREEN)
     {
       if (m_deferred)
       {
@@ -154,7 +394,7 @@ namespace RenderLab
     renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderPassBeginInfo.renderPass = viewData->m_renderPass;
 
-    if (view->getType() == View::SCREEN)
+    if (view->getType() == View::SCREEN || view->getType() == View::OFFSCREEN)
     {
       renderPassBeginInfo.clearValueCount = 2;
       renderPassBeginInfo.pClearValues = clearValues.data();
@@ -169,11 +409,18 @@ namespace RenderLab
       renderPassBeginInfo.pClearValues = shadowClearValues.data();
     }
 
-    renderPassBeginInfo.framebuffer = viewData->m_framebuffers[frameIndex];
+    renderPassBeginInfo.framebuffer = viewData->m_framebuffers[backBuffer.m_imageIndex];
     renderPassBeginInfo.renderArea.extent = viewData->m_extent;
-    //vkCmdBeginRenderPass(m_primaryCommandBuffer[frameIndex], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
-    vkCmdBeginRenderPass(viewData->m_commandBuffer[frameIndex], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-    
+
+    // The depth prepass and G-buffer subpasses of the screen are recorded in secondary command buffers
+    if (view->getType() == View::SCREEN || view->getType() == View::OFFSCREEN)
+    {
+      vkCmdBeginRenderPass(viewData->m_commandBuffer[frameIndex], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    }
+    else
+    {
+      vkCmdBeginRenderPass(viewData->m_commandBuffer[frameIndex], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+    }
   }
 
   void GraphicsVulkan::bindPipeline(shared_ptr<Mesh> mesh, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
@@ -181,20 +428,210 @@ namespace RenderLab
     vkMeshData* meshData = (vkMeshData*)mesh->getGraphicsData();
     vkViewData* viewData = (vkViewData*)view->getGraphicsData();
 
+    vkCommandState& state = getCommandState(viewData, frameIndex);
+
+    if (depthPrepass)
+    {
+      vkCmdBindPipeline(state.m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, meshData->m_depthPrepassPipeline);
+    }
+    else
+    {
+      // Looked up without inserting, other threads read the map too
+      vkCmdBindPipeline(state.m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, meshData->m_pipelines.find(view)->second);
+    }
+  }
+
+  // Ids are handed out in the order pipelines are first drawn with, 0 is left
+  // for meshes without a pipeline for the view
+  uint32_t GraphicsVulkan::getPipelineId(shared_ptr<Mesh> mesh, shared_ptr<View> view, bool depthPrepass)
+  {
+    vkMeshData* meshData = (vkMeshData*)mesh->getGraphicsData();
+    VkPipeline pipeline = VK_NULL_HANDLE;
     if (depthPrepass)
     {
-      vkCmdBindPipeline(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS, meshData->m_depthPrepassPipelines[frameIndex]);
+      pipeline = meshData->m_depthPrepassPipeline;
     }
     else
     {
-      vkCmdBindPipeline(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS, meshData->m_pipelines[view][frameIndex]);
+      map<shared_ptr<View>, VkPipeline>::iterator it = meshData->m_pipelines.find(view);
+      if (it != meshData->m_pipelines.end())
+      {
+        pipeline = it->second;
+      }
+    }
+    if (pipeline == VK_NULL_HANDLE)
+    {
+      return 0;
     }
+
+    unordered_map<VkPipeline, uint32_t>::iterator it = m_pipelineIds.find(pipeline);
+    if (it == m_pipelineIds.end())
+    {
+      it = m_pipelineIds.insert(std::make_pair(pipeline, (uint32_t)m_pipelineIds.size() + 1)).first;
+    }
+    return it->second;
   }
 
   void GraphicsVulkan::endDepthPrepass(shared_ptr<View> view, uint32_t frameIndex)
   {
     vkViewData* viewData = (vkViewData*)view->getGraphicsData();
-    vkCmdNextSubpass(viewData->m_commandBuffer[frameIndex], VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdNextSubpass(viewData->m_commandBuffer[frameIndex], VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  }
+
+  bool GraphicsVulkan::supportsParallelRecording()
+  {
+    return true;
+  }
+
+  void GraphicsVulkan::beginMeshPass(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
+  {
+    if (view->getType() != View::SCREEN && view->getType() != View::OFFSCREEN)
+    {
+      return;
+    }
+
+    vkViewData* viewData = (vkViewData*)view->getGraphicsData();
+    viewData->m_secondaryPass = true;
+    if (depthPrepass)
+    {
+      viewData->m_secondarySubpass = 0;
+    }
+    else
+    {
+      viewData->m_secondarySubpass = m_depthPrepass ? 1 : 0;
+    }
+
+    // One recorder per thread that can call in, created the first time the pool grows
+    shared_ptr<JobSystem> jobSystem = m_renderTechnique != nullptr ? m_renderTechnique->getJobSystem() : nullptr;
+    uint32_t numThreads = jobSystem != nullptr ? jobSystem->getNumThreads() : 1;
+    while (m_threadRecorders.size() < numThreads)
+    {
+      vkThreadRecorder* recorder = new vkThreadRecorder();
+      recorder->m_commandPools.resize(m_numFrames);
+      recorder->m_commandBuffers.resize(m_numFrames);
+      recorder->m_numUsed.resize(m_numFrames, 0);
+      recorder->m_recording = false;
+
+      VkCommandPoolCreateInfo commandPoolInfo = {};
+      commandPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+      commandPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+      commandPoolInfo.queueFamilyIndex = m_commandQueueFamily;
+      for (uint32_t i = 0; i < m_numFrames; i++)
+      {
+        vkCreateCommandPool(m_device, &commandPoolInfo, nullptr, &recorder->m_commandPools[i]);
+      }
+      m_threadRecorders.push_back(recorder);
+    }
+  }
+
+  void GraphicsVulkan::endMeshSlice(shared_ptr<View> view, uint32_t frameIndex, uint32_t slice)
+  {
+    vkViewData* viewData = (vkViewData*)view->getGraphicsData();
+    if (!viewData->m_secondaryPass)
+    {
+      return;
+    }
+
+    // A thread that picks up another slice starts a new buffer for it
+    vkThreadRecorder* recorder = m_threadRecorders[JobSystem::getThreadIndex()];
+    if (recorder->m_recording)
+    {
+      vkEndCommandBuffer(recorder->m_state.m_commandBuffer);
+      vkRecordedSlice recordedSlice;
+      recordedSlice.m_slice = slice;
+      recordedSlice.m_commandBuffer = recorder->m_state.m_commandBuffer;
+      recorder->m_slices.push_back(recordedSlice);
+      recorder->m_recording = false;
+    }
+  }
+
+  void GraphicsVulkan::endMeshPass(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
+  {
+    vkViewData* viewData = (vkViewData*)view->getGraphicsData();
+    if (!viewData->m_secondaryPass)
+    {
+      return;
+    }
+
+    // Draws recorded outside a slice go after all of them
+    vector<vkRecordedSlice> slices;
+    for (size_t i = 0; i < m_threadRecorders.size(); i++)
+    {
+      vkThreadRecorder* recorder = m_threadRecorders[i];
+      slices.insert(slices.end(), recorder->m_slices.begin(), recorder->m_slices.end());
+      recorder->m_slices.clear();
+      if (recorder->m_recording)
+      {
+        vkEndCommandBuffer(recorder->m_state.m_commandBuffer);
+        vkRecordedSlice recordedSlice;
+        recordedSlice.m_slice = UINT32_MAX;
+        recordedSlice.m_commandBuffer = recorder->m_state.m_commandBuffer;
+        slices.push_back(recordedSlice);
+        recorder->m_recording = false;
+      }
+    }
+    std::stable_sort(slices.begin(), slices.end(), [](const vkRecordedSlice& a, const vkRecordedSlice& b) { return a.m_slice < b.m_slice; });
+
+    vector<VkCommandBuffer> commandBuffers;
+    for (size_t i = 0; i < slices.size(); i++)
+    {
+      commandBuffers.push_back(slices[i].m_commandBuffer);
+    }
+
+    if (!commandBuffers.empty())
+    {
+      vkCmdExecuteCommands(viewData->m_commandBuffer[frameIndex], (uint32_t)commandBuffers.size(), commandBuffers.data());
+    }
+    viewData->m_secondaryPass = false;
+  }
+
+  GraphicsVulkan::vkCommandState& GraphicsVulkan::getCommandState(vkViewData* viewData, uint32_t frameIndex)
+  {
+    if (!viewData->m_secondaryPass)
+    {
+      return viewData->m_commandState;
+    }
+
+    // Only this thread touches its recorder until endMeshPass
+    vkThreadRecorder* recorder = m_threadRecorders[JobSystem::getThreadIndex()];
+    if (!recorder->m_recording)
+    {
+      vector<VkCommandBuffer>& commandBuffers = recorder->m_commandBuffers[frameIndex];
+      uint32_t& numUsed = recorder->m_numUsed[frameIndex];
+      if (numUsed == commandBuffers.size())
+      {
+        VkCommandBufferAllocateInfo commandBufferInfo = {};
+        commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferInfo.commandPool = recorder->m_commandPools[frameIndex];
+        commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        commandBufferInfo.commandBufferCount = 1;
+        VkCommandBuffer commandBuffer;
+        vkAllocateCommandBuffers(m_device, &commandBufferInfo, &commandBuffer);
+        commandBuffers.push_back(commandBuffer);
+      }
+
+      VkCommandBufferInheritanceInfo inheritanceInfo = {};
+      inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+      inheritanceInfo.renderPass = viewData->m_renderPass;
+      inheritanceInfo.subpass = viewData->m_secondarySubpass;
+      inheritanceInfo.framebuffer = viewData->m_framebuffers[viewData->m_acquiredBackBuffer.m_imageIndex];
+
+      VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+      commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+      commandBufferBeginInfo.pInheritanceInfo = &inheritanceInfo;
+
+      recorder->m_state.m_commandBuffer = commandBuffers[numUsed++];
+      recorder->m_state.m_boundVertexBuffer = VK_NULL_HANDLE;
+      recorder->m_state.m_boundIndexBuffer = VK_NULL_HANDLE;
+      vkBeginCommandBuffer(recorder->m_state.m_commandBuffer, &commandBufferBeginInfo);
+
+      // Dynamic state isn't inherited from the primary
+      vkCmdSetViewport(recorder->m_state.m_commandBuffer, 0, 1, &viewData->m_viewport);
+      vkCmdSetScissor(recorder->m_state.m_commandBuffer, 0, 1, &viewData->m_scissor);
+      recorder->m_recording = true;
+    }
+    return recorder->m_state;
   }
 
 
@@ -214,16 +651,16 @@ namespace RenderLab
       materialData = (vkMaterialData*)m_depthPrepassMaterial->getGraphicsData();
     }
 
+    vkCommandState& state = getCommandState(viewData, frameIndex);
+
     uint32_t dynamicOffsets[1];
     //dynamicOffsets[0] = 0;
     dynamicOffsets[0] = meshOffset;
-    vkCmdBindDescriptorSets(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS,
+    vkCmdBindDescriptorSets(state.m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
       materialData->m_pipelineLayout[frameIndex], 0, 1, &materialData->m_descriptorSet[frameIndex], 1, dynamicOffsets);
 
-    const VkDeviceSize vb_offset = 0;
-    vkCmdBindVertexBuffers(viewData->m_commandBuffer[frameIndex], 0, 1, &meshData->m_vertexBuffer, &vb_offset);
-    vkCmdBindIndexBuffer(viewData->m_commandBuffer[frameIndex], meshData->m_indexBuffer, 0, meshData->m_indexType);
-    vkCmdDrawIndexed(viewData->m_commandBuffer[frameIndex], (uint32_t)mesh->getIndexBufferSize(), 1, 0, 0, 0);
+    bindGeometry(state, meshData);
+    vkCmdDrawIndexed(state.m_commandBuffer, (uint32_t)mesh->getIndexBufferSize(), 1, meshData->m_firstIndex, meshData->m_vertexOffset, 0);
   }
 
 
@@ -234,56 +671,76 @@ namespace RenderLab
 
     vkViewData* lastViewData = (vkViewData*)lastView->getGraphicsData();
     vkBackBuffer& lastBackBuffer = lastViewData->m_acquiredBackBuffer;
+    uint32_t firstQuery = frameIndex * NUM_FRAME_TIMESTAMPS;
 
     // Render the composite meshes
-    if (view->getType() == View::SCREEN)
+    if (view->getType() == View::SCREEN || view->getType() == View::OFFSCREEN)
     {
-      vkCmdWriteTimestamp(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 1);
+      // The G-buffer subpass only takes secondary command buffers, so its end
+      // is stamped at the start of the lighting subpass
       vkCmdNextSubpass(viewData->m_commandBuffer[frameIndex], VK_SUBPASS_CONTENTS_INLINE);
+      vkCmdWriteTimestamp(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, firstQuery + 1);
       vkCmdSetViewport(viewData->m_commandBuffer[frameIndex], 0, 1, &viewData->m_viewport);
       vkCmdSetScissor(viewData->m_commandBuffer[frameIndex], 0, 1, &viewData->m_scissor);
 
-      shared_ptr<Mesh> mesh = view->getCompositeMesh(0);
-      shared_ptr<Material> material = mesh->getMaterial();
-      vkMeshData* meshData = (vkMeshData*)mesh->getGraphicsData();
-      vkMaterialData* materialData = (vkMaterialData*)material->getGraphicsData();
-
-      for (size_t i = 0; i < m_renderTechnique->getNumLightComponents(); i++)
+      if (m_renderTechnique->getClusteredShading() && view->numCompositeMeshes() > 1)
       {
-        shared_ptr<LightComponent> lightComponent = m_renderTechnique->getLightComponent((uint32_t)i);
-        vec3 color;
-        lightComponent->getDiffuse(color);
-        m_lightPushConstants.m_lightColor = vec4(color, viewData->m_extent.width);
-
-        mat4 transform;
-        vec3 position;
-        lightComponent->getPosition(position);
-        lightComponent->getEntity(0)->getCompositeTransform(transform);
-        m_lightPushConstants.m_lightPosition = vec4(vec3(transform * vec4(position, 1.0f)), viewData->m_extent.height);
-
-        vkCmdPushConstants(
-          viewData->m_commandBuffer[frameIndex], 
-          materialData->m_pipelineLayout[frameIndex],
-          VK_SHADER_STAGE_VERTEX_BIT| VK_SHADER_STAGE_FRAGMENT_BIT,
-          0,
-          sizeof(vkLightPushContants),
-          &m_lightPushConstants);
-
-        vkCmdBindPipeline(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS, meshData->m_pipelines[view][frameIndex]);
+        // One full screen pass, each pixel shades only the lights of its cluster
+        shared_ptr<Mesh> mesh = view->getCompositeMesh(1);
+        vkMeshData* meshData = (vkMeshData*)mesh->getGraphicsData();
+        vkMaterialData* materialData = (vkMaterialData*)mesh->getMaterial()->getGraphicsData();
+
+        vkCmdBindPipeline(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS, meshData->m_pipelines[view]);
         uint32_t dynamicOffsets[1];
         dynamicOffsets[0] = 0;
         vkCmdBindDescriptorSets(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS,
           materialData->m_pipelineLayout[frameIndex], 0, 1, &materialData->m_descriptorSet[frameIndex], 1, dynamicOffsets);
 
-        const VkDeviceSize vb_offset = 0;
-        vkCmdBindVertexBuffers(viewData->m_commandBuffer[frameIndex], 0, 1, &meshData->m_vertexBuffer, &vb_offset);
-        vkCmdBindIndexBuffer(viewData->m_commandBuffer[frameIndex], meshData->m_indexBuffer, 0, meshData->m_indexType);
-        vkCmdDrawIndexed(viewData->m_commandBuffer[frameIndex], (uint32_t)mesh->getIndexBufferSize(), 1, 0, 0, 0);
+        bindGeometry(viewData->m_commandState, meshData);
+        vkCmdDrawIndexed(viewData->m_commandBuffer[frameIndex], (uint32_t)mesh->getIndexBufferSize(), 1, meshData->m_firstIndex, meshData->m_vertexOffset, 0);
+      }
+      else
+      {
+        shared_ptr<Mesh> mesh = view->getCompositeMesh(0);
+        shared_ptr<Material> material = mesh->getMaterial();
+        vkMeshData* meshData = (vkMeshData*)mesh->getGraphicsData();
+        vkMaterialData* materialData = (vkMaterialData*)material->getGraphicsData();
+
+        for (size_t i = 0; i < m_renderTechnique->getNumLightComponents(); i++)
+        {
+          shared_ptr<LightComponent> lightComponent = m_renderTechnique->getLightComponent((uint32_t)i);
+          vec3 color;
+          lightComponent->getDiffuse(color);
+          m_lightPushConstants.m_lightColor = vec4(color, viewData->m_extent.width);
+
+          mat4 transform;
+          vec3 position;
+          lightComponent->getPosition(position);
+          lightComponent->getEntity(0)->getCompositeTransform(transform);
+          m_lightPushConstants.m_lightPosition = vec4(vec3(transform * vec4(position, 1.0f)), viewData->m_extent.height);
+
+          vkCmdPushConstants(
+            viewData->m_commandBuffer[frameIndex], 
+            materialData->m_pipelineLayout[frameIndex],
+            VK_SHADER_STAGE_VERTEX_BIT| VK_SHADER_STAGE_FRAGMENT_BIT,
+            0,
+            sizeof(vkLightPushContants),
+            &m_lightPushConstants);
+
+          vkCmdBindPipeline(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS, meshData->m_pipelines[view]);
+          uint32_t dynamicOffsets[1];
+          dynamicOffsets[0] = 0;
+          vkCmdBindDescriptorSets(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_BIND_POINT_GRAPHICS,
+            materialData->m_pipelineLayout[frameIndex], 0, 1, &materialData->m_descriptorSet[frameIndex], 1, dynamicOffsets);
+
+          bindGeometry(viewData->m_commandState, meshData);
+          vkCmdDrawIndexed(viewData->m_commandBuffer[frameIndex], (uint32_t)mesh->getIndexBufferSize(), 1, meshData->m_firstIndex, meshData->m_vertexOffset, 0);
+        }
       }
 
       vkCmdEndRenderPass(viewData->m_commandBuffer[frameIndex]);
 	  
-	    vkCmdWriteTimestamp(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 2);
+	    vkCmdWriteTimestamp(viewData->m_commandBuffer[frameIndex], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, firstQuery + 2);
       vkEndCommandBuffer(viewData->m_commandBuffer[frameIndex]);
 
       // we will render to the swapchain images
@@ -300,10 +757,16 @@ namespace RenderLab
       submitInfo.pCommandBuffers = &viewData->m_commandBuffer[frameIndex];
       submitInfo.pSignalSemaphores = &backBuffer.m_renderSemaphore;
 
-      vkQueueSubmit(m_commandQueue, 1, &submitInfo, backBuffer.m_renderFence);
-      vkWaitForFences(m_device, 1, &backBuffer.m_renderFence, true, UINT64_MAX);
+      // offscreen images are never acquired or presented
+      if (view->getType() == View::OFFSCREEN)
+      {
+        submitInfo.waitSemaphoreCount = 0;
+        submitInfo.signalSemaphoreCount = 0;
+      }
 
-	  VkResult r = vkGetQueryPoolResults(m_device, m_queryPool, 0, 3, sizeof(m_currentTimestamp), (void*)m_currentTimestamp, sizeof(uint64_t), VK_QUERY_RESULT_WAIT_BIT | VK_QUERY_RESULT_64_BIT);
+      // Not waited on here, acquireBackBuffer waits when this frame comes around again
+      vkQueueSubmit(m_commandQueue, 1, &submitInfo, backBuffer.m_renderFence);
+      backBuffer.m_timestampsWritten = true;
     }
   }
 
@@ -337,6 +800,8 @@ namespace RenderLab
 
   void GraphicsVulkan::build(shared_ptr<Mesh> mesh, vector<shared_ptr<UniformBuffer>>& frameDataUniformBuffers, vector<shared_ptr<UniformBuffer>>& objectDataUniformBuffers, size_t numFrames, vector<shared_ptr<LightComponent>>& lightComponents)
   {
+    CpuTimer meshTimer;
+    meshTimer.start();
     vkMeshData* meshData = (vkMeshData*)mesh->getGraphicsData();
     if (meshData == nullptr || mesh->isDirty())
     {
@@ -396,14 +861,8 @@ namespace RenderLab
       meshData->m_vertexInputState.vertexAttributeDescriptionCount = static_cast<uint32_t>(meshData->m_vertexInputAttributes.size());
       meshData->m_vertexInputState.pVertexAttributeDescriptions = meshData->m_vertexInputAttributes.data();
 
-      allocate_resources(mesh, meshData, meshData->m_vertexBufferSize, mesh->getIndexBufferSize() * sizeof(unsigned int));
-
-
-      uint8_t *vertexBufferData = nullptr;
-      uint8_t *indexBufferData = nullptr;
-      vkMapMemory(m_device, meshData->m_memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(&vertexBufferData));
-      indexBufferData = vertexBufferData + meshData->m_indexBufferMemoryOffset;
-
+      vector<uint8_t> vertexBufferData((size_t)meshData->m_vertexBufferSize);
+      vector<uint32_t> indexBufferData(mesh->getIndexBufferSize());
 
       bool hasNormals = false;
       bool hasTc0 = false;
@@ -428,7 +887,7 @@ namespace RenderLab
         bitangents = mesh->getVertexBufferData(4);
       }
 
-      float *vdst = reinterpret_cast<float *>(vertexBufferData);
+      float *vdst = reinterpret_cast<float *>(vertexBufferData.data());
       for (size_t i = 0, vindex = 0, tindex = 0; i < mesh->getNumVerts(); i++, vindex += 3, tindex += 2) {
         vdst[0] = positions[vindex];
         vdst[1] = positions[vindex + 1];
@@ -459,17 +918,18 @@ namespace RenderLab
         }
       }
 
-      uint32_t *dst = reinterpret_cast<uint32_t *>(indexBufferData);
+      uint32_t *dst = indexBufferData.data();
       unsigned int* indexBuffer = mesh->getIndexBuffer();
       for (unsigned int i = 0; i < mesh->getIndexBufferSize(); i++) {
         dst[i] = indexBuffer[i];
       }
 
-      vkUnmapMemory(m_device, meshData->m_memory);
+      allocate_resources(meshData, vertexBufferData, indexBufferData);
 
       mesh->setGraphicsData(meshData);
       mesh->setDirty(false);
     }
+    m_meshBuildTime += meshTimer.elapsedMicro();
     build(mesh->getMaterial(), frameDataUniformBuffers, objectDataUniformBuffers, numFrames);
 
     if (m_depthPrepassMaterial == nullptr && m_depthPrepass)
@@ -479,17 +939,12 @@ namespace RenderLab
     }
 
 
-    VkPipeline* pipelines = new VkPipeline[numFrames];
-    meshData->m_depthPrepassPipelines = new VkPipeline[numFrames];
-    for (size_t i = 0; i < numFrames; i++)
+    loadPipeline(mesh, meshData, mesh->getMaterial(), m_onscreenView, &meshData->m_pipelines[m_onscreenView]);
+    meshData->m_depthPrepassPipeline = VK_NULL_HANDLE;
+    if (m_depthPrepass)
     {
-      pipelines[i] = loadPipeline(mesh, meshData, mesh->getMaterial(), i, m_onscreenView);
-      if (m_depthPrepass)
-      {
-        meshData->m_depthPrepassPipelines[i] = loadPipeline(mesh, meshData, m_depthPrepassMaterial, i, m_onscreenView);
-      }
+      loadPipeline(mesh, meshData, m_depthPrepassMaterial, m_onscreenView, &meshData->m_depthPrepassPipeline);
     }
-    meshData->m_pipelines[m_onscreenView] = pipelines;
 
     //if (m_shadowMaterial == nullptr)
     //{
@@ -501,59 +956,228 @@ namespace RenderLab
     {
       if (lightComponents[i]->getCastShadow())
       {
-        pipelines = new VkPipeline[numFrames];
-        for (size_t j = 0; j < numFrames; ++j)
-        {
-          pipelines[j] = loadPipeline(mesh, meshData, m_shadowMaterial, j, lightComponents[i]->getShadowView());
-        }
-        meshData->m_pipelines[lightComponents[i]->getShadowView()] = pipelines;
+        loadPipeline(mesh, meshData, m_shadowMaterial, lightComponents[i]->getShadowView(), &meshData->m_pipelines[lightComponents[i]->getShadowView()]);
       }
     }
   }
 
-  void GraphicsVulkan::allocate_resources(shared_ptr<Mesh> mesh, vkMeshData* meshData, VkDeviceSize vertexBufferSize, VkDeviceSize indexBufferSize)
+  void GraphicsVulkan::allocate_resources(vkMeshData* meshData, const vector<uint8_t>& vertexBufferData, const vector<uint32_t>& indexBufferData)
+  {
+      VkDeviceSize vertexOffset, indexOffset;
+      meshData->m_vertexBuffer = allocateGeometry(m_vertexBuffers, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, meshData->m_stride,
+        vertexBufferData.data(), vertexBufferData.size(), vertexOffset);
+      meshData->m_indexBuffer = allocateGeometry(m_indexBuffers, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, sizeof(uint32_t),
+        (const uint8_t*)indexBufferData.data(), indexBufferData.size() * sizeof(uint32_t), indexOffset);
+
+      // Draws address the mesh by vertex offset and first index, the buffers stay bound at offset 0
+      meshData->m_vertexOffset = (int32_t)(vertexOffset / meshData->m_stride);
+      meshData->m_firstIndex = (uint32_t)(indexOffset / sizeof(uint32_t));
+  }
+
+  VkBuffer GraphicsVulkan::allocateGeometry(vector<vkGeometryBuffer>& buffers, VkBufferUsageFlags usage, VkDeviceSize stride, const uint8_t* data, VkDeviceSize size, VkDeviceSize& offset)
   {
+    size_t bufferIndex = 0;
+    for (; bufferIndex < buffers.size(); bufferIndex++)
+    {
+      if (buffers[bufferIndex].m_stride == stride && buffers[bufferIndex].m_used + size <= buffers[bufferIndex].m_size)
+      {
+        break;
+      }
+    }
+
+    if (bufferIndex == buffers.size())
+    {
+      // Whole vertices fit in each buffer, and a mesh bigger than the default gets a buffer of its own size
+      vkGeometryBuffer geometryBuffer = {};
+      geometryBuffer.m_stride = stride;
+      geometryBuffer.m_size = (32 * 1024 * 1024) / stride * stride;
+      if (geometryBuffer.m_size < size)
+      {
+        geometryBuffer.m_size = size;
+      }
+
       VkBufferCreateInfo bufferInfo = {};
       bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-      bufferInfo.size = vertexBufferSize;
-      bufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+      bufferInfo.size = geometryBuffer.m_size;
+      bufferInfo.usage = usage | (m_unifiedMemory ? 0 : VK_BUFFER_USAGE_TRANSFER_DST_BIT);
       bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-      vkCreateBuffer(m_device, &bufferInfo, nullptr, &meshData->m_vertexBuffer);
-
-      bufferInfo.size = indexBufferSize;
-      bufferInfo.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-      vkCreateBuffer(m_device, &bufferInfo, nullptr, &meshData->m_indexBuffer);
-
-      VkMemoryRequirements vertexBufferMemoryRequirements, indexBufferMemoryRequitements;
-      vkGetBufferMemoryRequirements(m_device, meshData->m_vertexBuffer, &vertexBufferMemoryRequirements);
-      vkGetBufferMemoryRequirements(m_device, meshData->m_indexBuffer, &indexBufferMemoryRequitements);
-
-      // indices follow vertices
-      meshData->m_indexBufferMemoryOffset = vertexBufferMemoryRequirements.size +
-        (indexBufferMemoryRequitements.alignment - (vertexBufferMemoryRequirements.size % indexBufferMemoryRequitements.alignment));
-
-      VkMemoryAllocateInfo memoryAllocateInfo = {};
-      memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-      memoryAllocateInfo.allocationSize = meshData->m_indexBufferMemoryOffset + indexBufferMemoryRequitements.size;
-
-      // find any supported and mappable memory type
-      uint32_t memoryTypes = (vertexBufferMemoryRequirements.memoryTypeBits & indexBufferMemoryRequitements.memoryTypeBits);
-      for (uint32_t idx = 0; idx < m_memoryFlags.size(); idx++) {
-        if ((memoryTypes & (1 << idx)) &&
-          (m_memoryFlags[idx] & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
-          (m_memoryFlags[idx] & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
-          // TODO this may not be reachable
-          memoryAllocateInfo.memoryTypeIndex = idx;
-          break;
-        }
-      }
+      vkCreateBuffer(m_device, &bufferInfo, nullptr, &geometryBuffer.m_buffer);
 
-      if (vkAllocateMemory(m_device, &memoryAllocateInfo, nullptr, &meshData->m_memory) != VK_SUCCESS) {
+      // Filled from the staging ring and never mapped, unless the memory is shared with the CPU
+      VkMemoryPropertyFlags properties = m_unifiedMemory ? (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+      if (!m_allocator->allocateBuffer(geometryBuffer.m_buffer, properties, VulkanAllocator::TLSF, geometryBuffer.m_allocation)) {
         throw std::runtime_error("failed to create memory!");
       }
+      buffers.push_back(geometryBuffer);
+    }
 
-      vkBindBufferMemory(m_device, meshData->m_vertexBuffer, meshData->m_memory, 0);
-      vkBindBufferMemory(m_device, meshData->m_indexBuffer, meshData->m_memory, meshData->m_indexBufferMemoryOffset);
+    vkGeometryBuffer& geometryBuffer = buffers[bufferIndex];
+    offset = geometryBuffer.m_used;
+    geometryBuffer.m_used += size;
+
+    if (m_unifiedMemory)
+    {
+      memcpy(geometryBuffer.m_allocation.m_data + offset, data, (size_t)size);
+    }
+    else
+    {
+      uploadBuffer(geometryBuffer.m_buffer, offset, data, size);
+    }
+    return geometryBuffer.m_buffer;
+  }
+
+  void GraphicsVulkan::bindGeometry(vkCommandState& state, vkMeshData* meshData)
+  {
+    // Meshes with the same vertex layout share buffers, so most draws need no binds at all
+    if (state.m_boundVertexBuffer != meshData->m_vertexBuffer)
+    {
+      const VkDeviceSize vb_offset = 0;
+      vkCmdBindVertexBuffers(state.m_commandBuffer, 0, 1, &meshData->m_vertexBuffer, &vb_offset);
+      state.m_boundVertexBuffer = meshData->m_vertexBuffer;
+    }
+    if (state.m_boundIndexBuffer != meshData->m_indexBuffer)
+    {
+      vkCmdBindIndexBuffer(state.m_commandBuffer, meshData->m_indexBuffer, 0, meshData->m_indexType);
+      state.m_boundIndexBuffer = meshData->m_indexBuffer;
+    }
+  }
+
+  void GraphicsVulkan::uploadBuffer(VkBuffer buffer, VkDeviceSize offset, const uint8_t* data, VkDeviceSize size)
+  {
+    // Anything larger than the ring goes through it in pieces
+    while (size > 0)
+    {
+      VkDeviceSize chunkSize = size < m_stagingSize ? size : m_stagingSize;
+      VkDeviceSize stagingOffset = allocateStaging(chunkSize);
+      memcpy(m_stagingData + stagingOffset, data, (size_t)chunkSize);
+
+      vkStagingCopy copy;
+      copy.m_buffer = buffer;
+      copy.m_region.srcOffset = stagingOffset;
+      copy.m_region.dstOffset = offset;
+      copy.m_region.size = chunkSize;
+      m_stagingCopies.push_back(copy);
+
+      data += chunkSize;
+      offset += chunkSize;
+      size -= chunkSize;
+    }
+  }
+
+  VkDeviceSize GraphicsVulkan::allocateStaging(VkDeviceSize size)
+  {
+    size = (size + 15) & ~(VkDeviceSize)15;
+    if (size > m_stagingSize)
+    {
+      size = m_stagingSize;
+    }
+
+    while (true)
+    {
+      // An allocation never straddles the end of the ring, the tail end is skipped instead
+      VkDeviceSize skipped = (m_stagingHead + size > m_stagingSize) ? m_stagingSize - m_stagingHead : 0;
+      if (m_stagingUsed + skipped + size <= m_stagingSize)
+      {
+        VkDeviceSize offset = skipped > 0 ? 0 : m_stagingHead;
+        m_stagingHead = offset + size;
+        m_stagingUsed += skipped + size;
+        m_stagingPending += skipped + size;
+        return offset;
+      }
+
+      // Out of space, submit what is pending and wait for the oldest copies to finish
+      if (m_stagingBatches.empty())
+      {
+        flushUploads();
+      }
+      reclaimStaging(true);
+    }
+  }
+
+  void GraphicsVulkan::flushUploads()
+  {
+    if (m_stagingCopies.empty())
+    {
+      return;
+    }
+
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandPool = m_primaryCommandPool;
+    allocInfo.commandBufferCount = 1;
+
+    vkStagingBatch batch;
+    vkAllocateCommandBuffers(m_device, &allocInfo, &batch.m_commandBuffer);
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(batch.m_commandBuffer, &beginInfo);
+
+    // One copy command per run of regions going to the same buffer
+    vector<VkBufferCopy> regions;
+    for (size_t i = 0; i < m_stagingCopies.size(); i++)
+    {
+      regions.push_back(m_stagingCopies[i].m_region);
+      if (i + 1 == m_stagingCopies.size() || m_stagingCopies[i + 1].m_buffer != m_stagingCopies[i].m_buffer)
+      {
+        vkCmdCopyBuffer(batch.m_commandBuffer, m_stagingBuffer, m_stagingCopies[i].m_buffer, (uint32_t)regions.size(), regions.data());
+        regions.clear();
+      }
+    }
+
+    // Later submissions on this queue read the data as vertices and indices
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+    vkCmdPipelineBarrier(batch.m_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+    vkEndCommandBuffer(batch.m_commandBuffer);
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    vkCreateFence(m_device, &fenceInfo, nullptr, &batch.m_fence);
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch.m_commandBuffer;
+    vkQueueSubmit(m_commandQueue, 1, &submitInfo, batch.m_fence);
+
+    batch.m_size = m_stagingPending;
+    m_stagingBatches.push(batch);
+    m_stagingCopies.clear();
+    m_stagingPending = 0;
+  }
+
+  void GraphicsVulkan::reclaimStaging(bool wait)
+  {
+    // Batches finish in submission order, so space is returned from the tail of the ring
+    while (!m_stagingBatches.empty())
+    {
+      vkStagingBatch& batch = m_stagingBatches.front();
+      if (wait)
+      {
+        vkWaitForFences(m_device, 1, &batch.m_fence, true, UINT64_MAX);
+        wait = false;
+      }
+      else if (vkGetFenceStatus(m_device, batch.m_fence) != VK_SUCCESS)
+      {
+        break;
+      }
+
+      vkDestroyFence(m_device, batch.m_fence, nullptr);
+      vkFreeCommandBuffers(m_device, m_primaryCommandPool, 1, &batch.m_commandBuffer);
+      m_stagingUsed -= batch.m_size;
+      m_stagingBatches.pop();
+    }
+
+    if (m_stagingUsed == 0)
+    {
+      m_stagingHead = 0;
+    }
   }
 
   void GraphicsVulkan::build(shared_ptr<Material> material, vector<shared_ptr<UniformBuffer>>& frameDataUniformBuffers, vector<shared_ptr<UniformBuffer>>& objectDataUniformBuffers, size_t numFrames)
@@ -566,6 +1190,8 @@ namespace RenderLab
         // TODO: Free old resources
       }
 
+      CpuTimer materialTimer;
+      materialTimer.start();
       materialData = new vkMaterialData();
       string vertexShaderFile = "shaders/";
       string fragmentShaderFile = "shaders/";
@@ -595,23 +1221,19 @@ namespace RenderLab
         vertexShaderFile += "DepthPrepass.vert.spv";
         fragmentShaderFile += "DepthPrepass.frag.spv";
       }
+      else if (material->getMaterialType() == Material::DEFERRED_CLUSTERED)
+      {
+        vertexShaderFile += "DeferredClustered.vert.spv";
+        fragmentShaderFile += "DeferredClustered.frag.spv";
+      }
 
-      materialData->m_vertexShaderCode = readFile(vertexShaderFile);
-      materialData->m_fragmentShaderCode = readFile(fragmentShaderFile);
-
-      VkShaderModuleCreateInfo shaderInfo = {};
-      shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-
-      shaderInfo.codeSize = materialData->m_vertexShaderCode.size();
-      shaderInfo.pCode = (const uint32_t*)materialData->m_vertexShaderCode.data();
-      vkCreateShaderModule(m_device, &shaderInfo, nullptr, &materialData->m_vertexShader);
-
-      shaderInfo.codeSize = materialData->m_fragmentShaderCode.size();
-      shaderInfo.pCode = (const uint32_t*)materialData->m_fragmentShaderCode.data();
-      vkCreateShaderModule(m_device, &shaderInfo, nullptr, &materialData->m_fragmentShader);
+      materialData->m_vertexShader = loadShader(vertexShaderFile);
+      materialData->m_fragmentShader = loadShader(fragmentShaderFile);
 
       if (material->getMaterialType() == Material::SHADOW_CUBE)
       {
+        VkShaderModuleCreateInfo shaderInfo = {};
+        shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
         shaderInfo.codeSize = materialData->m_geometryShaderCode.size();
         shaderInfo.pCode = (const uint32_t*)materialData->m_geometryShaderCode.data();
         vkCreateShaderModule(m_device, &shaderInfo, nullptr, &materialData->m_geometryShader);
@@ -654,6 +1276,7 @@ namespace RenderLab
 
       material->setGraphicsData(materialData);
       material->setDirty(false);
+      m_materialBuildTime += materialTimer.elapsedMicro();
     }
   }
 
@@ -676,7 +1299,7 @@ namespace RenderLab
 
     createTextureImage(texture);
     createImage(texture, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &textureData->m_image, &textureData->m_imageMemory);
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &textureData->m_image, &textureData->m_imageAllocation);
     transitionImageLayout(textureData->m_stagingImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_PREINITIALIZED, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
     transitionImageLayout(textureData->m_image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_PREINITIALIZED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
     copyImage(textureData->m_stagingImage, textureData->m_image, texture->getWidth(), texture->getHeight());
@@ -753,7 +1376,7 @@ namespace RenderLab
     endOneTimeCommands(commandBuffer);
   }
 
-  void GraphicsVulkan::createImage(shared_ptr<Texture> texture, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage* image, VkDeviceMemory* imageMemory) {
+  void GraphicsVulkan::createImage(shared_ptr<Texture> texture, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage* image, VulkanAllocator::Allocation* allocation) {
     VkImageCreateInfo imageInfo = {};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -773,21 +1396,10 @@ namespace RenderLab
       throw std::runtime_error("failed to create image!");
     }
 
-    VkMemoryRequirements memRequirements;
-    vkGetImageMemoryRequirements(m_device, *image, &memRequirements);
-
-    VkMemoryAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    memory_type_from_properties(memRequirements.memoryTypeBits, properties, &allocInfo.memoryTypeIndex);
-
-    if (vkAllocateMemory(m_device, &allocInfo, nullptr, imageMemory) != VK_SUCCESS) {
+    if (!m_allocator->allocateImage(*image, tiling == VK_IMAGE_TILING_OPTIMAL, properties, VulkanAllocator::TLSF, *allocation)) {
       throw std::runtime_error("failed to allocate image memory!");
     }
-    m_allocatedImageMemory += allocInfo.allocationSize;
-    
-
-    vkBindImageMemory(m_device, *image, *imageMemory, 0);
+    m_allocatedImageMemory += allocation->m_size;
   }
 
   void GraphicsVulkan::createTextureImage(shared_ptr<Texture> texture) {
@@ -796,7 +1408,7 @@ namespace RenderLab
     VkDeviceSize imageSize = width * height * 4;
     vkTextureData* textureData = (vkTextureData*)texture->getGraphicsData();
 
-    createImage(texture, VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &(textureData->m_stagingImage), &textureData->m_stagingImageMemory);
+    createImage(texture, VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &(textureData->m_stagingImage), &textureData->m_stagingImageAllocation);
 
     VkImageSubresource subresource = {};
     subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -806,8 +1418,7 @@ namespace RenderLab
     VkSubresourceLayout stagingImageLayout;
     vkGetImageSubresourceLayout(m_device, textureData->m_stagingImage, &subresource, &stagingImageLayout);
 
-    void* data;
-    vkMapMemory(m_device, textureData->m_stagingImageMemory, 0, imageSize, 0, &data);
+    void* data = textureData->m_stagingImageAllocation.m_data + stagingImageLayout.offset;
 
     unsigned char* srcData = texture->getData();
     if (stagingImageLayout.rowPitch == width * 4) 
@@ -822,8 +1433,6 @@ namespace RenderLab
         memcpy(&dataBytes[y * stagingImageLayout.rowPitch], &srcData[y * width * 4], width * 4);
       }
     }
-
-    vkUnmapMemory(m_device, textureData->m_stagingImageMemory);
   }
 
   void GraphicsVulkan::createImageView(VkImage image, VkFormat format, VkImageView* imageView) {
@@ -944,7 +1553,7 @@ namespace RenderLab
       }
     }
 
-    if (material->getMaterialType() == Material::DEFERRED_COMPOSITE)
+    if (material->getMaterialType() == Material::DEFERRED_COMPOSITE || material->getMaterialType() == Material::DEFERRED_CLUSTERED)
     {
       VkDescriptorSetLayoutBinding positionSamplerLayoutBinding = {};
       positionSamplerLayoutBinding.binding = 2;
@@ -1000,12 +1609,33 @@ namespace RenderLab
       //}
     }
 
+    if (material->getMaterialType() == Material::DEFERRED_CLUSTERED)
+    {
+      // Cluster grid, light index list and packed lights
+      for (uint32_t binding = 7; binding <= 9; binding++)
+      {
+        VkDescriptorSetLayoutBinding clusterLayoutBinding = {};
+        clusterLayoutBinding.binding = binding;
+        clusterLayoutBinding.descriptorCount = 1;
+        clusterLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        clusterLayoutBinding.pImmutableSamplers = nullptr;
+        clusterLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        bindings.push_back(clusterLayoutBinding);
+      }
+    }
+
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo = {};
     descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     descriptorSetLayoutInfo.bindingCount = (uint32_t)bindings.size();
     descriptorSetLayoutInfo.pBindings = bindings.data();
     vkCreateDescriptorSetLayout(m_device, &descriptorSetLayoutInfo, nullptr, &materialData->m_descriptorSetLayout[frameNumber]);
 
+    materialData->m_layoutBindings = 0;
+    for (size_t i = 0; i < bindings.size(); i++)
+    {
+      materialData->m_layoutBindings |= 1 << bindings[i].binding;
+    }
+
 
     VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -1017,6 +1647,7 @@ namespace RenderLab
     {
       pipelineLayoutInfo.pushConstantRangeCount = 1;
       pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+      materialData->m_layoutBindings |= PUSH_CONSTANT_BIT;
     }
 
     vkCreatePipelineLayout(m_device, &pipelineLayoutInfo, nullptr, &materialData->m_pipelineLayout[frameNumber]);
@@ -1076,7 +1707,7 @@ namespace RenderLab
       }
     }
 
-    if (material->getMaterialType() == Material::DEFERRED_COMPOSITE)
+    if (material->getMaterialType() == Material::DEFERRED_COMPOSITE || material->getMaterialType() == Material::DEFERRED_CLUSTERED)
     {
       VkDescriptorPoolSize positionSamplerPoolSize;
       positionSamplerPoolSize.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
@@ -1114,6 +1745,14 @@ namespace RenderLab
       //}
     }
 
+    if (material->getMaterialType() == Material::DEFERRED_CLUSTERED)
+    {
+      VkDescriptorPoolSize clusterPoolSize;
+      clusterPoolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      clusterPoolSize.descriptorCount = 3;
+      descriptorPoolSize.push_back(clusterPoolSize);
+    }
+
     VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
     descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     descriptorPoolInfo.maxSets = 1;
@@ -1142,6 +1781,7 @@ namespace RenderLab
     vkUniformBufferData* frameDataUniformBufferData = (vkUniformBufferData*)frameDataUniformBuffer->getGraphicsData();
     vkUniformBufferData* objectDataUniformBufferData = (vkUniformBufferData*)objectDataUniformBuffer->getGraphicsData();
     std::vector<VkDescriptorBufferInfo> descriptorBufferInfo(2);
+    std::vector<VkDescriptorBufferInfo> clusterBufferInfo(3);
     std::vector<VkWriteDescriptorSet> writeDescriptorSet;
 
     VkDescriptorBufferInfo frameDataDescBuffer = {};
@@ -1279,7 +1919,7 @@ namespace RenderLab
       }
     }
 
-    if (material->getMaterialType() == Material::DEFERRED_COMPOSITE)
+    if (material->getMaterialType() == Material::DEFERRED_COMPOSITE || material->getMaterialType() == Material::DEFERRED_CLUSTERED)
     {
       vkViewData* viewData = (vkViewData*)m_onscreenView->getGraphicsData();
 
@@ -1382,52 +2022,214 @@ namespace RenderLab
       //}
     }
 
+    if (material->getMaterialType() == Material::DEFERRED_CLUSTERED)
+    {
+      shared_ptr<UniformBuffer> clusterBuffers[3];
+      m_renderTechnique->getClusterUniformBuffers((uint32_t)frameNumber, clusterBuffers[0], clusterBuffers[1], clusterBuffers[2]);
+
+      for (uint32_t i = 0; i < 3; i++)
+      {
+        vkUniformBufferData* clusterBufferData = (vkUniformBufferData*)clusterBuffers[i]->getGraphicsData();
+        clusterBufferInfo[i].buffer = clusterBufferData->m_buffer;
+        clusterBufferInfo[i].offset = 0;
+        clusterBufferInfo[i].range = VK_WHOLE_SIZE;
+
+        VkWriteDescriptorSet clusterDescWrite = {};
+        clusterDescWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        clusterDescWrite.dstSet = materialData->m_descriptorSet[frameNumber];
+        clusterDescWrite.dstBinding = 7 + i;
+        clusterDescWrite.dstArrayElement = 0;
+        clusterDescWrite.descriptorCount = 1;
+        clusterDescWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        clusterDescWrite.pBufferInfo = &clusterBufferInfo[i];
+        writeDescriptorSet.push_back(clusterDescWrite);
+      }
+    }
+
     vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, nullptr);
   }
 
-  VkPipeline GraphicsVulkan::loadPipeline(shared_ptr<Mesh> mesh, vkMeshData* meshData, shared_ptr<Material> material, size_t frameIndex, shared_ptr<View> view)
+  void GraphicsVulkan::loadPipeline(shared_ptr<Mesh> mesh, vkMeshData* meshData, shared_ptr<Material> material, shared_ptr<View> view, VkPipeline* pipeline)
   {
-    int pipelineIndex = -1;
+    vkMaterialData* materialData = (vkMaterialData*)material->getGraphicsData();
+    vkViewData* viewData = (vkViewData*)view->getGraphicsData();
+    Material::Type materialType = material->getMaterialType();
+    bool screenView = view->getType() == View::SCREEN || view->getType() == View::OFFSCREEN;
+
+    vkPipelineKey key;
+    memset(&key, 0, sizeof(key));
+    key.m_vertexShader = materialData->m_vertexShader;
+    key.m_geometryShader = materialData->m_geometryShader;
+    key.m_fragmentShader = materialData->m_fragmentShader;
+    key.m_renderPass = viewData->m_renderPass;
+    key.m_layoutBindings = materialData->m_layoutBindings;
+
+    if (materialType == Material::DEPTH_PREPASS)
+    {
+      key.m_subpass = 0;
+    }
+    else if (materialType == Material::DEFERRED_COMPOSITE || materialType == Material::DEFERRED_CLUSTERED)
+    {
+      key.m_subpass = m_depthPrepass ? 2 : 1;
+    }
+    else
+    {
+      key.m_subpass = m_depthPrepass ? 1 : 0;
+    }
 
-    for (size_t i = 0; i < m_pipelineCache.size(); i++)
+    key.m_numAttributes = (uint32_t)meshData->m_vertexInputAttributes.size();
+    for (uint32_t i = 0; i < key.m_numAttributes; i++)
     {
-      if (mesh->getNumBuffers() == m_pipelineCache[i]->m_numMeshBuffers && 
-          material->getMaterialType() == m_pipelineCache[i]->m_materialType &&
-          frameIndex == m_pipelineCache[i]->m_frameIndex)
+      if (meshData->m_vertexInputAttributes[i].format == VK_FORMAT_R32G32B32_SFLOAT)
       {
-        pipelineIndex = (int)i;
-        break;
+        key.m_attributeFormats |= 1 << i;
       }
     }
+    key.m_topology = meshData->m_inputAssemblyState.topology;
+
+    // Two sided geometry is drawn without culling in every pass, so the depth
+    // prepass and the shadows match what the lit pass draws
+    if (materialType == Material::DEFERRED_CLUSTERED || mesh->getMaterial()->getTwoSided())
+    {
+      key.m_cullMode = VK_CULL_MODE_NONE;
+    }
+    else
+    {
+      key.m_cullMode = VK_CULL_MODE_BACK_BIT;
+    }
+    key.m_depthBias = screenView ? VK_FALSE : VK_TRUE;
+
+    if (screenView && m_deferred && (materialType == Material::DEFERRED_COMPOSITE || materialType == Material::DEFERRED_CLUSTERED))
+    {
+      key.m_depthTest = VK_FALSE;
+      key.m_depthWrite = VK_FALSE;
+    }
+    else if (screenView && m_deferred && materialType == Material::DEPTH_PREPASS)
+    {
+      key.m_depthTest = VK_TRUE;
+      key.m_depthWrite = VK_TRUE;
+    }
+    else
+    {
+      key.m_depthTest = VK_TRUE;
+      key.m_depthWrite = m_depthPrepass ? VK_FALSE : VK_TRUE;
+    }
 
-    if (pipelineIndex != -1)
+    key.m_blend = (screenView && m_deferred && materialType == Material::DEFERRED_COMPOSITE) ? VK_TRUE : VK_FALSE;
+    if (materialType == Material::SHADOW || materialType == Material::SHADOW_CUBE || materialType == Material::DEPTH_PREPASS)
+    {
+      key.m_numColorAttachments = 0;
+    }
+    else if (m_deferred && materialType == Material::DEFERRED_LIT)
+    {
+      key.m_numColorAttachments = 5;
+    }
+    else
     {
-      return m_pipelineCache[pipelineIndex]->m_pipeline;
+      key.m_numColorAttachments = 1;
     }
 
-    vkPipelineCacheInfo* pipelineCacheInfo = new vkPipelineCacheInfo();
-    pipelineCacheInfo->m_materialType = material->getMaterialType();
-    pipelineCacheInfo->m_numMeshBuffers = mesh->getNumBuffers();
-    pipelineCacheInfo->m_frameIndex = frameIndex;
-    m_pipelineCache.push_back(pipelineCacheInfo);
+    unordered_map<vkPipelineKey, VkPipeline, vkPipelineKeyHash, vkPipelineKeyEqual>::iterator it = m_pipelineCache.find(key);
+    if (it != m_pipelineCache.end())
+    {
+      m_pipelineCacheHits++;
+      *pipeline = it->second;
+      return;
+    }
 
-    vkMaterialData* materialData = (vkMaterialData*)material->getGraphicsData();
-    vkViewData* viewData = (vkViewData*)view->getGraphicsData();
+    // Not built yet, compilePipelines fills the slot in
+    *pipeline = VK_NULL_HANDLE;
+    unordered_map<vkPipelineKey, vkPipelineRequest, vkPipelineKeyHash, vkPipelineKeyEqual>::iterator pending = m_pendingPipelines.find(key);
+    if (pending != m_pendingPipelines.end())
+    {
+      m_pipelineCacheHits++;
+      pending->second.m_targets.push_back(pipeline);
+      return;
+    }
+    m_pipelineCacheMisses++;
+
+    vkPipelineRequest& request = m_pendingPipelines[key];
+    request.m_meshData = meshData;
+    // Any frame's layout will do, they are created from identical bindings
+    request.m_layout = materialData->m_pipelineLayout[0];
+    request.m_pipeline = VK_NULL_HANDLE;
+    request.m_createTime = 0;
+    request.m_targets.push_back(pipeline);
+  }
+
+  void GraphicsVulkan::compilePipelines()
+  {
+    if (m_pendingPipelines.empty())
+    {
+      return;
+    }
+
+    CpuTimer compileTimer;
+    compileTimer.start();
+
+    vector<vkPipelineRequest*> requests;
+    vector<const vkPipelineKey*> keys;
+    for (unordered_map<vkPipelineKey, vkPipelineRequest, vkPipelineKeyHash, vkPipelineKeyEqual>::iterator it = m_pendingPipelines.begin(); it != m_pendingPipelines.end(); ++it)
+    {
+      keys.push_back(&it->first);
+      requests.push_back(&it->second);
+    }
+
+    // Creation only reads the requests, and the driver cache is internally synchronized
+    function<void(uint32_t, uint32_t)> compile = [&](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t i = begin; i < end; i++)
+      {
+        CpuTimer createTimer;
+        createTimer.start();
+        requests[i]->m_pipeline = createPipeline(*keys[i], requests[i]->m_meshData, requests[i]->m_layout);
+        requests[i]->m_createTime = createTimer.elapsedMicro();
+      }
+    };
+
+    shared_ptr<JobSystem> jobSystem = m_renderTechnique != nullptr ? m_renderTechnique->getJobSystem() : nullptr;
+    if (jobSystem != nullptr)
+    {
+      jobSystem->parallelFor((uint32_t)requests.size(), 1, compile);
+      m_pipelineCompileThreads = jobSystem->getNumThreads();
+    }
+    else
+    {
+      compile(0, (uint32_t)requests.size());
+      m_pipelineCompileThreads = 1;
+    }
 
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+      m_pipelineCache[*keys[i]] = requests[i]->m_pipeline;
+      for (size_t j = 0; j < requests[i]->m_targets.size(); j++)
+      {
+        *requests[i]->m_targets[j] = requests[i]->m_pipeline;
+      }
+      m_pipelineCreateTime += requests[i]->m_createTime;
+      m_numPipelinesCreated++;
+    }
+    m_pendingPipelines.clear();
+
+    m_pipelineCompileTime += compileTimer.elapsedMicro();
+  }
+
+  VkPipeline GraphicsVulkan::createPipeline(const vkPipelineKey& key, vkMeshData* meshData, VkPipelineLayout layout)
+  {
     VkPipelineShaderStageCreateInfo shaderStageInfo[3] = {};
     shaderStageInfo[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     shaderStageInfo[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-    shaderStageInfo[0].module = materialData->m_vertexShader;
+    shaderStageInfo[0].module = key.m_vertexShader;
     shaderStageInfo[0].pName = "main";
     shaderStageInfo[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     shaderStageInfo[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    shaderStageInfo[1].module = materialData->m_fragmentShader;
+    shaderStageInfo[1].module = key.m_fragmentShader;
     shaderStageInfo[1].pName = "main";
-    if (material->getMaterialType() == Material::SHADOW_CUBE)
+    if (key.m_geometryShader != VK_NULL_HANDLE)
     {
       shaderStageInfo[2].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
       shaderStageInfo[2].stage = VK_SHADER_STAGE_GEOMETRY_BIT;
-      shaderStageInfo[2].module = materialData->m_geometryShader;
+      shaderStageInfo[2].module = key.m_geometryShader;
       shaderStageInfo[2].pName = "main";
     }
 
@@ -1441,17 +2243,9 @@ namespace RenderLab
     rasterizationInfo.depthClampEnable = false;
     rasterizationInfo.rasterizerDiscardEnable = false;
     rasterizationInfo.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizationInfo.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizationInfo.cullMode = key.m_cullMode;
     rasterizationInfo.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    
-    if (view->getType() == View::SCREEN)
-    {
-      rasterizationInfo.depthBiasEnable = false;
-    }
-    else
-    {
-      rasterizationInfo.depthBiasEnable = true;
-    }
+    rasterizationInfo.depthBiasEnable = key.m_depthBias;
     rasterizationInfo.lineWidth = 1.0f; 
 
     VkPipelineMultisampleStateCreateInfo multisampleInfo = {};
@@ -1462,16 +2256,8 @@ namespace RenderLab
     multisampleInfo.alphaToCoverageEnable = false;
     multisampleInfo.alphaToOneEnable = false;
 
-    vector<VkPipelineColorBlendAttachmentState> blendAttachments;
     VkPipelineColorBlendAttachmentState blendAttachment = {};   
-    if (view->getType() == View::SCREEN && m_deferred && material->getMaterialType() == Material::DEFERRED_COMPOSITE)
-    {
-      blendAttachment.blendEnable = true;
-    }
-    else
-    {
-      blendAttachment.blendEnable = false;
-    }
+    blendAttachment.blendEnable = key.m_blend;
     blendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
     blendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
     blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
@@ -1482,15 +2268,7 @@ namespace RenderLab
       VK_COLOR_COMPONENT_G_BIT |
       VK_COLOR_COMPONENT_B_BIT |
       VK_COLOR_COMPONENT_A_BIT;
-    blendAttachments.push_back(blendAttachment);
-
-    if (m_deferred && material->getMaterialType() == Material::DEFERRED_LIT)
-    {
-      blendAttachments.push_back(blendAttachment);
-      blendAttachments.push_back(blendAttachment);
-      blendAttachments.push_back(blendAttachment);
-      blendAttachments.push_back(blendAttachment);
-    }
+    vector<VkPipelineColorBlendAttachmentState> blendAttachments(key.m_numColorAttachments, blendAttachment);
 
     VkPipelineColorBlendStateCreateInfo blendInfo = {};
     blendInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
@@ -1509,30 +2287,8 @@ namespace RenderLab
 
     VkPipelineDepthStencilStateCreateInfo depthStencil = {};
     depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    if (view->getType() == View::SCREEN && m_deferred && material->getMaterialType() == Material::DEFERRED_COMPOSITE)
-    {
-      depthStencil.depthTestEnable = VK_FALSE;
-      depthStencil.depthWriteEnable = VK_FALSE;
-    }
-    else if (view->getType() == View::SCREEN && m_deferred && material->getMaterialType() == Material::DEPTH_PREPASS)
-    {
-      depthStencil.depthTestEnable = VK_TRUE;
-      depthStencil.depthWriteEnable = VK_TRUE;
-    }
-    else
-    {
-      if (m_depthPrepass)
-      {
-        depthStencil.depthTestEnable = VK_TRUE;
-        depthStencil.depthWriteEnable = VK_FALSE;
-      }
-      else
-      {
-        depthStencil.depthTestEnable = VK_TRUE;
-        depthStencil.depthWriteEnable = VK_TRUE;
-      }
-    }
-
+    depthStencil.depthTestEnable = key.m_depthTest;
+    depthStencil.depthWriteEnable = key.m_depthWrite;
     depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
     depthStencil.depthBoundsTestEnable = VK_FALSE;
     depthStencil.minDepthBounds = 0.0f; // Optional
@@ -1543,15 +2299,7 @@ namespace RenderLab
 
     VkGraphicsPipelineCreateInfo pipelineInfo = {};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    if (material->getMaterialType() == Material::SHADOW_CUBE)
-    {
-      pipelineInfo.stageCount = 3;
-    }
-    else
-    {
-      pipelineInfo.stageCount = 2;
-    }
-    
+    pipelineInfo.stageCount = key.m_geometryShader != VK_NULL_HANDLE ? 3 : 2;
     pipelineInfo.pStages = shaderStageInfo;
     pipelineInfo.pVertexInputState = &meshData->m_vertexInputState;
     pipelineInfo.pInputAssemblyState = &meshData->m_inputAssemblyState;
@@ -1560,36 +2308,36 @@ namespace RenderLab
     pipelineInfo.pRasterizationState = &rasterizationInfo;
     pipelineInfo.pMultisampleState = &multisampleInfo;
     pipelineInfo.pDepthStencilState = &depthStencil;
-
-    if (material->getMaterialType() == Material::SHADOW || material->getMaterialType() == Material::SHADOW_CUBE || material->getMaterialType() == Material::DEPTH_PREPASS)
-    {
-      pipelineInfo.pColorBlendState = nullptr;
-    }
-    else
-    {
-      pipelineInfo.pColorBlendState = &blendInfo;
-    }
-    
+    pipelineInfo.pColorBlendState = key.m_numColorAttachments > 0 ? &blendInfo : nullptr;
     pipelineInfo.pDynamicState = &dynamicInfo;
-    pipelineInfo.layout = materialData->m_pipelineLayout[frameIndex];
-    pipelineInfo.renderPass = viewData->m_renderPass;
-    
-    if (material->getMaterialType() == Material::DEPTH_PREPASS)
-    {
-      pipelineInfo.subpass = 0;
-    }
-    else if(material->getMaterialType() == Material::DEFERRED_COMPOSITE)
-    {
-      pipelineInfo.subpass = m_depthPrepass? 2: 1;
-    }
-    else
+    pipelineInfo.layout = layout;
+    pipelineInfo.renderPass = key.m_renderPass;
+    pipelineInfo.subpass = key.m_subpass;
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    vkCreateGraphicsPipelines(m_device, m_driverPipelineCache, 1, &pipelineInfo, nullptr, &pipeline);
+    return pipeline;
+  }
+
+  VkShaderModule GraphicsVulkan::loadShader(const string& filename)
+  {
+    map<string, VkShaderModule>::iterator it = m_shaderModules.find(filename);
+    if (it != m_shaderModules.end())
     {
-      pipelineInfo.subpass = m_depthPrepass ? 1: 0;
+      return it->second;
     }
-    
-    VkResult res = vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipelineCacheInfo->m_pipeline);
 
-    return pipelineCacheInfo->m_pipeline;
+    vector<char> code = readFile(filename);
+
+    VkShaderModuleCreateInfo shaderInfo = {};
+    shaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shaderInfo.codeSize = code.size();
+    shaderInfo.pCode = (const uint32_t*)code.data();
+
+    VkShaderModule shaderModule = VK_NULL_HANDLE;
+    vkCreateShaderModule(m_device, &shaderInfo, nullptr, &shaderModule);
+    m_shaderModules[filename] = shaderModule;
+    return shaderModule;
   }
 
   void GraphicsVulkan::build(shared_ptr<UniformBuffer> buffer)
@@ -1605,37 +2353,10 @@ namespace RenderLab
 
     vkCreateBuffer(m_device, &bufferInfo, nullptr, &uniformBufferData->m_buffer);
 
-    // Create The Buffer Memory
-    VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(m_device, uniformBufferData->m_buffer, &memoryRequirements);
-
-    VkDeviceSize alignedSize = memoryRequirements.size;
-    if (alignedSize % memoryRequirements.alignment)
-    {
-      alignedSize += memoryRequirements.alignment - (alignedSize % memoryRequirements.alignment);
-    }
-
-    // allocate memory
-    VkMemoryAllocateInfo memoryAllocateInfo = {};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.allocationSize = memoryRequirements.size;
-
-    for (uint32_t idx = 0; idx < m_memoryFlags.size(); idx++) {
-      if ((memoryRequirements.memoryTypeBits & (1 << idx)) &&
-        (m_memoryFlags[idx] & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
-        (m_memoryFlags[idx] & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
-        memoryAllocateInfo.memoryTypeIndex = idx;
-        break;
-      }
-    }
-
-    vkAllocateMemory(m_device, &memoryAllocateInfo, nullptr, &uniformBufferData->m_deviceMemory);
-
-    void *ptr;
-    vkMapMemory(m_device, uniformBufferData->m_deviceMemory, 0, VK_WHOLE_SIZE, 0, &ptr);
-
-    vkBindBufferMemory(m_device, uniformBufferData->m_buffer, uniformBufferData->m_deviceMemory, 0);
-    uniformBufferData->m_data = reinterpret_cast<uint8_t *>(ptr);
+    // Create The Buffer Memory. Uniform buffers live as long as the device, so
+    // they are packed linearly and stay mapped
+    m_allocator->allocateBuffer(uniformBufferData->m_buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VulkanAllocator::LINEAR, uniformBufferData->m_allocation);
+    uniformBufferData->m_data = uniformBufferData->m_allocation.m_data;
   }
 
   void GraphicsVulkan::updateUniformData(shared_ptr<UniformBuffer> buffer, size_t offset, float* data, size_t size)
@@ -1669,6 +2390,10 @@ namespace RenderLab
     {
       createOnscreenView(view, viewData, numFrames);
     } 
+    else if (view->getType() == View::OFFSCREEN)
+    {
+      createOffscreenView(view, viewData, numFrames);
+    }
     else if (view->getType() == View::SHADOW || view->getType() == View::SHADOW_CUBE)
     {
       createShadowView(view, viewData, numFrames);
@@ -1689,17 +2414,25 @@ namespace RenderLab
     commandBufferInfo.commandBufferCount = (uint32_t)numFrames;
     commandBufferInfo.commandPool = m_primaryCommandPool;
     commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    vkAllocateCommandBuffers(m_device, &commandBufferInfo, &viewData->m_commandBuffer[0]);
+    viewData->m_commandBuffer.resize(numFrames);
+    vkAllocateCommandBuffers(m_device, &commandBufferInfo, viewData->m_commandBuffer.data());
   }
 
   void GraphicsVulkan::createOnscreenView(shared_ptr<View> view, vkViewData* viewData, size_t numFrames)
   {
+    if (m_headless)
+    {
+      throw std::runtime_error("headless graphics can only render offscreen views");
+    }
+
     // Create the surface
+#ifdef VK_USE_PLATFORM_WIN32_KHR
     VkWin32SurfaceCreateInfoKHR surfaceInfo = {};
     surfaceInfo.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
     surfaceInfo.hinstance = m_hinstance;
     surfaceInfo.hwnd = m_window;
     vkCreateWin32SurfaceKHR(m_instance, &surfaceInfo, nullptr, &(viewData->m_surface));
+#endif
 
     vector<VkSurfaceFormatKHR> formats;
     uint32_t count = 0;
@@ -1722,6 +2455,7 @@ namespace RenderLab
 
     for (int i = 0; i < numFrames; i++) {
       vkBackBuffer backBuffer = {};
+      backBuffer.m_frameIndex = i;
       vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &backBuffer.m_acquireSemaphore);
       vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &backBuffer.m_renderSemaphore);
       vkCreateFence(m_device, &fenceInfo, nullptr, &backBuffer.m_presentFence);
@@ -1733,6 +2467,63 @@ namespace RenderLab
     //createGBufferPass(view, viewData);
   }
 
+  void GraphicsVulkan::createOffscreenView(shared_ptr<View> view, vkViewData* viewData, size_t numFrames)
+  {
+    // The same passes as the onscreen view, but the final color goes to images
+    // we own, so there is no surface to create or swapchain to acquire from
+    viewData->m_surface = VK_NULL_HANDLE;
+    viewData->m_surfaceFormat.format = VK_FORMAT_R8G8B8A8_UNORM;
+    viewData->m_surfaceFormat.colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+
+    createOnscreenDepthBuffer(view, viewData);
+    createOnscreenRenderPass(view, viewData);
+    resize(view, viewData->m_currentWidth, viewData->m_currentHeight);
+
+    // Create Back Buffers, one per image. Frames are only fenced, nothing is presented
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    for (uint32_t i = 0; i < numFrames; i++) {
+      vkBackBuffer backBuffer = {};
+      backBuffer.m_frameIndex = i;
+      backBuffer.m_imageIndex = i;
+      vkCreateFence(m_device, &fenceInfo, nullptr, &backBuffer.m_renderFence);
+
+      viewData->m_backBuffers.push(backBuffer);
+    }
+  }
+
+  void GraphicsVulkan::createOffscreenImages(shared_ptr<View> view, vkViewData* viewData, size_t numImages)
+  {
+    for (size_t i = 0; i < numImages; i++)
+    {
+      VkImageCreateInfo imageCreateInfo = {};
+      imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+      imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+      imageCreateInfo.format = viewData->m_surfaceFormat.format;
+      imageCreateInfo.extent.width = viewData->m_extent.width;
+      imageCreateInfo.extent.height = viewData->m_extent.height;
+      imageCreateInfo.extent.depth = 1;
+      imageCreateInfo.mipLevels = 1;
+      imageCreateInfo.arrayLayers = 1;
+      imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+      imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+      imageCreateInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+      imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+      imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+      VkImage image;
+      vkCreateImage(m_device, &imageCreateInfo, nullptr, &image);
+
+      VulkanAllocator::Allocation allocation;
+      m_allocator->allocateImage(image, true, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VulkanAllocator::TLSF, allocation);
+
+      viewData->m_images.push_back(image);
+      viewData->m_imageAllocations.push_back(allocation);
+    }
+  }
+
   void GraphicsVulkan::createGBufferAttachments(shared_ptr<View> view, vkViewData* viewData)
   {
     // (World space) Positions
@@ -1787,17 +2578,8 @@ namespace RenderLab
     image.tiling = VK_IMAGE_TILING_OPTIMAL;
     image.usage = usage | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
 
-    VkMemoryAllocateInfo memoryAllocateInfo = {};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.pNext = nullptr;
-    VkMemoryRequirements memReqs;
-
     vkCreateImage(m_device, &image, nullptr, &attachment->m_image);
-    vkGetImageMemoryRequirements(m_device, attachment->m_image, &memReqs);
-    memoryAllocateInfo.allocationSize = memReqs.size;
-    memory_type_from_properties(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memoryAllocateInfo.memoryTypeIndex);
-    vkAllocateMemory(m_device, &memoryAllocateInfo, nullptr, &attachment->m_memory);
-    vkBindImageMemory(m_device, attachment->m_image, attachment->m_memory, 0);
+    m_allocator->allocateImage(attachment->m_image, true, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VulkanAllocator::TLSF, attachment->m_allocation);
 
     VkImageViewCreateInfo imageView = {};
     imageView.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -1863,15 +2645,7 @@ namespace RenderLab
     image.flags = VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
     vkCreateImage(m_device, &image, nullptr, &viewData->m_depthImage);
 
-    VkMemoryAllocateInfo memoryAllocateInfo = {};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.pNext = nullptr;
-    VkMemoryRequirements memReqs;
-    vkGetImageMemoryRequirements(m_device, viewData->m_depthImage, &memReqs);
-    memoryAllocateInfo.allocationSize = memReqs.size;
-    memory_type_from_properties(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memoryAllocateInfo.memoryTypeIndex);
-    vkAllocateMemory(m_device, &memoryAllocateInfo, nullptr, &viewData->m_depthMemory);
-    vkBindImageMemory(m_device, viewData->m_depthImage, viewData->m_depthMemory, 0);
+    m_allocator->allocateImage(viewData->m_depthImage, true, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VulkanAllocator::TLSF, viewData->m_depthAllocation);
 
     VkImageViewCreateInfo depthStencilView = {};
     depthStencilView.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -1931,6 +2705,8 @@ namespace RenderLab
       fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
       vkBackBuffer backBuffer = {};
+      backBuffer.m_frameIndex = i;
+      backBuffer.m_imageIndex = i;
       vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &backBuffer.m_acquireSemaphore);
       vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &backBuffer.m_renderSemaphore);
       vkCreateFence(m_device, &fenceInfo, nullptr, &backBuffer.m_renderFence);
@@ -1944,8 +2720,8 @@ namespace RenderLab
     if (viewData->m_depthImage != VK_NULL_HANDLE)
     {
       vkDestroyImageView(m_device, viewData->m_depthView, nullptr);
-      vkFreeMemory(m_device, viewData->m_depthMemory, nullptr);
       vkDestroyImage(m_device, viewData->m_depthImage, nullptr);
+      m_allocator->free(viewData->m_depthAllocation);
     }
 
     VkImageCreateInfo imageCreateInfo = {};
@@ -1988,12 +2764,6 @@ namespace RenderLab
     imageCreateInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
     imageCreateInfo.flags = 0;
 
-    VkMemoryAllocateInfo memoryAllocateInfo = {};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.pNext = NULL;
-    memoryAllocateInfo.allocationSize = 0;
-    memoryAllocateInfo.memoryTypeIndex = 0;
-
     VkImageViewCreateInfo viewCreateInfo = {};
     viewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewCreateInfo.pNext = NULL;
@@ -2011,21 +2781,11 @@ namespace RenderLab
     viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
     viewCreateInfo.flags = 0;
 
-    VkMemoryRequirements memoryRequirements;
-
     /* Create image */
     vkCreateImage(m_device, &imageCreateInfo, NULL, &viewData->m_depthImage);
-    vkGetImageMemoryRequirements(m_device, viewData->m_depthImage, &memoryRequirements);
-
-    memoryAllocateInfo.allocationSize = memoryRequirements.size;
-    /* Use the memory properties to determine the type of memory required */
-    memory_type_from_properties(memoryRequirements.memoryTypeBits, 0, &memoryAllocateInfo.memoryTypeIndex);
-
-    /* Allocate memory */
-    vkAllocateMemory(m_device, &memoryAllocateInfo, NULL, &viewData->m_depthMemory);
 
-    /* Bind memory */
-    vkBindImageMemory(m_device, viewData->m_depthImage, viewData->m_depthMemory, 0);
+    /* Allocate and bind memory */
+    m_allocator->allocateImage(viewData->m_depthImage, imageCreateInfo.tiling == VK_IMAGE_TILING_OPTIMAL, 0, VulkanAllocator::TLSF, viewData->m_depthAllocation);
 
     /* Set the image layout to depth stencil optimal */
     setImageLayout(commandBuffer, viewData->m_depthImage, viewCreateInfo.subresourceRange.aspectMask,
@@ -2122,6 +2882,11 @@ namespace RenderLab
     attachmentDescs[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     attachmentDescs[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     attachmentDescs[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    if (view->getType() == View::OFFSCREEN)
+    {
+      // Left ready to be copied out by readBackBuffer
+      attachmentDescs[0].finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    }
     attachmentDescs[0].flags = 0;
 
     attachmentDescs[1].format = viewData->m_depthFormat;
@@ -2229,7 +2994,7 @@ namespace RenderLab
     subpasses[subpassIndex].pPreserveAttachments = NULL;
     subpassIndex++;
 
-    array<VkSubpassDependency, 2> subpassDependency;
+    array<VkSubpassDependency, 3> subpassDependency;
     subpassDependency[0].srcSubpass = 0;
     subpassDependency[0].dstSubpass = 1;
     subpassDependency[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
@@ -2249,13 +3014,25 @@ namespace RenderLab
       subpassDependency[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
     }
 
+    // With more than one frame in flight the previous frame can still be using
+    // the G-buffer and depth attachments, and the back buffer layout transition
+    // has to wait for the acquire semaphore, so order against earlier work
+    uint32_t externalIndex = subpassIndex - 1;
+    subpassDependency[externalIndex].srcSubpass = VK_SUBPASS_EXTERNAL;
+    subpassDependency[externalIndex].dstSubpass = 0;
+    subpassDependency[externalIndex].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    subpassDependency[externalIndex].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    subpassDependency[externalIndex].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+    subpassDependency[externalIndex].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    subpassDependency[externalIndex].dependencyFlags = 0;
+
     VkRenderPassCreateInfo render_pass_info = {};
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
     render_pass_info.attachmentCount = 8;
     render_pass_info.pAttachments = attachmentDescs;
     render_pass_info.subpassCount = subpassIndex;
     render_pass_info.pSubpasses = subpasses;
-    render_pass_info.dependencyCount = (uint32_t)(subpassIndex-1);
+    render_pass_info.dependencyCount = (uint32_t)subpassIndex;
     render_pass_info.pDependencies = subpassDependency.data();
 
     vkCreateRenderPass(m_device, &render_pass_info, nullptr, &viewData->m_renderPass);
@@ -2316,6 +3093,30 @@ namespace RenderLab
   void GraphicsVulkan::resize(shared_ptr<View> view, uint32_t width, uint32_t height)
   {
     vkViewData* viewData = (vkViewData*)view->getGraphicsData();
+    if (view->getType() == View::OFFSCREEN)
+    {
+      // No surface to negotiate the size with, the images are just recreated
+      if (viewData->m_images.empty() || width != viewData->m_currentWidth || height != viewData->m_currentHeight)
+      {
+        if (!viewData->m_images.empty())
+        {
+          vkDeviceWaitIdle(m_device);
+          detachSwapchain(view, viewData);
+        }
+
+        viewData->m_extent.width = width;
+        viewData->m_extent.height = height;
+        viewData->m_currentWidth = width;
+        viewData->m_currentHeight = height;
+
+        createOnscreenDepthBuffer(view, viewData);
+        createGBufferAttachments(view, viewData);
+        createOffscreenImages(view, viewData, m_numFrames);
+        attachSwapchain(view, viewData);
+      }
+      return;
+    }
+
     if (viewData->m_swapchain == nullptr || width != viewData->m_currentWidth || height != viewData->m_currentHeight)
     {
       VkSurfaceCapabilitiesKHR surfaceCapabilities;
@@ -2442,11 +3243,14 @@ namespace RenderLab
     viewData->m_scissor.offset = { 0, 0 };
     viewData->m_scissor.extent = viewData->m_extent;
 
-    // get swapchain images
-    uint32_t count = 0;
-    vkGetSwapchainImagesKHR(m_device, viewData->m_swapchain, &count, nullptr);
-    viewData->m_images.resize(count);
-    vkGetSwapchainImagesKHR(m_device, viewData->m_swapchain, &count, viewData->m_images.data());
+    // get swapchain images, offscreen views have already created their own
+    if (viewData->m_swapchain != VK_NULL_HANDLE)
+    {
+      uint32_t count = 0;
+      vkGetSwapchainImagesKHR(m_device, viewData->m_swapchain, &count, nullptr);
+      viewData->m_images.resize(count);
+      vkGetSwapchainImagesKHR(m_device, viewData->m_swapchain, &count, viewData->m_images.data());
+    }
 
     viewData->m_imageViews.reserve(viewData->m_images.size());
     viewData->m_framebuffers.reserve(viewData->m_images.size());
@@ -2502,6 +3306,14 @@ namespace RenderLab
       vkDestroyImageView(m_device, view, nullptr);
     }
 
+    // Swapchain images belong to the swapchain, only offscreen images have memory of their own
+    for (size_t i = 0; i < viewData->m_imageAllocations.size(); i++)
+    {
+      vkDestroyImage(m_device, viewData->m_images[i], nullptr);
+      m_allocator->free(viewData->m_imageAllocations[i]);
+    }
+
+    viewData->m_imageAllocations.clear();
     viewData->m_framebuffers.clear();
     viewData->m_imageViews.clear();
     viewData->m_images.clear();
@@ -2526,6 +3338,7 @@ namespace RenderLab
 
   void GraphicsVulkan::initializeInstance()
   {
+#ifdef _WIN32
     const char filename[] = "vulkan-1.dll";
     HMODULE mod;
     PFN_vkGetInstanceProcAddr get_proc = nullptr;
@@ -2548,6 +3361,7 @@ namespace RenderLab
     }
 
     //hmodule_ = mod;
+#endif
 
     VkApplicationInfo app_info = {};
     app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
@@ -2560,9 +3374,12 @@ namespace RenderLab
 #else
     bool validate = false;
 #endif
-    // require generic WSI extensions
-    m_instanceExtensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
-    m_deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    // require generic WSI extensions, unless we never present
+    if (!m_headless)
+    {
+      m_instanceExtensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+      m_deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
     //m_deviceExtensions.push_back("VK_NV_viewport_array2");
     //m_deviceExtensions.push_back("VK_NV_glsl_shader");
 
@@ -2573,7 +3390,12 @@ namespace RenderLab
       m_instanceExtensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
     }
 
-    m_instanceExtensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+#ifdef VK_USE_PLATFORM_WIN32_KHR
+    if (!m_headless)
+    {
+      m_instanceExtensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+    }
+#endif
 
     VkInstanceCreateInfo instance_info = {};
     instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -2588,7 +3410,7 @@ namespace RenderLab
       instance_info.ppEnabledLayerNames = nullptr;
     }
     instance_info.enabledExtensionCount = static_cast<uint32_t>(m_instanceExtensions.size());
-    instance_info.ppEnabledExtensionNames = &m_instanceExtensions[0];
+    instance_info.ppEnabledExtensionNames = m_instanceExtensions.data();
 
     vkCreateInstance(&instance_info, nullptr, &m_instance);
 
@@ -2623,11 +3445,17 @@ namespace RenderLab
           commandQueueFamily = i;
         }
 
-        // present queue must support the surface
-        if (presentQueueFamily < 0 && (vkGetPhysicalDeviceWin32PresentationSupportKHR(physical_device, i) == VK_TRUE))
+        // present queue must support the surface, headless there is nothing to present
+        if (m_headless)
+        {
+          presentQueueFamily = commandQueueFamily;
+        }
+#ifdef VK_USE_PLATFORM_WIN32_KHR
+        else if (presentQueueFamily < 0 && (vkGetPhysicalDeviceWin32PresentationSupportKHR(physical_device, i) == VK_TRUE))
         { 
           presentQueueFamily = i;
         }
+#endif
           
 
         if (commandQueueFamily >= 0 && presentQueueFamily >= 0)
@@ -2700,6 +3528,10 @@ namespace RenderLab
     {
       m_memoryFlags.push_back(m_memoryProperties.memoryTypes[i].propertyFlags);
     }
+
+    // Integrated and software devices read host memory as fast as their own
+    m_unifiedMemory = (m_physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ||
+                       m_physicalDeviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU);
   }
 
   void GraphicsVulkan::initializeQueues(uint32_t numFrames)
@@ -2721,18 +3553,95 @@ namespace RenderLab
     commandBufferInfo.commandBufferCount = numFrames;
     commandBufferInfo.commandPool = m_primaryCommandPool;
     commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    vkAllocateCommandBuffers(m_device, &commandBufferInfo, &m_primaryCommandBuffer[0]);
+    m_primaryCommandBuffer.resize(numFrames);
+    vkAllocateCommandBuffers(m_device, &commandBufferInfo, m_primaryCommandBuffer.data());
 
     VkQueryPoolCreateInfo queryPoolCreateInfo;
     queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
     queryPoolCreateInfo.pNext = nullptr;
     queryPoolCreateInfo.flags = 0;
-    queryPoolCreateInfo.queryCount = 3;
+    queryPoolCreateInfo.queryCount = numFrames * NUM_FRAME_TIMESTAMPS;
     queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
     queryPoolCreateInfo.pipelineStatistics = 0;
     vkCreateQueryPool(m_device, &queryPoolCreateInfo, nullptr, &m_queryPool);
   }
 
+  void GraphicsVulkan::initializePipelineCache()
+  {
+    vector<char> data;
+    ifstream file(m_pipelineCacheFile, std::ios::ate | std::ios::binary);
+    if (file.is_open())
+    {
+      data.resize((size_t)file.tellg());
+      file.seekg(0);
+      file.read(data.data(), data.size());
+    }
+
+    // Only seed the cache from a blob this device and driver wrote
+    vkPipelineCacheFileHeader header = {};
+    if (data.size() >= sizeof(header))
+    {
+      memcpy(&header, data.data(), sizeof(header));
+    }
+    m_pipelineCacheWarm = header.m_magic == PIPELINE_CACHE_MAGIC &&
+      header.m_version == PIPELINE_CACHE_VERSION &&
+      header.m_vendorID == m_physicalDeviceProperties.vendorID &&
+      header.m_deviceID == m_physicalDeviceProperties.deviceID &&
+      header.m_driverVersion == m_physicalDeviceProperties.driverVersion &&
+      memcmp(header.m_pipelineCacheUUID, m_physicalDeviceProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0 &&
+      header.m_dataSize == data.size() - sizeof(header);
+
+    VkPipelineCacheCreateInfo pipelineCacheInfo = {};
+    pipelineCacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    if (m_pipelineCacheWarm)
+    {
+      pipelineCacheInfo.initialDataSize = (size_t)header.m_dataSize;
+      pipelineCacheInfo.pInitialData = data.data() + sizeof(header);
+    }
+
+    if (vkCreatePipelineCache(m_device, &pipelineCacheInfo, nullptr, &m_driverPipelineCache) != VK_SUCCESS)
+    {
+      // Drivers may still reject data that passed the header check, start cold then
+      pipelineCacheInfo.initialDataSize = 0;
+      pipelineCacheInfo.pInitialData = nullptr;
+      m_pipelineCacheWarm = false;
+      vkCreatePipelineCache(m_device, &pipelineCacheInfo, nullptr, &m_driverPipelineCache);
+    }
+  }
+
+  void GraphicsVulkan::initializeStaging()
+  {
+    if (m_unifiedMemory)
+    {
+      return;
+    }
+
+    m_stagingSize = 16 * 1024 * 1024;
+
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = m_stagingSize;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    vkCreateBuffer(m_device, &bufferInfo, nullptr, &m_stagingBuffer);
+
+    VkMemoryRequirements memReqs;
+    vkGetBufferMemoryRequirements(m_device, m_stagingBuffer, &memReqs);
+
+    VkMemoryAllocateInfo memoryAllocateInfo = {};
+    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memoryAllocateInfo.allocationSize = memReqs.size;
+    memory_type_from_properties(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &memoryAllocateInfo.memoryTypeIndex);
+
+    if (vkAllocateMemory(m_device, &memoryAllocateInfo, nullptr, &m_stagingMemory) != VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate staging memory!");
+    }
+    vkBindBufferMemory(m_device, m_stagingBuffer, m_stagingMemory, 0);
+
+    // Stays mapped for the life of the device
+    vkMapMemory(m_device, m_stagingMemory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(&m_stagingData));
+  }
+
   bool GraphicsVulkan::has_all_device_extensions(VkPhysicalDevice physicalDevice)
   {
     // get device extensions
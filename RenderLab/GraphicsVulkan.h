@@ -2,6 +2,8 @@
 #include "Graphics.h"
 #include "Mesh.h"
 #include "Material.h"
+#include "VulkanAllocator.h"
+#include "CpuTimer.h"
 
 #include <string>
 #include <memory>
@@ -15,6 +17,9 @@
 #include <fstream>
 #include <cassert>
 #include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <string.h>
 
 #include <vulkan/vulkan.h>
 
@@ -25,7 +30,9 @@ using std::queue;
 using std::set;
 using std::array;
 using std::ifstream;
+using std::ofstream;
 using std::map;
+using std::unordered_map;
 
 namespace RenderLab
 {
@@ -34,6 +41,8 @@ namespace RenderLab
   {
   public:
     GraphicsVulkan(string name, HINSTANCE hinstance, HWND window);
+    // Headless: no surface or swapchain, only View::OFFSCREEN views can be presented to
+    GraphicsVulkan(string name);
     ~GraphicsVulkan();
 
     void initialize(uint32_t numFrames);
@@ -42,6 +51,7 @@ namespace RenderLab
     size_t getBufferAlignment();
     void build(shared_ptr<UniformBuffer> buffer);
     void build(shared_ptr<View> view, size_t numFrames);
+    void compilePipelines();
     void resize(shared_ptr<View> view, uint32_t width, uint32_t height);
     void setDepthBias(float constant, float slope);
 
@@ -53,12 +63,41 @@ namespace RenderLab
     void                renderEnd(shared_ptr<View> view, shared_ptr<View> lastView, bool lastLight, shared_ptr<UniformBuffer> frameDataUniformBuffer, shared_ptr<UniformBuffer> objectDataUniformBuffer, uint32_t frameIndex);
     void                swapBackBuffer(shared_ptr<View> view, uint32_t frameIndex);
     void                bindPipeline(shared_ptr<Mesh> mesh, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
+    uint32_t            getPipelineId(shared_ptr<Mesh> mesh, shared_ptr<View> view, bool depthPrepass);
     void                endDepthPrepass(shared_ptr<View> view, uint32_t frameIndex);
+    bool                supportsParallelRecording();
+    void                beginMeshPass(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
+    void                endMeshSlice(shared_ptr<View> view, uint32_t frameIndex, uint32_t slice);
+    void                endMeshPass(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
     void                render(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
     float				        getGPUFrameTime();
     float				        getGPUFrameTime2();
+    bool                readBackBuffer(shared_ptr<View> view, vector<uint8_t>& pixels, uint32_t& width, uint32_t& height);
+    void                getMemoryStats(VulkanAllocator::Stats& stats);
+
+    // The driver pipeline cache is seeded from this file at initialize and
+    // written back by savePipelineCache, which the application calls on exit.
+    void                setPipelineCacheFile(const string& filename);
+    bool                savePipelineCache();
+    void                getPipelineStats(uint32_t& numPipelines, unsigned long long& createMicro, bool& warmCache, uint32_t& cacheHits, uint32_t& cacheMisses);
+
+    // Where the load time went, in microseconds. Pipeline creation is summed
+    // over the compile threads, the compile time is wall clock.
+    struct StartupTimes
+    {
+      unsigned long long  m_meshMicro;
+      unsigned long long  m_materialMicro;
+      unsigned long long  m_pipelineCompileMicro;
+      unsigned long long  m_pipelineCreateMicro;
+      uint32_t            m_compileThreads;
+    };
+    void                getStartupTimes(StartupTimes& times);
 
   private:
+    HINSTANCE             m_hinstance;
+    HWND                  m_window;
+    bool                  m_headless;
+
     vector<const char *>  m_instanceLayers;
     vector<const char *>  m_instanceExtensions;
     vector<const char *>  m_deviceExtensions;
@@ -72,13 +111,16 @@ namespace RenderLab
     VkQueue               m_commandQueue;
     VkQueue               m_presentQueue;
 
+    uint32_t              m_numFrames;
     VkCommandPool         m_primaryCommandPool;
-    VkCommandBuffer       m_primaryCommandBuffer[2];
+    vector<VkCommandBuffer> m_primaryCommandBuffer;
 
     VkPhysicalDeviceProperties          m_physicalDeviceProperties;
     vector<VkMemoryPropertyFlags>       m_memoryFlags;
     VkPhysicalDeviceMemoryProperties    m_memoryProperties;
 
+    // Each frame in flight writes its own slice of the timestamp pool
+    static const uint32_t NUM_FRAME_TIMESTAMPS = 3;
     VkQueryPool           m_queryPool;
 	  uint64_t							m_currentTimestamp[3];
 
@@ -94,32 +136,43 @@ namespace RenderLab
       VkIndexType                               m_indexType;
       //vector<VkDrawIndexedIndirectCommand>      m_draw_commands;
 
+      // Where the mesh lives in the shared geometry buffers
       VkBuffer                                  m_vertexBuffer;
       VkBuffer                                  m_indexBuffer;
-      VkDeviceMemory                            m_memory;
-      VkDeviceSize                              m_indexBufferMemoryOffset;
+      int32_t                                   m_vertexOffset;
+      uint32_t                                  m_firstIndex;
 
-      map<shared_ptr<View>, VkPipeline*>        m_pipelines;
-      VkPipeline*                               m_depthPrepassPipelines;
+      // Pipelines don't depend on the frame, one per view serves every frame in flight
+      map<shared_ptr<View>, VkPipeline>         m_pipelines;
+      VkPipeline                                m_depthPrepassPipeline;
+    };
+
+    // Shared vertex or index buffer, meshes are packed in one after another.
+    // Vertex buffers hold one layout each so meshes can be addressed by vertex offset.
+    struct vkGeometryBuffer
+    {
+      VkBuffer                    m_buffer;
+      VulkanAllocator::Allocation m_allocation;
+      VkDeviceSize                m_stride;
+      VkDeviceSize                m_size;
+      VkDeviceSize                m_used;
     };
 
     // Per texture graphics data
     struct vkTextureData
     {
-      VkImage               m_stagingImage;
-      VkDeviceMemory        m_stagingImageMemory;
-      VkImage               m_image;
-      VkDeviceMemory        m_imageMemory;
-      VkImageView           m_imageView;
-      VkSampler             m_textureSampler;
+      VkImage                     m_stagingImage;
+      VulkanAllocator::Allocation m_stagingImageAllocation;
+      VkImage                     m_image;
+      VulkanAllocator::Allocation m_imageAllocation;
+      VkImageView                 m_imageView;
+      VkSampler                   m_textureSampler;
     };
 
     // Per material graphics data
     struct vkMaterialData
     {
-      vector<char>          m_vertexShaderCode;
       vector<char>          m_geometryShaderCode;
-      vector<char>          m_fragmentShaderCode;
 
       VkShaderModule        m_vertexShader;
       VkShaderModule        m_geometryShader;
@@ -129,6 +182,7 @@ namespace RenderLab
       VkDescriptorSetLayout* m_descriptorSetLayout;
       VkPipelineLayout*      m_pipelineLayout;
       VkDescriptorPool*      m_descriptorPool;
+      uint32_t               m_layoutBindings;   // one bit per descriptor binding, PUSH_CONSTANT_BIT if it has push constants
     };
 
     struct vkLightPushContants
@@ -140,14 +194,16 @@ namespace RenderLab
     // Per buffer graphics data
     struct vkUniformBufferData
     {
-      VkDeviceMemory                m_deviceMemory;
+      VulkanAllocator::Allocation   m_allocation;
       VkBuffer                      m_buffer;
       uint8_t*                      m_data;
     };
 
     // Data needed for back buffers
     struct vkBackBuffer {
+      uint32_t    m_frameIndex;
       uint32_t    m_imageIndex;
+      bool        m_timestampsWritten;
       VkSemaphore m_acquireSemaphore;
       VkSemaphore m_renderSemaphore;
       VkFence     m_presentFence;
@@ -155,11 +211,11 @@ namespace RenderLab
     };
 
     struct FrameBufferAttachment {
-      VkImage         m_image;
-      VkDeviceMemory  m_memory;
-      VkImageView     m_view;
-      VkFormat        m_format;
-      VkSampler       m_textureSampler;
+      VkImage                     m_image;
+      VulkanAllocator::Allocation m_allocation;
+      VkImageView                 m_view;
+      VkFormat                    m_format;
+      VkSampler                   m_textureSampler;
     };
 
     struct FrameBuffer {
@@ -173,6 +229,14 @@ namespace RenderLab
       VkRenderPass          m_renderPass;
     };
 
+    // A command buffer being recorded, binds are skipped when they repeat
+    struct vkCommandState
+    {
+      VkCommandBuffer m_commandBuffer;
+      VkBuffer        m_boundVertexBuffer;
+      VkBuffer        m_boundIndexBuffer;
+    };
+
     // Per View graphics data
     struct vkViewData
     {
@@ -186,11 +250,12 @@ namespace RenderLab
       VkRect2D                            m_scissor;
 
       vector<VkImage>                     m_images;
+      vector<VulkanAllocator::Allocation> m_imageAllocations;
       vector<VkImageView>                 m_imageViews;
       vector<VkFramebuffer>               m_framebuffers;
       VkFormat                            m_depthFormat;
       VkImage                             m_depthImage;
-      VkDeviceMemory                      m_depthMemory;
+      VulkanAllocator::Allocation         m_depthAllocation;
       VkImageView                         m_depthView;
       VkSampler                           m_shadowSampler;
       VkRenderPass                        m_renderPass;
@@ -199,17 +264,124 @@ namespace RenderLab
       vkBackBuffer                        m_acquiredBackBuffer;
 
       VkCommandPool                       m_commandPool;
-      VkCommandBuffer                     m_commandBuffer[2];
+      vector<VkCommandBuffer>             m_commandBuffer;
+      vkCommandState                      m_commandState;
+
+      // Set between beginMeshPass and endMeshPass while the draws go to secondary command buffers
+      bool                                m_secondaryPass;
+      uint32_t                            m_secondarySubpass;
 
       FrameBuffer                         m_gBuffer;
     };
 
-    struct vkPipelineCacheInfo
+    // A secondary command buffer holding one slice of a mesh pass
+    struct vkRecordedSlice
+    {
+      uint32_t                        m_slice;
+      VkCommandBuffer                 m_commandBuffer;
+    };
+
+    // Each job system thread records its share of a mesh pass into secondary
+    // command buffers from its own pools, one pool per frame in flight. The
+    // pool of a frame is reset once that frame's fence has signalled.
+    struct vkThreadRecorder
+    {
+      vector<VkCommandPool>           m_commandPools;
+      vector<vector<VkCommandBuffer>> m_commandBuffers;
+      vector<uint32_t>                m_numUsed;
+      vector<vkRecordedSlice>         m_slices;
+      vkCommandState                  m_state;
+      bool                            m_recording;
+    };
+
+    // A range of the staging ring waiting to be copied into a device local buffer
+    struct vkStagingCopy
+    {
+      VkBuffer        m_buffer;
+      VkBufferCopy    m_region;
+    };
+
+    // Copies submitted together, the ring space they used is free once the fence signals
+    struct vkStagingBatch
+    {
+      VkFence         m_fence;
+      VkCommandBuffer m_commandBuffer;
+      VkDeviceSize    m_size;
+    };
+
+    // Written ahead of the driver's cache data. A blob from another device,
+    // driver version or file version is ignored rather than handed to the driver.
+    static const uint32_t PIPELINE_CACHE_MAGIC = 0x4350524c;   // "RLPC"
+    static const uint32_t PIPELINE_CACHE_VERSION = 1;
+    struct vkPipelineCacheFileHeader
+    {
+      uint32_t  m_magic;
+      uint32_t  m_version;
+      uint32_t  m_vendorID;
+      uint32_t  m_deviceID;
+      uint32_t  m_driverVersion;
+      uint8_t   m_pipelineCacheUUID[VK_UUID_SIZE];
+      uint64_t  m_dataSize;
+    };
+
+    // Everything that goes into a graphics pipeline. Shader modules are shared
+    // per file so equal permutations compare equal, and the layout is named by
+    // its bindings because the per frame layouts are all compatible. Vertex
+    // attributes are packed in order, so their formats fix the offsets too.
+    // Keys are cleared before they are filled so they can be hashed and
+    // compared as bytes.
+    static const uint32_t PUSH_CONSTANT_BIT = 0x80000000;
+    struct vkPipelineKey
+    {
+      VkShaderModule  m_vertexShader;
+      VkShaderModule  m_geometryShader;
+      VkShaderModule  m_fragmentShader;
+      VkRenderPass    m_renderPass;
+      uint32_t        m_subpass;
+      uint32_t        m_layoutBindings;
+      uint32_t        m_numAttributes;
+      uint32_t        m_attributeFormats;   // bit set for a three component attribute
+      uint32_t        m_topology;
+      uint32_t        m_cullMode;
+      uint32_t        m_depthBias;
+      uint32_t        m_depthTest;
+      uint32_t        m_depthWrite;
+      uint32_t        m_blend;
+      uint32_t        m_numColorAttachments;
+    };
+
+    struct vkPipelineKeyHash
+    {
+      size_t operator()(const vkPipelineKey& key) const
+      {
+        // FNV-1a
+        const uint8_t* bytes = (const uint8_t*)&key;
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < sizeof(vkPipelineKey); i++)
+        {
+          hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+        return (size_t)hash;
+      }
+    };
+
+    struct vkPipelineKeyEqual
+    {
+      bool operator()(const vkPipelineKey& a, const vkPipelineKey& b) const
+      {
+        return memcmp(&a, &b, sizeof(vkPipelineKey)) == 0;
+      }
+    };
+
+    // A pipeline asked for during build, created by compilePipelines. Every
+    // mesh slot that wants it is filled in once it exists.
+    struct vkPipelineRequest
     {
-      size_t          m_numMeshBuffers;
-      Material::Type  m_materialType;
-      size_t          m_frameIndex;
-      VkPipeline      m_pipeline;
+      vkMeshData*         m_meshData;     // vertex input state
+      VkPipelineLayout    m_layout;
+      VkPipeline          m_pipeline;
+      unsigned long long  m_createTime;
+      vector<VkPipeline*> m_targets;
     };
 
 
@@ -218,12 +390,21 @@ namespace RenderLab
     void initializeVirtualDevice();
     void initializeProperties();
     void initializeQueues(uint32_t numFrames);
+    void initializeStaging();
+    void initializePipelineCache();
 
     bool has_all_device_extensions(VkPhysicalDevice physicalDevice);
     bool memory_type_from_properties(uint32_t typeBits, VkFlags requirements_mask, uint32_t *typeIndex);
-    void allocate_resources(shared_ptr<Mesh> mesh, vkMeshData* meshData, VkDeviceSize vertexBufferSize, VkDeviceSize indexBufferSize);
+    void allocate_resources(vkMeshData* meshData, const vector<uint8_t>& vertexBufferData, const vector<uint32_t>& indexBufferData);
+    VkBuffer allocateGeometry(vector<vkGeometryBuffer>& buffers, VkBufferUsageFlags usage, VkDeviceSize stride, const uint8_t* data, VkDeviceSize size, VkDeviceSize& offset);
+    void bindGeometry(vkCommandState& state, vkMeshData* meshData);
+    vkCommandState& getCommandState(vkViewData* viewData, uint32_t frameIndex);
+    void uploadBuffer(VkBuffer buffer, VkDeviceSize offset, const uint8_t* data, VkDeviceSize size);
+    VkDeviceSize allocateStaging(VkDeviceSize size);
+    void flushUploads();
+    void reclaimStaging(bool wait);
     void loadTexture(shared_ptr<Texture> texture);
-    void createImage(shared_ptr<Texture> texture, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage* image, VkDeviceMemory* imageMemory);
+    void createImage(shared_ptr<Texture> texture, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage* image, VulkanAllocator::Allocation* allocation);
     void createTextureImage(shared_ptr<Texture> texture);
     void copyImage(VkImage srcImage, VkImage dstImage, size_t width, size_t height);
     void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
@@ -233,6 +414,8 @@ namespace RenderLab
     void updateDescriptorSets(shared_ptr<Material> material, vkMaterialData* materialData, size_t frameNumber, shared_ptr<UniformBuffer> frameDataUniformBuffer, shared_ptr<UniformBuffer> objectDataUniformBuffer);
 
     void createOnscreenView(shared_ptr<View> view, vkViewData* viewData, size_t numFrames);
+    void createOffscreenView(shared_ptr<View> view, vkViewData* viewData, size_t numFrames);
+    void createOffscreenImages(shared_ptr<View> view, vkViewData* viewData, size_t numImages);
     void createShadowView(shared_ptr<View> view, vkViewData* viewData, size_t numFrames);
     void createShadowRenderPass(shared_ptr<View> view, vkViewData* viewData);
     void createOnscreenDepthBuffer(shared_ptr<View> view, vkViewData* viewData);
@@ -245,14 +428,31 @@ namespace RenderLab
     void attachSwapchain(shared_ptr<View> view, vkViewData* viewData);
     void detachSwapchain(shared_ptr<View> view, vkViewData* viewData);
 
-    VkPipeline loadPipeline(shared_ptr<Mesh> mesh, vkMeshData* meshData, shared_ptr<Material> material, size_t frameIndex, shared_ptr<View> view);
+    void loadPipeline(shared_ptr<Mesh> mesh, vkMeshData* meshData, shared_ptr<Material> material, shared_ptr<View> view, VkPipeline* pipeline);
+    VkPipeline createPipeline(const vkPipelineKey& key, vkMeshData* meshData, VkPipelineLayout layout);
+    VkShaderModule loadShader(const string& filename);
 
     VkCommandBuffer beginOneTimeCommands();
     void            endOneTimeCommands(VkCommandBuffer commandBuffer);
 
     vector<char> readFile(const string& filename);
 
-    vector<vkPipelineCacheInfo*>  m_pipelineCache;
+    unordered_map<vkPipelineKey, VkPipeline, vkPipelineKeyHash, vkPipelineKeyEqual> m_pipelineCache;
+    uint32_t                      m_pipelineCacheHits;
+    uint32_t                      m_pipelineCacheMisses;
+    unordered_map<VkPipeline, uint32_t> m_pipelineIds;
+    unordered_map<vkPipelineKey, vkPipelineRequest, vkPipelineKeyHash, vkPipelineKeyEqual> m_pendingPipelines;
+    vector<vkThreadRecorder*>     m_threadRecorders;
+    unsigned long long            m_meshBuildTime;
+    unsigned long long            m_materialBuildTime;
+    unsigned long long            m_pipelineCompileTime;
+    uint32_t                      m_pipelineCompileThreads;
+    map<string, VkShaderModule>   m_shaderModules;
+    VkPipelineCache               m_driverPipelineCache;
+    string                        m_pipelineCacheFile;
+    bool                          m_pipelineCacheWarm;
+    uint32_t                      m_numPipelinesCreated;
+    unsigned long long            m_pipelineCreateTime;
     shared_ptr<Material>          m_shadowMaterial;
     vector<vkViewData*>           m_shadowViewData;
     float                         m_constantDepthBias;
@@ -260,6 +460,23 @@ namespace RenderLab
     VkFence*                      m_lightFences;
     int                           m_lightFenceIndex;
     long long                     m_allocatedImageMemory;
+    shared_ptr<VulkanAllocator>   m_allocator;
+    vector<vkGeometryBuffer>      m_vertexBuffers;
+    vector<vkGeometryBuffer>      m_indexBuffers;
+
+    // Mesh data goes to device local memory through a persistently mapped
+    // staging ring. Copies are batched until the next frame starts. Devices
+    // that share memory with the CPU skip the ring and map the buffers instead.
+    bool                          m_unifiedMemory;
+    VkBuffer                      m_stagingBuffer;
+    VkDeviceMemory                m_stagingMemory;
+    uint8_t*                      m_stagingData;
+    VkDeviceSize                  m_stagingSize;
+    VkDeviceSize                  m_stagingHead;
+    VkDeviceSize                  m_stagingUsed;
+    VkDeviceSize                  m_stagingPending;
+    vector<vkStagingCopy>         m_stagingCopies;
+    queue<vkStagingBatch>         m_stagingBatches;
     map<string, vkTextureData*>   m_textureMap;
     bool                          m_deferred;
     shared_ptr<Material>          m_depthPrepassMaterial;
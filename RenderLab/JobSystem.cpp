@@ -0,0 +1,168 @@
+#include "stdafx.h"
+#include "JobSystem.h"
+
+namespace RenderLab
+{
+  // 0 for any thread outside the pool, 1..n-1 for the pool's workers
+  static thread_local uint32_t t_threadIndex = 0;
+
+  JobSystem::JobSystem(string name, uint32_t numThreads) :
+    m_name(name),
+    m_numThreads(numThreads > 0 ? numThreads : 1),
+    m_queuedTasks(0),
+    m_running(true)
+  {
+    for (uint32_t i = 0; i < m_numThreads; i++)
+    {
+      m_queues.push_back(new TaskQueue());
+    }
+
+    for (uint32_t i = 1; i < m_numThreads; i++)
+    {
+      m_threads.push_back(std::thread(&JobSystem::workerMain, this, i));
+    }
+  }
+
+  JobSystem::~JobSystem()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_wakeMutex);
+      m_running = false;
+    }
+    m_wakeCondition.notify_all();
+
+    for (size_t i = 0; i < m_threads.size(); i++)
+    {
+      m_threads[i].join();
+    }
+
+    for (size_t i = 0; i < m_queues.size(); i++)
+    {
+      delete m_queues[i];
+    }
+  }
+
+  void JobSystem::parallelFor(uint32_t count, uint32_t grainSize, const function<void(uint32_t, uint32_t)>& job)
+  {
+    if (count == 0)
+    {
+      return;
+    }
+    if (grainSize == 0)
+    {
+      grainSize = 1;
+    }
+
+    uint32_t numTasks = (count + grainSize - 1) / grainSize;
+    if (m_numThreads == 1 || numTasks == 1)
+    {
+      job(0, count);
+      return;
+    }
+
+    std::atomic<uint32_t> remaining(numTasks);
+    uint32_t threadIndex = getThreadIndex();
+
+    // Deal the tasks out round robin so every thread starts on its own queue
+    m_queuedTasks += numTasks;
+    for (uint32_t t = 0; t < numTasks; t++)
+    {
+      Task task;
+      task.m_job = &job;
+      task.m_begin = t * grainSize;
+      task.m_end = task.m_begin + grainSize < count ? task.m_begin + grainSize : count;
+      task.m_remaining = &remaining;
+
+      TaskQueue* queue = m_queues[(threadIndex + t) % m_numThreads];
+      std::lock_guard<std::mutex> lock(queue->m_mutex);
+      queue->m_tasks.push_back(task);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_wakeMutex);
+    }
+    m_wakeCondition.notify_all();
+
+    // Help until every task of this loop is done, which may include tasks of
+    // other loops picked up along the way
+    Task task;
+    while (remaining.load(std::memory_order_acquire) > 0)
+    {
+      if (popTask(threadIndex, task) || stealTask(threadIndex, task))
+      {
+        runTask(task);
+      }
+      else
+      {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  uint32_t JobSystem::getNumThreads()
+  {
+    return m_numThreads;
+  }
+
+  uint32_t JobSystem::getThreadIndex()
+  {
+    return t_threadIndex;
+  }
+
+  void JobSystem::workerMain(uint32_t threadIndex)
+  {
+    t_threadIndex = threadIndex;
+
+    Task task;
+    while (m_running)
+    {
+      if (popTask(threadIndex, task) || stealTask(threadIndex, task))
+      {
+        runTask(task);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(m_wakeMutex);
+      m_wakeCondition.wait(lock, [this] { return m_queuedTasks.load() > 0 || !m_running; });
+    }
+  }
+
+  bool JobSystem::popTask(uint32_t threadIndex, Task& task)
+  {
+    TaskQueue* queue = m_queues[threadIndex];
+    std::lock_guard<std::mutex> lock(queue->m_mutex);
+    if (queue->m_tasks.empty())
+    {
+      return false;
+    }
+
+    task = queue->m_tasks.back();
+    queue->m_tasks.pop_back();
+    m_queuedTasks--;
+    return true;
+  }
+
+  bool JobSystem::stealTask(uint32_t threadIndex, Task& task)
+  {
+    for (uint32_t i = 1; i < m_numThreads; i++)
+    {
+      TaskQueue* queue = m_queues[(threadIndex + i) % m_numThreads];
+      std::lock_guard<std::mutex> lock(queue->m_mutex);
+      if (!queue->m_tasks.empty())
+      {
+        task = queue->m_tasks.front();
+        queue->m_tasks.pop_front();
+        m_queuedTasks--;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void JobSystem::runTask(Task& task)
+  {
+    (*task.m_job)(task.m_begin, task.m_end);
+    task.m_remaining->fetch_sub(1, std::memory_order_release);
+  }
+}
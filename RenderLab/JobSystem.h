@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+#include <stdint.h>
+
+using std::string;
+using std::vector;
+using std::function;
+
+namespace RenderLab
+{
+  // Work stealing thread pool. Every thread owns a task queue; it pops its own
+  // tasks from the back and steals from the front of the others once it runs
+  // dry. The thread calling parallelFor works on the loop until it completes.
+  class JobSystem
+  {
+  public:
+    JobSystem(string name, uint32_t numThreads);
+    ~JobSystem();
+
+    void            parallelFor(uint32_t count, uint32_t grainSize, const function<void(uint32_t, uint32_t)>& job);
+    uint32_t        getNumThreads();
+    static uint32_t getThreadIndex();
+
+  private:
+    struct Task
+    {
+      const function<void(uint32_t, uint32_t)>* m_job;
+      uint32_t                                  m_begin;
+      uint32_t                                  m_end;
+      std::atomic<uint32_t>*                    m_remaining;
+    };
+
+    struct TaskQueue
+    {
+      std::mutex        m_mutex;
+      std::deque<Task>  m_tasks;
+    };
+
+    void workerMain(uint32_t threadIndex);
+    bool popTask(uint32_t threadIndex, Task& task);
+    bool stealTask(uint32_t threadIndex, Task& task);
+    void runTask(Task& task);
+
+    string                    m_name;
+    uint32_t                  m_numThreads;
+    vector<std::thread>       m_threads;
+    vector<TaskQueue*>        m_queues;
+    std::mutex                m_wakeMutex;
+    std::condition_variable   m_wakeCondition;
+    std::atomic<uint32_t>     m_queuedTasks;
+    std::atomic<bool>         m_running;
+  };
+}
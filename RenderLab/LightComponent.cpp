@@ -53,7 +53,7 @@ namespace RenderLab
     return m_dirty;
   }
 
-  void LightComponent::setPosition(vec3& position)
+  void LightComponent::setPosition(const vec3& position)
   {
     m_position = position;
   }
@@ -63,7 +63,7 @@ namespace RenderLab
     position = m_position;
   }
 
-  void LightComponent::setViewPosition(vec3& position)
+  void LightComponent::setViewPosition(const vec3& position)
   {
     m_viewPosition = position;
   }
@@ -73,7 +73,7 @@ namespace RenderLab
     position = m_viewPosition;
   }
 
-  void LightComponent::setDirection(vec3& direction)
+  void LightComponent::setDirection(const vec3& direction)
   {
     m_direction = direction;
   }
@@ -83,7 +83,7 @@ namespace RenderLab
     direction = m_direction;
   }
 
-  void LightComponent::setAmbient(vec3& ambient)
+  void LightComponent::setAmbient(const vec3& ambient)
   {
     m_ambient = ambient;
   }
@@ -93,7 +93,7 @@ namespace RenderLab
     ambient = m_ambient;
   }
 
-  void LightComponent::setDiffuse(vec3& diffuse)
+  void LightComponent::setDiffuse(const vec3& diffuse)
   {
     m_diffuse = diffuse;
   }
@@ -103,7 +103,7 @@ namespace RenderLab
     diffuse = m_diffuse;
   }
 
-  void LightComponent::setSpecular(vec3& specular)
+  void LightComponent::setSpecular(const vec3& specular)
   {
     m_specular = specular;
   }
@@ -133,7 +133,7 @@ namespace RenderLab
     return m_outerConeAngle;
   }
 
-  void LightComponent::setAttenuation(vec3& attenuation)
+  void LightComponent::setAttenuation(const vec3& attenuation)
   {
     m_attenuation = attenuation;
   }
@@ -30,23 +30,23 @@ namespace RenderLab
 
     void setDirty(bool dirty);
     bool isDirty();
-    void setPosition(vec3& position);
+    void setPosition(const vec3& position);
     void getPosition(vec3& position);
-    void setViewPosition(vec3& position);
+    void setViewPosition(const vec3& position);
     void getViewPosition(vec3& position);
-    void setDirection(vec3& direction);
+    void setDirection(const vec3& direction);
     void getDirection(vec3& direction);
-    void setAmbient(vec3& ambient);
+    void setAmbient(const vec3& ambient);
     void getAmbient(vec3& ambient);
-    void setDiffuse(vec3& diffuse);
+    void setDiffuse(const vec3& diffuse);
     void getDiffuse(vec3& diffuse);
-    void setSpecular(vec3& specular);
+    void setSpecular(const vec3& specular);
     void getSpecular(vec3& specular);
     void setInnerConeAngle(float angle);
     float getInnerConeAngle();
     void setOuterConeAngle(float angle);
     float getOuterConeAngle();
-    void setAttenuation(vec3& attenuation);
+    void setAttenuation(const vec3& attenuation);
     void getAttenuation(vec3& attenuation);
     void setCastShadow(bool castShadow);
     bool getCastShadow();
@@ -94,7 +94,7 @@ namespace RenderLab
     return m_noTexture;
   }
 
-  void Material::setAlbedoColor(vec4& albedoColor)
+  void Material::setAlbedoColor(const vec4& albedoColor)
   {
     m_albedoColor = albedoColor;
   }
@@ -125,7 +125,7 @@ namespace RenderLab
   }
 
 
-  void Material::setEmissiveColor(vec3& emissiveColor)
+  void Material::setEmissiveColor(const vec3& emissiveColor)
   {
     m_emissiveColor = emissiveColor;
   }
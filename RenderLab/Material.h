@@ -33,7 +33,8 @@ namespace RenderLab
       SHADOW_CUBE,
       DEFERRED_COMPOSITE,
       DEFERRED_LIT,
-	    DEPTH_PREPASS
+	    DEPTH_PREPASS,
+      DEFERRED_CLUSTERED
     };
 
     Material(string name, Type type);
@@ -54,13 +55,13 @@ namespace RenderLab
     shared_ptr<Texture> getEmissiveTexture();
     bool                hasNoTexture();
 
-    void          setAlbedoColor(vec4& albedoColor);
+    void          setAlbedoColor(const vec4& albedoColor);
     void          getAlbedoColor(vec4& albedoColor);
     void          setMetallic(float metallic);
     float         getMetallic();
     void          setRoughness(float roughness);
     float         getRoughness();
-    void          setEmissiveColor(vec3& emissiveColor);
+    void          setEmissiveColor(const vec3& emissiveColor);
     void          getEmissiveColor(vec3& emissiveColor);
 
     void          setTwoSided(bool twoSided);
@@ -2,18 +2,25 @@
 #include "Mesh.h"
 
 #include <cstring>
+#include <math.h>
 
 using std::memcpy;
 
 namespace RenderLab
 {
+  const float Mesh::UNBOUNDED_EXTENT = 1.0e30f;
+
   Mesh::Mesh(string name, Primitive primitive, size_t numVerts, size_t numVertexArrayBuffers):
     m_name(name),
     m_primitive(primitive),
     m_numVerts(numVerts),
     m_numVertexArrayBuffers(numVertexArrayBuffers),
-    m_graphicsData(nullptr),
-    m_dirty(true)
+    m_localCenter(0.0f),
+    m_localExtent(UNBOUNDED_EXTENT),
+    m_worldCenter(0.0f),
+    m_worldExtent(UNBOUNDED_EXTENT),
+    m_dirty(true),
+    m_graphicsData(nullptr)
   {
     m_vertexData = new struct vertexData[numVertexArrayBuffers];
     for (size_t i = 0; i < numVertexArrayBuffers; i++)
@@ -59,6 +66,24 @@ namespace RenderLab
     m_vertexData[index].data = new float[m_numVerts*size * sizeof(float)];
     memcpy(m_vertexData[index].data, data, numBytes);
     m_dirty = true;
+
+    // Buffer 0 holds the positions
+    if (index == 0 && size == 3 && m_numVerts > 0)
+    {
+      const float* positions = m_vertexData[index].data;
+      vec3 minimum(positions[0], positions[1], positions[2]);
+      vec3 maximum = minimum;
+      for (size_t i = 1; i < m_numVerts; i++)
+      {
+        vec3 position(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2]);
+        minimum = glm::min(minimum, position);
+        maximum = glm::max(maximum, position);
+      }
+      m_localCenter = (minimum + maximum) * 0.5f;
+      m_localExtent = (maximum - minimum) * 0.5f;
+      m_worldCenter = m_localCenter;
+      m_worldExtent = m_localExtent;
+    }
     //for (unsigned int i = 0; i<m_numVerts; i++)
     //{
     //  for (unsigned int j = 0; j<size; j++)
@@ -68,6 +93,34 @@ namespace RenderLab
     //}
   }
 
+  bool Mesh::updateWorldBounds(const mat4& transform)
+  {
+    if (m_localExtent.x >= UNBOUNDED_EXTENT)
+    {
+      return false;
+    }
+
+    // The box around the transformed box, each axis of the result takes the
+    // absolute contribution of every local axis
+    vec3 center = vec3(transform * vec4(m_localCenter, 1.0f));
+    vec3 extent;
+    for (int i = 0; i < 3; i++)
+    {
+      extent[i] = fabsf(transform[0][i]) * m_localExtent.x + fabsf(transform[1][i]) * m_localExtent.y + fabsf(transform[2][i]) * m_localExtent.z;
+    }
+
+    bool moved = center != m_worldCenter || extent != m_worldExtent;
+    m_worldCenter = center;
+    m_worldExtent = extent;
+    return moved;
+  }
+
+  void Mesh::getWorldBounds(vec3& center, vec3& extent)
+  {
+    center = m_worldCenter;
+    extent = m_worldExtent;
+  }
+
   void Mesh::addIndexBuffer(size_t size, unsigned int* data)
   {
     m_indexBufferSize = size;
@@ -20,6 +20,9 @@ namespace RenderLab
       LINES
     };
 
+    // Extent of meshes without positions to bound, they are never culled
+    static const float UNBOUNDED_EXTENT;
+
     Mesh(string name, Primitive primitive, size_t numVerts, size_t numVertexArrayBuffers);
     ~Mesh();
 
@@ -33,6 +36,12 @@ namespace RenderLab
     size_t                getNumVerts();
     unsigned int*         getIndexBuffer();
     size_t                getNumBuffers();
+
+    // Box around the positions in vertex buffer 0. The world box follows the
+    // composite transform passed to updateWorldBounds, which returns whether
+    // it moved.
+    bool                  updateWorldBounds(const mat4& transform);
+    void                  getWorldBounds(vec3& center, vec3& extent);
     void                  setMaterial(shared_ptr<Material> material);
     shared_ptr<Material>  getMaterial();
     void                  setRenderComponent(shared_ptr<RenderComponent> renderComponent);
@@ -56,6 +65,10 @@ namespace RenderLab
     size_t                m_numVertexArrayBuffers;
     struct vertexData*    m_vertexData;
     unsigned int*         m_indexBuffer;
+    vec3                  m_localCenter;
+    vec3                  m_localExtent;
+    vec3                  m_worldCenter;
+    vec3                  m_worldExtent;
     size_t                m_indexBufferSize;
     shared_ptr<Material>  m_material;
     shared_ptr<RenderComponent>  m_renderComponent;
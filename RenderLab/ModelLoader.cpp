@@ -6,8 +6,7 @@
 #include <assimp/vector3.h>
 #include <assimp/quaternion.h>
 
-#include <IL\il.h>
-#include <atlstr.h>
+#include <IL/il.h>
 
 using std::make_shared;
 using std::static_pointer_cast;
@@ -563,7 +562,7 @@ namespace RenderLab
     /* generate DevIL Image IDs */
     ilGenImages(1, &ilDiffuseID);
     ilBindImage(ilDiffuseID); /* Binding of DevIL image name */
-    success = ilLoadImage((const wchar_t*)filename);
+    success = ilLoadImage((ILconst_string)filename);
     //ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
 
     if (success) /* If no error occured: */
@@ -586,9 +585,6 @@ namespace RenderLab
 
   void ModelLoader::printLog(string s)
   {
-    string st = s + "\n";
-    TCHAR name[256];
-    _tcscpy_s(name, CA2T(st.c_str()));
-    OutputDebugString(name);
+    printDebugString(s + "\n");
   }
 }
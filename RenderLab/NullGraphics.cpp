@@ -0,0 +1,156 @@
+#include "stdafx.h"
+#include "NullGraphics.h"
+
+#include <string.h>
+
+namespace RenderLab
+{
+  NullGraphics::NullGraphics(string name) : Graphics(name),
+    m_name(name),
+    m_numFrames(1),
+    m_frameIndex(0),
+    m_boundPipeline(0)
+  {
+    resetDrawStats();
+  }
+
+  NullGraphics::~NullGraphics()
+  {
+    for (size_t i = 0; i < m_uniformData.size(); i++)
+    {
+      free(m_uniformData[i]);
+    }
+  }
+
+  void NullGraphics::initialize(uint32_t numFrames)
+  {
+    m_numFrames = numFrames > 0 ? numFrames : 1;
+  }
+
+  size_t NullGraphics::getBufferAlignment()
+  {
+    // The worst case minStorageBufferOffsetAlignment, so offsets are laid out as on a GPU
+    return 256;
+  }
+
+  void NullGraphics::build(shared_ptr<UniformBuffer> buffer)
+  {
+    uint8_t* data = (uint8_t*)malloc(buffer->getSize());
+    m_uniformData.push_back(data);
+    buffer->setGraphicsData(data);
+  }
+
+  void NullGraphics::updateUniformData(shared_ptr<UniformBuffer> buffer, size_t offset, float* data, size_t size)
+  {
+    updateUniformData(buffer, offset, (uint8_t*)data, size);
+  }
+
+  void NullGraphics::updateUniformData(shared_ptr<UniformBuffer> buffer, size_t offset, uint8_t* data, size_t size)
+  {
+    uint8_t* ptr = (uint8_t*)buffer->getGraphicsData() + offset;
+    memcpy(ptr, data, size);
+    m_drawStats.m_uniformBytes += size;
+  }
+
+  uint32_t NullGraphics::acquireBackBuffer(shared_ptr<View> view)
+  {
+    // Only the onscreen view starts a new frame, shadow views render into the current one
+    if (view == m_onscreenView)
+    {
+      m_frameIndex = (m_frameIndex + 1) % m_numFrames;
+      m_frameDraws.clear();
+      m_drawStats.m_numFrames++;
+    }
+    return m_frameIndex;
+  }
+
+  void NullGraphics::renderBegin(shared_ptr<View> view, shared_ptr<View> lastView, shared_ptr<UniformBuffer> frameDataUniformBuffer, shared_ptr<UniformBuffer> objectDataUniformBuffer, uint32_t frameIndex)
+  {
+    m_drawStats.m_numRenderPasses++;
+  }
+
+  void NullGraphics::bindPipeline(shared_ptr<Mesh> mesh, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
+  {
+    m_boundPipeline = getPipelineId(mesh, view, depthPrepass);
+    m_drawStats.m_numPipelineBinds++;
+  }
+
+  // One pipeline per material, and one depth prepass pipeline shared by all,
+  // like the Vulkan backend builds for meshes with the same vertex layout
+  uint32_t NullGraphics::getPipelineId(shared_ptr<Mesh> mesh, shared_ptr<View> view, bool depthPrepass)
+  {
+    if (depthPrepass)
+    {
+      return 1;
+    }
+    map<Material*, uint32_t>::iterator it = m_pipelineIds.find(mesh->getMaterial().get());
+    if (it == m_pipelineIds.end())
+    {
+      it = m_pipelineIds.insert(std::make_pair(mesh->getMaterial().get(), (uint32_t)m_pipelineIds.size() + 2)).first;
+    }
+    return it->second;
+  }
+
+  void NullGraphics::render(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
+  {
+    // A draw recorded with another mesh's pipeline still bound
+    if (m_boundPipeline != getPipelineId(mesh, view, depthPrepass))
+    {
+      m_drawStats.m_numPipelineMismatches++;
+    }
+    DrawRecord draw;
+    draw.m_mesh = mesh.get();
+    draw.m_view = view.get();
+    draw.m_meshOffset = meshOffset;
+    draw.m_frameIndex = frameIndex;
+    draw.m_depthPrepass = depthPrepass;
+    draw.m_faceMask = 0;
+    m_frameDraws.push_back(draw);
+    m_drawStats.m_numDraws++;
+  }
+
+  void NullGraphics::renderShadowCaster(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, uint32_t faceMask)
+  {
+    DrawRecord draw;
+    draw.m_mesh = mesh.get();
+    draw.m_view = view.get();
+    draw.m_meshOffset = meshOffset;
+    draw.m_frameIndex = frameIndex;
+    draw.m_depthPrepass = false;
+    draw.m_faceMask = faceMask;
+    m_frameDraws.push_back(draw);
+    m_drawStats.m_numDraws++;
+    m_drawStats.m_numShadowDraws++;
+    for (uint32_t faces = faceMask; faces != 0; faces &= faces - 1)
+    {
+      m_drawStats.m_numShadowFaces++;
+    }
+  }
+
+  void NullGraphics::getDrawStats(DrawStats& drawStats)
+  {
+    drawStats = m_drawStats;
+  }
+
+  void NullGraphics::resetDrawStats()
+  {
+    m_drawStats.m_numFrames = 0;
+    m_drawStats.m_numRenderPasses = 0;
+    m_drawStats.m_numPipelineBinds = 0;
+    m_drawStats.m_numPipelineMismatches = 0;
+    m_drawStats.m_numDraws = 0;
+    m_drawStats.m_numShadowDraws = 0;
+    m_drawStats.m_numShadowFaces = 0;
+    m_drawStats.m_uniformBytes = 0;
+  }
+
+  size_t NullGraphics::numFrameDraws()
+  {
+    return m_frameDraws.size();
+  }
+
+  void NullGraphics::getFrameDraw(uint32_t index, DrawRecord& draw)
+  {
+    draw = m_frameDraws[index];
+  }
+}
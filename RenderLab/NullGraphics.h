@@ -0,0 +1,78 @@
+#pragma once
+#include "Graphics.h"
+#include "Mesh.h"
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <map>
+
+#include <stdint.h>
+
+using std::string;
+using std::shared_ptr;
+using std::vector;
+using std::map;
+
+namespace RenderLab
+{
+  // Graphics backend without a GPU. Uniform data is copied into host memory as
+  // the real backends would, and draws are recorded instead of submitted, so
+  // the CPU side of a frame can be measured and checked on headless machines.
+  class NullGraphics :
+    public Graphics
+  {
+  public:
+    struct DrawRecord
+    {
+      Mesh*     m_mesh;
+      View*     m_view;
+      uint32_t  m_meshOffset;
+      uint32_t  m_frameIndex;
+      bool      m_depthPrepass;
+      uint32_t  m_faceMask;
+    };
+
+    struct DrawStats
+    {
+      uint64_t  m_numFrames;
+      uint64_t  m_numRenderPasses;
+      uint64_t  m_numPipelineBinds;
+      uint64_t  m_numPipelineMismatches;
+      uint64_t  m_numDraws;
+      uint64_t  m_numShadowDraws;
+      uint64_t  m_numShadowFaces;
+      uint64_t  m_uniformBytes;
+    };
+
+    NullGraphics(string name);
+    ~NullGraphics();
+
+    void        initialize(uint32_t numFrames);
+    size_t      getBufferAlignment();
+    void        build(shared_ptr<UniformBuffer> buffer);
+    void        updateUniformData(shared_ptr<UniformBuffer> buffer, size_t offset, float* data, size_t size);
+    void        updateUniformData(shared_ptr<UniformBuffer> buffer, size_t offset, uint8_t* data, size_t size);
+    uint32_t    acquireBackBuffer(shared_ptr<View> view);
+    void        renderBegin(shared_ptr<View> view, shared_ptr<View> lastView, shared_ptr<UniformBuffer> frameDataUniformBuffer, shared_ptr<UniformBuffer> objectDataUniformBuffer, uint32_t frameIndex);
+    void        bindPipeline(shared_ptr<Mesh> mesh, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
+    uint32_t    getPipelineId(shared_ptr<Mesh> mesh, shared_ptr<View> view, bool depthPrepass);
+    void        render(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
+    void        renderShadowCaster(shared_ptr<Mesh> mesh, uint32_t meshOffset, shared_ptr<View> view, uint32_t frameIndex, uint32_t faceMask);
+
+    void        getDrawStats(DrawStats& drawStats);
+    void        resetDrawStats();
+    size_t      numFrameDraws();
+    void        getFrameDraw(uint32_t index, DrawRecord& draw);
+
+  private:
+    string              m_name;
+    uint32_t            m_numFrames;
+    uint32_t            m_frameIndex;
+    vector<uint8_t*>    m_uniformData;
+    vector<DrawRecord>  m_frameDraws;
+    map<Material*, uint32_t> m_pipelineIds;
+    uint32_t            m_boundPipeline;
+    DrawStats           m_drawStats;
+  };
+}
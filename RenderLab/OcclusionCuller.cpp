@@ -0,0 +1,427 @@
+#include "stdafx.h"
+#include "OcclusionCuller.h"
+#include "CpuTimer.h"
+
+#include <immintrin.h>
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+
+#if defined(__AVX__)
+#define OCCLUSION_CULLER_WIDTH 8
+#else
+#define OCCLUSION_CULLER_WIDTH 4
+#endif
+
+#define OCCLUSION_BAND_HEIGHT 8
+
+namespace RenderLab
+{
+  OcclusionCuller::OcclusionCuller(uint32_t width, uint32_t height) :
+    m_jobSystem(nullptr),
+    m_stats()
+  {
+    // Rows are whole SIMD steps and the rows split evenly into bands
+    m_width = std::max((width + 7) & ~7u, 8u);
+    m_height = std::max((height + OCCLUSION_BAND_HEIGHT - 1) / OCCLUSION_BAND_HEIGHT * OCCLUSION_BAND_HEIGHT, (uint32_t)OCCLUSION_BAND_HEIGHT);
+    m_numBands = m_height / OCCLUSION_BAND_HEIGHT;
+
+    uint32_t levelWidth = m_width;
+    uint32_t levelHeight = m_height;
+    while (true)
+    {
+      m_depthLevels.push_back((float*)_mm_malloc(levelWidth * levelHeight * sizeof(float), 32));
+      m_levelWidths.push_back(levelWidth);
+      m_levelHeights.push_back(levelHeight);
+      if (levelWidth == 1 && levelHeight == 1)
+      {
+        break;
+      }
+      levelWidth = (levelWidth + 1) / 2;
+      levelHeight = (levelHeight + 1) / 2;
+    }
+  }
+
+  OcclusionCuller::~OcclusionCuller()
+  {
+    for (size_t i = 0; i < m_depthLevels.size(); i++)
+    {
+      _mm_free(m_depthLevels[i]);
+    }
+  }
+
+  void OcclusionCuller::setJobSystem(shared_ptr<JobSystem> jobSystem)
+  {
+    m_jobSystem = jobSystem;
+  }
+
+  void OcclusionCuller::begin(const mat4& viewProjection)
+  {
+    m_viewProjection = viewProjection;
+    m_occluders.clear();
+    m_stats = Stats();
+  }
+
+  void OcclusionCuller::addOccluder(const float* positions, uint32_t numVerts, const unsigned int* indices, uint32_t numIndices, const mat4& transform)
+  {
+    Occluder occluder;
+    occluder.m_positions = positions;
+    occluder.m_numVerts = numVerts;
+    occluder.m_indices = indices;
+    occluder.m_numIndices = numIndices;
+    occluder.m_transform = m_viewProjection * transform;
+    occluder.m_firstTriangle = 0;
+    m_occluders.push_back(occluder);
+  }
+
+  void OcclusionCuller::rasterize()
+  {
+    CpuTimer timer;
+    timer.start();
+
+    uint32_t numTriangles = 0;
+    for (size_t i = 0; i < m_occluders.size(); i++)
+    {
+      m_occluders[i].m_firstTriangle = numTriangles;
+      numTriangles += m_occluders[i].m_numIndices / 3;
+    }
+    m_triangles.resize(numTriangles);
+
+    uint32_t numThreads = m_jobSystem != nullptr ? m_jobSystem->getNumThreads() : 1;
+    m_threadClipVertices.resize(numThreads);
+
+    std::fill(m_depthLevels[0], m_depthLevels[0] + m_width * m_height, FLT_MAX);
+    if (m_jobSystem != nullptr && numThreads > 1)
+    {
+      m_jobSystem->parallelFor((uint32_t)m_occluders.size(), 1, [&](uint32_t begin, uint32_t end)
+      {
+        for (uint32_t i = begin; i < end; i++)
+        {
+          transformOccluder(i, m_threadClipVertices[JobSystem::getThreadIndex()]);
+        }
+      });
+      m_jobSystem->parallelFor(m_numBands, 1, [&](uint32_t begin, uint32_t end)
+      {
+        for (uint32_t band = begin; band < end; band++)
+        {
+          rasterizeBand(band, m_depthLevels[0], true);
+        }
+      });
+    }
+    else
+    {
+      for (uint32_t i = 0; i < (uint32_t)m_occluders.size(); i++)
+      {
+        transformOccluder(i, m_threadClipVertices[0]);
+      }
+      for (uint32_t band = 0; band < m_numBands; band++)
+      {
+        rasterizeBand(band, m_depthLevels[0], true);
+      }
+    }
+    buildHiZ();
+
+    m_stats.m_numOccluders = (uint32_t)m_occluders.size();
+    m_stats.m_numTriangles = numTriangles;
+    for (uint32_t i = 0; i < numTriangles; i++)
+    {
+      m_stats.m_numClippedTriangles += m_triangles[i].m_valid ? 0 : 1;
+    }
+    m_stats.m_rasterMicro = timer.elapsedMicro();
+  }
+
+  void OcclusionCuller::transformOccluder(uint32_t occluderIndex, vector<vec4>& clipVertices)
+  {
+    const Occluder& occluder = m_occluders[occluderIndex];
+    clipVertices.resize(occluder.m_numVerts);
+    for (uint32_t i = 0; i < occluder.m_numVerts; i++)
+    {
+      const float* position = occluder.m_positions + i * 3;
+      clipVertices[i] = occluder.m_transform * vec4(position[0], position[1], position[2], 1.0f);
+    }
+
+    // Triangles reaching in front of the near plane are dropped rather than
+    // clipped, an occluder that covers less only culls less
+    for (uint32_t t = 0; t < occluder.m_numIndices / 3; t++)
+    {
+      Triangle& triangle = m_triangles[occluder.m_firstTriangle + t];
+      triangle.m_valid = true;
+      for (uint32_t v = 0; v < 3; v++)
+      {
+        const vec4& clip = clipVertices[occluder.m_indices[t * 3 + v]];
+        if (clip.z + clip.w < 0.0f || clip.w <= 0.0f)
+        {
+          triangle.m_valid = false;
+          break;
+        }
+        float inverseW = 1.0f / clip.w;
+        triangle.m_vertices[v].x = (clip.x * inverseW * 0.5f + 0.5f) * m_width;
+        triangle.m_vertices[v].y = (clip.y * inverseW * 0.5f + 0.5f) * m_height;
+        triangle.m_vertices[v].z = clip.z * inverseW;
+      }
+    }
+  }
+
+  void OcclusionCuller::rasterizeBand(uint32_t band, float* depth, bool simd)
+  {
+    int bandBegin = (int)(band * OCCLUSION_BAND_HEIGHT);
+    int bandEnd = bandBegin + OCCLUSION_BAND_HEIGHT;
+
+    for (size_t t = 0; t < m_triangles.size(); t++)
+    {
+      const Triangle& triangle = m_triangles[t];
+      if (!triangle.m_valid)
+      {
+        continue;
+      }
+
+      vec3 v0 = triangle.m_vertices[0];
+      vec3 v1 = triangle.m_vertices[1];
+      vec3 v2 = triangle.m_vertices[2];
+      float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+      if (fabsf(area) < 1.0e-8f)
+      {
+        continue;
+      }
+
+      // Both windings fill, turned so the edge functions are positive inside
+      if (area < 0.0f)
+      {
+        std::swap(v1, v2);
+        area = -area;
+      }
+
+      int minX = std::max((int)floorf(std::min(std::min(v0.x, v1.x), v2.x)), 0);
+      int maxX = std::min((int)ceilf(std::max(std::max(v0.x, v1.x), v2.x)), (int)m_width);
+      int minY = std::max((int)floorf(std::min(std::min(v0.y, v1.y), v2.y)), bandBegin);
+      int maxY = std::min((int)ceilf(std::max(std::max(v0.y, v1.y), v2.y)), bandEnd);
+      if (minX >= maxX || minY >= maxY)
+      {
+        continue;
+      }
+
+      // Edge a->b is a * x + b * y + c, sampled at the pixel centers
+      float a0 = v1.y - v2.y;
+      float b0 = v2.x - v1.x;
+      float c0 = -(a0 * v1.x + b0 * v1.y);
+      float a1 = v2.y - v0.y;
+      float b1 = v0.x - v2.x;
+      float c1 = -(a1 * v2.x + b1 * v2.y);
+      float a2 = v0.y - v1.y;
+      float b2 = v1.x - v0.x;
+      float c2 = -(a2 * v0.x + b2 * v0.y);
+
+      // z is affine in screen space after the divide
+      float dzdx = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+      float dzdy = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) / area;
+      float zc = v0.z - dzdx * v0.x - dzdy * v0.y;
+
+      int startX = minX & ~(OCCLUSION_CULLER_WIDTH - 1);
+      for (int y = minY; y < maxY; y++)
+      {
+        float py = (float)y + 0.5f;
+        float row0 = b0 * py + c0;
+        float row1 = b1 * py + c1;
+        float row2 = b2 * py + c2;
+        float rowZ = dzdy * py + zc;
+        float* depthRow = depth + y * m_width;
+
+        if (simd)
+        {
+#if defined(__AVX__)
+          __m256 a0v = _mm256_set1_ps(a0);
+          __m256 a1v = _mm256_set1_ps(a1);
+          __m256 a2v = _mm256_set1_ps(a2);
+          __m256 dzdxv = _mm256_set1_ps(dzdx);
+          __m256 row0v = _mm256_set1_ps(row0);
+          __m256 row1v = _mm256_set1_ps(row1);
+          __m256 row2v = _mm256_set1_ps(row2);
+          __m256 rowZv = _mm256_set1_ps(rowZ);
+          __m256 zero = _mm256_setzero_ps();
+          __m256 laneOffsets = _mm256_set_ps(7.5f, 6.5f, 5.5f, 4.5f, 3.5f, 2.5f, 1.5f, 0.5f);
+          for (int x = startX; x < maxX; x += 8)
+          {
+            __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), laneOffsets);
+            __m256 e0 = _mm256_add_ps(_mm256_mul_ps(a0v, px), row0v);
+            __m256 e1 = _mm256_add_ps(_mm256_mul_ps(a1v, px), row1v);
+            __m256 e2 = _mm256_add_ps(_mm256_mul_ps(a2v, px), row2v);
+            __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ), _mm256_cmp_ps(e1, zero, _CMP_GE_OQ)), _mm256_cmp_ps(e2, zero, _CMP_GE_OQ));
+            if (_mm256_movemask_ps(inside) == 0)
+            {
+              continue;
+            }
+            __m256 z = _mm256_add_ps(_mm256_mul_ps(dzdxv, px), rowZv);
+            __m256 current = _mm256_load_ps(depthRow + x);
+            _mm256_store_ps(depthRow + x, _mm256_blendv_ps(current, _mm256_min_ps(current, z), inside));
+          }
+#else
+          __m128 a0v = _mm_set1_ps(a0);
+          __m128 a1v = _mm_set1_ps(a1);
+          __m128 a2v = _mm_set1_ps(a2);
+          __m128 dzdxv = _mm_set1_ps(dzdx);
+          __m128 row0v = _mm_set1_ps(row0);
+          __m128 row1v = _mm_set1_ps(row1);
+          __m128 row2v = _mm_set1_ps(row2);
+          __m128 rowZv = _mm_set1_ps(rowZ);
+          __m128 zero = _mm_setzero_ps();
+          __m128 laneOffsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+          for (int x = startX; x < maxX; x += 4)
+          {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), laneOffsets);
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(a0v, px), row0v);
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(a1v, px), row1v);
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(a2v, px), row2v);
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+            if (_mm_movemask_ps(inside) == 0)
+            {
+              continue;
+            }
+            __m128 z = _mm_add_ps(_mm_mul_ps(dzdxv, px), rowZv);
+            __m128 current = _mm_load_ps(depthRow + x);
+            __m128 nearer = _mm_min_ps(current, z);
+            _mm_store_ps(depthRow + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, current)));
+          }
+#endif
+        }
+        else
+        {
+          for (int x = startX; x < maxX; x++)
+          {
+            float px = (float)x + 0.5f;
+            if (a0 * px + row0 >= 0.0f && a1 * px + row1 >= 0.0f && a2 * px + row2 >= 0.0f)
+            {
+              depthRow[x] = std::min(depthRow[x], dzdx * px + rowZ);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  void OcclusionCuller::buildHiZ()
+  {
+    for (size_t level = 1; level < m_depthLevels.size(); level++)
+    {
+      const float* source = m_depthLevels[level - 1];
+      float* destination = m_depthLevels[level];
+      uint32_t sourceWidth = m_levelWidths[level - 1];
+      uint32_t sourceHeight = m_levelHeights[level - 1];
+      for (uint32_t y = 0; y < m_levelHeights[level]; y++)
+      {
+        uint32_t y0 = y * 2;
+        uint32_t y1 = std::min(y0 + 1, sourceHeight - 1);
+        for (uint32_t x = 0; x < m_levelWidths[level]; x++)
+        {
+          uint32_t x0 = x * 2;
+          uint32_t x1 = std::min(x0 + 1, sourceWidth - 1);
+          float farthest = std::max(std::max(source[y0 * sourceWidth + x0], source[y0 * sourceWidth + x1]),
+            std::max(source[y1 * sourceWidth + x0], source[y1 * sourceWidth + x1]));
+          destination[y * m_levelWidths[level] + x] = farthest;
+        }
+      }
+    }
+  }
+
+  bool OcclusionCuller::isVisible(const vec3& center, const vec3& extent)
+  {
+    float minX = FLT_MAX;
+    float minY = FLT_MAX;
+    float maxX = -FLT_MAX;
+    float maxY = -FLT_MAX;
+    float minZ = FLT_MAX;
+    for (uint32_t corner = 0; corner < 8; corner++)
+    {
+      vec3 offset((corner & 1) ? extent.x : -extent.x, (corner & 2) ? extent.y : -extent.y, (corner & 4) ? extent.z : -extent.z);
+      vec4 clip = m_viewProjection * vec4(center + offset, 1.0f);
+
+      // Boxes reaching the near plane can't be placed on the screen
+      if (clip.z + clip.w < 0.0f || clip.w <= 0.0f)
+      {
+        return true;
+      }
+      float inverseW = 1.0f / clip.w;
+      float x = (clip.x * inverseW * 0.5f + 0.5f) * m_width;
+      float y = (clip.y * inverseW * 0.5f + 0.5f) * m_height;
+      minX = std::min(minX, x);
+      maxX = std::max(maxX, x);
+      minY = std::min(minY, y);
+      maxY = std::max(maxY, y);
+      minZ = std::min(minZ, clip.z * inverseW);
+    }
+
+    // Off the buffer is left to the frustum test
+    if (maxX < 0.0f || maxY < 0.0f || minX >= (float)m_width || minY >= (float)m_height)
+    {
+      return true;
+    }
+
+    // Occluders cover whole pixels whose centers they cover, so a box can peek
+    // past an occluder edge inside a pixel marked as covered. One more pixel
+    // all around reaches the uncovered pixel across that edge.
+    int x0 = std::max((int)floorf(minX) - 1, 0);
+    int y0 = std::max((int)floorf(minY) - 1, 0);
+    int x1 = std::min((int)floorf(maxX) + 1, (int)m_width - 1);
+    int y1 = std::min((int)floorf(maxY) + 1, (int)m_height - 1);
+
+    // The coarsest level where the box still spans at most 2x2 texels
+    uint32_t level = 0;
+    while (level + 1 < m_depthLevels.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+    {
+      level++;
+    }
+
+    const float* depth = m_depthLevels[level];
+    uint32_t levelWidth = m_levelWidths[level];
+    for (int y = y0 >> level; y <= (y1 >> level); y++)
+    {
+      for (int x = x0 >> level; x <= (x1 >> level); x++)
+      {
+        if (depth[y * levelWidth + x] >= minZ)
+        {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Rasterizes the same triangles one pixel at a time and counts the pixels
+  // that come out different from the SIMD depth buffer
+  uint32_t OcclusionCuller::validate()
+  {
+    float* reference = (float*)_mm_malloc(m_width * m_height * sizeof(float), 32);
+    std::fill(reference, reference + m_width * m_height, FLT_MAX);
+    for (uint32_t band = 0; band < m_numBands; band++)
+    {
+      rasterizeBand(band, reference, false);
+    }
+
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < m_width * m_height; i++)
+    {
+      mismatches += reference[i] != m_depthLevels[0][i] ? 1 : 0;
+    }
+    _mm_free(reference);
+    return mismatches;
+  }
+
+  uint32_t OcclusionCuller::getWidth()
+  {
+    return m_width;
+  }
+
+  uint32_t OcclusionCuller::getHeight()
+  {
+    return m_height;
+  }
+
+  uint32_t OcclusionCuller::getSimdWidth()
+  {
+    return OCCLUSION_CULLER_WIDTH;
+  }
+
+  void OcclusionCuller::getStats(Stats& stats)
+  {
+    stats = m_stats;
+  }
+}
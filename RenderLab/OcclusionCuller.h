@@ -0,0 +1,83 @@
+#pragma once
+
+#include "JobSystem.h"
+
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+using glm::vec3;
+using glm::vec4;
+using glm::mat4;
+using std::shared_ptr;
+using std::vector;
+
+namespace RenderLab
+{
+  // Rasterizes occluder triangles into a small depth buffer on the CPU and
+  // tests boxes against a max depth pyramid built from it. Rows of the buffer
+  // are split into bands that rasterize in parallel, and each band fills 4
+  // (SSE) or 8 (AVX) pixels at a time.
+  class OcclusionCuller
+  {
+  public:
+    struct Stats {
+      uint32_t            m_numOccluders;
+      uint32_t            m_numTriangles;
+      uint32_t            m_numClippedTriangles;
+      unsigned long long  m_rasterMicro;
+    };
+
+    OcclusionCuller(uint32_t width, uint32_t height);
+    ~OcclusionCuller();
+
+    void      setJobSystem(shared_ptr<JobSystem> jobSystem);
+    void      begin(const mat4& viewProjection);
+    void      addOccluder(const float* positions, uint32_t numVerts, const unsigned int* indices, uint32_t numIndices, const mat4& transform);
+    void      rasterize();
+    bool      isVisible(const vec3& center, const vec3& extent);
+    uint32_t  validate();
+    uint32_t  getWidth();
+    uint32_t  getHeight();
+    uint32_t  getSimdWidth();
+    void      getStats(Stats& stats);
+
+  private:
+    struct Occluder {
+      const float*        m_positions;
+      uint32_t            m_numVerts;
+      const unsigned int* m_indices;
+      uint32_t            m_numIndices;
+      mat4                m_transform;
+      uint32_t            m_firstTriangle;
+    };
+
+    // Screen space corners, x and y in pixels and z the clip space depth
+    struct Triangle {
+      vec3      m_vertices[3];
+      bool      m_valid;
+    };
+
+    void      transformOccluder(uint32_t occluderIndex, vector<vec4>& clipVertices);
+    void      rasterizeBand(uint32_t band, float* depth, bool simd);
+    void      buildHiZ();
+
+    uint32_t                  m_width;
+    uint32_t                  m_height;
+    uint32_t                  m_numBands;
+    mat4                      m_viewProjection;
+    shared_ptr<JobSystem>     m_jobSystem;
+    vector<Occluder>          m_occluders;
+    vector<Triangle>          m_triangles;
+    vector<vector<vec4>>      m_threadClipVertices;
+
+    // Level 0 is the depth buffer itself, every level above keeps the farthest
+    // depth of the 2x2 texels under it
+    vector<float*>            m_depthLevels;
+    vector<uint32_t>          m_levelWidths;
+    vector<uint32_t>          m_levelHeights;
+    Stats                     m_stats;
+  };
+}
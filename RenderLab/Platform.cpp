@@ -0,0 +1,16 @@
+#include "stdafx.h"
+#include "Platform.h"
+
+#include <stdio.h>
+
+namespace RenderLab
+{
+  void printDebugString(const string& s)
+  {
+#ifdef _WIN32
+    OutputDebugStringA(s.c_str());
+#else
+    fputs(s.c_str(), stderr);
+#endif
+  }
+}
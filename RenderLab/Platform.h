@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+
+#include <stdint.h>
+
+using std::string;
+
+#ifndef _WIN32
+// Just enough of the Win32 types for the core to build without windows.h. The
+// values match Windows so input handling behaves the same on every platform.
+typedef void*     HINSTANCE;
+typedef void*     HWND;
+typedef uint32_t  UINT;
+typedef uintptr_t WPARAM;
+typedef intptr_t  LPARAM;
+
+struct MSG
+{
+  HWND    hwnd;
+  UINT    message;
+  WPARAM  wParam;
+  LPARAM  lParam;
+};
+
+#define WM_KEYDOWN                  0x0100
+#define WM_KEYUP                    0x0101
+#define WM_MOUSEMOVE                0x0200
+#define WM_LBUTTONDOWN              0x0201
+#define WM_LBUTTONUP                0x0202
+#define WM_MOUSEWHEEL               0x020A
+
+#define VK_SPACE                    0x20
+#define VK_ADD                      0x6B
+#define VK_SUBTRACT                 0x6D
+#define VK_F1                       0x70
+#define VK_F2                       0x71
+#define VK_F3                       0x72
+#define VK_F4                       0x73
+#define VK_F5                       0x74
+#define VK_F6                       0x75
+#define VK_F7                       0x76
+#define VK_F8                       0x77
+#define VK_F9                       0x78
+#define VK_F10                      0x79
+#define VK_F11                      0x7A
+#define VK_F12                      0x7B
+
+#define GET_X_LPARAM(lp)            ((int)(short)((uint32_t)(lp) & 0xffff))
+#define GET_Y_LPARAM(lp)            ((int)(short)(((uint32_t)(lp) >> 16) & 0xffff))
+#define GET_WHEEL_DELTA_WPARAM(wp)  ((short)(((uint32_t)(wp) >> 16) & 0xffff))
+#endif
+
+namespace RenderLab
+{
+  // Debugger output on Windows, stderr everywhere else
+  void printDebugString(const string& s);
+}
@@ -37,4 +37,9 @@ namespace RenderLab
   void ProcessorComponent::execute(double absoluteTime, double deltaTime)
   {
   }
+
+  bool ProcessorComponent::getAccessSets(vector<Entity*>& readSet, vector<Entity*>& writeSet)
+  {
+    return false;
+  }
 }
@@ -3,8 +3,10 @@
 #include "Component.h"
 
 #include <string>
+#include <vector>
 
 using std::string;
+using std::vector;
 
 namespace RenderLab
 {
@@ -21,6 +23,10 @@ namespace RenderLab
     virtual void handleMouse(MSG* event);
     virtual void execute(double absoluteTime, double deltaTime);
 
+    // Entities execute reads and writes, fixed for the processor's lifetime.
+    // Returning false means it may touch anything and always runs alone.
+    virtual bool getAccessSets(vector<Entity*>& readSet, vector<Entity*>& writeSet);
+
   private:
     bool m_sendKeyboardEvents;
     bool m_sendMouseEvents;
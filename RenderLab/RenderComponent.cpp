@@ -3,7 +3,8 @@
 
 namespace RenderLab
 {
-  RenderComponent::RenderComponent(string name) : Component(name, Component::RENDER)
+  RenderComponent::RenderComponent(string name) : Component(name, Component::RENDER),
+    m_visible(true)
   {
   }
 
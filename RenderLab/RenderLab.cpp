@@ -11,6 +11,8 @@
 #include "FirstPersonProcessor.h"
 #include "RotationProcessor.h"
 #include "TranslationProcessor.h"
+#include "GraphicsVulkan.h"
+#include "GraphicsOpenGL.h"
 
 #include <memory>
 #include <array>
@@ -33,6 +35,7 @@ LRESULT CALLBACK    WndProc(HWND, UINT, WPARAM, LPARAM);
 INT_PTR CALLBACK    About(HWND, UINT, WPARAM, LPARAM);
 
 RenderLab::WorldManager*  g_worldManager;
+shared_ptr<RenderLab::GraphicsVulkan> g_graphics;
 unsigned int              g_windowX = 0;
 unsigned int              g_windowY = 0;
 unsigned int              g_windowWidth = 1200;
@@ -103,6 +106,11 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
       g_worldManager->executeFrame();
     }
 
+    // The pipeline cache lets the next run skip most of its pipeline compiles
+    g_graphics->savePipelineCache();
+    delete g_worldManager;
+    g_worldManager = nullptr;
+
     return (int) msg.wParam;
 }
 
@@ -159,7 +167,10 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
    ShowWindow(hWnd, nCmdShow);
    UpdateWindow(hWnd);
 
-   g_worldManager = new RenderLab::WorldManager("WorldManager", hInst, hWnd);
+   g_graphics = make_shared<RenderLab::GraphicsVulkan>("Vulkan Graphics", hInst, hWnd);
+   shared_ptr<RenderLab::Graphics> graphics = g_graphics;
+   //shared_ptr<RenderLab::Graphics> graphics = make_shared<RenderLab::GraphicsOpenGL>("OpenGL Graphics", hInst, hWnd);
+   g_worldManager = new RenderLab::WorldManager("WorldManager", graphics);
 
    // Load the Sponza World
    shared_ptr<RenderLab::Entity> rootEntity = make_shared<RenderLab::Entity>("Root Entity");
@@ -0,0 +1,724 @@
+// RenderLabBench.cpp : Headless CPU frame benchmark.
+//
+// Builds a procedural scene, runs it for a fixed number of frames against
+// NullGraphics and reports the CPU time of each phase of the frame. The scene
+// and the camera path only depend on the frame number, so runs on different
+// machines do the same work. Built with RENDERLAB_VULKAN, --vulkan renders the
+// same frames offscreen with GraphicsVulkan and adds the GPU pass times.
+
+#include "stdafx.h"
+
+#include "WorldManager.h"
+#include "NullGraphics.h"
+#include "RenderComponent.h"
+#include "LightComponent.h"
+#include "TranslationProcessor.h"
+#include "Entity.h"
+#include "CpuTimer.h"
+#include "FrustumCuller.h"
+#include "BoundingVolumeHierarchy.h"
+#include "OcclusionCuller.h"
+#ifdef RENDERLAB_VULKAN
+#include "GraphicsVulkan.h"
+#endif
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+using std::shared_ptr;
+using std::make_shared;
+using std::vector;
+
+struct BenchOptions
+{
+  uint32_t  m_frames;
+  uint32_t  m_warmupFrames;
+  uint32_t  m_lights;
+  uint32_t  m_shadowLights;
+  uint32_t  m_groups;
+  uint32_t  m_objectsPerGroup;
+  uint32_t  m_threads;
+  bool      m_serialProcessors;
+  bool      m_noCull;
+  bool      m_linearCull;
+  uint32_t  m_hierarchyBounds;
+  bool      m_occlusionCull;
+  uint32_t  m_walls;
+  uint32_t  m_materials;
+  bool      m_noSort;
+  bool      m_vulkan;
+  const char* m_readbackFile;
+};
+
+struct PhaseTimes
+{
+  vector<double>  m_samples;
+
+  void report(const char* name)
+  {
+    vector<double> sorted = m_samples;
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0.0;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      total += sorted[i];
+    }
+    double mean = sorted.empty() ? 0.0 : total / sorted.size();
+    double median = sorted.empty() ? 0.0 : sorted[sorted.size() / 2];
+    double p99 = sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)];
+    double worst = sorted.empty() ? 0.0 : sorted.back();
+    printf("  %-12s mean %8.3f ms  median %8.3f ms  p99 %8.3f ms  max %8.3f ms\n", name, mean / 1000.0, median / 1000.0, p99 / 1000.0, worst / 1000.0);
+  }
+};
+
+static void printUsage()
+{
+  printf("usage: renderlab_bench [--frames n] [--warmup n] [--lights n] [--groups n] [--objects n] [--threads n] [--serial] [--nocull] [--linearcull] [--bvh n] [--shadows n] [--occlusion] [--walls n] [--materials n] [--nosort]\n");
+  printf("  --objects is the number of meshes per group, --threads 0 uses every hardware thread\n");
+  printf("  --linearcull tests every mesh instead of walking the hierarchy, --bvh n only benchmarks the hierarchy on n boxes\n");
+  printf("  --shadows n gives the first n lights cube shadow maps, the moving ones among them render every frame\n");
+  printf("  --materials n deals the boxes out over n materials, --nosort draws in scene order and binds a pipeline for every draw\n");
+  printf("  --occlusion culls meshes hidden behind the largest visible ones, --walls n adds n long walls across the grid to hide behind\n");
+#ifdef RENDERLAB_VULKAN
+  printf("  [--vulkan [--readback file.ppm]] renders offscreen on the first Vulkan device, run from the directory holding shaders/\n");
+#endif
+}
+
+static bool parseOptions(int argc, char** argv, BenchOptions& options)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    uint32_t* value = nullptr;
+    if (strcmp(argv[i], "--frames") == 0) value = &options.m_frames;
+    else if (strcmp(argv[i], "--warmup") == 0) value = &options.m_warmupFrames;
+    else if (strcmp(argv[i], "--lights") == 0) value = &options.m_lights;
+    else if (strcmp(argv[i], "--shadows") == 0) value = &options.m_shadowLights;
+    else if (strcmp(argv[i], "--groups") == 0) value = &options.m_groups;
+    else if (strcmp(argv[i], "--objects") == 0) value = &options.m_objectsPerGroup;
+    else if (strcmp(argv[i], "--threads") == 0) value = &options.m_threads;
+    else if (strcmp(argv[i], "--bvh") == 0) value = &options.m_hierarchyBounds;
+    else if (strcmp(argv[i], "--walls") == 0) value = &options.m_walls;
+    else if (strcmp(argv[i], "--materials") == 0) value = &options.m_materials;
+    else if (strcmp(argv[i], "--serial") == 0)
+    {
+      options.m_serialProcessors = true;
+      continue;
+    }
+    else if (strcmp(argv[i], "--nocull") == 0)
+    {
+      options.m_noCull = true;
+      continue;
+    }
+    else if (strcmp(argv[i], "--linearcull") == 0)
+    {
+      options.m_linearCull = true;
+      continue;
+    }
+    else if (strcmp(argv[i], "--occlusion") == 0)
+    {
+      options.m_occlusionCull = true;
+      continue;
+    }
+    else if (strcmp(argv[i], "--nosort") == 0)
+    {
+      options.m_noSort = true;
+      continue;
+    }
+#ifdef RENDERLAB_VULKAN
+    else if (strcmp(argv[i], "--vulkan") == 0)
+    {
+      options.m_vulkan = true;
+      continue;
+    }
+    else if (strcmp(argv[i], "--readback") == 0 && i + 1 < argc)
+    {
+      options.m_readbackFile = argv[++i];
+      continue;
+    }
+#endif
+
+    if (value == nullptr || i + 1 >= argc)
+    {
+      return false;
+    }
+    *value = (uint32_t)strtoul(argv[++i], nullptr, 10);
+  }
+  return true;
+}
+
+// std::mt19937 produces the same sequence everywhere, unlike rand() and the
+// standard distributions. Draws are kept in separate statements so the
+// argument evaluation order of the compiler doesn't matter.
+static float randomFloat(std::mt19937& random, float low, float high)
+{
+  return low + (high - low) * (float)(random() & 0xffffff) / 16777216.0f;
+}
+
+static shared_ptr<RenderLab::Mesh> createBox(string name, vec3 size, shared_ptr<RenderLab::Material> material)
+{
+  static const float faceNormals[6][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+  float verts[24 * 3];
+  float normals[24 * 3];
+  float texCoords[24 * 2];
+  unsigned int indices[36];
+
+  for (uint32_t f = 0; f < 6; f++)
+  {
+    vec3 n(faceNormals[f][0], faceNormals[f][1], faceNormals[f][2]);
+    vec3 u = fabs(n.y) > 0.5f ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f);
+    vec3 v = glm::cross(n, u);
+    for (uint32_t c = 0; c < 4; c++)
+    {
+      float s = (c == 1 || c == 2) ? 1.0f : -1.0f;
+      float t = (c >= 2) ? 1.0f : -1.0f;
+      vec3 p = 0.5f * (n + s * u + t * v) * size;
+      uint32_t vertex = f * 4 + c;
+      verts[vertex * 3 + 0] = p.x;
+      verts[vertex * 3 + 1] = p.y;
+      verts[vertex * 3 + 2] = p.z;
+      normals[vertex * 3 + 0] = n.x;
+      normals[vertex * 3 + 1] = n.y;
+      normals[vertex * 3 + 2] = n.z;
+      texCoords[vertex * 2 + 0] = s * 0.5f + 0.5f;
+      texCoords[vertex * 2 + 1] = t * 0.5f + 0.5f;
+    }
+
+    unsigned int quad[6] = { 0, 1, 2, 0, 2, 3 };
+    for (uint32_t i = 0; i < 6; i++)
+    {
+      indices[f * 6 + i] = f * 4 + quad[i];
+    }
+  }
+
+  shared_ptr<RenderLab::Mesh> mesh = make_shared<RenderLab::Mesh>(name, RenderLab::Mesh::TRIANGLES, 24, 3);
+  mesh->addVertexBuffer(0, 3, sizeof(verts), verts);
+  mesh->addVertexBuffer(1, 3, sizeof(normals), normals);
+  mesh->addVertexBuffer(2, 2, sizeof(texCoords), texCoords);
+  mesh->addIndexBuffer(36, indices);
+  mesh->setMaterial(material);
+  return mesh;
+}
+
+static bool writeImage(const char* filename, vector<uint8_t>& pixels, uint32_t width, uint32_t height)
+{
+  FILE* file = fopen(filename, "wb");
+  if (file == nullptr)
+  {
+    return false;
+  }
+
+  // Binary PPM, dropping the alpha channel
+  fprintf(file, "P6\n%u %u\n255\n", width, height);
+  for (size_t i = 0; i < (size_t)width * height; i++)
+  {
+    fwrite(&pixels[i * 4], 1, 3, file);
+  }
+  fclose(file);
+  return true;
+}
+
+// A grid of groups, each a parent entity with a row of boxes under it. Every
+// other group slides back and forth, so part of the hierarchy is dirty each
+// frame, and a share of the lights move on their own. Walls run across the
+// grid between rows of groups and never move.
+static void createScene(RenderLab::WorldManager* worldManager, BenchOptions& options)
+{
+  std::mt19937 random(1234);
+  shared_ptr<RenderLab::Entity> rootEntity = make_shared<RenderLab::Entity>("Root Entity");
+  vector<shared_ptr<RenderLab::Material>> materials;
+  for (uint32_t m = 0; m < std::max(options.m_materials, 1u); m++)
+  {
+    materials.push_back(make_shared<RenderLab::Material>("Bench Material " + std::to_string(m), RenderLab::Material::DEFERRED_LIT));
+  }
+  shared_ptr<RenderLab::Material> material = materials[0];
+
+  uint32_t groupsPerRow = (uint32_t)ceil(sqrt((double)std::max(options.m_groups, 1u)));
+  for (uint32_t g = 0; g < options.m_groups; g++)
+  {
+    shared_ptr<RenderLab::Entity> groupEntity = make_shared<RenderLab::Entity>("Group " + std::to_string(g));
+    vec3 groupPosition(((g % groupsPerRow) - groupsPerRow * 0.5f) * 20.0f, 0.0f, ((g / groupsPerRow) - groupsPerRow * 0.5f) * 20.0f);
+    groupEntity->setTransform(glm::translate(mat4(), groupPosition));
+
+    for (uint32_t o = 0; o < options.m_objectsPerGroup; o++)
+    {
+      shared_ptr<RenderLab::Entity> objectEntity = make_shared<RenderLab::Entity>("Object " + std::to_string(g) + "." + std::to_string(o));
+      vec3 objectPosition;
+      objectPosition.x = randomFloat(random, -8.0f, 8.0f);
+      objectPosition.y = randomFloat(random, 0.0f, 6.0f);
+      objectPosition.z = randomFloat(random, -8.0f, 8.0f);
+      objectEntity->setTransform(glm::translate(mat4(), objectPosition));
+
+      shared_ptr<RenderLab::RenderComponent> renderComponent = make_shared<RenderLab::RenderComponent>("Object Render Component");
+      renderComponent->addMesh(createBox("Box", vec3(1.0f), materials[(g * options.m_objectsPerGroup + o) % materials.size()]));
+      objectEntity->addComponent(renderComponent);
+      groupEntity->addChild(objectEntity);
+    }
+
+    if (g % 2 == 0)
+    {
+      groupEntity->addComponent(make_shared<RenderLab::TranslationProcessor>("Group Translation Processor", -5.0f, 5.0f, 0.05f, vec3(0.0f, 1.0f, 0.0f), groupEntity));
+    }
+    rootEntity->addChild(groupEntity);
+  }
+
+  float extent = groupsPerRow * 10.0f + 10.0f;
+  for (uint32_t w = 0; w < options.m_walls; w++)
+  {
+    shared_ptr<RenderLab::Entity> wallEntity = make_shared<RenderLab::Entity>("Wall " + std::to_string(w));
+    float z = ((w + 1.0f) / (options.m_walls + 1.0f) - 0.5f) * groupsPerRow * 20.0f - 10.0f;
+    wallEntity->setTransform(glm::translate(mat4(), vec3(-10.0f, 6.0f, z)));
+
+    shared_ptr<RenderLab::RenderComponent> renderComponent = make_shared<RenderLab::RenderComponent>("Wall Render Component");
+    renderComponent->addMesh(createBox("Wall", vec3(groupsPerRow * 20.0f, 12.0f, 1.0f), material));
+    wallEntity->addComponent(renderComponent);
+    rootEntity->addChild(wallEntity);
+  }
+
+  for (uint32_t l = 0; l < options.m_lights; l++)
+  {
+    shared_ptr<RenderLab::Entity> lightEntity = make_shared<RenderLab::Entity>("Light " + std::to_string(l));
+    shared_ptr<RenderLab::LightComponent> lightComponent = make_shared<RenderLab::LightComponent>("Light " + std::to_string(l), RenderLab::LightComponent::POINT, l < options.m_shadowLights);
+    vec3 color;
+    color.r = randomFloat(random, 0.2f, 1.0f);
+    color.g = randomFloat(random, 0.2f, 1.0f);
+    color.b = randomFloat(random, 0.2f, 1.0f);
+    lightComponent->setDiffuse(color);
+    lightEntity->addComponent(lightComponent);
+
+    vec3 lightPosition;
+    lightPosition.x = randomFloat(random, -extent, extent);
+    lightPosition.y = randomFloat(random, 0.0f, 20.0f);
+    lightPosition.z = randomFloat(random, -extent, extent);
+    lightEntity->setTransform(glm::translate(mat4(), lightPosition));
+    if (l % 4 == 0)
+    {
+      lightEntity->addComponent(make_shared<RenderLab::TranslationProcessor>("Light Translation Processor", -20.0f, 20.0f, 0.2f, vec3(1.0f, 0.0f, 0.0f), lightEntity));
+    }
+    rootEntity->addChild(lightEntity);
+  }
+
+  worldManager->addEntity(rootEntity);
+}
+
+// Boxes scattered at a fixed density over a square that grows with their
+// number. Times the hierarchy's build and refits, then checks its queries
+// against testing every box.
+static void benchmarkHierarchy(uint32_t numBounds)
+{
+  std::mt19937 random(4321);
+  float side = (float)sqrt((double)numBounds) * 4.0f;
+  vector<vec3> centers(numBounds);
+  vector<vec3> extents(numBounds);
+  RenderLab::BoundingVolumeHierarchy hierarchy;
+  RenderLab::FrustumCuller culler;
+  RenderLab::BoundingVolumeHierarchy::Stats stats;
+  RenderLab::CpuTimer timer;
+
+  hierarchy.setNumBounds(numBounds);
+  culler.setNumBounds(numBounds);
+  for (uint32_t i = 0; i < numBounds; i++)
+  {
+    centers[i].x = randomFloat(random, -side * 0.5f, side * 0.5f);
+    centers[i].y = randomFloat(random, 0.0f, 10.0f);
+    centers[i].z = randomFloat(random, -side * 0.5f, side * 0.5f);
+    extents[i].x = randomFloat(random, 0.1f, 1.5f);
+    extents[i].y = randomFloat(random, 0.1f, 1.5f);
+    extents[i].z = randomFloat(random, 0.1f, 1.5f);
+    hierarchy.setBounds(i, centers[i], extents[i]);
+    culler.setBounds(i, centers[i], extents[i]);
+  }
+  hierarchy.build();
+  hierarchy.getStats(stats);
+  printf("renderlab_bench: hierarchy over %u boxes, %u nodes, %u leaves, depth %u\n", numBounds, stats.m_numNodes, stats.m_numLeaves, stats.m_maxDepth);
+  printf("  build        %8.3f ms\n", stats.m_buildMicro / 1000.0);
+
+  // A tenth of the boxes move, then all of them
+  uint32_t moveCounts[2] = { numBounds / 10, numBounds };
+  for (uint32_t pass = 0; pass < 2; pass++)
+  {
+    for (uint32_t i = 0; i < moveCounts[pass]; i++)
+    {
+      uint32_t index = pass == 0 ? (uint32_t)(random() % numBounds) : i;
+      centers[index].y += randomFloat(random, -0.5f, 0.5f);
+      hierarchy.setBounds(index, centers[index], extents[index]);
+      culler.setBounds(index, centers[index], extents[index]);
+    }
+    hierarchy.refit();
+    hierarchy.getStats(stats);
+    printf("  refit %6u %8.3f ms, %u nodes\n", moveCounts[pass], stats.m_refitMicro / 1000.0, stats.m_numRefitNodes);
+  }
+
+  const uint32_t numFrustums = 100;
+  vector<mat4> frustums(numFrustums);
+  for (uint32_t i = 0; i < numFrustums; i++)
+  {
+    vec3 eye;
+    eye.x = randomFloat(random, -side * 0.5f, side * 0.5f);
+    eye.y = randomFloat(random, 2.0f, 20.0f);
+    eye.z = randomFloat(random, -side * 0.5f, side * 0.5f);
+    float angle = randomFloat(random, 0.0f, 6.2831853f);
+    frustums[i] = glm::perspective(0.8f, 1.5f, 0.1f, 200.0f) * glm::lookAt(eye, eye + vec3(sin(angle), -0.2f, cos(angle)), vec3(0.0f, 1.0f, 0.0f));
+  }
+
+  vector<uint32_t> indices;
+  vector<uint8_t> visible(numBounds);
+  uint64_t hierarchyVisible = 0;
+  uint64_t linearVisible = 0;
+  uint32_t mismatches = 0;
+  timer.start();
+  for (uint32_t i = 0; i < numFrustums; i++)
+  {
+    indices.clear();
+    hierarchyVisible += hierarchy.queryFrustum(frustums[i], indices);
+  }
+  unsigned long long hierarchyTime = timer.elapsedMicro();
+  timer.start();
+  for (uint32_t i = 0; i < numFrustums; i++)
+  {
+    culler.setFrustum(frustums[i]);
+    linearVisible += culler.cull(visible.data());
+  }
+  unsigned long long linearTime = timer.elapsedMicro();
+  for (uint32_t i = 0; i < numFrustums; i++)
+  {
+    indices.clear();
+    hierarchy.queryFrustum(frustums[i], indices);
+    culler.setFrustum(frustums[i]);
+    culler.cull(visible.data());
+    for (size_t j = 0; j < indices.size(); j++)
+    {
+      visible[indices[j]] ^= 1;
+    }
+    mismatches += (uint32_t)std::count(visible.begin(), visible.end(), (uint8_t)1);
+  }
+  printf("  frustum      %8.3f ms hierarchy, %8.3f ms linear x%u, %.1f visible, %u mismatches\n", hierarchyTime / 1000.0 / numFrustums, linearTime / 1000.0 / numFrustums,
+    culler.getSimdWidth(), (double)hierarchyVisible / numFrustums, mismatches);
+  (void)linearVisible;
+
+  const uint32_t numSpheres = 1000;
+  uint64_t sphereHits = 0;
+  mismatches = 0;
+  timer.start();
+  for (uint32_t i = 0; i < numSpheres; i++)
+  {
+    vec3 center(randomFloat(random, -side * 0.5f, side * 0.5f), 5.0f, randomFloat(random, -side * 0.5f, side * 0.5f));
+    indices.clear();
+    uint32_t numHits = hierarchy.querySphere(center, 25.0f, indices);
+    sphereHits += numHits;
+  }
+  unsigned long long sphereTime = timer.elapsedMicro();
+  for (uint32_t i = 0; i < 20; i++)
+  {
+    vec3 center(randomFloat(random, -side * 0.5f, side * 0.5f), 5.0f, randomFloat(random, -side * 0.5f, side * 0.5f));
+    indices.clear();
+    uint32_t numHits = hierarchy.querySphere(center, 25.0f, indices);
+    uint32_t numExpected = 0;
+    for (uint32_t j = 0; j < numBounds; j++)
+    {
+      vec3 offset = glm::max(glm::abs(centers[j] - center) - extents[j], vec3(0.0f));
+      numExpected += glm::dot(offset, offset) <= 25.0f * 25.0f ? 1 : 0;
+    }
+    mismatches += numHits != numExpected ? 1 : 0;
+  }
+  printf("  sphere       %8.3f ms, %.1f hits, %u mismatches in 20 checked\n", sphereTime / 1000.0 / numSpheres, (double)sphereHits / numSpheres, mismatches);
+
+  const uint32_t numRays = 10000;
+  uint32_t rayHits = 0;
+  mismatches = 0;
+  timer.start();
+  for (uint32_t i = 0; i < numRays; i++)
+  {
+    vec3 origin(randomFloat(random, -side * 0.5f, side * 0.5f), 5.0f, randomFloat(random, -side * 0.5f, side * 0.5f));
+    float angle = randomFloat(random, 0.0f, 6.2831853f);
+    uint32_t index = 0;
+    float distance = 0.0f;
+    rayHits += hierarchy.queryRay(origin, vec3(sin(angle), 0.0f, cos(angle)), 1000.0f, index, distance) ? 1 : 0;
+  }
+  unsigned long long rayTime = timer.elapsedMicro();
+  for (uint32_t i = 0; i < 20; i++)
+  {
+    vec3 origin(randomFloat(random, -side * 0.5f, side * 0.5f), 5.0f, randomFloat(random, -side * 0.5f, side * 0.5f));
+    float angle = randomFloat(random, 0.0f, 6.2831853f);
+    vec3 direction(sin(angle), 0.01f, cos(angle));
+    uint32_t index = 0;
+    float distance = 0.0f;
+    bool hit = hierarchy.queryRay(origin, direction, 1000.0f, index, distance);
+
+    float nearest = 1000.0f;
+    bool expected = false;
+    for (uint32_t j = 0; j < numBounds; j++)
+    {
+      vec3 t0 = (centers[j] - extents[j] - origin) / direction;
+      vec3 t1 = (centers[j] + extents[j] - origin) / direction;
+      vec3 tNear = glm::min(t0, t1);
+      vec3 tFar = glm::max(t0, t1);
+      float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+      float exit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+      if (enter <= exit && enter <= nearest)
+      {
+        nearest = enter;
+        expected = true;
+      }
+    }
+    mismatches += (hit != expected || (hit && fabs(distance - nearest) > 1.0e-3f)) ? 1 : 0;
+  }
+  printf("  ray          %8.3f us, %u of %u hit, %u mismatches in 20 checked\n", rayTime / (double)numRays, rayHits, numRays, mismatches);
+}
+
+int main(int argc, char** argv)
+{
+  BenchOptions options;
+  options.m_frames = 300;
+  options.m_warmupFrames = 10;
+  options.m_lights = 500;
+  options.m_shadowLights = 0;
+  options.m_groups = 64;
+  options.m_objectsPerGroup = 16;
+  options.m_threads = 0;
+  options.m_serialProcessors = false;
+  options.m_noCull = false;
+  options.m_linearCull = false;
+  options.m_hierarchyBounds = 0;
+  options.m_occlusionCull = false;
+  options.m_walls = 0;
+  options.m_materials = 1;
+  options.m_noSort = false;
+  options.m_vulkan = false;
+  options.m_readbackFile = nullptr;
+  if (!parseOptions(argc, argv, options))
+  {
+    printUsage();
+    return 1;
+  }
+
+  if (options.m_hierarchyBounds > 0)
+  {
+    benchmarkHierarchy(options.m_hierarchyBounds);
+    return 0;
+  }
+
+  RenderLab::CpuTimer setupTimer;
+  setupTimer.start();
+
+  shared_ptr<RenderLab::Graphics> graphics;
+  shared_ptr<RenderLab::NullGraphics> nullGraphics;
+  RenderLab::View::Type viewType = RenderLab::View::SCREEN;
+#ifdef RENDERLAB_VULKAN
+  shared_ptr<RenderLab::GraphicsVulkan> vulkanGraphics;
+  if (options.m_vulkan)
+  {
+    vulkanGraphics = make_shared<RenderLab::GraphicsVulkan>("Vulkan Graphics");
+    graphics = vulkanGraphics;
+    viewType = RenderLab::View::OFFSCREEN;
+
+    // The Vulkan backend has no shadow material to build the cube pipelines with
+    options.m_shadowLights = 0;
+  }
+#endif
+  if (graphics == nullptr)
+  {
+    nullGraphics = make_shared<RenderLab::NullGraphics>("Null Graphics");
+    graphics = nullGraphics;
+  }
+
+  RenderLab::WorldManager* worldManager = new RenderLab::WorldManager("WorldManager", graphics);
+  worldManager->setNumThreads(options.m_threads);
+  worldManager->setProcessorScheduling(options.m_serialProcessors ? RenderLab::WorldManager::SERIAL_PROCESSORS : RenderLab::WorldManager::PARALLEL_PROCESSORS);
+  worldManager->setLogging(false);
+
+  shared_ptr<RenderLab::View> screenView = make_shared<RenderLab::View>("Screen View", viewType);
+  screenView->setViewportSize(vec2(1200, 800));
+  worldManager->addView(screenView);
+
+  worldManager->getRenderTechnique()->setFrustumCulling(!options.m_noCull);
+  worldManager->getRenderTechnique()->setCullingMethod(options.m_linearCull ? RenderLab::RenderTechnique::LINEAR_CULLING : RenderLab::RenderTechnique::HIERARCHY_CULLING);
+  worldManager->getRenderTechnique()->setOcclusionCulling(options.m_occlusionCull);
+  worldManager->getRenderTechnique()->setDrawSorting(!options.m_noSort);
+
+  createScene(worldManager, options);
+  worldManager->buildFrame();
+  unsigned long long setupTime = setupTimer.elapsedMicro();
+
+  PhaseTimes processorTimes;
+  PhaseTimes transformTimes;
+  PhaseTimes renderTimes;
+  PhaseTimes frameTimes;
+  PhaseTimes gBufferTimes;
+  PhaseTimes lightingTimes;
+  PhaseTimes cullTimes;
+  PhaseTimes occlusionTimes;
+  PhaseTimes sortTimes;
+  uint64_t totalVisible = 0;
+  uint64_t totalCulled = 0;
+  uint64_t totalOccluders = 0;
+  uint64_t totalOccluded = 0;
+  uint64_t totalPipelineChanges = 0;
+  uint64_t totalSortedPipelineChanges = 0;
+  uint64_t totalMaterialChanges = 0;
+  uint64_t totalSortedMaterialChanges = 0;
+  uint64_t totalPipelineBinds = 0;
+  uint64_t totalShadowViews = 0;
+  uint64_t totalShadowCasters = 0;
+  uint64_t totalShadowFaces = 0;
+  uint64_t totalUnculledFaces = 0;
+  uint32_t totalFrames = options.m_warmupFrames + options.m_frames;
+  float radius = (float)ceil(sqrt((double)std::max(options.m_groups, 1u))) * 12.0f + 20.0f;
+  for (uint32_t frame = 0; frame < totalFrames; frame++)
+  {
+    if (frame == options.m_warmupFrames && nullGraphics != nullptr)
+    {
+      nullGraphics->resetDrawStats();
+    }
+
+    // Orbit the scene so the lights sweep through the cluster grid
+    float angle = frame * 0.01f;
+    vec3 eye(radius * sin(angle), 15.0f, radius * cos(angle));
+    screenView->setViewTransform(glm::lookAt(eye, vec3(0.0f, 2.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f)));
+
+    worldManager->executeFrame();
+
+    if (frame >= options.m_warmupFrames)
+    {
+      unsigned long long processorTime = 0;
+      unsigned long long transformTime = 0;
+      unsigned long long renderTime = 0;
+      worldManager->getFrameTimes(processorTime, transformTime, renderTime);
+      processorTimes.m_samples.push_back((double)processorTime);
+      transformTimes.m_samples.push_back((double)transformTime);
+      renderTimes.m_samples.push_back((double)renderTime);
+      frameTimes.m_samples.push_back((double)(processorTime + transformTime + renderTime));
+
+      RenderLab::RenderTechnique::CullStats cullStats;
+      worldManager->getRenderTechnique()->getCullStats(cullStats);
+      totalVisible += cullStats.m_numVisible;
+      totalCulled += cullStats.m_numCulled;
+      totalShadowViews += cullStats.m_numShadowViews;
+      totalShadowCasters += cullStats.m_numShadowCasters;
+      totalShadowFaces += cullStats.m_numShadowFaces;
+      totalUnculledFaces += (uint64_t)cullStats.m_numShadowViews * cullStats.m_numMeshes * 6;
+      cullTimes.m_samples.push_back((double)cullStats.m_cullMicro);
+      totalOccluders += cullStats.m_numOccluders;
+      totalOccluded += cullStats.m_numOccluded;
+      occlusionTimes.m_samples.push_back((double)cullStats.m_occlusionMicro);
+
+      RenderLab::RenderTechnique::DrawSortStats drawSortStats;
+      worldManager->getRenderTechnique()->getDrawSortStats(drawSortStats);
+      totalPipelineChanges += drawSortStats.m_numPipelineChanges;
+      totalSortedPipelineChanges += drawSortStats.m_numSortedPipelineChanges;
+      totalMaterialChanges += drawSortStats.m_numMaterialChanges;
+      totalSortedMaterialChanges += drawSortStats.m_numSortedMaterialChanges;
+      totalPipelineBinds += drawSortStats.m_numPipelineBinds;
+      sortTimes.m_samples.push_back((double)drawSortStats.m_sortMicro);
+
+      // GPU pass times come back in nanoseconds, from the frame that last used
+      // this frame's slot since they are read without waiting on the GPU
+      gBufferTimes.m_samples.push_back(graphics->getGPUFrameTime() / 1000.0);
+      lightingTimes.m_samples.push_back(graphics->getGPUFrameTime2() / 1000.0);
+    }
+  }
+
+  printf("renderlab_bench: %u groups x %u objects, %u lights, %u threads, %s processors\n", options.m_groups, options.m_objectsPerGroup, options.m_lights,
+    worldManager->getNumThreads(), options.m_serialProcessors ? "serial" : "parallel");
+  printf("  setup        %8.3f ms\n", setupTime / 1000.0);
+  printf("  %u frames after %u warmup frames\n", options.m_frames, options.m_warmupFrames);
+  processorTimes.report("processors");
+  transformTimes.report("transforms");
+  renderTimes.report("render");
+  frameTimes.report("frame");
+  cullTimes.report("culling");
+  printf("  culling %s: %.1f meshes visible, %.1f culled per frame\n", options.m_noCull ? "off" : options.m_linearCull ? "linear" : "hierarchy",
+    (double)totalVisible / std::max(options.m_frames, 1u), (double)totalCulled / std::max(options.m_frames, 1u));
+  sortTimes.report("draw list");
+  if (options.m_noSort)
+  {
+    printf("  draw order scene: %.1f pipeline binds, %.1f pipeline and %.1f material changes per frame\n", (double)totalPipelineBinds / std::max(options.m_frames, 1u),
+      (double)totalPipelineChanges / std::max(options.m_frames, 1u), (double)totalMaterialChanges / std::max(options.m_frames, 1u));
+  }
+  else
+  {
+    printf("  draw order sorted: %.1f pipeline binds, pipeline changes %.1f -> %.1f, material changes %.1f -> %.1f per frame\n", (double)totalPipelineBinds / std::max(options.m_frames, 1u),
+      (double)totalPipelineChanges / std::max(options.m_frames, 1u), (double)totalSortedPipelineChanges / std::max(options.m_frames, 1u),
+      (double)totalMaterialChanges / std::max(options.m_frames, 1u), (double)totalSortedMaterialChanges / std::max(options.m_frames, 1u));
+  }
+  if (options.m_occlusionCull)
+  {
+    // The last frame's depth buffer is rasterized again one pixel at a time to check the SIMD path
+    RenderLab::OcclusionCuller* occlusionCuller = worldManager->getRenderTechnique()->getOcclusionCuller();
+    occlusionTimes.report("occlusion");
+    printf("  occlusion %ux%u x%u: %.1f occluders, %.1f meshes occluded per frame, %u pixel mismatches\n", occlusionCuller->getWidth(), occlusionCuller->getHeight(),
+      occlusionCuller->getSimdWidth(), (double)totalOccluders / std::max(options.m_frames, 1u), (double)totalOccluded / std::max(options.m_frames, 1u),
+      occlusionCuller->validate());
+  }
+  if (options.m_shadowLights > 0)
+  {
+    // Without caster lists every mesh would go to all six faces of every shadow map
+    printf("  shadows: %.2f maps, %.1f casters, %.1f cube faces per frame, %.1f faces without caster culling\n", (double)totalShadowViews / std::max(options.m_frames, 1u),
+      (double)totalShadowCasters / std::max(options.m_frames, 1u), (double)totalShadowFaces / std::max(options.m_frames, 1u),
+      (double)totalUnculledFaces / std::max(options.m_frames, 1u));
+  }
+  if (nullGraphics != nullptr)
+  {
+    RenderLab::NullGraphics::DrawStats drawStats;
+    nullGraphics->getDrawStats(drawStats);
+    uint64_t numFrames = std::max(drawStats.m_numFrames, (uint64_t)1);
+    printf("  per frame: %.1f draws, %.1f pipeline binds, %.1f render passes, %.1f KB uniform data, %llu draws with the wrong pipeline\n", (double)drawStats.m_numDraws / numFrames,
+      (double)drawStats.m_numPipelineBinds / numFrames, (double)drawStats.m_numRenderPasses / numFrames, (double)drawStats.m_uniformBytes / numFrames / 1024.0,
+      (unsigned long long)drawStats.m_numPipelineMismatches);
+  }
+  else
+  {
+    gBufferTimes.report("gpu gbuffer");
+    lightingTimes.report("gpu lighting");
+  }
+#ifdef RENDERLAB_VULKAN
+  if (vulkanGraphics != nullptr)
+  {
+    // Run twice to compare, the cache saved on exit is what the second run starts from
+    uint32_t numPipelines = 0;
+    unsigned long long pipelineTime = 0;
+    bool warmCache = false;
+    uint32_t cacheHits = 0;
+    uint32_t cacheMisses = 0;
+    vulkanGraphics->getPipelineStats(numPipelines, pipelineTime, warmCache, cacheHits, cacheMisses);
+    printf("  pipelines: %u created in %.3f ms, %s cache, %u hits %u misses\n", numPipelines, pipelineTime / 1000.0, warmCache ? "warm" : "cold", cacheHits, cacheMisses);
+
+    RenderLab::GraphicsVulkan::StartupTimes startupTimes;
+    vulkanGraphics->getStartupTimes(startupTimes);
+    printf("  startup: meshes %.3f ms, materials %.3f ms, pipelines %.3f ms on %u threads (%.3f ms of creation)\n",
+      startupTimes.m_meshMicro / 1000.0, startupTimes.m_materialMicro / 1000.0, startupTimes.m_pipelineCompileMicro / 1000.0,
+      startupTimes.m_compileThreads, startupTimes.m_pipelineCreateMicro / 1000.0);
+
+    RenderLab::VulkanAllocator::Stats memoryStats;
+    vulkanGraphics->getMemoryStats(memoryStats);
+    printf("  gpu memory: %u allocations in %u blocks + %u dedicated, %.1f MB reserved, %.1f MB used, %.1f MB wasted, %.1f MB free, %.1f MB fragmented\n",
+      memoryStats.m_numAllocations, memoryStats.m_numBlocks, memoryStats.m_numDedicated, memoryStats.m_reservedBytes / 1048576.0, memoryStats.m_usedBytes / 1048576.0,
+      memoryStats.m_wastedBytes / 1048576.0, memoryStats.m_freeBytes / 1048576.0, memoryStats.m_fragmentedBytes / 1048576.0);
+  }
+#endif
+
+  if (options.m_readbackFile != nullptr)
+  {
+    vector<uint8_t> pixels;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    if (!graphics->readBackBuffer(screenView, pixels, width, height) || !writeImage(options.m_readbackFile, pixels, width, height))
+    {
+      printf("  failed to write %s\n", options.m_readbackFile);
+    }
+  }
+
+#ifdef RENDERLAB_VULKAN
+  if (vulkanGraphics != nullptr && !vulkanGraphics->savePipelineCache())
+  {
+    printf("  failed to save the pipeline cache\n");
+  }
+#endif
+
+  delete worldManager;
+  return 0;
+}
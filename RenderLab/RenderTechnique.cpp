@@ -3,22 +3,49 @@
 
 namespace RenderLab
 {
-  RenderTechnique::RenderTechnique(string name, WorldManager* worldManager, HINSTANCE hinstance, HWND window, shared_ptr<Graphics> graphics):
+  // Far plane of the cube map projections the point light shadows render with
+  static const float SHADOW_CUBE_FAR_CLIP = 1000.0f;
+
+  RenderTechnique::RenderTechnique(string name, WorldManager* worldManager, shared_ptr<Graphics> graphics):
     m_name(name),
     m_worldManager(worldManager),
-    m_hinstance(hinstance),
-    m_window(window),
     m_graphics(graphics),
     m_currentLight(0),
     m_depthPrepass(false),
     m_clusterData(nullptr),
-    m_freezeClusterEntity(false)
+    m_freezeClusterEntity(false),
+    m_clusterBinner(nullptr),
+    m_clusterLightRadius(25.0f),
+    m_lightAssignment(SEPARABLE),
+    m_clusteredShading(true),
+    m_maxClusterShaderLights(0),
+    m_clusterShaderOverflow(false),
+    m_clusterTileWidth(64),
+    m_clusterTileHeight(64),
+    m_numClusterSlices(16),
+    m_clusterSlicing(EXPONENTIAL_SLICES),
+    m_frustumCuller(new FrustumCuller()),
+    m_frustumCulling(true),
+    m_cullingMethod(HIERARCHY_CULLING),
+    m_cullingHierarchy(new BoundingVolumeHierarchy()),
+    m_occlusionCuller(new OcclusionCuller(256, 128)),
+    m_occlusionCulling(false),
+    m_maxOccluders(64),
+    m_minOccluderSize(0.15f),
+    m_drawSorting(true),
+    m_drawSortStats(),
+    m_cullStats()
   {
   }
 
 
   RenderTechnique::~RenderTechnique()
   {
+    destroyClusterGrid();
+    delete m_clusterBinner;
+    delete m_frustumCuller;
+    delete m_cullingHierarchy;
+    delete m_occlusionCuller;
   }
 
   void RenderTechnique::addRenderComponent(shared_ptr<RenderComponent> renderComponent, shared_ptr<Entity> entity)
@@ -88,7 +115,7 @@ namespace RenderLab
   void RenderTechnique::addView(shared_ptr<View> view)
   {
     m_views.push_back(view);
-    if (view->getType() == View::SCREEN)
+    if (view->getType() == View::SCREEN || view->getType() == View::OFFSCREEN)
     {
       m_onscreenView = view;
       m_graphics->setOnscreenView(view);
@@ -123,12 +150,12 @@ namespace RenderLab
     vec2 viewportSize;
     view->getViewportSize(viewportSize);
 
-    // Determine the number of X and Y tiles
-    uint32_t segmentWidth = 64;
-    uint32_t segmentHeight = 64;
+    // Determine the number of X and Y tiles. Z counts slice boundaries, one more than slices.
+    uint32_t segmentWidth = m_clusterTileWidth;
+    uint32_t segmentHeight = m_clusterTileHeight;
     uint32_t numXSegments = (uint32_t)viewportSize.x / segmentWidth;
     uint32_t numYSegments = (uint32_t)viewportSize.y / segmentHeight;
-    uint32_t numZSegments = 10;
+    uint32_t numZSegments = m_numClusterSlices + 1;
 
     if ((uint32_t)viewportSize.x % segmentWidth != 0)
     {
@@ -143,80 +170,29 @@ namespace RenderLab
 
     shared_ptr<Mesh> mesh = make_shared<Mesh>("Frustum Lines", Mesh::LINES, numVerts, 2);
 
-    float* vertexBuffer = (float*)malloc(numVerts * 3 * sizeof(float));
     float* normalBuffer = (float*)malloc(numVerts * 3 * sizeof(float));
 
     uint32_t* indexBuffer = (uint32_t*)malloc(numClusters * 12 * 2 * sizeof(uint32_t));
 
-    m_clusterData = (ClusterData*)malloc(sizeof(ClusterData));
-    m_clusterData->m_clusters = (Cluster*)malloc(numClusters*sizeof(Cluster));
-    m_clusterData->m_numClusterVerts = numVerts;
-    m_clusterData->m_localVerts = vertexBuffer;
-	  m_clusterData->m_numXSegments = numXSegments;
-	  m_clusterData->m_numYSegments = numYSegments;
-	  m_clusterData->m_numZSegments = numZSegments;
-    m_clusterData->m_clusterVerts = (vec3*)malloc(numVerts*sizeof(vec3));
+    createClusterGrid(numXSegments, numYSegments, numZSegments);
+    m_clusterBinner = new ClusterBinner(numClusters);
+    m_rowLightIndices.resize((numZSegments - 1) * numYSegments);
+    rebuildClusterGrid(view);
 
-    // Get the eye and direction in world space
     mat4 viewTransform;
     view->getViewTransform(viewTransform);
     mat4 invViewTransform = glm::inverse(viewTransform);
 
-    vec3 worldDirectionX = vec3(1.0f, 0.0f, 0.0f);
-    vec3 worldDirectionY = vec3(0.0f, 1.0f, 0.0f);
-    vec3 worldDirectionZ = vec3(0.0f, 0.0f, 1.0f);
-    vec3 worldEye = vec3();
-
-    //vec3 worldDirectionX = vec3(invViewTransform[0]);
-    //vec3 worldDirectionY = vec3(invViewTransform[1]);
-    //vec3 worldDirectionZ = vec3(invViewTransform[2]);
-    //vec3 worldEye = vec3(invViewTransform[3]);
-
-    float hFov = view->getFieldOfView();
-    float nearClip = view->getNearClip();
-    float farClip = view->getFarClip();
-
-    vec3 nearZ = worldEye + -worldDirectionZ * nearClip;
-    vec3 farZ = worldEye + -worldDirectionZ * farClip;
-
-    float zInc = (farClip - nearClip) / numZSegments;
-    
-    uint32_t vindex = 0;
-    uint32_t nindex = 0;
-
-    vec3 currentZ = nearZ;
-    float currentZD = nearClip;
-
-    for (uint32_t k = 0; k < numZSegments; k++)
+    for (uint32_t i = 0; i < numVerts; i++)
     {
-      float farD = tan(hFov*0.5f * (float)M_PI / 180.0f) * currentZD;
-      float currentYD = farD;
-      float xInc = farD * 2.0f / numXSegments;
-      float yInc = -farD * 2.0f / numYSegments;
-
-      for (uint32_t j = 0; j < numYSegments + 1; j++)
-      {
-        float currentXD = -farD;
-        for (uint32_t i = 0; i < numXSegments + 1; i++)
-        {
-          vec3 currentPoint = currentZ + worldDirectionX * currentXD + worldDirectionY * currentYD;
-          vertexBuffer[vindex++] = currentPoint.x;
-          vertexBuffer[vindex++] = currentPoint.y;
-          vertexBuffer[vindex++] = currentPoint.z;
-          normalBuffer[nindex++] = 0.0f;
-          normalBuffer[nindex++] = 0.0f;
-          normalBuffer[nindex++] = 1.0f;
-          currentXD += xInc;
-        }
-        currentYD += yInc;
-      }
-      currentZD += zInc;
-      currentZ = worldEye + -worldDirectionZ * currentZD;
+      normalBuffer[i * 3] = 0.0f;
+      normalBuffer[i * 3 + 1] = 0.0f;
+      normalBuffer[i * 3 + 2] = 1.0f;
     }
 
     uint32_t iindex = 0;
+    uint32_t vindex = 0;
     uint32_t bvindex = 0;
-    uint32_t clusterIndex = 0;
     for (uint32_t k = 0; k < numZSegments-1; k++)
     {
       vindex = k * (numYSegments + 1) * (numXSegments + 1);
@@ -252,42 +228,15 @@ namespace RenderLab
           indexBuffer[iindex++] = bvindex + numXSegments + 1;
           indexBuffer[iindex++] = bvindex;
 
-          m_clusterData->m_clusters[clusterIndex].m_verts[0] = vindex;
-          m_clusterData->m_clusters[clusterIndex].m_verts[1] = vindex + 1;
-          m_clusterData->m_clusters[clusterIndex].m_verts[2] = vindex + 1 + numXSegments + 1;
-          m_clusterData->m_clusters[clusterIndex].m_verts[3] = vindex + numXSegments + 1;
-          m_clusterData->m_clusters[clusterIndex].m_verts[4] = bvindex;
-          m_clusterData->m_clusters[clusterIndex].m_verts[5] = bvindex + 1;
-          m_clusterData->m_clusters[clusterIndex].m_verts[6] = bvindex + 1 + numXSegments + 1;
-          m_clusterData->m_clusters[clusterIndex].m_verts[7] = bvindex + numXSegments + 1;
-
-          vec3 p[8];
-          for (int i = 0; i < 8; i++)
-          {
-            uint32_t vertexIndex = m_clusterData->m_clusters[clusterIndex].m_verts[i] * 3;
-            p[i].x = m_clusterData->m_localVerts[vertexIndex];
-            p[i].y = m_clusterData->m_localVerts[vertexIndex +1];
-            p[i].z = m_clusterData->m_localVerts[vertexIndex +2];
-          }
-
-          m_clusterData->m_clusters[clusterIndex].m_planes[0] = planeEquation(p[0], p[3], p[2]);
-          m_clusterData->m_clusters[clusterIndex].m_planes[1] = planeEquation(p[1], p[2], p[6]);
-          m_clusterData->m_clusters[clusterIndex].m_planes[2] = planeEquation(p[5], p[6], p[7]);
-          m_clusterData->m_clusters[clusterIndex].m_planes[3] = planeEquation(p[4], p[7], p[3]);
-          m_clusterData->m_clusters[clusterIndex].m_planes[4] = planeEquation(p[1], p[5], p[4]);
-          m_clusterData->m_clusters[clusterIndex].m_planes[5] = planeEquation(p[3], p[7], p[6]);
-
-          m_clusterData->m_clusters[clusterIndex].m_lights = new vector<shared_ptr<LightComponent>>;
           vindex++;
           bvindex++;
-          clusterIndex++;
         }
         vindex++;
         bvindex++;
       }
     }
 
-    mesh->addVertexBuffer(0, 3, numVerts * 3 * sizeof(float), vertexBuffer);
+    mesh->addVertexBuffer(0, 3, numVerts * 3 * sizeof(float), m_clusterData->m_localVerts);
     mesh->addVertexBuffer(1, 3, numVerts * 3 * sizeof(float), normalBuffer);
     mesh->addIndexBuffer(numClusters * 12 * 2, indexBuffer);
 
@@ -304,6 +253,181 @@ namespace RenderLab
     addRenderComponent(renderComponent, m_clusterEntity);
   }
 
+  void RenderTechnique::createClusterGrid(uint32_t numXSegments, uint32_t numYSegments, uint32_t numZSegments)
+  {
+    uint32_t numVerts = (numXSegments + 1) * (numYSegments + 1) * numZSegments;
+    uint32_t numClusters = numXSegments * numYSegments * (numZSegments - 1);
+
+    m_clusterData = (ClusterData*)malloc(sizeof(ClusterData));
+    m_clusterData->m_clusters = (Cluster*)malloc(numClusters*sizeof(Cluster));
+    m_clusterData->m_lightGrid = (ClusterLightGrid*)malloc(numClusters*sizeof(ClusterLightGrid));
+    m_clusterData->m_numClusterVerts = numVerts;
+    m_clusterData->m_localVerts = (float*)malloc(numVerts * 3 * sizeof(float));
+    m_clusterData->m_numXSegments = numXSegments;
+    m_clusterData->m_numYSegments = numYSegments;
+    m_clusterData->m_numZSegments = numZSegments;
+    m_clusterData->m_xPlanes = (vec4*)malloc((numXSegments + 1) * sizeof(vec4));
+    m_clusterData->m_yPlanes = (vec4*)malloc((numYSegments + 1) * sizeof(vec4));
+    m_clusterData->m_zPlanes = (vec4*)malloc(numZSegments * sizeof(vec4));
+    m_clusterData->m_fieldOfView = 0.0f;
+    m_clusterData->m_nearClip = 0.0f;
+    m_clusterData->m_farClip = 0.0f;
+
+    uint32_t vindex = 0;
+    uint32_t bvindex = 0;
+    uint32_t clusterIndex = 0;
+    for (uint32_t k = 0; k < numZSegments - 1; k++)
+    {
+      vindex = k * (numYSegments + 1) * (numXSegments + 1);
+      bvindex = (k + 1) * (numYSegments + 1) * (numXSegments + 1);
+      for (uint32_t j = 0; j < numYSegments; j++)
+      {
+        for (uint32_t i = 0; i < numXSegments; i++)
+        {
+          m_clusterData->m_clusters[clusterIndex].m_verts[0] = vindex;
+          m_clusterData->m_clusters[clusterIndex].m_verts[1] = vindex + 1;
+          m_clusterData->m_clusters[clusterIndex].m_verts[2] = vindex + 1 + numXSegments + 1;
+          m_clusterData->m_clusters[clusterIndex].m_verts[3] = vindex + numXSegments + 1;
+          m_clusterData->m_clusters[clusterIndex].m_verts[4] = bvindex;
+          m_clusterData->m_clusters[clusterIndex].m_verts[5] = bvindex + 1;
+          m_clusterData->m_clusters[clusterIndex].m_verts[6] = bvindex + 1 + numXSegments + 1;
+          m_clusterData->m_clusters[clusterIndex].m_verts[7] = bvindex + numXSegments + 1;
+
+          m_clusterData->m_lightGrid[clusterIndex].m_offset = 0;
+          m_clusterData->m_lightGrid[clusterIndex].m_count = 0;
+          vindex++;
+          bvindex++;
+          clusterIndex++;
+        }
+        vindex++;
+        bvindex++;
+      }
+    }
+  }
+
+  void RenderTechnique::updateClusterGrid(float fieldOfView, float nearClip, float farClip)
+  {
+    uint32_t numXSegments = m_clusterData->m_numXSegments;
+    uint32_t numYSegments = m_clusterData->m_numYSegments;
+    uint32_t numZSegments = m_clusterData->m_numZSegments;
+    uint32_t numClusters = numXSegments * numYSegments * (numZSegments - 1);
+    float* vertexBuffer = m_clusterData->m_localVerts;
+    float tanHalfFov = tan(fieldOfView*0.5f * (float)M_PI / 180.0f);
+
+    // The grid lives in view space, looking down -z
+    uint32_t vindex = 0;
+    for (uint32_t k = 0; k < numZSegments; k++)
+    {
+      float currentZD = getSliceDepth(k, nearClip, farClip);
+      float farD = tanHalfFov * currentZD;
+      float currentYD = farD;
+      float xInc = farD * 2.0f / numXSegments;
+      float yInc = -farD * 2.0f / numYSegments;
+
+      for (uint32_t j = 0; j < numYSegments + 1; j++)
+      {
+        float currentXD = -farD;
+        for (uint32_t i = 0; i < numXSegments + 1; i++)
+        {
+          vertexBuffer[vindex++] = currentXD;
+          vertexBuffer[vindex++] = currentYD;
+          vertexBuffer[vindex++] = -currentZD;
+          currentXD += xInc;
+        }
+        currentYD += yInc;
+      }
+    }
+
+    // Slice boundary planes, each facing toward the next slice
+    m_clusterData->m_tanHalfFov = tanHalfFov;
+
+    // Maps view depth (or its log) straight to a slice index for the shader
+    if (m_clusterSlicing == EXPONENTIAL_SLICES)
+    {
+      m_clusterData->m_sliceScale = m_numClusterSlices / log(farClip / nearClip);
+      m_clusterData->m_sliceBias = -m_clusterData->m_sliceScale * log(nearClip);
+    }
+    else
+    {
+      m_clusterData->m_sliceScale = m_numClusterSlices / (farClip - nearClip);
+      m_clusterData->m_sliceBias = -m_clusterData->m_sliceScale * nearClip;
+    }
+
+    for (uint32_t i = 0; i < numXSegments + 1; i++)
+    {
+      float t = -tanHalfFov + i * tanHalfFov * 2.0f / numXSegments;
+      m_clusterData->m_xPlanes[i] = vec4(1.0f, 0.0f, t, 0.0f) * (1.0f / sqrt(1.0f + t * t));
+    }
+    for (uint32_t j = 0; j < numYSegments + 1; j++)
+    {
+      float t = tanHalfFov - j * tanHalfFov * 2.0f / numYSegments;
+      m_clusterData->m_yPlanes[j] = vec4(0.0f, -1.0f, -t, 0.0f) * (1.0f / sqrt(1.0f + t * t));
+    }
+    for (uint32_t k = 0; k < numZSegments; k++)
+    {
+      m_clusterData->m_zPlanes[k] = vec4(0.0f, 0.0f, -1.0f, -getSliceDepth(k, nearClip, farClip));
+    }
+
+    for (uint32_t clusterIndex = 0; clusterIndex < numClusters; clusterIndex++)
+    {
+      Cluster& cluster = m_clusterData->m_clusters[clusterIndex];
+      vec3 p[8];
+      for (int i = 0; i < 8; i++)
+      {
+        uint32_t vertexIndex = cluster.m_verts[i] * 3;
+        p[i].x = vertexBuffer[vertexIndex];
+        p[i].y = vertexBuffer[vertexIndex + 1];
+        p[i].z = vertexBuffer[vertexIndex + 2];
+      }
+
+      cluster.m_planes[0] = planeEquation(p[0], p[3], p[2]);
+      cluster.m_planes[1] = planeEquation(p[1], p[2], p[6]);
+      cluster.m_planes[2] = planeEquation(p[5], p[6], p[7]);
+      cluster.m_planes[3] = planeEquation(p[4], p[7], p[3]);
+      cluster.m_planes[4] = planeEquation(p[1], p[5], p[4]);
+      cluster.m_planes[5] = planeEquation(p[3], p[7], p[6]);
+    }
+
+    m_clusterData->m_fieldOfView = fieldOfView;
+    m_clusterData->m_nearClip = nearClip;
+    m_clusterData->m_farClip = farClip;
+  }
+
+  void RenderTechnique::rebuildClusterGrid(shared_ptr<View> view)
+  {
+    updateClusterGrid(view->getFieldOfView(), view->getNearClip(), view->getFarClip());
+
+    uint32_t numClusters = m_clusterData->m_numXSegments * m_clusterData->m_numYSegments * (m_clusterData->m_numZSegments - 1);
+    for (uint32_t clusterIndex = 0; clusterIndex < numClusters; clusterIndex++)
+    {
+      m_clusterBinner->setClusterPlanes(clusterIndex, m_clusterData->m_clusters[clusterIndex].m_planes);
+    }
+  }
+
+  bool RenderTechnique::clusterGridChanged(shared_ptr<View> view)
+  {
+    return view->getFieldOfView() != m_clusterData->m_fieldOfView ||
+           view->getNearClip() != m_clusterData->m_nearClip ||
+           view->getFarClip() != m_clusterData->m_farClip;
+  }
+
+  void RenderTechnique::destroyClusterGrid()
+  {
+    if (m_clusterData == nullptr)
+    {
+      return;
+    }
+
+    free(m_clusterData->m_clusters);
+    free(m_clusterData->m_lightGrid);
+    free(m_clusterData->m_localVerts);
+    free(m_clusterData->m_xPlanes);
+    free(m_clusterData->m_yPlanes);
+    free(m_clusterData->m_zPlanes);
+    free(m_clusterData);
+    m_clusterData = nullptr;
+  }
+
   void RenderTechnique::setClusterEntityFreeze(bool freeze)
   {
     m_freezeClusterEntity = freeze;
@@ -320,7 +444,7 @@ namespace RenderLab
     for (size_t i = 0; i < m_views.size(); ++i)
     {
       m_graphics->build(m_views[i], numFrames);
-      if (m_views[i]->getType() == View::SCREEN)
+      if (m_views[i]->getType() == View::SCREEN || m_views[i]->getType() == View::OFFSCREEN)
       {
         buildFrustumLines(m_views[i]);
       }
@@ -362,6 +486,8 @@ namespace RenderLab
       m_objectDataUniformBuffers.push_back(uniformBuffer);
     }   
 
+    // Materials are numbered in the order they are met for the draw sort keys
+    map<Material*, uint32_t> materialIds;
     m_meshOffsets = new uint32_t[m_numMeshes];
     for (size_t i = 0; i < m_renderComponents.size(); i++)
     {
@@ -370,10 +496,47 @@ namespace RenderLab
       {
         m_meshOffsets[currentMeshIndex] = (uint32_t)currentOffset;
         currentOffset += m_objectDataAlignedSize;
+        m_meshes.push_back(m_renderComponents[i]->getMesh(j));
+        m_meshComponents.push_back((uint32_t)i);
+
+        Material* material = m_renderComponents[i]->getMesh(j)->getMaterial().get();
+        map<Material*, uint32_t>::iterator materialId = materialIds.find(material);
+        if (materialId == materialIds.end())
+        {
+          materialId = materialIds.insert(std::make_pair(material, (uint32_t)materialIds.size())).first;
+        }
+        m_meshMaterialIds.push_back(materialId->second);
+      }
+    }
+
+    // Storage for the clustered shading pass, sized for the lights known at build time
+    if (m_clusterData != nullptr)
+    {
+      uint32_t numClusters = m_clusterData->m_numXSegments * m_clusterData->m_numYSegments * (m_clusterData->m_numZSegments - 1);
+      m_maxClusterShaderLights = (uint32_t)m_lightComponents.size();
+      size_t gridSize = sizeof(ClusterShaderParamBlock) + numClusters * sizeof(ClusterLightGrid);
+      size_t lightIndexSize = std::max((size_t)numClusters * m_maxClusterShaderLights, (size_t)1) * sizeof(uint32_t);
+      size_t lightSize = std::max((size_t)m_maxClusterShaderLights, (size_t)1) * sizeof(ClusterLightShaderData);
+      for (size_t i = 0; i < numFrames; i++)
+      {
+        uniformBuffer = make_shared<UniformBuffer>("Cluster Grid UniformBuffer " + std::to_string(i), gridSize);
+        m_graphics->build(uniformBuffer);
+        m_clusterGridUniformBuffers.push_back(uniformBuffer);
+
+        uniformBuffer = make_shared<UniformBuffer>("Cluster Light Index UniformBuffer " + std::to_string(i), lightIndexSize);
+        m_graphics->build(uniformBuffer);
+        m_clusterLightIndexUniformBuffers.push_back(uniformBuffer);
+
+        uniformBuffer = make_shared<UniformBuffer>("Cluster Light UniformBuffer " + std::to_string(i), lightSize);
+        m_graphics->build(uniformBuffer);
+        m_clusterLightUniformBuffers.push_back(uniformBuffer);
       }
     }
 
     createCompositeMeshes();
+
+    // Meshes only asked for their pipelines, compile them all at once
+    m_graphics->compilePipelines();
   }
 
   void RenderTechnique::createCompositeMeshes()
@@ -426,6 +589,21 @@ namespace RenderLab
     m_graphics->build(mesh, m_frameDataUniformBuffers, m_objectDataUniformBuffers, 2, m_lightComponents);
 
     m_onscreenView->addCompositeMesh(mesh);
+
+    // A single triangle covering the screen for the clustered pass
+    shared_ptr<Mesh> clusteredMesh = make_shared<Mesh>("Clustered Composite Mesh", Mesh::TRIANGLES, 3, 1);
+    shared_ptr<Material> clusteredMaterial = make_shared<Material>("Clustered Composite Material", Material::DEFERRED_CLUSTERED);
+    clusteredMesh->setMaterial(clusteredMaterial);
+
+    float triangleVerts[9] = { -1.0f, -1.0f, 0.0f, 3.0f, -1.0f, 0.0f, -1.0f, 3.0f, 0.0f };
+    clusteredMesh->addVertexBuffer(0, 3, sizeof(float) * 9, triangleVerts);
+
+    unsigned int triangleIndices[3] = { 0, 1, 2 };
+    clusteredMesh->addIndexBuffer(3, triangleIndices);
+
+    m_graphics->build(clusteredMesh, m_frameDataUniformBuffers, m_objectDataUniformBuffers, 2, m_lightComponents);
+
+    m_onscreenView->addCompositeMesh(clusteredMesh);
   }
 
   void RenderTechnique::render()
@@ -434,6 +612,8 @@ namespace RenderLab
     shared_ptr<View> lastView = m_onscreenView;
 
     //updateFrameData(frameIndex);
+    cullMeshes();
+    m_drawSortStats = DrawSortStats();
     updateClusterData(m_onscreenView, frameIndex);
     updateMeshData(m_onscreenView, frameIndex);
     bool lastLight = false;
@@ -454,7 +634,7 @@ namespace RenderLab
         //updateMeshData(view, frameIndex);
         m_graphics->acquireBackBuffer(view);
         m_graphics->renderBegin(view, lastView, m_frameDataUniformBuffers[frameIndex], m_objectDataUniformBuffers[frameIndex], frameIndex);
-        renderMeshes(view, frameIndex, true, false);
+        renderShadowCasters(i, view, frameIndex);
         m_graphics->renderEnd(view, lastView, lastLight, m_frameDataUniformBuffers[frameIndex], m_objectDataUniformBuffers[frameIndex], frameIndex);
         m_graphics->swapBackBuffer(view, frameIndex);
         lastView = view;
@@ -468,169 +648,1160 @@ namespace RenderLab
     m_graphics->renderBegin(m_onscreenView, lastView, m_frameDataUniformBuffers[frameIndex], m_objectDataUniformBuffers[frameIndex], frameIndex);
     if (m_depthPrepass)
     { 
-      renderMeshes(m_onscreenView, frameIndex, false, true);
+      renderMeshes(m_onscreenView, frameIndex, true);
       m_graphics->endDepthPrepass(lastView, frameIndex);
     }
-    renderMeshes(m_onscreenView, frameIndex, false, false);
+    renderMeshes(m_onscreenView, frameIndex, false);
     m_graphics->renderEnd(m_onscreenView, lastView, false, m_frameDataUniformBuffers[frameIndex], m_objectDataUniformBuffers[frameIndex], frameIndex);
 
     // Swap the buffers
     m_graphics->swapBackBuffer(m_onscreenView, frameIndex);
   }
 
-  void RenderTechnique::updateCurrentLight(uint32_t frameIndex, int lightIndex)
-  {
-    uint32_t offset = 0;
-    uint32_t size = 0;
-    float* data = nullptr;
-
-    ivec4 lightInfo;
-    lightInfo.x = lightIndex;
-    lightInfo.y = (int)m_lightComponents.size();
-    data = (float*)glm::value_ptr(lightInfo);
-    size = sizeof(lightInfo);
-    m_graphics->updateUniformData(m_frameDataUniformBuffers[frameIndex], offset, data, size);
-  }
-
-  void RenderTechnique::updateClusterData(shared_ptr<View> view, uint32_t frameIndex)
+  void RenderTechnique::cullMeshes()
   {
-    mat4 viewTransform;
-    mat4 invViewTransform;
-
-    view->getViewTransform(viewTransform);
-    invViewTransform = glm::inverse(viewTransform);
+    CpuTimer timer;
+    timer.start();
 
-    uint32_t vindex = 0;
-    for (uint32_t i = 0; i < m_clusterData->m_numClusterVerts; i++)
+    // The world bounds follow the composite transforms left by this frame's
+    // processors. The hierarchy only hears about the ones that moved.
+    uint32_t currentMeshIndex = 0;
+    bool hierarchy = m_cullingMethod == HIERARCHY_CULLING;
+    if (hierarchy && m_cullingHierarchy->getNumBounds() != m_numMeshes)
     {
-      vec4 localPoint(0.0f, 0.0f, 0.0f, 1.0f);
-      localPoint.x = m_clusterData->m_localVerts[vindex++];
-      localPoint.y = m_clusterData->m_localVerts[vindex++];
-      localPoint.z = m_clusterData->m_localVerts[vindex++];
-      m_clusterData->m_clusterVerts[i] = vec3(invViewTransform * localPoint);
+      m_cullingHierarchy->setNumBounds((uint32_t)m_numMeshes);
     }
-
-    for (size_t i = 0; i < m_lightComponents.size(); ++i)
+    else if (!hierarchy)
+    {
+      m_frustumCuller->setNumBounds((uint32_t)m_numMeshes);
+    }
+    for (size_t i = 0; i < m_renderComponents.size(); i++)
     {
-      vec3 position;
       mat4 transform;
-      m_lightComponents[i]->getPosition(position);
-      m_lightComponents[i]->getEntity(0)->getCompositeTransform(transform);
-      vec3 lightViewPosition = vec3(transform * vec4(position, 1.0f));
-      m_lightComponents[i]->setViewPosition(lightViewPosition);
+      m_renderComponents[i]->getEntity(0)->getCompositeTransform(transform);
+      for (size_t j = 0; j < m_renderComponents[i]->numMeshes(); j++, currentMeshIndex++)
+      {
+        vec3 center;
+        vec3 extent;
+        shared_ptr<Mesh> mesh = m_renderComponents[i]->getMesh(j);
+        bool moved = mesh->updateWorldBounds(transform);
+        mesh->getWorldBounds(center, extent);
+        if (!hierarchy)
+        {
+          m_frustumCuller->setBounds(currentMeshIndex, center, extent);
+        }
+        else if (moved || !m_cullingHierarchy->isBuilt())
+        {
+          m_cullingHierarchy->setBounds(currentMeshIndex, center, extent);
+        }
+      }
+    }
+    if (hierarchy)
+    {
+      m_cullingHierarchy->refit();
     }
 
-    size_t maxLights = 0;
-    size_t minLights = 100000;
-    size_t numZero = 0;
-    size_t totalLights = 0;
+    m_cullStats = CullStats();
+    m_cullStats.m_numMeshes = (uint32_t)m_numMeshes;
 
-    uint32_t clusterIndex = 0;
-	  for (uint32_t k = 0; k < m_clusterData->m_numZSegments-1; k++)
-	  {
-		  for (uint32_t j = 0; j < m_clusterData->m_numYSegments; j++)
-		  {
-			  for (uint32_t i = 0; i < m_clusterData->m_numXSegments; i++)
-			  {
-          vec3 p1 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[0]];
-          vec3 p2 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[1]];
-          vec3 p3 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[2]];
-          vec3 p4 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[3]];
-          vec3 p5 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[4]];
-          vec3 p6 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[5]];
-          vec3 p7 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[6]];
-          vec3 p8 = m_clusterData->m_clusterVerts[m_clusterData->m_clusters[clusterIndex].m_verts[7]];
-
-          //m_clusterData->m_clusters[clusterIndex].m_planes[0].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[0], p1);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[1].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[1], p2);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[2].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[2], p6);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[3].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[3], p5);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[4].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[4], p2);
-          //m_clusterData->m_clusters[clusterIndex].m_planes[5].w = updatePlaneD(m_clusterData->m_clusters[clusterIndex].m_planes[5], p4);
-
-          m_clusterData->m_clusters[clusterIndex].m_planes[0] = planeEquation(p1, p4, p3);
-          m_clusterData->m_clusters[clusterIndex].m_planes[1] = planeEquation(p2, p3, p7);
-          m_clusterData->m_clusters[clusterIndex].m_planes[2] = planeEquation(p6, p7, p8);
-          m_clusterData->m_clusters[clusterIndex].m_planes[3] = planeEquation(p5, p8, p4);
-          m_clusterData->m_clusters[clusterIndex].m_planes[4] = planeEquation(p2, p6, p5);
-          m_clusterData->m_clusters[clusterIndex].m_planes[5] = planeEquation(p4, p8, p7);
-
-          m_clusterData->m_clusters[clusterIndex].m_lights->clear();
-          for (uint32_t l = 0; l < m_lightComponents.size(); l++)
-          {
-            vec3 lightViewPosition;
-            m_lightComponents[l]->getViewPosition(lightViewPosition);
-            if (intersectsCluster(clusterIndex, lightViewPosition, 25.0f))
-            {
-              m_clusterData->m_clusters[clusterIndex].m_lights->push_back(m_lightComponents[l]);
-              totalLights++;
-            }
-          }
+    mat4 viewTransform;
+    mat4 projectionTransform;
+    m_onscreenView->getViewTransform(viewTransform);
+    m_onscreenView->getProjectionTransform(projectionTransform);
+    vector<uint8_t>& visible = m_meshVisibility[m_onscreenView];
+    m_cullStats.m_numVisible = cullFrustum(projectionTransform * viewTransform, visible);
+    if (m_occlusionCulling)
+    {
+      m_cullStats.m_numVisible -= cullOccluded(viewTransform, projectionTransform * viewTransform, visible);
+    }
+    m_cullStats.m_numCulled = m_cullStats.m_numMeshes - m_cullStats.m_numVisible;
+    m_meshUpdates = visible;
 
-          size_t numLights = m_clusterData->m_clusters[clusterIndex].m_lights->size();
-          if (numLights == 0)
-          {
-            numZero++;
-          }
-          if (numLights > maxLights)
-          {
-            maxLights = numLights;
-          }
-          if (numLights < minLights)
-          {
-            minLights = numLights;
-          }
-          clusterIndex++;
-			  }
-		  }
-	  }
+    // Only the shadow maps rendered this frame need caster lists
+    m_shadowCasters.resize(m_lightComponents.size());
+    m_shadowFaceMasks.resize(m_lightComponents.size());
+    for (size_t i = 0; i < m_lightComponents.size(); ++i)
+    {
+      if (!m_lightComponents[i]->getCastShadow() || !m_lightComponents[i]->isDirty())
+      {
+        continue;
+      }
 
-    m_worldManager->printLog("MaxLights: " + std::to_string(maxLights) + ", totalLights: " + std::to_string(totalLights) + ", zeros: " + std::to_string(numZero));
-    if (!m_freezeClusterEntity)
+      buildShadowCasters(i);
+      vector<uint32_t>& casters = m_shadowCasters[i];
+      m_cullStats.m_numShadowViews++;
+      m_cullStats.m_numShadowCasters += (uint32_t)casters.size();
+      m_cullStats.m_numShadowCulled += m_cullStats.m_numMeshes - (uint32_t)casters.size();
+      for (size_t j = 0; j < casters.size(); j++)
+      {
+        m_meshUpdates[casters[j]] = 1;
+        for (uint8_t faceMask = m_shadowFaceMasks[i][j]; faceMask != 0; faceMask &= faceMask - 1)
+        {
+          m_cullStats.m_numShadowFaces++;
+        }
+      }
+    }
+
+    for (size_t i = 0; i < m_numMeshes; i++)
     {
-      m_clusterEntity->setTransform(invViewTransform);
-      m_clusterEntity->updateCompositeTransform(mat4());
+      m_cullStats.m_numUpdated += m_meshUpdates[i];
     }
+    m_cullStats.m_cullMicro = timer.elapsedMicro();
   }
 
-  vec4 RenderTechnique::planeEquation(vec3 p1, vec3 p2, vec3 p3)
+  uint32_t RenderTechnique::cullFrustum(const mat4& viewProjection, vector<uint8_t>& visible)
   {
-    vec4 plane;
-    vec3 v1 = glm::normalize(p3 - p2);
-    vec3 v2 = glm::normalize(p1 - p2);
-    vec3 normal = glm::normalize(glm::cross(v1, v2));
-    
-    plane.x = -normal.x;
-    plane.y = -normal.y;
-    plane.z = -normal.z;
-    plane.w = -(normal.x * p1.x + normal.y * p1.y + normal.z * p1.z);
-    return plane;
+    if (m_cullingMethod == HIERARCHY_CULLING)
+    {
+      m_cullIndices.clear();
+      m_cullingHierarchy->queryFrustum(viewProjection, m_cullIndices);
+    }
+    else
+    {
+      m_frustumCuller->setFrustum(viewProjection);
+    }
+    return applyCullResults(visible);
   }
 
-  float RenderTechnique::updatePlaneD(vec4 plane, vec3 p)
+  // The closest large meshes that survived the frustum are drawn into the CPU
+  // depth buffer, then every other visible mesh is tested against it. Returns
+  // the number of meshes it hid.
+  uint32_t RenderTechnique::cullOccluded(const mat4& viewTransform, const mat4& viewProjection, vector<uint8_t>& visible)
   {
-    return -(plane.x * p.x + plane.y * p.y + plane.z * p.z);
-  }
+    CpuTimer timer;
+    timer.start();
 
-  bool RenderTechnique::intersectsCluster(uint32_t clusterIndex, vec3 lightViewPosition, float radius)
-  {
-    bool intersects = true;
-    for (int i = 0; i < 6; i++)
+    // Size is the bounding radius over the distance, roughly how much of the
+    // screen the mesh can cover
+    m_occluderCandidates.clear();
+    for (uint32_t i = 0; i < (uint32_t)m_numMeshes; i++)
     {
-      vec4 plane = m_clusterData->m_clusters[clusterIndex].m_planes[i];
-      float denom = 1.0f / sqrt(plane.x * plane.x + plane.y*plane.y + plane.z*plane.z);
-      float d = (plane.x * lightViewPosition.x + plane.y * lightViewPosition.y + plane.z * lightViewPosition.z + plane.w) * denom;
-      if ((d + radius) < 0.0f)
+      shared_ptr<Mesh> mesh = m_meshes[i];
+      if (!visible[i] || mesh->getPrimitive() != Mesh::TRIANGLES || mesh->getIndexBuffer() == nullptr || mesh->getVertexBufferSize(0) != 3)
       {
-        return false;
+        continue;
       }
-    }
-
-    return intersects;
-  }
 
-  void RenderTechnique::updateFrameData(uint32_t frameIndex)
-  {
+      vec3 worldCenter;
+      vec3 worldExtent;
+      mesh->getWorldBounds(worldCenter, worldExtent);
+      if (worldExtent.x >= Mesh::UNBOUNDED_EXTENT)
+      {
+        continue;
+      }
+      float distance = glm::length(vec3(viewTransform * vec4(worldCenter, 1.0f)));
+      float worldRadius = glm::length(worldExtent);
+      float size = distance > worldRadius ? worldRadius / distance : FLT_MAX;
+      if (size >= m_minOccluderSize)
+      {
+        m_occluderCandidates.push_back(std::make_pair(size, i));
+      }
+    }
+    if (m_occluderCandidates.size() > m_maxOccluders)
+    {
+      std::partial_sort(m_occluderCandidates.begin(), m_occluderCandidates.begin() + m_maxOccluders, m_occluderCandidates.end(),
+        [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) { return a.first > b.first; });
+      m_occluderCandidates.resize(m_maxOccluders);
+    }
+
+    m_occluderFlags.assign(m_numMeshes, 0);
+    m_occlusionCuller->begin(viewProjection);
+    for (size_t i = 0; i < m_occluderCandidates.size(); i++)
+    {
+      uint32_t meshIndex = m_occluderCandidates[i].second;
+      shared_ptr<Mesh> mesh = m_meshes[meshIndex];
+      mat4 transform;
+      m_renderComponents[m_meshComponents[meshIndex]]->getEntity(0)->getCompositeTransform(transform);
+      m_occlusionCuller->addOccluder(mesh->getVertexBufferData(0), (uint32_t)mesh->getNumVerts(), mesh->getIndexBuffer(), (uint32_t)mesh->getIndexBufferSize(), transform);
+      m_occluderFlags[meshIndex] = 1;
+    }
+    m_occlusionCuller->rasterize();
+
+    // An occluder can't hide itself, so only the rest are tested
+    uint32_t numOccluded = 0;
+    if (!m_occluderCandidates.empty())
+    {
+      vector<uint32_t> threadOccluded(m_jobSystem != nullptr ? m_jobSystem->getNumThreads() : 1, 0);
+      auto testMeshes = [&](uint32_t begin, uint32_t end)
+      {
+        uint32_t occluded = 0;
+        for (uint32_t i = begin; i < end; i++)
+        {
+          if (!visible[i] || m_occluderFlags[i])
+          {
+            continue;
+          }
+          vec3 center;
+          vec3 extent;
+          m_meshes[i]->getWorldBounds(center, extent);
+          if (extent.x < Mesh::UNBOUNDED_EXTENT && !m_occlusionCuller->isVisible(center, extent))
+          {
+            visible[i] = 0;
+            occluded++;
+          }
+        }
+        threadOccluded[m_jobSystem != nullptr ? JobSystem::getThreadIndex() : 0] += occluded;
+      };
+      if (m_jobSystem != nullptr)
+      {
+        m_jobSystem->parallelFor((uint32_t)m_numMeshes, 64, testMeshes);
+      }
+      else
+      {
+        testMeshes(0, (uint32_t)m_numMeshes);
+      }
+      for (size_t i = 0; i < threadOccluded.size(); i++)
+      {
+        numOccluded += threadOccluded[i];
+      }
+    }
+
+    m_cullStats.m_numOccluders = (uint32_t)m_occluderCandidates.size();
+    m_cullStats.m_numOccluded = numOccluded;
+    m_cullStats.m_occlusionMicro = timer.elapsedMicro();
+    return numOccluded;
+  }
+
+  void RenderTechnique::buildShadowCasters(size_t lightIndex)
+  {
+    vector<uint32_t>& casters = m_shadowCasters[lightIndex];
+    vector<uint8_t>& faceMasks = m_shadowFaceMasks[lightIndex];
+    casters.clear();
+    faceMasks.clear();
+
+    // Directional shadows have no volume to cull against
+    shared_ptr<LightComponent> light = m_lightComponents[lightIndex];
+    bool cubeShadow = light->getShadowView()->getType() == View::SHADOW_CUBE;
+    vec3 position;
+    mat4 transform;
+    light->getPosition(position);
+    light->getEntity(0)->getCompositeTransform(transform);
+    vec3 lightPosition = vec3(transform * vec4(position, 1.0f));
+
+    // Clustered shading cuts every light off at the cluster light radius, so
+    // nothing further out can shadow what it lights. Light volumes light the
+    // whole cube, which the sphere through its corners covers.
+    float radius = m_clusteredShading ? m_clusterLightRadius : SHADOW_CUBE_FAR_CLIP * 1.7320508f;
+    float radiusSquared = radius * radius;
+
+    m_cullIndices.clear();
+    if (m_frustumCulling && cubeShadow && m_cullingMethod == HIERARCHY_CULLING)
+    {
+      m_cullingHierarchy->querySphere(lightPosition, radius, m_cullIndices);
+      std::sort(m_cullIndices.begin(), m_cullIndices.end());
+    }
+    else
+    {
+      for (uint32_t i = 0; i < (uint32_t)m_numMeshes; i++)
+      {
+        vec3 center;
+        vec3 extent;
+        m_meshes[i]->getWorldBounds(center, extent);
+        vec3 offset = glm::max(glm::abs(center - lightPosition) - extent, vec3(0.0f));
+        if (!m_frustumCulling || !cubeShadow || glm::dot(offset, offset) <= radiusSquared)
+        {
+          m_cullIndices.push_back(i);
+        }
+      }
+    }
+
+    for (size_t i = 0; i < m_cullIndices.size(); i++)
+    {
+      uint32_t meshIndex = m_cullIndices[i];
+      shared_ptr<RenderComponent> renderComponent = m_renderComponents[m_meshComponents[meshIndex]];
+      if (!renderComponent->IsVisible() || !renderComponent->getEntity(0)->getCastShadow())
+      {
+        continue;
+      }
+
+      vec3 center;
+      vec3 extent;
+      m_meshes[meshIndex]->getWorldBounds(center, extent);
+      casters.push_back(meshIndex);
+      faceMasks.push_back(cubeShadow && m_frustumCulling ? getCubeFaceMask(center - lightPosition, extent) : 0x3f);
+    }
+  }
+
+  // Faces follow the order of light_view_projections, +X, -X, +Y, -Y, +Z, -Z. A
+  // face sees the points whose offset from the light is largest along its axis,
+  // so a box reaches it when it crosses all four planes through the light at 45
+  // degrees to that axis.
+  uint8_t RenderTechnique::getCubeFaceMask(const vec3& offset, const vec3& extent)
+  {
+    uint8_t faceMask = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      int b = (axis + 1) % 3;
+      int c = (axis + 2) % 3;
+      for (int side = 0; side < 2; side++)
+      {
+        float major = (side == 0 ? offset[axis] : -offset[axis]) + extent[axis];
+        if (major + extent[b] >= fabsf(offset[b]) && major + extent[c] >= fabsf(offset[c]))
+        {
+          faceMask |= (uint8_t)(1 << (axis * 2 + side));
+        }
+      }
+    }
+    return faceMask;
+  }
+
+  uint32_t RenderTechnique::applyCullResults(vector<uint8_t>& visible)
+  {
+    visible.resize(m_numMeshes);
+    if (!m_frustumCulling)
+    {
+      std::fill(visible.begin(), visible.end(), (uint8_t)1);
+    }
+    else if (m_cullingMethod == HIERARCHY_CULLING)
+    {
+      std::fill(visible.begin(), visible.end(), (uint8_t)0);
+      for (size_t i = 0; i < m_cullIndices.size(); i++)
+      {
+        visible[m_cullIndices[i]] = 1;
+      }
+    }
+    else
+    {
+      m_frustumCuller->cull(visible.data());
+    }
+
+    // Hidden components are dropped whether or not culling is on
+    uint32_t numVisible = 0;
+    uint32_t currentMeshIndex = 0;
+    for (size_t i = 0; i < m_renderComponents.size(); i++)
+    {
+      bool componentVisible = m_renderComponents[i]->IsVisible();
+      for (size_t j = 0; j < m_renderComponents[i]->numMeshes(); j++, currentMeshIndex++)
+      {
+        if (!componentVisible)
+        {
+          visible[currentMeshIndex] = 0;
+        }
+        numVisible += visible[currentMeshIndex];
+      }
+    }
+    return numVisible;
+  }
+
+  void RenderTechnique::setFrustumCulling(bool frustumCulling)
+  {
+    m_frustumCulling = frustumCulling;
+  }
+
+  bool RenderTechnique::getFrustumCulling()
+  {
+    return m_frustumCulling;
+  }
+
+  void RenderTechnique::setCullingMethod(CullingMethod cullingMethod)
+  {
+    // The hierarchy misses the moves made while it was unused, so it starts over
+    if (cullingMethod != m_cullingMethod)
+    {
+      m_cullingHierarchy->setNumBounds(0);
+    }
+    m_cullingMethod = cullingMethod;
+  }
+
+  RenderTechnique::CullingMethod RenderTechnique::getCullingMethod()
+  {
+    return m_cullingMethod;
+  }
+
+  void RenderTechnique::setOcclusionCulling(bool occlusionCulling)
+  {
+    m_occlusionCulling = occlusionCulling;
+  }
+
+  bool RenderTechnique::getOcclusionCulling()
+  {
+    return m_occlusionCulling;
+  }
+
+  void RenderTechnique::setMaxOccluders(uint32_t maxOccluders)
+  {
+    m_maxOccluders = maxOccluders;
+  }
+
+  OcclusionCuller* RenderTechnique::getOcclusionCuller()
+  {
+    return m_occlusionCuller;
+  }
+
+  void RenderTechnique::setDrawSorting(bool drawSorting)
+  {
+    m_drawSorting = drawSorting;
+  }
+
+  bool RenderTechnique::getDrawSorting()
+  {
+    return m_drawSorting;
+  }
+
+  void RenderTechnique::getDrawSortStats(DrawSortStats& drawSortStats)
+  {
+    drawSortStats = m_drawSortStats;
+  }
+
+  void RenderTechnique::getCullStats(CullStats& cullStats)
+  {
+    cullStats = m_cullStats;
+  }
+
+  void RenderTechnique::updateCurrentLight(uint32_t frameIndex, int lightIndex)
+  {
+    uint32_t offset = 0;
+    uint32_t size = 0;
+    float* data = nullptr;
+
+    ivec4 lightInfo;
+    lightInfo.x = lightIndex;
+    lightInfo.y = (int)m_lightComponents.size();
+    data = (float*)glm::value_ptr(lightInfo);
+    size = sizeof(lightInfo);
+    m_graphics->updateUniformData(m_frameDataUniformBuffers[frameIndex], offset, data, size);
+  }
+
+  void RenderTechnique::updateClusterData(shared_ptr<View> view, uint32_t frameIndex)
+  {
+    mat4 viewTransform;
+    mat4 invViewTransform;
+
+    view->getViewTransform(viewTransform);
+    invViewTransform = glm::inverse(viewTransform);
+
+    // The grid only depends on the projection, so it is rebuilt only when that changes
+    if (clusterGridChanged(view))
+    {
+      rebuildClusterGrid(view);
+      m_worldManager->printLog("Cluster grid rebuilt for field of view " + std::to_string(m_clusterData->m_fieldOfView));
+    }
+
+    m_clusterLightPositions.resize(m_lightComponents.size());
+    m_clusterLightViewPositions.resize(m_lightComponents.size());
+    m_clusterLightIndices.resize(m_lightComponents.size());
+
+    for (size_t i = 0; i < m_lightComponents.size(); ++i)
+    {
+      vec3 position;
+      mat4 transform;
+      m_lightComponents[i]->getPosition(position);
+      m_lightComponents[i]->getEntity(0)->getCompositeTransform(transform);
+      vec4 lightPosition = transform * vec4(position, 1.0f);
+      vec3 lightViewPosition = vec3(viewTransform * lightPosition);
+      m_lightComponents[i]->setViewPosition(lightViewPosition);
+      m_clusterLightPositions[i] = vec3(lightPosition);
+      m_clusterLightViewPositions[i] = lightViewPosition;
+    }
+    m_clusterBinner->setLights(m_clusterLightViewPositions.data(), (uint32_t)m_lightComponents.size(), m_clusterLightRadius);
+
+    if (m_lightAssignment == SEPARABLE)
+    {
+      assignLightsSeparable();
+    }
+    else
+    {
+      assignLightsBruteForce();
+    }
+    compactClusterLights();
+
+    updateClusterStats();
+    m_worldManager->printLog("MaxLights: " + std::to_string(m_clusterStats.m_maxLights) + ", meanLights: " + std::to_string(m_clusterStats.m_meanLights) +
+      ", totalLights: " + std::to_string(m_clusterStats.m_totalLights) + ", zeros: " + std::to_string(m_clusterStats.m_numEmpty));
+    if (m_clusteredShading)
+    {
+      updateClusterShaderData(viewTransform, frameIndex);
+    }
+    if (!m_freezeClusterEntity)
+    {
+      m_clusterEntity->setTransform(invViewTransform);
+      m_clusterEntity->updateCompositeTransform(mat4());
+    }
+  }
+
+  void RenderTechnique::assignLightsBruteForce()
+  {
+    uint32_t numXSegments = m_clusterData->m_numXSegments;
+    uint32_t numYSegments = m_clusterData->m_numYSegments;
+    uint32_t numZSegments = m_clusterData->m_numZSegments - 1;
+    uint32_t numLights = (uint32_t)m_lightComponents.size();
+
+    resizeThreadLightIndices(numLights);
+
+    // Bin the lights one row of clusters per task against the view space
+    // planes. Each row collects its lists back to back in its own buffer.
+    m_jobSystem->parallelFor(numZSegments * numYSegments, 1, [&](uint32_t begin, uint32_t end)
+    {
+      uint32_t* lightIndices = m_threadLightIndices[JobSystem::getThreadIndex()].data();
+      for (uint32_t row = begin; row < end; row++)
+      {
+        vector<uint32_t>& rowLights = m_rowLightIndices[row];
+        rowLights.clear();
+        for (uint32_t clusterIndex = row * numXSegments; clusterIndex < (row + 1) * numXSegments; clusterIndex++)
+        {
+          uint32_t numClusterLights = m_clusterBinner->binCluster(clusterIndex, lightIndices);
+          rowLights.insert(rowLights.end(), lightIndices, lightIndices + numClusterLights);
+          m_clusterData->m_lightGrid[clusterIndex].m_count = numClusterLights;
+        }
+      }
+    });
+  }
+
+  void RenderTechnique::assignLightsSeparable()
+  {
+    uint32_t numXSegments = m_clusterData->m_numXSegments;
+    uint32_t numYSegments = m_clusterData->m_numYSegments;
+    uint32_t numZSegments = m_clusterData->m_numZSegments - 1;
+    uint32_t numLights = (uint32_t)m_lightComponents.size();
+    uint32_t numRows = numZSegments * numYSegments;
+    uint32_t overlapStride = numXSegments + numYSegments + numZSegments;
+
+    m_lightSliceRanges.resize(numLights);
+    m_sliceOverlaps.resize(numLights * overlapStride);
+
+    // Find the slices every light touches on each axis
+    m_jobSystem->parallelFor(numLights, 64, [&](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t l = begin; l < end; l++)
+      {
+        vec3 position = m_clusterLightViewPositions[l];
+        SliceRange& range = m_lightSliceRanges[l];
+        uint8_t* xOverlaps = &m_sliceOverlaps[l * overlapStride];
+        uint8_t* yOverlaps = xOverlaps + numXSegments;
+        uint8_t* zOverlaps = yOverlaps + numYSegments;
+
+        range.m_visible = computeSliceRange(m_clusterData->m_zPlanes, numZSegments, position, zOverlaps, range.m_firstZ, range.m_lastZ) &&
+                          computeSliceRange(m_clusterData->m_yPlanes, numYSegments, position, yOverlaps, range.m_firstY, range.m_lastY) &&
+                          computeSliceRange(m_clusterData->m_xPlanes, numXSegments, position, xOverlaps, range.m_firstX, range.m_lastX);
+      }
+    });
+
+    // Bucket the lights by the rows they touch so a row only looks at its own
+    // lights. Counting then filling in light order keeps every bucket sorted.
+    m_rowBucketOffsets.assign(numRows + 1, 0);
+    for (uint32_t l = 0; l < numLights; l++)
+    {
+      SliceRange& range = m_lightSliceRanges[l];
+      uint8_t* yOverlaps = &m_sliceOverlaps[l * overlapStride] + numXSegments;
+      uint8_t* zOverlaps = yOverlaps + numYSegments;
+      if (!range.m_visible)
+      {
+        continue;
+      }
+      for (uint32_t k = range.m_firstZ; k <= range.m_lastZ; k++)
+      {
+        for (uint32_t j = range.m_firstY; j <= range.m_lastY; j++)
+        {
+          m_rowBucketOffsets[k * numYSegments + j + 1] += zOverlaps[k] & yOverlaps[j];
+        }
+      }
+    }
+    for (uint32_t row = 0; row < numRows; row++)
+    {
+      m_rowBucketOffsets[row + 1] += m_rowBucketOffsets[row];
+    }
+    m_rowBucketLights.resize(m_rowBucketOffsets[numRows]);
+    for (uint32_t l = 0; l < numLights; l++)
+    {
+      SliceRange& range = m_lightSliceRanges[l];
+      uint8_t* yOverlaps = &m_sliceOverlaps[l * overlapStride] + numXSegments;
+      uint8_t* zOverlaps = yOverlaps + numYSegments;
+      if (!range.m_visible)
+      {
+        continue;
+      }
+      for (uint32_t k = range.m_firstZ; k <= range.m_lastZ; k++)
+      {
+        for (uint32_t j = range.m_firstY; j <= range.m_lastY; j++)
+        {
+          if (zOverlaps[k] && yOverlaps[j])
+          {
+            m_rowBucketLights[m_rowBucketOffsets[k * numYSegments + j]++] = l;
+          }
+        }
+      }
+    }
+    // Filling advanced each offset to the end of its bucket, shift them back
+    for (uint32_t row = numRows; row > 0; row--)
+    {
+      m_rowBucketOffsets[row] = m_rowBucketOffsets[row - 1];
+    }
+    m_rowBucketOffsets[0] = 0;
+
+    // Fill one row of clusters per task so no two tasks share a cluster. The
+    // lights of the row's bucket are counted per cluster first so each
+    // cluster's lights land back to back in the row buffer.
+    m_jobSystem->parallelFor(numRows, 1, [&](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t row = begin; row < end; row++)
+      {
+        ClusterLightGrid* grid = &m_clusterData->m_lightGrid[row * numXSegments];
+        vector<uint32_t>& rowLights = m_rowLightIndices[row];
+        uint32_t* rowCandidates = m_rowBucketLights.data() + m_rowBucketOffsets[row];
+        uint32_t numCandidates = m_rowBucketOffsets[row + 1] - m_rowBucketOffsets[row];
+        for (uint32_t i = 0; i < numXSegments; i++)
+        {
+          grid[i].m_count = 0;
+        }
+
+        for (uint32_t c = 0; c < numCandidates; c++)
+        {
+          uint32_t l = rowCandidates[c];
+          SliceRange& range = m_lightSliceRanges[l];
+          uint8_t* xOverlaps = &m_sliceOverlaps[l * overlapStride];
+          for (uint32_t i = range.m_firstX; i <= range.m_lastX; i++)
+          {
+            grid[i].m_count += xOverlaps[i];
+          }
+        }
+
+        uint32_t rowCount = 0;
+        for (uint32_t i = 0; i < numXSegments; i++)
+        {
+          grid[i].m_offset = rowCount;
+          rowCount += grid[i].m_count;
+          grid[i].m_count = 0;
+        }
+        rowLights.resize(rowCount);
+
+        for (uint32_t c = 0; c < numCandidates; c++)
+        {
+          uint32_t l = rowCandidates[c];
+          SliceRange& range = m_lightSliceRanges[l];
+          uint8_t* xOverlaps = &m_sliceOverlaps[l * overlapStride];
+          for (uint32_t i = range.m_firstX; i <= range.m_lastX; i++)
+          {
+            if (xOverlaps[i])
+            {
+              rowLights[grid[i].m_offset + grid[i].m_count++] = l;
+            }
+          }
+        }
+      }
+    });
+  }
+
+  void RenderTechnique::resizeThreadLightIndices(uint32_t numLights)
+  {
+    m_threadLightIndices.resize(m_jobSystem->getNumThreads());
+    for (size_t t = 0; t < m_threadLightIndices.size(); t++)
+    {
+      m_threadLightIndices[t].resize(numLights);
+    }
+  }
+
+  bool RenderTechnique::computeSliceRange(vec4* planes, uint32_t numSlices, vec3 position, uint8_t* overlaps, uint32_t& first, uint32_t& last)
+  {
+    // A slice lies between boundary planes s and s + 1. The sphere touches it unless it is
+    // fully behind the first plane or fully in front of the second, the same two tests the
+    // brute force path makes against those cluster faces.
+    first = numSlices;
+    last = 0;
+    float previous = planes[0].x * position.x + planes[0].y * position.y + planes[0].z * position.z + planes[0].w;
+    for (uint32_t s = 0; s < numSlices; s++)
+    {
+      float next = planes[s + 1].x * position.x + planes[s + 1].y * position.y + planes[s + 1].z * position.z + planes[s + 1].w;
+      overlaps[s] = (previous >= -m_clusterLightRadius && next <= m_clusterLightRadius) ? 1 : 0;
+      if (overlaps[s])
+      {
+        if (first == numSlices)
+        {
+          first = s;
+        }
+        last = s;
+      }
+      previous = next;
+    }
+
+    return first != numSlices;
+  }
+
+  void RenderTechnique::compactClusterLights()
+  {
+    uint32_t numXSegments = m_clusterData->m_numXSegments;
+    uint32_t numRows = m_clusterData->m_numYSegments * (m_clusterData->m_numZSegments - 1);
+    uint32_t numClusters = numRows * numXSegments;
+
+    // Exclusive prefix sum over the counts gives every cluster its offset
+    uint32_t numLightIndices = 0;
+    for (uint32_t clusterIndex = 0; clusterIndex < numClusters; clusterIndex++)
+    {
+      m_clusterData->m_lightGrid[clusterIndex].m_offset = numLightIndices;
+      numLightIndices += m_clusterData->m_lightGrid[clusterIndex].m_count;
+    }
+    m_clusterLightList.resize(numLightIndices);
+
+    // A row's clusters are contiguous, so each row buffer is copied in one go
+    m_jobSystem->parallelFor(numRows, 4, [&](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t row = begin; row < end; row++)
+      {
+        vector<uint32_t>& rowLights = m_rowLightIndices[row];
+        if (!rowLights.empty())
+        {
+          memcpy(&m_clusterLightList[m_clusterData->m_lightGrid[row * numXSegments].m_offset], rowLights.data(), rowLights.size() * sizeof(uint32_t));
+        }
+      }
+    });
+  }
+
+  void RenderTechnique::updateClusterShaderData(mat4& viewTransform, uint32_t frameIndex)
+  {
+    uint32_t numClusters = m_clusterData->m_numXSegments * m_clusterData->m_numYSegments * (m_clusterData->m_numZSegments - 1);
+    uint32_t numLights = (uint32_t)m_lightComponents.size();
+
+    if (m_clusterGridUniformBuffers.empty())
+    {
+      return;
+    }
+
+    // The buffers were sized when the technique was built and are already bound
+    // to the clustered material, so shade with light volumes rather than let the
+    // shader read the last frame that fit
+    bool overflow = numLights > m_maxClusterShaderLights;
+    if (overflow != m_clusterShaderOverflow)
+    {
+      m_clusterShaderOverflow = overflow;
+      if (overflow)
+      {
+        m_worldManager->printLog("Clustered shading: " + std::to_string(numLights) + " lights exceed the " + std::to_string(m_maxClusterShaderLights) +
+          " the cluster buffers were built for, falling back to light volumes");
+      }
+      else
+      {
+        m_worldManager->printLog("Clustered shading: light count back within the cluster buffers");
+      }
+    }
+    if (overflow)
+    {
+      return;
+    }
+
+    ClusterShaderParamBlock params;
+    params.view = viewTransform;
+    params.clusterSize = vec4((float)m_clusterData->m_numXSegments, (float)m_clusterData->m_numYSegments, (float)(m_clusterData->m_numZSegments - 1), m_clusterData->m_tanHalfFov);
+    params.clusterDepth = vec4(m_clusterData->m_sliceScale, m_clusterData->m_sliceBias, m_clusterSlicing == EXPONENTIAL_SLICES ? 1.0f : 0.0f, 0.0f);
+    m_graphics->updateUniformData(m_clusterGridUniformBuffers[frameIndex], 0, (uint8_t*)&params, sizeof(params));
+    m_graphics->updateUniformData(m_clusterGridUniformBuffers[frameIndex], sizeof(params), (uint8_t*)m_clusterData->m_lightGrid, numClusters * sizeof(ClusterLightGrid));
+
+    if (!m_clusterLightList.empty())
+    {
+      m_graphics->updateUniformData(m_clusterLightIndexUniformBuffers[frameIndex], 0, (uint8_t*)m_clusterLightList.data(), m_clusterLightList.size() * sizeof(uint32_t));
+    }
+
+    m_clusterLightShaderData.resize(numLights);
+    for (uint32_t i = 0; i < numLights; i++)
+    {
+      vec3 color;
+      m_lightComponents[i]->getDiffuse(color);
+      m_clusterLightShaderData[i].positionRadius = vec4(m_clusterLightPositions[i], m_clusterLightRadius);
+      m_clusterLightShaderData[i].color = vec4(color, 1.0f);
+    }
+    if (numLights > 0)
+    {
+      m_graphics->updateUniformData(m_clusterLightUniformBuffers[frameIndex], 0, (uint8_t*)m_clusterLightShaderData.data(), numLights * sizeof(ClusterLightShaderData));
+    }
+  }
+
+  void RenderTechnique::updateClusterStats()
+  {
+    uint32_t numClustersPerSlice = m_clusterData->m_numXSegments * m_clusterData->m_numYSegments;
+    uint32_t numSlices = m_clusterData->m_numZSegments - 1;
+
+    m_clusterStats.m_numClusters = numClustersPerSlice * numSlices;
+    m_clusterStats.m_numEmpty = 0;
+    m_clusterStats.m_maxLights = 0;
+    m_clusterStats.m_totalLights = 0;
+    m_clusterStats.m_sliceMaxLights.assign(numSlices, 0);
+    m_clusterStats.m_sliceMeanLights.assign(numSlices, 0.0f);
+
+    for (uint32_t k = 0; k < numSlices; k++)
+    {
+      size_t sliceLights = 0;
+      for (uint32_t clusterIndex = k * numClustersPerSlice; clusterIndex < (k + 1) * numClustersPerSlice; clusterIndex++)
+      {
+        uint32_t numLights = m_clusterData->m_lightGrid[clusterIndex].m_count;
+        sliceLights += numLights;
+        if (numLights == 0)
+        {
+          m_clusterStats.m_numEmpty++;
+        }
+        if (numLights > m_clusterStats.m_sliceMaxLights[k])
+        {
+          m_clusterStats.m_sliceMaxLights[k] = numLights;
+        }
+      }
+
+      m_clusterStats.m_sliceMeanLights[k] = (float)sliceLights / numClustersPerSlice;
+      m_clusterStats.m_maxLights = std::max(m_clusterStats.m_maxLights, m_clusterStats.m_sliceMaxLights[k]);
+      m_clusterStats.m_totalLights += sliceLights;
+    }
+
+    uint32_t numOccupied = m_clusterStats.m_numClusters - m_clusterStats.m_numEmpty;
+    m_clusterStats.m_meanLights = (float)m_clusterStats.m_totalLights / m_clusterStats.m_numClusters;
+    m_clusterStats.m_meanOccupiedLights = numOccupied > 0 ? (float)m_clusterStats.m_totalLights / numOccupied : 0.0f;
+  }
+
+  float RenderTechnique::getSliceDepth(uint32_t slice, float nearClip, float farClip)
+  {
+    float t = (float)slice / m_numClusterSlices;
+    if (m_clusterSlicing == EXPONENTIAL_SLICES)
+    {
+      // Slices grow geometrically so each cluster stays roughly cube shaped
+      return nearClip * pow(farClip / nearClip, t);
+    }
+
+    return nearClip + (farClip - nearClip) * t;
+  }
+
+  void RenderTechnique::setClusterTileSize(uint32_t tileWidth, uint32_t tileHeight)
+  {
+    m_clusterTileWidth = tileWidth > 0 ? tileWidth : 1;
+    m_clusterTileHeight = tileHeight > 0 ? tileHeight : 1;
+  }
+
+  void RenderTechnique::setClusterSlices(uint32_t numSlices, ClusterSlicing slicing)
+  {
+    m_numClusterSlices = numSlices > 0 ? numSlices : 1;
+    m_clusterSlicing = slicing;
+  }
+
+  void RenderTechnique::getClusterStats(ClusterStats& clusterStats)
+  {
+    clusterStats = m_clusterStats;
+  }
+
+  void RenderTechnique::logClusterStats()
+  {
+    if (m_clusterData == nullptr)
+    {
+      return;
+    }
+
+    m_worldManager->printLog("Cluster grid: " + std::to_string(m_clusterData->m_numXSegments) + "x" + std::to_string(m_clusterData->m_numYSegments) + "x" + std::to_string(m_clusterData->m_numZSegments - 1) +
+      (m_clusterSlicing == EXPONENTIAL_SLICES ? " exponential" : " uniform") + ", " + std::to_string(m_clusterTileWidth) + "x" + std::to_string(m_clusterTileHeight) + " pixel tiles");
+    m_worldManager->printLog("  Max lights: " + std::to_string(m_clusterStats.m_maxLights) + ", mean: " + std::to_string(m_clusterStats.m_meanLights) +
+      ", mean of occupied: " + std::to_string(m_clusterStats.m_meanOccupiedLights) + ", empty: " + std::to_string(m_clusterStats.m_numEmpty) + " of " + std::to_string(m_clusterStats.m_numClusters));
+
+    for (size_t k = 0; k < m_clusterStats.m_sliceMaxLights.size(); k++)
+    {
+      float sliceNear = getSliceDepth((uint32_t)k, m_onscreenView->getNearClip(), m_onscreenView->getFarClip());
+      float sliceFar = getSliceDepth((uint32_t)k + 1, m_onscreenView->getNearClip(), m_onscreenView->getFarClip());
+      m_worldManager->printLog("  Slice " + std::to_string(k) + " [" + std::to_string(sliceNear) + ", " + std::to_string(sliceFar) + "]: max " +
+        std::to_string(m_clusterStats.m_sliceMaxLights[k]) + ", mean " + std::to_string(m_clusterStats.m_sliceMeanLights[k]));
+    }
+  }
+
+  void RenderTechnique::getClusterUniformBuffers(uint32_t frameIndex, shared_ptr<UniformBuffer>& gridBuffer, shared_ptr<UniformBuffer>& lightIndexBuffer, shared_ptr<UniformBuffer>& lightBuffer)
+  {
+    gridBuffer = m_clusterGridUniformBuffers[frameIndex];
+    lightIndexBuffer = m_clusterLightIndexUniformBuffers[frameIndex];
+    lightBuffer = m_clusterLightUniformBuffers[frameIndex];
+  }
+
+  void RenderTechnique::setClusteredShading(bool clusteredShading)
+  {
+    m_clusteredShading = clusteredShading;
+  }
+
+  bool RenderTechnique::getClusteredShading()
+  {
+    return m_clusteredShading && !m_clusterShaderOverflow;
+  }
+
+  void RenderTechnique::getClusterLights(ClusterLightGrid*& lightGrid, uint32_t& numClusters, uint32_t*& lightIndexList, uint32_t& numLightIndices)
+  {
+    if (m_clusterData == nullptr)
+    {
+      lightGrid = nullptr;
+      numClusters = 0;
+      lightIndexList = nullptr;
+      numLightIndices = 0;
+      return;
+    }
+
+    lightGrid = m_clusterData->m_lightGrid;
+    numClusters = m_clusterData->m_numXSegments * m_clusterData->m_numYSegments * (m_clusterData->m_numZSegments - 1);
+    lightIndexList = m_clusterLightList.data();
+    numLightIndices = (uint32_t)m_clusterLightList.size();
+  }
+
+  void RenderTechnique::benchmarkClusterScaling(uint32_t iterations)
+  {
+    if (m_clusterData == nullptr)
+    {
+      return;
+    }
+
+    uint32_t numClusters = m_clusterData->m_numXSegments * m_clusterData->m_numYSegments * (m_clusterData->m_numZSegments - 1);
+    uint32_t maxThreads = std::max(16u, std::thread::hardware_concurrency());
+    shared_ptr<JobSystem> jobSystem = m_jobSystem;
+    double bruteForceBase = 0.0;
+    double separableBase = 0.0;
+    CpuTimer timer;
+
+    m_worldManager->printLog("Cluster update scaling: " + std::to_string(numClusters) + " clusters, " + std::to_string(m_lightComponents.size()) + " lights, " + std::to_string(iterations) + " iterations");
+    for (uint32_t numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+    {
+      m_jobSystem = make_shared<JobSystem>("Benchmark Job System", numThreads);
+
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        assignLightsBruteForce();
+        compactClusterLights();
+      }
+      double bruteForceTime = (double)timer.elapsedMicro() / iterations;
+
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        assignLightsSeparable();
+        compactClusterLights();
+      }
+      double separableTime = (double)timer.elapsedMicro() / iterations;
+
+      if (numThreads == 1)
+      {
+        bruteForceBase = bruteForceTime;
+        separableBase = separableTime;
+      }
+      m_worldManager->printLog("  " + std::to_string(numThreads) + " threads: brute force " + std::to_string(bruteForceTime / 1000.0) + " ms, x" + std::to_string(bruteForceBase / bruteForceTime) +
+        ", separable " + std::to_string(separableTime / 1000.0) + " ms, x" + std::to_string(separableBase / separableTime));
+    }
+
+    m_jobSystem = jobSystem;
+  }
+
+  void RenderTechnique::setJobSystem(shared_ptr<JobSystem> jobSystem)
+  {
+    m_jobSystem = jobSystem;
+    m_occlusionCuller->setJobSystem(jobSystem);
+  }
+
+  shared_ptr<JobSystem> RenderTechnique::getJobSystem()
+  {
+    return m_jobSystem;
+  }
+
+  void RenderTechnique::setLightAssignment(LightAssignment lightAssignment)
+  {
+    m_lightAssignment = lightAssignment;
+  }
+
+  RenderTechnique::LightAssignment RenderTechnique::getLightAssignment()
+  {
+    return m_lightAssignment;
+  }
+
+  void RenderTechnique::validateLightAssignment()
+  {
+    if (m_clusterData == nullptr)
+    {
+      return;
+    }
+
+    uint32_t numClusters = m_clusterData->m_numXSegments * m_clusterData->m_numYSegments * (m_clusterData->m_numZSegments - 1);
+
+    assignLightsBruteForce();
+    compactClusterLights();
+    vector<ClusterLightGrid> bruteForceGrid(m_clusterData->m_lightGrid, m_clusterData->m_lightGrid + numClusters);
+    vector<uint32_t> bruteForceList = m_clusterLightList;
+
+    assignLightsSeparable();
+    compactClusterLights();
+    size_t mismatches = 0;
+    for (uint32_t clusterIndex = 0; clusterIndex < numClusters; clusterIndex++)
+    {
+      ClusterLightGrid& bruteForce = bruteForceGrid[clusterIndex];
+      ClusterLightGrid& separable = m_clusterData->m_lightGrid[clusterIndex];
+      if (bruteForce.m_count != separable.m_count ||
+          !std::equal(bruteForceList.data() + bruteForce.m_offset, bruteForceList.data() + bruteForce.m_offset + bruteForce.m_count, m_clusterLightList.data() + separable.m_offset))
+      {
+        mismatches++;
+      }
+    }
+
+    m_worldManager->printLog("Light assignment check: " + std::to_string(mismatches) + " of " + std::to_string(numClusters) + " clusters differ between brute force and separable");
+  }
+
+  void RenderTechnique::benchmarkClusterBinning(uint32_t iterations)
+  {
+    if (m_clusterBinner == nullptr || m_clusterBinner->getNumLights() == 0)
+    {
+      return;
+    }
+
+    uint32_t numClusters = m_clusterBinner->getNumClusters();
+    uint32_t numLights = m_clusterBinner->getNumLights();
+    size_t scalarTotal = 0;
+    size_t simdTotal = 0;
+    size_t mismatches = 0;
+    vector<uint32_t> scalarIndices(numLights);
+    CpuTimer timer;
+
+    // Reference path, one sqrt per plane per light
+    timer.start();
+    for (uint32_t it = 0; it < iterations; it++)
+    {
+      for (uint32_t c = 0; c < numClusters; c++)
+      {
+        for (uint32_t l = 0; l < numLights; l++)
+        {
+          if (intersectsCluster(c, m_clusterLightViewPositions[l], m_clusterLightRadius))
+          {
+            scalarTotal++;
+          }
+        }
+      }
+    }
+    unsigned long long scalarTime = timer.elapsedMicro();
+
+    timer.start();
+    for (uint32_t it = 0; it < iterations; it++)
+    {
+      for (uint32_t c = 0; c < numClusters; c++)
+      {
+        simdTotal += m_clusterBinner->binCluster(c, m_clusterLightIndices.data());
+      }
+    }
+    unsigned long long simdTime = timer.elapsedMicro();
+
+    for (uint32_t c = 0; c < numClusters; c++)
+    {
+      uint32_t numScalar = 0;
+      for (uint32_t l = 0; l < numLights; l++)
+      {
+        if (intersectsCluster(c, m_clusterLightViewPositions[l], m_clusterLightRadius))
+        {
+          scalarIndices[numScalar++] = l;
+        }
+      }
+      uint32_t numSimd = m_clusterBinner->binCluster(c, m_clusterLightIndices.data());
+      if (numScalar != numSimd || !std::equal(scalarIndices.begin(), scalarIndices.begin() + numScalar, m_clusterLightIndices.begin()))
+      {
+        mismatches++;
+      }
+    }
+
+    double pairs = (double)iterations * numClusters * numLights;
+    double scalarRate = pairs / ((scalarTime > 0 ? scalarTime : 1) * 1.0e-6);
+    double simdRate = pairs / ((simdTime > 0 ? simdTime : 1) * 1.0e-6);
+    m_worldManager->printLog("Cluster binning: " + std::to_string(numClusters) + " clusters x " + std::to_string(numLights) + " lights, " + std::to_string(iterations) + " iterations");
+    m_worldManager->printLog("  Scalar: " + std::to_string(scalarRate / 1.0e6) + " M clusters*lights/s, " + std::to_string(scalarTotal) + " hits");
+    m_worldManager->printLog("  SIMD x" + std::to_string(m_clusterBinner->getSimdWidth()) + ": " + std::to_string(simdRate / 1.0e6) + " M clusters*lights/s, " + std::to_string(simdTotal) + " hits");
+    m_worldManager->printLog("  Speedup: " + std::to_string(simdRate / scalarRate) + ", mismatched clusters: " + std::to_string(mismatches));
+  }
+
+  void RenderTechnique::benchmarkClusterGrid(uint32_t iterations)
+  {
+    if (m_clusterData == nullptr)
+    {
+      return;
+    }
+
+    mat4 viewTransform;
+    m_onscreenView->getViewTransform(viewTransform);
+    mat4 invViewTransform = glm::inverse(viewTransform);
+    uint32_t numLights = (uint32_t)m_lightComponents.size();
+    vec2 resolutions[] = { vec2(1920.0f, 1080.0f), vec2(3840.0f, 2160.0f) };
+    ClusterData* clusterData = m_clusterData;
+    vector<vec3> lightViewPositions(numLights);
+    CpuTimer timer;
+
+    m_worldManager->printLog("Cluster grid update: " + std::to_string(numLights) + " lights, " + std::to_string(iterations) + " iterations");
+    for (uint32_t r = 0; r < 2; r++)
+    {
+      uint32_t numXSegments = ((uint32_t)resolutions[r].x + m_clusterTileWidth - 1) / m_clusterTileWidth;
+      uint32_t numYSegments = ((uint32_t)resolutions[r].y + m_clusterTileHeight - 1) / m_clusterTileHeight;
+      uint32_t numZSegments = m_numClusterSlices + 1;
+      uint32_t numClusters = numXSegments * numYSegments * m_numClusterSlices;
+
+      createClusterGrid(numXSegments, numYSegments, numZSegments);
+      updateClusterGrid(m_onscreenView->getFieldOfView(), m_onscreenView->getNearClip(), m_onscreenView->getFarClip());
+      vector<vec3> worldVerts(m_clusterData->m_numClusterVerts);
+      vector<vec4> worldPlanes(numClusters * 6);
+
+      // What every frame used to cost: move the grid to world space and rebuild every cluster's planes
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        for (uint32_t i = 0; i < m_clusterData->m_numClusterVerts; i++)
+        {
+          vec4 localPoint(m_clusterData->m_localVerts[i * 3], m_clusterData->m_localVerts[i * 3 + 1], m_clusterData->m_localVerts[i * 3 + 2], 1.0f);
+          worldVerts[i] = vec3(invViewTransform * localPoint);
+        }
+        for (uint32_t c = 0; c < numClusters; c++)
+        {
+          uint32_t* verts = m_clusterData->m_clusters[c].m_verts;
+          vec4* planes = &worldPlanes[c * 6];
+          planes[0] = planeEquation(worldVerts[verts[0]], worldVerts[verts[3]], worldVerts[verts[2]]);
+          planes[1] = planeEquation(worldVerts[verts[1]], worldVerts[verts[2]], worldVerts[verts[6]]);
+          planes[2] = planeEquation(worldVerts[verts[5]], worldVerts[verts[6]], worldVerts[verts[7]]);
+          planes[3] = planeEquation(worldVerts[verts[4]], worldVerts[verts[7]], worldVerts[verts[3]]);
+          planes[4] = planeEquation(worldVerts[verts[1]], worldVerts[verts[5]], worldVerts[verts[4]]);
+          planes[5] = planeEquation(worldVerts[verts[3]], worldVerts[verts[7]], worldVerts[verts[6]]);
+        }
+      }
+      double worldTime = (double)timer.elapsedMicro() / iterations;
+
+      // What it costs now: the grid stays put and the lights move to view space
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        for (uint32_t l = 0; l < numLights; l++)
+        {
+          lightViewPositions[l] = vec3(viewTransform * vec4(m_clusterLightPositions[l], 1.0f));
+        }
+      }
+      double viewTime = (double)timer.elapsedMicro() / iterations;
+
+      destroyClusterGrid();
+      m_worldManager->printLog("  " + std::to_string((uint32_t)resolutions[r].x) + "x" + std::to_string((uint32_t)resolutions[r].y) + ", " + std::to_string(numClusters) + " clusters: world space grid " +
+        std::to_string(worldTime / 1000.0) + " ms, view space lights " + std::to_string(viewTime / 1000.0) + " ms, saved " + std::to_string((worldTime - viewTime) / 1000.0) + " ms");
+    }
+
+    m_clusterData = clusterData;
+  }
+
+  vec4 RenderTechnique::planeEquation(vec3 p1, vec3 p2, vec3 p3)
+  {
+    vec4 plane;
+    vec3 v1 = glm::normalize(p3 - p2);
+    vec3 v2 = glm::normalize(p1 - p2);
+    vec3 normal = glm::normalize(glm::cross(v1, v2));
+    
+    plane.x = -normal.x;
+    plane.y = -normal.y;
+    plane.z = -normal.z;
+    plane.w = normal.x * p1.x + normal.y * p1.y + normal.z * p1.z;
+    return plane;
+  }
+
+  float RenderTechnique::updatePlaneD(vec4 plane, vec3 p)
+  {
+    return -(plane.x * p.x + plane.y * p.y + plane.z * p.z);
+  }
+
+  bool RenderTechnique::intersectsCluster(uint32_t clusterIndex, vec3 lightViewPosition, float radius)
+  {
+    bool intersects = true;
+    for (int i = 0; i < 6; i++)
+    {
+      vec4 plane = m_clusterData->m_clusters[clusterIndex].m_planes[i];
+      float denom = 1.0f / sqrt(plane.x * plane.x + plane.y*plane.y + plane.z*plane.z);
+      float d = (plane.x * lightViewPosition.x + plane.y * lightViewPosition.y + plane.z * lightViewPosition.z + plane.w) * denom;
+      if ((d + radius) < 0.0f)
+      {
+        return false;
+      }
+    }
+
+    return intersects;
+  }
+
+  void RenderTechnique::updateFrameData(uint32_t frameIndex)
+  {
     mat4 transform;
     mat4 projectionTransform;
     mat4 viewProjection;
@@ -639,7 +1810,7 @@ namespace RenderLab
     float* data = nullptr;
 
     mat4 viewMatrix;
-    mat4 lightProjection = glm::perspective(90.0f, 1.0f, 0.1f, 1000.0f);
+    mat4 lightProjection = glm::perspective(90.0f, 1.0f, 0.1f, SHADOW_CUBE_FAR_CLIP);
 
     vec3 yAxis(0.0f, -1.0f, 0.0f);
     vec3 zAxis(0.0f, 0.0f, -1.0f);
@@ -689,21 +1860,138 @@ namespace RenderLab
     }
   }
 
-  void RenderTechnique::renderMeshes(shared_ptr<View> view, uint32_t frameIndex, bool shadowPass, bool depthPrepass)
+  void RenderTechnique::renderShadowCasters(size_t lightIndex, shared_ptr<View> view, uint32_t frameIndex)
   {
-    uint32_t currentMeshIndex = 0;
-    for (size_t i = 0; i < m_renderComponents.size(); i++)
+    vector<uint32_t>& casters = m_shadowCasters[lightIndex];
+    vector<uint8_t>& faceMasks = m_shadowFaceMasks[lightIndex];
+    uint32_t boundPipeline = 0;
+    m_graphics->beginMeshPass(view, frameIndex, false);
+    for (size_t i = 0; i < casters.size(); i++)
     {
-      if (shadowPass && m_renderComponents[i]->getEntity(0)->getCastShadow() == false)
+      uint32_t pipeline = m_graphics->getPipelineId(m_meshes[casters[i]], view, false);
+      if (i == 0 || pipeline != boundPipeline)
       {
-        continue;
+        m_graphics->bindPipeline(m_meshes[casters[i]], view, frameIndex, false);
+        boundPipeline = pipeline;
       }
+      m_graphics->renderShadowCaster(m_meshes[casters[i]], m_meshOffsets[casters[i]], view, frameIndex, faceMasks[i]);
+    }
+    m_graphics->endMeshPass(view, frameIndex, false);
+  }
+
+  void RenderTechnique::renderMeshes(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass)
+  {
+    // Flatten the pass so it can be dealt out to threads, leaving out what
+    // culling dropped for this view
+    const uint8_t* visible = nullptr;
+    map<shared_ptr<View>, vector<uint8_t>>::iterator visibility = m_meshVisibility.find(view);
+    if (visibility != m_meshVisibility.end() && visibility->second.size() == m_numMeshes)
+    {
+      visible = visibility->second.data();
+    }
+
+    CpuTimer timer;
+    timer.start();
+
+    mat4 viewTransform;
+    view->getViewTransform(viewTransform);
+    float inverseFarClip = 1.0f / view->getFarClip();
+    uint32_t pass = depthPrepass ? 0 : 1;
 
+    m_passMeshes.clear();
+    m_passMeshOffsets.clear();
+    m_passPipelines.clear();
+    m_drawList.clear();
+    uint32_t currentMeshIndex = 0;
+    for (size_t i = 0; i < m_renderComponents.size(); i++)
+    {
       for (size_t j = 0; j < m_renderComponents[i]->numMeshes(); j++, currentMeshIndex++)
       {
+        if (visible != nullptr && !visible[currentMeshIndex])
+        {
+          continue;
+        }
         shared_ptr<Mesh> mesh = m_renderComponents[i]->getMesh(j);
-        m_graphics->bindPipeline(mesh, view, frameIndex, depthPrepass);
-        m_graphics->render(mesh, m_meshOffsets[currentMeshIndex], view, frameIndex, depthPrepass);
+        uint32_t pipeline = m_graphics->getPipelineId(mesh, view, depthPrepass);
+        uint32_t drawIndex = (uint32_t)m_passMeshes.size();
+        m_passMeshes.push_back(mesh);
+        m_passMeshOffsets.push_back(m_meshOffsets[currentMeshIndex]);
+        m_passPipelines.push_back(pipeline);
+
+        // The depth prepass draws with one material for all
+        vec3 center;
+        vec3 extent;
+        mesh->getWorldBounds(center, extent);
+        float depth = extent.x >= Mesh::UNBOUNDED_EXTENT ? 0.0f : -(viewTransform * vec4(center, 1.0f)).z * inverseFarClip;
+        m_drawList.add(DrawList::makeKey(pass, pipeline, depthPrepass ? 0 : m_meshMaterialIds[currentMeshIndex], depth), drawIndex);
+      }
+    }
+
+    uint32_t numMeshes = (uint32_t)m_passMeshes.size();
+    countStateChanges(m_drawSortStats.m_numPipelineChanges, m_drawSortStats.m_numMaterialChanges);
+    if (m_drawSorting)
+    {
+      m_drawList.sort();
+      countStateChanges(m_drawSortStats.m_numSortedPipelineChanges, m_drawSortStats.m_numSortedMaterialChanges);
+    }
+    m_drawSortStats.m_numDraws += numMeshes;
+    m_drawSortStats.m_sortMicro += timer.elapsedMicro();
+
+    // Each thread records one contiguous slice of the list into its own
+    // command buffer. The slices are submitted in order, so the sorted order
+    // holds and only the first draw of a slice binds whatever was bound before.
+    uint32_t numThreads = m_jobSystem != nullptr ? m_jobSystem->getNumThreads() : 1;
+    bool parallelRecording = numThreads > 1 && m_graphics->supportsParallelRecording();
+    uint32_t sliceSize = std::max(parallelRecording ? (numMeshes + numThreads - 1) / numThreads : numMeshes, 1u);
+    vector<uint32_t> threadBinds(numThreads, 0);
+    auto recordDraws = [&](uint32_t begin, uint32_t end)
+    {
+      uint32_t binds = 0;
+      for (uint32_t i = begin; i < end; i++)
+      {
+        uint32_t draw = m_drawList.getIndex(i);
+        if (!m_drawSorting || i == begin || m_passPipelines[draw] != m_passPipelines[m_drawList.getIndex(i - 1)])
+        {
+          m_graphics->bindPipeline(m_passMeshes[draw], view, frameIndex, depthPrepass);
+          binds++;
+        }
+        m_graphics->render(m_passMeshes[draw], m_passMeshOffsets[draw], view, frameIndex, depthPrepass);
+      }
+      threadBinds[m_jobSystem != nullptr ? JobSystem::getThreadIndex() : 0] += binds;
+      m_graphics->endMeshSlice(view, frameIndex, begin / sliceSize);
+    };
+
+    m_graphics->beginMeshPass(view, frameIndex, depthPrepass);
+    if (parallelRecording)
+    {
+      m_jobSystem->parallelFor(numMeshes, sliceSize, recordDraws);
+    }
+    else
+    {
+      recordDraws(0, numMeshes);
+    }
+    m_graphics->endMeshPass(view, frameIndex, depthPrepass);
+
+    for (size_t i = 0; i < threadBinds.size(); i++)
+    {
+      m_drawSortStats.m_numPipelineBinds += threadBinds[i];
+    }
+  }
+
+  // Pipeline and material changes along the draw list as it is ordered now
+  void RenderTechnique::countStateChanges(uint32_t& pipelineChanges, uint32_t& materialChanges)
+  {
+    for (size_t i = 0; i < m_drawList.size(); i++)
+    {
+      uint64_t key = m_drawList.getKey(i);
+      uint64_t lastKey = i > 0 ? m_drawList.getKey(i - 1) : 0;
+      if (i == 0 || m_passPipelines[m_drawList.getIndex(i)] != m_passPipelines[m_drawList.getIndex(i - 1)])
+      {
+        pipelineChanges++;
+      }
+      if (i == 0 || DrawList::getMaterialId(key) != DrawList::getMaterialId(lastKey))
+      {
+        materialChanges++;
       }
     }
   }
@@ -715,6 +2003,11 @@ namespace RenderLab
     {
       for (size_t j = 0; j < m_renderComponents[i]->numMeshes(); j++, currentMeshIndex++)
       {
+        // Meshes no view draws this frame keep last frame's data
+        if (m_meshUpdates.size() == m_numMeshes && !m_meshUpdates[currentMeshIndex])
+        {
+          continue;
+        }
         shared_ptr<Mesh> mesh = m_renderComponents[i]->getMesh(j);
         updateMeshData(view, mesh, m_renderComponents[i]->getEntity(0), frameIndex, currentMeshIndex);
       }
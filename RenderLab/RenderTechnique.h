@@ -6,20 +6,30 @@
 #include "View.h"
 #include "Graphics.h"
 #include "UniformBuffer.h"
+#include "ClusterBinner.h"
+#include "FrustumCuller.h"
+#include "BoundingVolumeHierarchy.h"
+#include "OcclusionCuller.h"
+#include "DrawList.h"
+#include "CpuTimer.h"
+#include "JobSystem.h"
 #include "RenderTechnique.h"
 #include "WorldManager.h"
 
 #include <string>
 #include <memory>
 #include <vector>
-#include <atlstr.h>
+#include <map>
+#include <algorithm>
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <float.h>
 
 using std::string;
 using std::shared_ptr;
 using std::make_shared;
 using std::vector;
+using std::map;
 using glm::ivec4;
 
 namespace RenderLab
@@ -33,7 +43,72 @@ namespace RenderLab
   class RenderTechnique
   {
   public:
-    RenderTechnique(string name, WorldManager* worldManager, HINSTANCE hinstance, HWND window, shared_ptr<Graphics> graphics);
+    enum LightAssignment
+    {
+      BRUTE_FORCE,
+      SEPARABLE
+    };
+
+    enum ClusterSlicing
+    {
+      UNIFORM_SLICES,
+      EXPONENTIAL_SLICES
+    };
+
+    enum CullingMethod
+    {
+      LINEAR_CULLING,
+      HIERARCHY_CULLING
+    };
+
+    struct ClusterStats {
+      uint32_t          m_numClusters;
+      uint32_t          m_numEmpty;
+      uint32_t          m_maxLights;
+      float             m_meanLights;
+      float             m_meanOccupiedLights;
+      size_t            m_totalLights;
+      vector<uint32_t>  m_sliceMaxLights;
+      vector<float>     m_sliceMeanLights;
+    };
+
+    // Meshes tested and kept by the frustum culling of the last frame
+    struct CullStats {
+      uint32_t  m_numMeshes;
+      uint32_t  m_numVisible;
+      uint32_t  m_numCulled;
+      uint32_t  m_numOccluders;
+      uint32_t  m_numOccluded;
+      uint32_t  m_numShadowViews;
+      uint32_t  m_numShadowCasters;
+      uint32_t  m_numShadowCulled;
+      uint32_t  m_numShadowFaces;
+      uint32_t  m_numUpdated;
+      unsigned long long m_cullMicro;
+      unsigned long long m_occlusionMicro;
+    };
+
+    // State changes of the mesh passes of the last frame. Without sorting
+    // every draw binds its pipeline, the changes count the binds scene order
+    // and sorted order need when a bind is skipped for a pipeline already bound.
+    struct DrawSortStats {
+      uint32_t  m_numDraws;
+      uint32_t  m_numPipelineChanges;
+      uint32_t  m_numSortedPipelineChanges;
+      uint32_t  m_numMaterialChanges;
+      uint32_t  m_numSortedMaterialChanges;
+      uint32_t  m_numPipelineBinds;
+      unsigned long long m_sortMicro;
+    };
+
+    // Where a cluster's lights sit in the flat light index list. Matches a
+    // std430 uvec2 so the table can be uploaded as a storage buffer as is.
+    struct ClusterLightGrid {
+      uint32_t  m_offset;
+      uint32_t  m_count;
+    };
+
+    RenderTechnique(string name, WorldManager* worldManager, shared_ptr<Graphics> graphics);
     ~RenderTechnique();
 
     void addRenderComponent(shared_ptr<RenderComponent> renderComponent, shared_ptr<Entity> entity);
@@ -46,6 +121,34 @@ namespace RenderLab
     void removeView(shared_ptr<View> view);
     void updateWindow(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
     void setClusterEntityFreeze(bool freeze);
+    void benchmarkClusterBinning(uint32_t iterations);
+    void benchmarkClusterScaling(uint32_t iterations);
+    void benchmarkClusterGrid(uint32_t iterations);
+    void setJobSystem(shared_ptr<JobSystem> jobSystem);
+    shared_ptr<JobSystem> getJobSystem();
+    void setLightAssignment(LightAssignment lightAssignment);
+    LightAssignment getLightAssignment();
+    void validateLightAssignment();
+    void getClusterLights(ClusterLightGrid*& lightGrid, uint32_t& numClusters, uint32_t*& lightIndexList, uint32_t& numLightIndices);
+    void getClusterUniformBuffers(uint32_t frameIndex, shared_ptr<UniformBuffer>& gridBuffer, shared_ptr<UniformBuffer>& lightIndexBuffer, shared_ptr<UniformBuffer>& lightBuffer);
+    void setClusteredShading(bool clusteredShading);
+    bool getClusteredShading();
+    void setClusterTileSize(uint32_t tileWidth, uint32_t tileHeight);
+    void setClusterSlices(uint32_t numSlices, ClusterSlicing slicing);
+    void getClusterStats(ClusterStats& clusterStats);
+    void logClusterStats();
+    void setFrustumCulling(bool frustumCulling);
+    bool getFrustumCulling();
+    void setCullingMethod(CullingMethod cullingMethod);
+    CullingMethod getCullingMethod();
+    void setOcclusionCulling(bool occlusionCulling);
+    bool getOcclusionCulling();
+    void setMaxOccluders(uint32_t maxOccluders);
+    OcclusionCuller* getOcclusionCuller();
+    void setDrawSorting(bool drawSorting);
+    bool getDrawSorting();
+    void getDrawSortStats(DrawSortStats& drawSortStats);
+    void getCullStats(CullStats& cullStats);
 
     virtual void build();
     virtual void render();
@@ -53,12 +156,33 @@ namespace RenderLab
   private:
     void updateFrameData(uint32_t frameIndex);
     void updateClusterData(shared_ptr<View> view, uint32_t frameIndex);
+    void assignLightsBruteForce();
+    void assignLightsSeparable();
+    bool computeSliceRange(vec4* planes, uint32_t numSlices, vec3 position, uint8_t* overlaps, uint32_t& first, uint32_t& last);
+    void compactClusterLights();
+    void resizeThreadLightIndices(uint32_t numLights);
+    void updateClusterShaderData(mat4& viewTransform, uint32_t frameIndex);
+    void updateClusterStats();
+    float getSliceDepth(uint32_t slice, float nearClip, float farClip);
     void updateCurrentLight(uint32_t frameIndex, int lightIndex);
-    void renderMeshes(shared_ptr<View> view, uint32_t frameIndex, bool shadowPass, bool depthPrepass);
+    void cullMeshes();
+    uint32_t cullFrustum(const mat4& viewProjection, vector<uint8_t>& visible);
+    uint32_t cullOccluded(const mat4& viewTransform, const mat4& viewProjection, vector<uint8_t>& visible);
+    void buildShadowCasters(size_t lightIndex);
+    uint8_t getCubeFaceMask(const vec3& offset, const vec3& extent);
+    void renderShadowCasters(size_t lightIndex, shared_ptr<View> view, uint32_t frameIndex);
+    uint32_t applyCullResults(vector<uint8_t>& visible);
+    void renderMeshes(shared_ptr<View> view, uint32_t frameIndex, bool depthPrepass);
+    void countStateChanges(uint32_t& pipelineChanges, uint32_t& materialChanges);
     void updateMeshData(shared_ptr<View> view, uint32_t frameIndex);
     void updateMeshData(shared_ptr<View> view, shared_ptr<Mesh> mesh, shared_ptr<Entity> entity, uint32_t frameIndex, uint32_t meshIndex);
     void createCompositeMeshes();
     void buildFrustumLines(shared_ptr<View> view);
+    void createClusterGrid(uint32_t numXSegments, uint32_t numYSegments, uint32_t numZSegments);
+    void updateClusterGrid(float fieldOfView, float nearClip, float farClip);
+    void rebuildClusterGrid(shared_ptr<View> view);
+    bool clusterGridChanged(shared_ptr<View> view);
+    void destroyClusterGrid();
     vec4 planeEquation(vec3 p1, vec3 p2, vec3 p3);
     float updatePlaneD(vec4 plane, vec3 p);
     bool intersectsCluster(uint32_t clusterIndex, vec3 lightViewPosition, float radius);
@@ -86,25 +210,53 @@ namespace RenderLab
       vec4 flags;
     };
 
+    // Header of the cluster grid storage buffer, followed by one ClusterLightGrid per cluster
+    struct ClusterShaderParamBlock {
+      mat4 view;
+      vec4 clusterSize;
+      vec4 clusterDepth;
+    };
+
+    struct ClusterLightShaderData {
+      vec4 positionRadius;
+      vec4 color;
+    };
+
     struct Cluster {
       uint32_t                            m_verts[8];
 	    vec4	                              m_planes[6];
-      vector<shared_ptr<LightComponent>>* m_lights;
+    };
+
+    struct SliceRange {
+      bool      m_visible;
+      uint32_t  m_firstX;
+      uint32_t  m_lastX;
+      uint32_t  m_firstY;
+      uint32_t  m_lastY;
+      uint32_t  m_firstZ;
+      uint32_t  m_lastZ;
     };
 
     struct ClusterData {
       uint32_t  m_numClusterVerts;
-      vec3*     m_clusterVerts;
       float*    m_localVerts;
 	    uint32_t  m_numXSegments;
 	    uint32_t  m_numYSegments;
 	    uint32_t  m_numZSegments;
       Cluster*  m_clusters;
+      ClusterLightGrid* m_lightGrid;
+      vec4*     m_xPlanes;
+      vec4*     m_yPlanes;
+      vec4*     m_zPlanes;
+      float     m_tanHalfFov;
+      float     m_sliceScale;
+      float     m_sliceBias;
+      float     m_fieldOfView;
+      float     m_nearClip;
+      float     m_farClip;
     };
 
     string                m_name;
-    HINSTANCE             m_hinstance;
-    HWND                  m_window;
     shared_ptr<Graphics>  m_graphics;
 
     WorldManager*                         m_worldManager;
@@ -125,5 +277,56 @@ namespace RenderLab
     ClusterData*                          m_clusterData;
     shared_ptr<Entity>                    m_clusterEntity;
     bool                                  m_freezeClusterEntity;
+    ClusterBinner*                        m_clusterBinner;
+    vector<vec3>                          m_clusterLightPositions;
+    vector<vec3>                          m_clusterLightViewPositions;
+    vector<uint32_t>                      m_clusterLightIndices;
+    vector<vector<uint32_t>>              m_threadLightIndices;
+    vector<vector<uint32_t>>              m_rowLightIndices;
+    vector<uint32_t>                      m_clusterLightList;
+    vector<uint32_t>                      m_rowBucketOffsets;
+    vector<uint32_t>                      m_rowBucketLights;
+    vector<SliceRange>                    m_lightSliceRanges;
+    vector<uint8_t>                       m_sliceOverlaps;
+    shared_ptr<JobSystem>                 m_jobSystem;
+    vector<shared_ptr<Mesh>>              m_passMeshes;
+    vector<uint32_t>                      m_passMeshOffsets;
+    float                                 m_clusterLightRadius;
+    LightAssignment                       m_lightAssignment;
+    bool                                  m_clusteredShading;
+    vector<shared_ptr<UniformBuffer>>     m_clusterGridUniformBuffers;
+    vector<shared_ptr<UniformBuffer>>     m_clusterLightIndexUniformBuffers;
+    vector<shared_ptr<UniformBuffer>>     m_clusterLightUniformBuffers;
+    vector<ClusterLightShaderData>        m_clusterLightShaderData;
+    uint32_t                              m_maxClusterShaderLights;
+    bool                                  m_clusterShaderOverflow;
+    uint32_t                              m_clusterTileWidth;
+    uint32_t                              m_clusterTileHeight;
+    uint32_t                              m_numClusterSlices;
+    ClusterSlicing                        m_clusterSlicing;
+    ClusterStats                          m_clusterStats;
+    FrustumCuller*                        m_frustumCuller;
+    bool                                  m_frustumCulling;
+    CullingMethod                         m_cullingMethod;
+    BoundingVolumeHierarchy*              m_cullingHierarchy;
+    vector<uint32_t>                      m_cullIndices;
+    OcclusionCuller*                      m_occlusionCuller;
+    bool                                  m_occlusionCulling;
+    uint32_t                              m_maxOccluders;
+    float                                 m_minOccluderSize;
+    vector<std::pair<float, uint32_t>>    m_occluderCandidates;
+    vector<uint8_t>                       m_occluderFlags;
+    vector<shared_ptr<Mesh>>              m_meshes;
+    vector<uint32_t>                      m_meshComponents;
+    vector<uint32_t>                      m_meshMaterialIds;
+    DrawList                              m_drawList;
+    vector<uint32_t>                      m_passPipelines;
+    bool                                  m_drawSorting;
+    DrawSortStats                         m_drawSortStats;
+    vector<vector<uint32_t>>              m_shadowCasters;
+    vector<vector<uint8_t>>               m_shadowFaceMasks;
+    map<shared_ptr<View>, vector<uint8_t>> m_meshVisibility;
+    vector<uint8_t>                       m_meshUpdates;
+    CullStats                             m_cullStats;
   };
 }
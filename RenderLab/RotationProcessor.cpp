@@ -28,4 +28,11 @@ namespace RenderLab
 
     m_target->setTransform(currentTransform*m_transform);
   }
+
+  bool RotationProcessor::getAccessSets(vector<Entity*>& readSet, vector<Entity*>& writeSet)
+  {
+    readSet.push_back(m_target.get());
+    writeSet.push_back(m_target.get());
+    return true;
+  }
 }
\ No newline at end of file
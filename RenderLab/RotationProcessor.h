@@ -23,6 +23,7 @@ namespace RenderLab
     ~RotationProcessor();
 
     void execute(double absoluteTime, double deltaTime);
+    bool getAccessSets(vector<Entity*>& readSet, vector<Entity*>& writeSet);
 
   private:
     shared_ptr<Entity>  m_target;
@@ -0,0 +1,230 @@
+#include "stdafx.h"
+#include "TransformStore.h"
+#include "Entity.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+namespace RenderLab
+{
+  TransformStore::TransformStore(string name) :
+    m_name(name),
+    m_firstDirty(0),
+    m_levelsDirty(false)
+  {
+  }
+
+  TransformStore::~TransformStore()
+  {
+    update();
+    for (size_t i = 0; i < m_entities.size(); i++)
+    {
+      m_entities[i]->detachTransformStore(m_localTransforms[i], m_worldTransforms[i]);
+    }
+  }
+
+  void TransformStore::addEntity(shared_ptr<Entity> entity, uint32_t parentIndex)
+  {
+    if (entity->getTransformIndex() != INVALID_INDEX)
+    {
+      return;
+    }
+
+    // Appending keeps parents ahead of children, whatever order subtrees arrive in
+    uint32_t index = (uint32_t)m_localTransforms.size();
+    mat4 transform;
+    entity->getTransform(transform);
+    m_localTransforms.push_back(transform);
+    m_worldTransforms.push_back(transform);
+    m_parents.push_back(parentIndex);
+    m_depths.push_back(parentIndex != INVALID_INDEX ? m_depths[parentIndex] + 1 : 0);
+    m_dirty.push_back(1);
+    m_entities.push_back(entity.get());
+    if (index < m_firstDirty)
+    {
+      m_firstDirty = index;
+    }
+    entity->attachTransformStore(this, index);
+    m_levelsDirty = true;
+
+    for (unsigned int i = 0; i < entity->numChildren(); i++)
+    {
+      addEntity(entity->getChild(i), index);
+    }
+  }
+
+  void TransformStore::removeEntity(shared_ptr<Entity> entity)
+  {
+    uint32_t first = entity->getTransformIndex();
+    if (first == INVALID_INDEX)
+    {
+      return;
+    }
+
+    // Detached entities keep their last world transform
+    update();
+
+    uint32_t numNodes = (uint32_t)m_localTransforms.size();
+    vector<uint32_t> remap(numNodes - first, INVALID_INDEX);
+    uint32_t next = first;
+    for (uint32_t i = first; i < numNodes; i++)
+    {
+      uint32_t parent = m_parents[i];
+      uint32_t newParent = parent;
+      if (parent != INVALID_INDEX && parent >= first)
+      {
+        newParent = remap[parent - first];
+      }
+
+      // The subtree is everything reached from the removed node through removed parents
+      if (i == first || (parent != INVALID_INDEX && parent >= first && newParent == INVALID_INDEX))
+      {
+        m_entities[i]->detachTransformStore(m_localTransforms[i], m_worldTransforms[i]);
+        continue;
+      }
+
+      m_localTransforms[next] = m_localTransforms[i];
+      m_worldTransforms[next] = m_worldTransforms[i];
+      m_parents[next] = newParent;
+      m_depths[next] = m_depths[i];
+      m_entities[next] = m_entities[i];
+      m_entities[next]->setTransformIndex(next);
+      remap[i - first] = next;
+      next++;
+    }
+
+    m_localTransforms.resize(next);
+    m_worldTransforms.resize(next);
+    m_parents.resize(next);
+    m_depths.resize(next);
+    m_dirty.resize(next);
+    m_entities.resize(next);
+    m_firstDirty = next;
+    m_levelsDirty = true;
+  }
+
+  void TransformStore::setLocalTransform(uint32_t index, const mat4& transform)
+  {
+    m_localTransforms[index] = transform;
+    m_dirty[index] = 1;
+
+    uint32_t firstDirty = m_firstDirty.load();
+    while (index < firstDirty && !m_firstDirty.compare_exchange_weak(firstDirty, index))
+    {
+    }
+  }
+
+  void TransformStore::getLocalTransform(uint32_t index, mat4& transform)
+  {
+    transform = m_localTransforms[index];
+  }
+
+  void TransformStore::getWorldTransform(uint32_t index, mat4& transform)
+  {
+    transform = m_worldTransforms[index];
+  }
+
+  uint32_t TransformStore::update()
+  {
+    uint32_t numNodes = (uint32_t)m_localTransforms.size();
+    uint32_t firstDirty = std::min(m_firstDirty.load(), numNodes);
+    uint32_t numUpdated = 0;
+
+    // Not worth waking the pool for a handful of nodes
+    if (m_jobSystem != nullptr && m_jobSystem->getNumThreads() > 1 && numNodes - firstDirty >= 1024)
+    {
+      numUpdated = updateLevels(firstDirty);
+    }
+    else
+    {
+      // Parents are finished before their children are reached, so a dirty
+      // flag only has to be pushed down one level at a time
+      for (uint32_t i = firstDirty; i < numNodes; i++)
+      {
+        if (updateNode(i))
+        {
+          numUpdated++;
+        }
+      }
+    }
+
+    if (firstDirty < numNodes)
+    {
+      memset(&m_dirty[firstDirty], 0, numNodes - firstDirty);
+    }
+    m_firstDirty = numNodes;
+
+    return numUpdated;
+  }
+
+  size_t TransformStore::numNodes()
+  {
+    return m_localTransforms.size();
+  }
+
+  void TransformStore::setJobSystem(shared_ptr<JobSystem> jobSystem)
+  {
+    m_jobSystem = jobSystem;
+  }
+
+  bool TransformStore::updateNode(uint32_t index)
+  {
+    uint32_t parent = m_parents[index];
+    if (parent != INVALID_INDEX && m_dirty[parent])
+    {
+      m_dirty[index] = 1;
+    }
+    if (m_dirty[index])
+    {
+      m_worldTransforms[index] = parent != INVALID_INDEX ? m_worldTransforms[parent] * m_localTransforms[index] : m_localTransforms[index];
+      return true;
+    }
+    return false;
+  }
+
+  uint32_t TransformStore::updateLevels(uint32_t firstDirty)
+  {
+    if (m_levelsDirty)
+    {
+      buildLevels();
+    }
+
+    // Every parent sits one level up, so each level only waits on the one before
+    std::atomic<uint32_t> numUpdated(0);
+    for (size_t level = 0; level < m_levels.size(); level++)
+    {
+      vector<uint32_t>& nodes = m_levels[level];
+      uint32_t first = (uint32_t)(std::lower_bound(nodes.begin(), nodes.end(), firstDirty) - nodes.begin());
+      m_jobSystem->parallelFor((uint32_t)nodes.size() - first, 256, [&](uint32_t begin, uint32_t end)
+      {
+        uint32_t numLevelUpdated = 0;
+        for (uint32_t n = first + begin; n < first + end; n++)
+        {
+          if (updateNode(nodes[n]))
+          {
+            numLevelUpdated++;
+          }
+        }
+        numUpdated += numLevelUpdated;
+      });
+    }
+
+    return numUpdated;
+  }
+
+  void TransformStore::buildLevels()
+  {
+    // Filled in index order, so each level stays sorted
+    m_levels.clear();
+    for (uint32_t i = 0; i < (uint32_t)m_depths.size(); i++)
+    {
+      if (m_depths[i] >= m_levels.size())
+      {
+        m_levels.resize(m_depths[i] + 1);
+      }
+      m_levels[m_depths[i]].push_back(i);
+    }
+    m_levelsDirty = false;
+  }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#include <glm/glm.hpp>
+
+#include "JobSystem.h"
+
+#include <stdint.h>
+
+using glm::mat4;
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+namespace RenderLab
+{
+  class Entity;
+
+  // Flattened transform hierarchy. Local and world transforms live in plain
+  // arrays ordered so a parent always comes before its children, which lets a
+  // single linear pass bring the world transforms up to date. Only dirty nodes
+  // and the nodes below them are recomputed. With a job system the pass runs
+  // one hierarchy level at a time, splitting each level across threads.
+  // Local transforms of different nodes may be set from different threads.
+  class TransformStore
+  {
+  public:
+    static const uint32_t INVALID_INDEX = 0xffffffff;
+
+    TransformStore(string name);
+    ~TransformStore();
+
+    void      addEntity(shared_ptr<Entity> entity, uint32_t parentIndex);
+    void      removeEntity(shared_ptr<Entity> entity);
+    void      setLocalTransform(uint32_t index, const mat4& transform);
+    void      getLocalTransform(uint32_t index, mat4& transform);
+    void      getWorldTransform(uint32_t index, mat4& transform);
+    uint32_t  update();
+    size_t    numNodes();
+    void      setJobSystem(shared_ptr<JobSystem> jobSystem);
+
+  private:
+    bool      updateNode(uint32_t index);
+    uint32_t  updateLevels(uint32_t firstDirty);
+    void      buildLevels();
+
+    string                    m_name;
+    vector<mat4>              m_localTransforms;
+    vector<mat4>              m_worldTransforms;
+    vector<uint32_t>          m_parents;
+    vector<uint32_t>          m_depths;
+    vector<uint8_t>           m_dirty;
+    vector<Entity*>           m_entities;
+    std::atomic<uint32_t>     m_firstDirty;
+    vector<vector<uint32_t>>  m_levels;
+    bool                      m_levelsDirty;
+    shared_ptr<JobSystem>     m_jobSystem;
+  };
+}
@@ -34,4 +34,11 @@ namespace RenderLab
 
     m_entity->setTransform(currentTransform*transform);
   }
+
+  bool TranslationProcessor::getAccessSets(vector<Entity*>& readSet, vector<Entity*>& writeSet)
+  {
+    readSet.push_back(m_entity.get());
+    writeSet.push_back(m_entity.get());
+    return true;
+  }
 }
@@ -8,8 +8,6 @@
 
 #include <string>
 
-#include <atlstr.h>
-
 using std::string;
 using glm::mat4;
 using glm::vec3;
@@ -25,6 +23,7 @@ namespace RenderLab
     ~TranslationProcessor();
 
     void  execute(double absoluteTime, double deltaTime);
+    bool  getAccessSets(vector<Entity*>& readSet, vector<Entity*>& writeSet);
 
   private:
     float m_start;
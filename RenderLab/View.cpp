@@ -34,7 +34,7 @@ namespace RenderLab
     viewTransform = m_viewMatrix;
   }
 
-  void View::setViewTransform(mat4& viewTransform)
+  void View::setViewTransform(const mat4& viewTransform)
   {
     m_viewMatrix = viewTransform;
   }
@@ -74,7 +74,7 @@ namespace RenderLab
     return m_farClip;
   }
 
-  void View::setViewportPosition(vec2& position)
+  void View::setViewportPosition(const vec2& position)
   {
     m_viewportPosition = position;
   }
@@ -84,7 +84,7 @@ namespace RenderLab
     position = m_viewportPosition;
   }
 
-  void View::setViewportSize(vec2& size)
+  void View::setViewportSize(const vec2& size)
   {
     m_viewportSize = size;
   }
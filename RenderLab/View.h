@@ -30,14 +30,15 @@ namespace RenderLab
       SCREEN,
       SHADOW,
       SHADOW_CUBE,
-      REFLECTION
+      REFLECTION,
+      OFFSCREEN
     };
 
     View(string name, Type type);
     ~View();
 
     Type getType();
-    void setViewTransform(mat4& viewTransform);
+    void setViewTransform(const mat4& viewTransform);
     void getViewTransform(mat4& viewTransform);
     void getProjectionTransform(mat4& projectionTransform);
 
@@ -47,9 +48,9 @@ namespace RenderLab
     float getNearClip();
     void  setFarClip(float farClip);
     float getFarClip();
-    void  setViewportPosition(vec2& position);
+    void  setViewportPosition(const vec2& position);
     void  getViewportPosition(vec2& position);
-    void  setViewportSize(vec2& size);
+    void  setViewportSize(const vec2& size);
     void  getViewportSize(vec2& size);
     void  addCompositeMesh(shared_ptr<Mesh> mesh);
     shared_ptr<Mesh>  getCompositeMesh(size_t index);
@@ -0,0 +1,535 @@
+#include "stdafx.h"
+#include "VulkanAllocator.h"
+
+namespace RenderLab
+{
+  static uint32_t highestBit(VkDeviceSize value)
+  {
+    uint32_t bit = 0;
+    while (value >>= 1)
+    {
+      bit++;
+    }
+    return bit;
+  }
+
+  static uint32_t lowestBit(uint32_t value)
+  {
+    uint32_t bit = 0;
+    while ((value & 1) == 0)
+    {
+      value >>= 1;
+      bit++;
+    }
+    return bit;
+  }
+
+  static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+  {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  VulkanAllocator::VulkanAllocator(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize) :
+    m_device(device),
+    m_blockSize(blockSize),
+    m_numDedicated(0),
+    m_dedicatedBytes(0)
+  {
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_memoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    m_bufferImageGranularity = properties.limits.bufferImageGranularity > 0 ? properties.limits.bufferImageGranularity : 1;
+  }
+
+  VulkanAllocator::~VulkanAllocator()
+  {
+    for (size_t i = 0; i < m_blocks.size(); i++)
+    {
+      Block* block = m_blocks[i];
+      Range* range = block->m_firstRange;
+      while (range != nullptr)
+      {
+        Range* next = range->m_next;
+        delete range;
+        range = next;
+      }
+      vkFreeMemory(m_device, block->m_memory, nullptr);
+      delete block;
+    }
+  }
+
+  bool VulkanAllocator::allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool optimalImage, Strategy strategy, Allocation& allocation)
+  {
+    allocation = {};
+
+    uint32_t memoryTypeIndex;
+    if (!findMemoryType(requirements.memoryTypeBits, properties, memoryTypeIndex))
+    {
+      return false;
+    }
+
+    // Small heaps, like the host visible window into device memory, get smaller blocks
+    uint32_t heapIndex = m_memoryProperties.memoryTypes[memoryTypeIndex].heapIndex;
+    VkDeviceSize blockSize = m_blockSize;
+    if (m_memoryProperties.memoryHeaps[heapIndex].size / 8 < blockSize)
+    {
+      blockSize = m_memoryProperties.memoryHeaps[heapIndex].size / 8;
+    }
+    bool hostVisible = (m_memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+
+    if (requirements.size >= blockSize / 2)
+    {
+      VkMemoryAllocateInfo memoryAllocateInfo = {};
+      memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+      memoryAllocateInfo.allocationSize = requirements.size;
+      memoryAllocateInfo.memoryTypeIndex = memoryTypeIndex;
+      if (vkAllocateMemory(m_device, &memoryAllocateInfo, nullptr, &allocation.m_memory) != VK_SUCCESS)
+      {
+        return false;
+      }
+
+      if (hostVisible)
+      {
+        vkMapMemory(m_device, allocation.m_memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(&allocation.m_data));
+      }
+      allocation.m_size = requirements.size;
+      m_numDedicated++;
+      m_dedicatedBytes += requirements.size;
+      return true;
+    }
+
+    for (size_t i = 0; i < m_blocks.size(); i++)
+    {
+      Block* block = m_blocks[i];
+      if (block->m_memoryTypeIndex != memoryTypeIndex || block->m_strategy != strategy)
+      {
+        continue;
+      }
+
+      if (strategy == LINEAR ? allocateLinear(block, requirements.size, requirements.alignment, optimalImage, allocation) :
+                               allocateTLSF(block, requirements.size, requirements.alignment, optimalImage, allocation))
+      {
+        return true;
+      }
+    }
+
+    Block* block = createBlock(memoryTypeIndex, strategy, blockSize);
+    if (block == nullptr)
+    {
+      return false;
+    }
+
+    return strategy == LINEAR ? allocateLinear(block, requirements.size, requirements.alignment, optimalImage, allocation) :
+                                allocateTLSF(block, requirements.size, requirements.alignment, optimalImage, allocation);
+  }
+
+  bool VulkanAllocator::allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, Strategy strategy, Allocation& allocation)
+  {
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(m_device, buffer, &requirements);
+    if (!allocate(requirements, properties, false, strategy, allocation))
+    {
+      return false;
+    }
+
+    vkBindBufferMemory(m_device, buffer, allocation.m_memory, allocation.m_offset);
+    return true;
+  }
+
+  bool VulkanAllocator::allocateImage(VkImage image, bool optimalTiling, VkMemoryPropertyFlags properties, Strategy strategy, Allocation& allocation)
+  {
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(m_device, image, &requirements);
+    if (!allocate(requirements, properties, optimalTiling, strategy, allocation))
+    {
+      return false;
+    }
+
+    vkBindImageMemory(m_device, image, allocation.m_memory, allocation.m_offset);
+    return true;
+  }
+
+  void VulkanAllocator::free(Allocation& allocation)
+  {
+    if (allocation.m_memory == VK_NULL_HANDLE)
+    {
+      return;
+    }
+
+    Block* block = (Block*)allocation.m_block;
+    if (block == nullptr)
+    {
+      vkFreeMemory(m_device, allocation.m_memory, nullptr);
+      m_numDedicated--;
+      m_dedicatedBytes -= allocation.m_size;
+    }
+    else if (block->m_strategy == LINEAR)
+    {
+      // Space is only handed back once the whole block is empty
+      block->m_numAllocations--;
+      block->m_usedBytes -= allocation.m_size;
+      if (block->m_numAllocations == 0)
+      {
+        block->m_linearOffset = 0;
+        block->m_allocatedBytes = 0;
+      }
+    }
+    else
+    {
+      freeTLSF(block, (Range*)allocation.m_range);
+    }
+
+    allocation = {};
+  }
+
+  void VulkanAllocator::getStats(Stats& stats)
+  {
+    stats = {};
+    stats.m_numDedicated = m_numDedicated;
+    stats.m_numAllocations = m_numDedicated;
+    stats.m_reservedBytes = m_dedicatedBytes;
+    stats.m_usedBytes = m_dedicatedBytes;
+
+    for (size_t i = 0; i < m_blocks.size(); i++)
+    {
+      Block* block = m_blocks[i];
+      stats.m_numBlocks++;
+      stats.m_numAllocations += block->m_numAllocations;
+      stats.m_reservedBytes += block->m_size;
+      stats.m_usedBytes += block->m_usedBytes;
+      stats.m_wastedBytes += block->m_allocatedBytes - block->m_usedBytes;
+
+      VkDeviceSize freeBytes = block->m_size - block->m_allocatedBytes;
+      VkDeviceSize largestFree = freeBytes;
+      if (block->m_strategy == TLSF)
+      {
+        largestFree = 0;
+        for (Range* range = block->m_firstRange; range != nullptr; range = range->m_next)
+        {
+          if (range->m_free && range->m_size > largestFree)
+          {
+            largestFree = range->m_size;
+          }
+        }
+      }
+      stats.m_freeBytes += freeBytes;
+      stats.m_fragmentedBytes += freeBytes - largestFree;
+    }
+  }
+
+  bool VulkanAllocator::findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties, uint32_t& typeIndex)
+  {
+    for (uint32_t i = 0; i < m_memoryProperties.memoryTypeCount; i++)
+    {
+      if ((typeBits & (1 << i)) && (m_memoryProperties.memoryTypes[i].propertyFlags & properties) == properties)
+      {
+        typeIndex = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  VulkanAllocator::Block* VulkanAllocator::createBlock(uint32_t memoryTypeIndex, Strategy strategy, VkDeviceSize size)
+  {
+    VkMemoryAllocateInfo memoryAllocateInfo = {};
+    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memoryAllocateInfo.allocationSize = size;
+    memoryAllocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(m_device, &memoryAllocateInfo, nullptr, &memory) != VK_SUCCESS)
+    {
+      return nullptr;
+    }
+
+    Block* block = new Block();
+    *block = {};
+    block->m_memory = memory;
+    block->m_memoryTypeIndex = memoryTypeIndex;
+    block->m_strategy = strategy;
+    block->m_size = size;
+
+    if (m_memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+      vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(&block->m_data));
+    }
+
+    if (strategy == TLSF)
+    {
+      Range* range = new Range();
+      *range = {};
+      range->m_size = size;
+      range->m_free = true;
+      block->m_firstRange = range;
+      insertFree(block, range);
+    }
+
+    m_blocks.push_back(block);
+    return block;
+  }
+
+  bool VulkanAllocator::allocateLinear(Block* block, VkDeviceSize size, VkDeviceSize alignment, bool optimalImage, Allocation& allocation)
+  {
+    VkDeviceSize offset = alignUp(block->m_linearOffset, alignment);
+    if (block->m_numAllocations > 0 && block->m_lastOptimalImage != optimalImage && onSamePage(block->m_linearOffset - 1, offset))
+    {
+      offset = alignUp(offset, m_bufferImageGranularity);
+    }
+    if (offset + size > block->m_size)
+    {
+      return false;
+    }
+
+    block->m_linearOffset = offset + size;
+    block->m_lastOptimalImage = optimalImage;
+    block->m_numAllocations++;
+    block->m_usedBytes += size;
+    block->m_allocatedBytes = block->m_linearOffset;
+
+    allocation.m_memory = block->m_memory;
+    allocation.m_offset = offset;
+    allocation.m_size = size;
+    allocation.m_data = block->m_data != nullptr ? block->m_data + offset : nullptr;
+    allocation.m_block = block;
+    allocation.m_range = nullptr;
+    return true;
+  }
+
+  bool VulkanAllocator::allocateTLSF(Block* block, VkDeviceSize size, VkDeviceSize alignment, bool optimalImage, Allocation& allocation)
+  {
+    // Round up to the next list boundary so any range in the first list found is big enough
+    VkDeviceSize searchSize = size;
+    if (searchSize >= SL_COUNT)
+    {
+      searchSize += ((VkDeviceSize)1 << (highestBit(searchSize) - SL_LOG2)) - 1;
+    }
+    uint32_t fl, sl;
+    mapping(searchSize, fl, sl);
+
+    Range* range = nullptr;
+    VkDeviceSize offset = 0;
+    for (uint32_t f = fl; f < FL_COUNT && range == nullptr; f++)
+    {
+      if ((block->m_flBitmap >> f) == 0)
+      {
+        break;
+      }
+
+      uint32_t slMap = block->m_slBitmap[f] & (f == fl ? (~0u << sl) : ~0u);
+      while (slMap != 0 && range == nullptr)
+      {
+        uint32_t s = lowestBit(slMap);
+        slMap &= slMap - 1;
+
+        // Alignment or granularity can still rule a range out, so keep looking
+        for (Range* candidate = block->m_freeLists[f][s]; candidate != nullptr; candidate = candidate->m_nextFree)
+        {
+          if (fitRange(candidate, size, alignment, optimalImage, offset))
+          {
+            range = candidate;
+            break;
+          }
+        }
+      }
+    }
+
+    if (range == nullptr)
+    {
+      return false;
+    }
+
+    removeFree(block, range);
+
+    // Padding too small to be worth tracking stays with the allocation
+    VkDeviceSize front = offset - range->m_offset;
+    if (front >= MIN_RANGE_SIZE)
+    {
+      Range* frontRange = new Range();
+      *frontRange = {};
+      frontRange->m_offset = range->m_offset;
+      frontRange->m_size = front;
+      frontRange->m_free = true;
+      frontRange->m_prev = range->m_prev;
+      frontRange->m_next = range;
+      if (range->m_prev != nullptr)
+      {
+        range->m_prev->m_next = frontRange;
+      }
+      else
+      {
+        block->m_firstRange = frontRange;
+      }
+      range->m_prev = frontRange;
+      range->m_offset += front;
+      range->m_size -= front;
+      insertFree(block, frontRange);
+    }
+
+    VkDeviceSize back = range->m_offset + range->m_size - (offset + size);
+    if (back >= MIN_RANGE_SIZE)
+    {
+      Range* backRange = new Range();
+      *backRange = {};
+      backRange->m_offset = offset + size;
+      backRange->m_size = back;
+      backRange->m_free = true;
+      backRange->m_prev = range;
+      backRange->m_next = range->m_next;
+      if (range->m_next != nullptr)
+      {
+        range->m_next->m_prev = backRange;
+      }
+      range->m_next = backRange;
+      range->m_size -= back;
+      insertFree(block, backRange);
+    }
+
+    range->m_free = false;
+    range->m_usedSize = size;
+    range->m_optimalImage = optimalImage;
+    block->m_numAllocations++;
+    block->m_usedBytes += size;
+    block->m_allocatedBytes += range->m_size;
+
+    allocation.m_memory = block->m_memory;
+    allocation.m_offset = offset;
+    allocation.m_size = size;
+    allocation.m_data = block->m_data != nullptr ? block->m_data + offset : nullptr;
+    allocation.m_block = block;
+    allocation.m_range = range;
+    return true;
+  }
+
+  bool VulkanAllocator::fitRange(Range* range, VkDeviceSize size, VkDeviceSize alignment, bool optimalImage, VkDeviceSize& offset)
+  {
+    offset = alignUp(range->m_offset, alignment);
+
+    // Neighbours of a free range are always allocated, coalescing sees to that
+    Range* prev = range->m_prev;
+    if (prev != nullptr && prev->m_optimalImage != optimalImage && onSamePage(prev->m_offset + prev->m_size - 1, offset))
+    {
+      offset = alignUp(offset, m_bufferImageGranularity);
+    }
+
+    if (offset + size > range->m_offset + range->m_size)
+    {
+      return false;
+    }
+
+    Range* next = range->m_next;
+    if (next != nullptr && next->m_optimalImage != optimalImage && onSamePage(offset + size - 1, next->m_offset))
+    {
+      return false;
+    }
+
+    return true;
+  }
+
+  void VulkanAllocator::freeTLSF(Block* block, Range* range)
+  {
+    block->m_numAllocations--;
+    block->m_usedBytes -= range->m_usedSize;
+    block->m_allocatedBytes -= range->m_size;
+
+    range->m_free = true;
+    range->m_usedSize = 0;
+    range->m_optimalImage = false;
+
+    Range* prev = range->m_prev;
+    if (prev != nullptr && prev->m_free)
+    {
+      removeFree(block, prev);
+      prev->m_size += range->m_size;
+      prev->m_next = range->m_next;
+      if (range->m_next != nullptr)
+      {
+        range->m_next->m_prev = prev;
+      }
+      delete range;
+      range = prev;
+    }
+
+    Range* next = range->m_next;
+    if (next != nullptr && next->m_free)
+    {
+      removeFree(block, next);
+      range->m_size += next->m_size;
+      range->m_next = next->m_next;
+      if (next->m_next != nullptr)
+      {
+        next->m_next->m_prev = range;
+      }
+      delete next;
+    }
+
+    insertFree(block, range);
+  }
+
+  void VulkanAllocator::insertFree(Block* block, Range* range)
+  {
+    uint32_t fl, sl;
+    mapping(range->m_size, fl, sl);
+
+    range->m_prevFree = nullptr;
+    range->m_nextFree = block->m_freeLists[fl][sl];
+    if (range->m_nextFree != nullptr)
+    {
+      range->m_nextFree->m_prevFree = range;
+    }
+    block->m_freeLists[fl][sl] = range;
+    block->m_flBitmap |= 1u << fl;
+    block->m_slBitmap[fl] |= 1u << sl;
+  }
+
+  void VulkanAllocator::removeFree(Block* block, Range* range)
+  {
+    uint32_t fl, sl;
+    mapping(range->m_size, fl, sl);
+
+    if (range->m_prevFree != nullptr)
+    {
+      range->m_prevFree->m_nextFree = range->m_nextFree;
+    }
+    else
+    {
+      block->m_freeLists[fl][sl] = range->m_nextFree;
+    }
+    if (range->m_nextFree != nullptr)
+    {
+      range->m_nextFree->m_prevFree = range->m_prevFree;
+    }
+    range->m_prevFree = nullptr;
+    range->m_nextFree = nullptr;
+
+    if (block->m_freeLists[fl][sl] == nullptr)
+    {
+      block->m_slBitmap[fl] &= ~(1u << sl);
+      if (block->m_slBitmap[fl] == 0)
+      {
+        block->m_flBitmap &= ~(1u << fl);
+      }
+    }
+  }
+
+  void VulkanAllocator::mapping(VkDeviceSize size, uint32_t& fl, uint32_t& sl)
+  {
+    // The first level is the power of two, the second splits it into SL_COUNT lists
+    if (size < SL_COUNT)
+    {
+      fl = 0;
+      sl = (uint32_t)size;
+      return;
+    }
+
+    uint32_t bit = highestBit(size);
+    fl = bit - SL_LOG2 + 1;
+    sl = (uint32_t)(size >> (bit - SL_LOG2)) - SL_COUNT;
+  }
+
+  bool VulkanAllocator::onSamePage(VkDeviceSize endA, VkDeviceSize startB)
+  {
+    return (endA / m_bufferImageGranularity) == (startB / m_bufferImageGranularity);
+  }
+}
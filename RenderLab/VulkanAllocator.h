@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include <stdint.h>
+
+using std::vector;
+
+namespace RenderLab
+{
+  // Sub-allocates device memory out of large per memory type blocks, so a
+  // scene with hundreds of meshes and textures needs a handful of
+  // vkAllocateMemory calls instead of one per resource.
+  //
+  // LINEAR blocks hand out memory with a bump pointer and only reset once
+  // everything in them is freed, for resources that live as long as the
+  // device. TLSF blocks use a two level segregated fit free list with
+  // coalescing, for resources that come and go. Requests of half a block or
+  // more get a dedicated allocation. Host visible blocks stay mapped.
+  // Alignment is honoured per request, and buffers or linear images never
+  // share a bufferImageGranularity page with optimal tiling images.
+  class VulkanAllocator
+  {
+  public:
+    enum Strategy
+    {
+      LINEAR,
+      TLSF
+    };
+
+    struct Allocation
+    {
+      VkDeviceMemory  m_memory;
+      VkDeviceSize    m_offset;
+      VkDeviceSize    m_size;
+      uint8_t*        m_data;     // null unless the memory is host visible
+      void*           m_block;    // null for dedicated allocations
+      void*           m_range;
+    };
+
+    struct Stats
+    {
+      uint32_t      m_numBlocks;
+      uint32_t      m_numDedicated;
+      uint32_t      m_numAllocations;
+      VkDeviceSize  m_reservedBytes;    // allocated from the driver
+      VkDeviceSize  m_usedBytes;        // requested by resources
+      VkDeviceSize  m_wastedBytes;      // alignment and granularity padding, and freed linear space
+      VkDeviceSize  m_freeBytes;
+      VkDeviceSize  m_fragmentedBytes;  // free bytes outside the largest free range of each block
+    };
+
+    VulkanAllocator(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize);
+    ~VulkanAllocator();
+
+    bool  allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool optimalImage, Strategy strategy, Allocation& allocation);
+    bool  allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, Strategy strategy, Allocation& allocation);
+    bool  allocateImage(VkImage image, bool optimalTiling, VkMemoryPropertyFlags properties, Strategy strategy, Allocation& allocation);
+    void  free(Allocation& allocation);
+    void  getStats(Stats& stats);
+
+  private:
+    static const uint32_t     SL_LOG2 = 4;
+    static const uint32_t     SL_COUNT = 1 << SL_LOG2;
+    static const uint32_t     FL_COUNT = 32;
+    static const VkDeviceSize MIN_RANGE_SIZE = 64;
+
+    // A piece of a TLSF block, either free or holding one allocation
+    struct Range
+    {
+      VkDeviceSize  m_offset;
+      VkDeviceSize  m_size;
+      VkDeviceSize  m_usedSize;
+      bool          m_free;
+      bool          m_optimalImage;
+      Range*        m_prev;
+      Range*        m_next;
+      Range*        m_prevFree;
+      Range*        m_nextFree;
+    };
+
+    struct Block
+    {
+      VkDeviceMemory  m_memory;
+      uint32_t        m_memoryTypeIndex;
+      Strategy        m_strategy;
+      VkDeviceSize    m_size;
+      uint8_t*        m_data;
+      uint32_t        m_numAllocations;
+      VkDeviceSize    m_usedBytes;
+      VkDeviceSize    m_allocatedBytes;
+
+      // LINEAR
+      VkDeviceSize    m_linearOffset;
+      bool            m_lastOptimalImage;
+
+      // TLSF
+      Range*          m_firstRange;
+      uint32_t        m_flBitmap;
+      uint32_t        m_slBitmap[FL_COUNT];
+      Range*          m_freeLists[FL_COUNT][SL_COUNT];
+    };
+
+    bool    findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties, uint32_t& typeIndex);
+    Block*  createBlock(uint32_t memoryTypeIndex, Strategy strategy, VkDeviceSize size);
+    bool    allocateLinear(Block* block, VkDeviceSize size, VkDeviceSize alignment, bool optimalImage, Allocation& allocation);
+    bool    allocateTLSF(Block* block, VkDeviceSize size, VkDeviceSize alignment, bool optimalImage, Allocation& allocation);
+    bool    fitRange(Range* range, VkDeviceSize size, VkDeviceSize alignment, bool optimalImage, VkDeviceSize& offset);
+    void    freeTLSF(Block* block, Range* range);
+    void    insertFree(Block* block, Range* range);
+    void    removeFree(Block* block, Range* range);
+    void    mapping(VkDeviceSize size, uint32_t& fl, uint32_t& sl);
+    bool    onSamePage(VkDeviceSize endA, VkDeviceSize startB);
+
+    VkDevice                          m_device;
+    VkPhysicalDeviceMemoryProperties  m_memoryProperties;
+    VkDeviceSize                      m_bufferImageGranularity;
+    VkDeviceSize                      m_blockSize;
+    vector<Block*>                    m_blocks;
+    uint32_t                          m_numDedicated;
+    VkDeviceSize                      m_dedicatedBytes;
+  };
+}
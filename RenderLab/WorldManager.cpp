@@ -4,26 +4,38 @@
 #include "Mesh.h"
 #include "Material.h"
 #include "RenderComponent.h"
-#include "GraphicsVulkan.h"
-#include "GraphicsOpenGL.h"
+#ifndef RENDERLAB_NO_MODEL_LOADER
+#include "ModelLoader.h"
+#endif
 
 using std::make_shared;
 using std::static_pointer_cast;
 
 namespace RenderLab {
-  WorldManager::WorldManager(string name, HINSTANCE hinstance, HWND window) :
+  WorldManager::WorldManager(string name, shared_ptr<Graphics> graphics) :
     m_name(name),
+    m_processorScheduleDirty(false),
+    m_processorScheduling(PARALLEL_PROCESSORS),
+    m_graphics(graphics),
+    m_processorTime(0),
+    m_transformTime(0),
+    m_renderTime(0),
+    m_logging(true),
     m_constantDepthBias(3.0f),
     m_slopeDepthBias(0.0f),
     m_clusterEntityFreeze(false)
   {
-    m_graphics = make_shared<GraphicsVulkan>("Vulkan Graphics", hinstance, window);
-    //m_graphics = make_shared<GraphicsOpenGL>("OpenGL Graphics", hinstance, window);
     m_graphics->initialize(2);
-    m_renderTechnique = make_shared<RenderTechnique>("Default Render Technique", this, hinstance, window, m_graphics);
+    m_jobSystem = make_shared<JobSystem>("Job System", std::thread::hardware_concurrency());
+    m_renderTechnique = make_shared<RenderTechnique>("Default Render Technique", this, m_graphics);
+    m_renderTechnique->setJobSystem(m_jobSystem);
     m_graphics->setRenderTechnique(m_renderTechnique);
 
+#ifndef RENDERLAB_NO_MODEL_LOADER
     m_modelLoader = make_shared<ModelLoader>();
+#endif
+    m_transformStore = make_shared<TransformStore>("World Transforms");
+    m_transformStore->setJobSystem(m_jobSystem);
 
     m_timer.start();
   }
@@ -42,14 +54,23 @@ namespace RenderLab {
     unsigned long long processTime = 0;
     unsigned long long renderTime = 0;
     unsigned long long currentTime = 0;
+    unsigned long long transformStartTime = 0;
     m_lastFrameStartTime = m_frameStartTime;
     m_frameStartTime = m_timer.elapsedMicro();
 
     // Run all the processors
-    for (size_t i = 0; i < m_processors.size(); i++)
+    if (m_processorScheduling == PARALLEL_PROCESSORS)
     {
-      m_processors[i]->execute((double)m_timer.elapsedMicro(), (double)(m_frameStartTime - m_lastFrameStartTime));
+      executeProcessors();
     }
+    else
+    {
+      for (size_t i = 0; i < m_processors.size(); i++)
+      {
+        m_processors[i]->execute((double)m_timer.elapsedMicro(), (double)(m_frameStartTime - m_lastFrameStartTime));
+      }
+    }
+    transformStartTime = m_timer.elapsedMicro();
     updateTransforms();
     currentTime = m_timer.elapsedMicro();
     processTime = currentTime - m_frameStartTime;
@@ -59,20 +80,126 @@ namespace RenderLab {
     m_renderTechnique->render();
 
     renderTime = m_timer.elapsedMicro() - currentTime;
+    m_processorTime = transformStartTime - m_frameStartTime;
+    m_transformTime = currentTime - transformStartTime;
+    m_renderTime = renderTime;
+
     float gpuTime = m_graphics->getGPUFrameTime();
     float gpuTime2 = m_graphics->getGPUFrameTime2();
     printLog("ProcessTime: " + std::to_string((double)processTime/1000.0) + ", RenderTime: " + std::to_string((double)renderTime/1000.0) + ", GPUTime: " + std::to_string((double)gpuTime / 1000000.0) + ", " + std::to_string((double)gpuTime2 / 1000000.0));
   }
 
-  void WorldManager::updateTransforms()
+  void WorldManager::executeProcessors()
   {
-    mat4 identity;
-    for (size_t i = 0; i<m_entities.size(); i++)
+    if (m_processorScheduleDirty)
+    {
+      scheduleProcessors();
+    }
+
+    double absoluteTime = (double)m_timer.elapsedMicro();
+    double deltaTime = (double)(m_frameStartTime - m_lastFrameStartTime);
+    for (size_t wave = 0; wave + 1 < m_processorWaveOffsets.size(); wave++)
+    {
+      uint32_t first = m_processorWaveOffsets[wave];
+      uint32_t count = m_processorWaveOffsets[wave + 1] - first;
+      m_jobSystem->parallelFor(count, 16, [&](uint32_t begin, uint32_t end)
+      {
+        for (uint32_t i = first + begin; i < first + end; i++)
+        {
+          m_scheduledProcessors[i]->execute(absoluteTime, deltaTime);
+        }
+      });
+    }
+  }
+
+  // Packs the processors into waves that can each run concurrently. A
+  // processor goes in the wave after the last earlier one it conflicts with,
+  // so conflicting processors keep their serial order. One that doesn't
+  // declare what it touches gets a wave to itself.
+  void WorldManager::scheduleProcessors()
+  {
+    map<Entity*, uint32_t> lastRead;
+    map<Entity*, uint32_t> lastWrite;
+    vector<uint32_t> processorWaves(m_processors.size());
+    vector<Entity*> readSet;
+    vector<Entity*> writeSet;
+    uint32_t firstWave = 0;
+    uint32_t numWaves = 0;
+
+    for (size_t i = 0; i < m_processors.size(); i++)
+    {
+      readSet.clear();
+      writeSet.clear();
+      uint32_t wave = firstWave;
+      if (!m_processors[i]->getAccessSets(readSet, writeSet))
+      {
+        wave = numWaves;
+        firstWave = wave + 1;
+      }
+      else
+      {
+        for (size_t r = 0; r < readSet.size(); r++)
+        {
+          map<Entity*, uint32_t>::iterator it = lastWrite.find(readSet[r]);
+          if (it != lastWrite.end())
+          {
+            wave = std::max(wave, it->second + 1);
+          }
+        }
+        for (size_t w = 0; w < writeSet.size(); w++)
+        {
+          map<Entity*, uint32_t>::iterator it = lastWrite.find(writeSet[w]);
+          if (it != lastWrite.end())
+          {
+            wave = std::max(wave, it->second + 1);
+          }
+          it = lastRead.find(writeSet[w]);
+          if (it != lastRead.end())
+          {
+            wave = std::max(wave, it->second + 1);
+          }
+        }
+        for (size_t r = 0; r < readSet.size(); r++)
+        {
+          lastRead[readSet[r]] = std::max(lastRead[readSet[r]], wave);
+        }
+        for (size_t w = 0; w < writeSet.size(); w++)
+        {
+          lastWrite[writeSet[w]] = wave;
+        }
+      }
+
+      processorWaves[i] = wave;
+      numWaves = std::max(numWaves, wave + 1);
+    }
+
+    // Lay the waves out back to back, keeping serial order inside each
+    m_processorWaveOffsets.assign(numWaves + 1, 0);
+    for (size_t i = 0; i < m_processors.size(); i++)
     {
-      updateTransform(m_entities[i], identity);
+      m_processorWaveOffsets[processorWaves[i] + 1]++;
     }
+    for (uint32_t wave = 0; wave < numWaves; wave++)
+    {
+      m_processorWaveOffsets[wave + 1] += m_processorWaveOffsets[wave];
+    }
+    m_scheduledProcessors.resize(m_processors.size());
+    vector<uint32_t> waveFill(m_processorWaveOffsets.begin(), m_processorWaveOffsets.end() - 1);
+    for (size_t i = 0; i < m_processors.size(); i++)
+    {
+      m_scheduledProcessors[waveFill[processorWaves[i]]++] = m_processors[i].get();
+    }
+
+    m_processorScheduleDirty = false;
+    printLog("Processor schedule: " + std::to_string(m_processors.size()) + " processors in " + std::to_string(numWaves) + " waves");
+  }
+
+  void WorldManager::updateTransforms()
+  {
+    m_transformStore->update();
   }
 
+  // Recursive walk the TransformStore replaced, kept as the benchmark baseline
   void WorldManager::updateTransform(shared_ptr<Entity> entity, mat4& parent)
   {
     entity->updateCompositeTransform(parent);
@@ -92,6 +219,7 @@ namespace RenderLab {
   void WorldManager::addEntity(shared_ptr<Entity> entity)
   {
     m_entities.push_back(entity);
+    m_transformStore->addEntity(entity, TransformStore::INVALID_INDEX);
     processAddEntity(entity);
   }
 
@@ -101,6 +229,7 @@ namespace RenderLab {
     {
       if (*it == entity)
       {
+        m_transformStore->removeEntity(entity);
         m_entities.erase(it);
         return;
       }
@@ -171,6 +300,7 @@ namespace RenderLab {
   void WorldManager::addProcessorComponent(shared_ptr<ProcessorComponent> processorComponent)
   {
     m_processors.push_back(processorComponent);
+    m_processorScheduleDirty = true;
   }
 
   void WorldManager::addLightComponent(shared_ptr<LightComponent> lightComponent, shared_ptr<Entity> entity)
@@ -190,6 +320,7 @@ namespace RenderLab {
       if (*it == processorComponent)
       {
         m_processors.erase(it);
+        m_processorScheduleDirty = true;
         return;
       }
     }
@@ -253,6 +384,64 @@ namespace RenderLab {
         m_clusterEntityFreeze = !m_clusterEntityFreeze;
         m_renderTechnique->setClusterEntityFreeze(m_clusterEntityFreeze);
         break;
+      case VK_F2:
+        m_renderTechnique->benchmarkClusterBinning(100);
+        break;
+      case VK_F3:
+        if (m_renderTechnique->getLightAssignment() == RenderTechnique::BRUTE_FORCE)
+        {
+          m_renderTechnique->setLightAssignment(RenderTechnique::SEPARABLE);
+          printLog("Light assignment: separable");
+        }
+        else
+        {
+          m_renderTechnique->setLightAssignment(RenderTechnique::BRUTE_FORCE);
+          printLog("Light assignment: brute force");
+        }
+        break;
+      case VK_F4:
+        m_renderTechnique->validateLightAssignment();
+        break;
+      case VK_F5:
+        m_renderTechnique->benchmarkClusterScaling(20);
+        break;
+      case VK_F6:
+        if (m_renderTechnique->getClusteredShading())
+        {
+          m_renderTechnique->setClusteredShading(false);
+          printLog("Deferred lighting: light volumes");
+        }
+        else
+        {
+          m_renderTechnique->setClusteredShading(true);
+          printLog("Deferred lighting: clustered");
+        }
+        break;
+      case VK_F7:
+        m_renderTechnique->logClusterStats();
+        break;
+      case VK_F8:
+        m_renderTechnique->benchmarkClusterGrid(20);
+        break;
+      case VK_F9:
+        benchmarkTransforms(100);
+        break;
+      case VK_F11:
+        if (m_processorScheduling == PARALLEL_PROCESSORS)
+        {
+          m_processorScheduling = SERIAL_PROCESSORS;
+          printLog("Processors: serial");
+        }
+        else
+        {
+          m_processorScheduling = PARALLEL_PROCESSORS;
+          printLog("Processors: parallel");
+        }
+        break;
+      case VK_F12:
+        m_renderTechnique->setFrustumCulling(!m_renderTechnique->getFrustumCulling());
+        printLog(m_renderTechnique->getFrustumCulling() ? "Frustum culling: on" : "Frustum culling: off");
+        break;
       }
     }
 
@@ -278,19 +467,184 @@ namespace RenderLab {
 
   shared_ptr<Entity> WorldManager::loadAssimpModel(string filename)
   {
+#ifndef RENDERLAB_NO_MODEL_LOADER
     return m_modelLoader->loadAssimpModel(filename);
+#else
+    printLog("No model loader, cannot load " + filename);
+    return nullptr;
+#endif
   }
 
   shared_ptr<Entity>  WorldManager::loadGLTFModel(string filename)
   {
+#ifndef RENDERLAB_NO_MODEL_LOADER
     return m_modelLoader->loadGLTFModel(filename);
+#else
+    printLog("No model loader, cannot load " + filename);
+    return nullptr;
+#endif
+  }
+
+  shared_ptr<JobSystem> WorldManager::getJobSystem()
+  {
+    return m_jobSystem;
+  }
+
+  shared_ptr<RenderTechnique> WorldManager::getRenderTechnique()
+  {
+    return m_renderTechnique;
+  }
+
+  void WorldManager::setNumThreads(uint32_t numThreads)
+  {
+    if (numThreads == 0)
+    {
+      numThreads = std::thread::hardware_concurrency();
+    }
+    if (numThreads == m_jobSystem->getNumThreads())
+    {
+      return;
+    }
+
+    m_jobSystem = make_shared<JobSystem>("Job System", numThreads);
+    m_renderTechnique->setJobSystem(m_jobSystem);
+    m_transformStore->setJobSystem(m_jobSystem);
+  }
+
+  uint32_t WorldManager::getNumThreads()
+  {
+    return m_jobSystem->getNumThreads();
+  }
+
+  void WorldManager::setProcessorScheduling(ProcessorScheduling processorScheduling)
+  {
+    m_processorScheduling = processorScheduling;
+  }
+
+  WorldManager::ProcessorScheduling WorldManager::getProcessorScheduling()
+  {
+    return m_processorScheduling;
+  }
+
+  void WorldManager::benchmarkTransforms(uint32_t iterations)
+  {
+    // A root with a node per material group, each holding that group's meshes.
+    // 32 groups of 12 is about the size of Sponza, then ten times that.
+    uint32_t numGroups[] = { 32, 320 };
+    uint32_t numMeshesPerGroup = 12;
+    mat4 identity;
+    CpuTimer timer;
+
+    printLog("Transform update: " + std::to_string(iterations) + " iterations");
+    for (uint32_t s = 0; s < 2; s++)
+    {
+      shared_ptr<Entity> root = make_shared<Entity>("Benchmark Root");
+      vector<shared_ptr<Entity>> meshes;
+      for (uint32_t g = 0; g < numGroups[s]; g++)
+      {
+        shared_ptr<Entity> group = make_shared<Entity>("Benchmark Group");
+        group->setTransform(glm::translate(mat4(), vec3((float)g, 0.0f, 0.0f)));
+        root->addChild(group);
+        for (uint32_t m = 0; m < numMeshesPerGroup; m++)
+        {
+          shared_ptr<Entity> mesh = make_shared<Entity>("Benchmark Mesh");
+          mesh->setTransform(glm::translate(mat4(), vec3(0.0f, (float)m, 0.0f)));
+          group->addChild(mesh);
+          meshes.push_back(mesh);
+        }
+      }
+      uint32_t numNodes = 1 + numGroups[s] * (1 + numMeshesPerGroup);
+
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        updateTransform(root, identity);
+      }
+      double recursiveTime = (double)timer.elapsedMicro() / iterations;
+
+      vector<mat4> recursiveTransforms(meshes.size());
+      for (size_t i = 0; i < meshes.size(); i++)
+      {
+        meshes[i]->getCompositeTransform(recursiveTransforms[i]);
+      }
+
+      TransformStore transformStore("Benchmark Transforms");
+      transformStore.addEntity(root, TransformStore::INVALID_INDEX);
+
+      // The whole tree moves, as when the root is animated
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        root->setTransform(identity);
+        transformStore.update();
+      }
+      double allDirtyTime = (double)timer.elapsedMicro() / iterations;
+
+      // A single mesh moves
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        mat4 transform;
+        meshes[it % meshes.size()]->getTransform(transform);
+        meshes[it % meshes.size()]->setTransform(transform);
+        transformStore.update();
+      }
+      double oneDirtyTime = (double)timer.elapsedMicro() / iterations;
+
+      // Nothing moved
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        transformStore.update();
+      }
+      double cleanTime = (double)timer.elapsedMicro() / iterations;
+
+      // The whole tree again, one level at a time across the pool
+      transformStore.setJobSystem(m_jobSystem);
+      timer.start();
+      for (uint32_t it = 0; it < iterations; it++)
+      {
+        root->setTransform(identity);
+        transformStore.update();
+      }
+      double parallelTime = (double)timer.elapsedMicro() / iterations;
+
+      size_t mismatches = 0;
+      for (size_t i = 0; i < meshes.size(); i++)
+      {
+        mat4 transform;
+        meshes[i]->getCompositeTransform(transform);
+        if (transform != recursiveTransforms[i])
+        {
+          mismatches++;
+        }
+      }
+
+      printLog("  " + std::to_string(numNodes) + " entities: recursive " + std::to_string(recursiveTime) + " us, store all dirty " + std::to_string(allDirtyTime) +
+        " us, one dirty " + std::to_string(oneDirtyTime) + " us, clean " + std::to_string(cleanTime) + " us, all dirty on " +
+        std::to_string(m_jobSystem->getNumThreads()) + " threads " + std::to_string(parallelTime) + " us, mismatches: " + std::to_string(mismatches));
+    }
+  }
+
+  // CPU time of the last frame in microseconds, split into its phases
+  void WorldManager::getFrameTimes(unsigned long long& processorTime, unsigned long long& transformTime, unsigned long long& renderTime)
+  {
+    processorTime = m_processorTime;
+    transformTime = m_transformTime;
+    renderTime = m_renderTime;
+  }
+
+  void WorldManager::setLogging(bool logging)
+  {
+    m_logging = logging;
   }
 
   void WorldManager::printLog(string s)
   {
-    string st = s + "\n";
-    TCHAR name[256];
-    _tcscpy_s(name, CA2T(st.c_str()));
-    OutputDebugString(name);
+    if (!m_logging)
+    {
+      return;
+    }
+    printDebugString(s + "\n");
   }
 }
\ No newline at end of file
@@ -11,18 +11,14 @@
 #include "LightComponent.h"
 #include "Graphics.h"
 #include "CpuTimer.h"
-#include "ModelLoader.h"
+#include "JobSystem.h"
+#include "TransformStore.h"
 
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
 
-#include <assimp/Importer.hpp>
-#include <assimp/scene.h> 
-#include <assimp/postprocess.h>
-#include <assimp/mesh.h>
-
 using std::string;
 using std::vector;
 using std::shared_ptr;
@@ -38,7 +34,13 @@ namespace RenderLab
   class WorldManager
   {
   public:
-    WorldManager(string name, HINSTANCE hinstance, HWND window);
+    enum ProcessorScheduling
+    {
+      SERIAL_PROCESSORS,
+      PARALLEL_PROCESSORS
+    };
+
+    WorldManager(string name, shared_ptr<Graphics> graphics);
     ~WorldManager();
 
     void                addEntity(shared_ptr<Entity> entity);
@@ -62,6 +64,15 @@ namespace RenderLab
 
 
     void                updateWindow(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+    shared_ptr<JobSystem> getJobSystem();
+    shared_ptr<RenderTechnique> getRenderTechnique();
+    void                setNumThreads(uint32_t numThreads);
+    uint32_t            getNumThreads();
+    void                setProcessorScheduling(ProcessorScheduling processorScheduling);
+    ProcessorScheduling getProcessorScheduling();
+    void                benchmarkTransforms(uint32_t iterations);
+    void                getFrameTimes(unsigned long long& processorTime, unsigned long long& transformTime, unsigned long long& renderTime);
+    void                setLogging(bool logging);
     void                printLog(string s);
 
   private:
@@ -70,13 +81,23 @@ namespace RenderLab
     vector<shared_ptr<Entity>>                m_entities;
     vector<shared_ptr<View>>                  m_views;
     vector<shared_ptr<ProcessorComponent>>    m_processors;
+    vector<ProcessorComponent*>               m_scheduledProcessors;
+    vector<uint32_t>                          m_processorWaveOffsets;
+    bool                                      m_processorScheduleDirty;
+    ProcessorScheduling                       m_processorScheduling;
     shared_ptr<Graphics>                      m_graphics;
     shared_ptr<RenderTechnique>               m_renderTechnique;
     shared_ptr<ModelLoader>                   m_modelLoader;
+    shared_ptr<JobSystem>                     m_jobSystem;
+    shared_ptr<TransformStore>                m_transformStore;
     CpuTimer                                  m_timer;
     unsigned long long                        m_frameStartTime;
     unsigned long long                        m_lastFrameStartTime;
     unsigned long long                        m_totalTime;
+    unsigned long long                        m_processorTime;
+    unsigned long long                        m_transformTime;
+    unsigned long long                        m_renderTime;
+    bool                                      m_logging;
     float                                     m_constantDepthBias;
     float                                     m_slopeDepthBias;
     bool                                      m_clusterEntityFreeze;
@@ -91,6 +112,8 @@ namespace RenderLab
     void removeRenderComponent(shared_ptr<RenderComponent> renderComponent, shared_ptr<Entity> entity);
 
 
+    void executeProcessors();
+    void scheduleProcessors();
     void updateTransforms();
     void updateTransform(shared_ptr<Entity> entity, mat4& parent);
   };
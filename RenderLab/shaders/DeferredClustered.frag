@@ -0,0 +1,239 @@
+#version 440
+
+precision highp float;
+
+struct Light
+{
+  mat4 light_view_projections[6];
+  vec4 light_position;
+  vec4 light_color;
+};
+
+struct ClusterLight
+{
+  vec4 position_radius;
+  vec4 color;
+};
+
+layout(std140, set = 0, binding = 0) readonly buffer frame_param_block {
+	ivec4 lightInfo;
+	vec4 viewPosition;
+	Light lights[6];
+} frameParams;
+
+layout (binding = 2) uniform sampler2D position_sampler;
+layout (binding = 3) uniform sampler2D normal_sampler;
+layout (binding = 4) uniform sampler2D albedo_sampler;
+layout (binding = 5) uniform sampler2D metallic_roughness_sampler;
+layout (binding = 6) uniform sampler2D emissive_sampler;
+
+// x, y and z cluster counts with the tangent of the half field of view in w,
+// then the slice scale and bias, applied to log(depth) when z is set, then
+// (offset, count) per cluster
+layout(std430, set = 0, binding = 7) readonly buffer cluster_grid_block {
+  mat4 view;
+  vec4 clusterSize;
+  vec4 clusterDepth;
+  uvec2 grid[];
+} clusterGrid;
+
+layout(std430, set = 0, binding = 8) readonly buffer cluster_light_index_block {
+  uint indices[];
+} clusterLightIndices;
+
+layout(std430, set = 0, binding = 9) readonly buffer cluster_light_block {
+  ClusterLight lights[];
+} clusterLights;
+
+layout(location = 0) out vec4 fragcolor;
+
+#define PI 3.14159265359f
+
+vec3 Fresnel_Schlick(vec3 specularColor, vec3 l, vec3 h)
+{
+    return (specularColor + (1.0f - specularColor) * pow((1.0f - dot(l, h)), 5));
+}
+
+vec3 Specular_F(vec3 specularColor, vec3 l, vec3 h)
+{
+    //return Fresnel_None(specularColor);
+    return Fresnel_Schlick(specularColor, l, h);
+    //return Fresnel_CookTorrance(specularColor, h, v);
+}
+
+float NormalDistribution_GGX(float a, float NdH)
+{
+    // Isotropic ggx.
+    float a2 = a*a;
+    float NdH2 = NdH * NdH;
+
+    float denominator = NdH2 * (a2 - 1.0f) + 1.0f;
+    denominator *= denominator;
+    denominator *= PI;
+
+    return a2 / denominator;
+}
+
+float NormalDistribution_BlinnPhong(float a, float NdH)
+{
+    return (1 / (PI * a * a)) * pow(NdH, 2 / (a * a) - 2);
+}
+
+float NormalDistribution_Beckmann(float a, float NdH)
+{
+    float a2 = a * a;
+    float NdH2 = NdH * NdH;
+
+    return (1.0f/(PI * a2 * NdH2 * NdH2 + 0.001)) * exp( (NdH2 - 1.0f) / ( a2 * NdH2));
+}
+
+float Specular_D(float a, float NdH)
+{
+    //return NormalDistribution_BlinnPhong(a, NdH);
+    //return NormalDistribution_Beckmann(a, NdH);
+    return NormalDistribution_GGX(a, NdH);
+}
+
+//-------------------------- Geometric shadowing -------------------------------------------
+float Geometric_Implicit(float a, float NdV, float NdL)
+{
+    return NdL * NdV;
+}
+
+float Geometric_Neumann(float a, float NdV, float NdL)
+{
+    return (NdL * NdV) / max(NdL, NdV);
+}
+
+float Geometric_CookTorrance(float a, float NdV, float NdL, float NdH, float VdH)
+{
+    return min(1.0f, min((2.0f * NdH * NdV)/VdH, (2.0f * NdH * NdL)/ VdH));
+}
+
+float Geometric_Kelemen(float a, float NdV, float NdL, float LdV)
+{
+    return (2 * NdL * NdV) / (1 + LdV);
+}
+
+float Geometric_Beckman(float a, float dotValue)
+{
+    float c = dotValue / ( a * sqrt(1.0f - dotValue * dotValue));
+
+    if ( c >= 1.6f )
+    {
+        return 1.0f;
+    }
+    else
+    {
+        float c2 = c * c;
+        return (3.535f * c + 2.181f * c2) / ( 1 + 2.276f * c + 2.577f * c2);
+    }
+}
+
+float Geometric_Smith_Beckmann(float a, float NdV, float NdL)
+{
+    return Geometric_Beckman(a, NdV) * Geometric_Beckman(a, NdL);
+}
+
+float Geometric_GGX(float a, float dotValue)
+{
+    float a2 = a * a;
+    return (2.0f * dotValue) / (dotValue + sqrt(a2 + ((1.0f - a2) * (dotValue * dotValue))));
+}
+
+float Geometric_Smith_GGX(float a, float NdV, float NdL)
+{
+    return Geometric_GGX(a, NdV) * Geometric_GGX(a, NdL);
+}
+
+float Geometric_Smith_Schlick_GGX(float a, float NdV, float NdL)
+{
+        // Smith schlick-GGX.
+    float k = a * 0.5f;
+    float GV = NdV / (NdV * (1 - k) + k);
+    float GL = NdL / (NdL * (1 - k) + k);
+
+    return GV * GL;
+}
+
+float Specular_G(float a, float NdV, float NdL, float NdH, float VdH, float LdV)
+{
+  //return Geometric_Implicit(a, NdV, NdL);
+  //return Geometric_Neumann(a, NdV, NdL);
+  //return Geometric_CookTorrance(a, NdV, NdL, NdH, VdH);
+  //return Geometric_Kelemen(a, NdV, NdL, LdV);
+  //return Geometric_Smith_Beckmann(a, NdV, NdL);
+  //return Geometric_Smith_GGX(a, NdV, NdL);
+  return Geometric_Smith_Schlick_GGX(a, NdV, NdL);
+}
+
+vec3 Specular(vec3 specularColor, vec3 h, vec3 v, vec3 l, float a, float NdL, float NdV, float NdH, float VdH, float LdV)
+{
+  vec3 fresnel = Specular_F(specularColor, l, h);
+  float normalDistribution = Specular_D(a, NdH);
+  float visibility = Specular_G(a, NdV, NdL, NdH, VdH, LdV) / (4.0f * NdL * NdV + 0.0001f);
+  return (fresnel * normalDistribution * visibility);
+}
+
+void main()
+{
+  vec2 tex_coord = gl_FragCoord.xy / vec2(textureSize(position_sampler, 0));
+
+  vec4 position_sample = texture(position_sampler, tex_coord);
+  vec3 world_normal = texture(normal_sampler, tex_coord).rgb;
+  vec3 albedo = texture(albedo_sampler, tex_coord).rgb;
+
+  vec3 world_position = position_sample.rgb;
+  float roughness = position_sample.a;
+
+  vec3 specularColor = vec3(0.04, 0.04, 0.04);
+  vec3 viewDirection = normalize(frameParams.viewPosition.xyz - world_position);
+  vec3 diffuse = albedo / PI;
+  float a = max(0.001f, roughness * roughness);
+  float NdV = clamp(dot(world_normal, viewDirection), 0.0, 1.0);
+
+  vec3 finalColor = vec3(0.0f, 0.0f, 0.0f);
+
+  // Find the cluster the same way the CPU slices the view frustum
+  vec3 view_position = (clusterGrid.view * vec4(world_position, 1.0)).xyz;
+  float depth = -view_position.z;
+  float tanHalfFov = clusterGrid.clusterSize.w;
+  int i = int(floor((view_position.x / depth + tanHalfFov) * clusterGrid.clusterSize.x / (2.0 * tanHalfFov)));
+  int j = int(floor((tanHalfFov - view_position.y / depth) * clusterGrid.clusterSize.y / (2.0 * tanHalfFov)));
+  float sliceDepth = clusterGrid.clusterDepth.z > 0.5 ? log(max(depth, 0.0001)) : depth;
+  int k = int(floor(sliceDepth * clusterGrid.clusterDepth.x + clusterGrid.clusterDepth.y));
+
+  if (depth > 0.0 &&
+      i >= 0 && i < int(clusterGrid.clusterSize.x) &&
+      j >= 0 && j < int(clusterGrid.clusterSize.y) &&
+      k >= 0 && k < int(clusterGrid.clusterSize.z))
+  {
+    uvec2 cluster = clusterGrid.grid[(k * int(clusterGrid.clusterSize.y) + j) * int(clusterGrid.clusterSize.x) + i];
+    for (uint n = 0; n < cluster.y; n++)
+    {
+      ClusterLight light = clusterLights.lights[clusterLightIndices.indices[cluster.x + n]];
+
+      vec3 lightDirection = light.position_radius.xyz - world_position;
+      float lightDistance = length(lightDirection);
+      if (lightDistance > light.position_radius.w)
+      {
+        continue;
+      }
+      lightDirection = lightDirection / lightDistance;
+
+      float attenuation = 30 * PI/(lightDistance * lightDistance);
+
+      float NdL = clamp(dot(world_normal, lightDirection), 0.0, 1.0);
+      vec3 h = normalize(lightDirection + viewDirection);
+      float NdH = clamp(dot(world_normal, h), 0.0, 1.0);
+      float VdH = clamp(dot(viewDirection, h), 0.0, 1.0);
+      float LdV = clamp(dot(lightDirection, viewDirection), 0.0, 1.0);
+
+      vec3 spec = Specular(specularColor, h, viewDirection, lightDirection, a, NdL, NdV, NdH, VdH, LdV);
+
+      finalColor += (attenuation * NdL * light.color.rgb * (diffuse * (1.0 - spec) + spec));
+    }
+  }
+
+  fragcolor = vec4(finalColor, 1.0);
+}
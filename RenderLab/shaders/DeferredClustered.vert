@@ -0,0 +1,9 @@
+#version 440
+
+layout(location = 0) in vec3 in_pos;
+
+// The mesh is a single triangle already in clip space that covers the screen
+void main()
+{
+  gl_Position = vec4(in_pos.xy, 0.0, 1.0);
+}
@@ -1,5 +1,7 @@
 glslangValidator.exe -V DeferredComposite.vert -o DeferredComposite.vert.spv
 glslangValidator.exe -V DeferredComposite.frag -o DeferredComposite.frag.spv
+glslangValidator.exe -V DeferredClustered.vert -o DeferredClustered.vert.spv
+glslangValidator.exe -V DeferredClustered.frag -o DeferredClustered.frag.spv
 glslangValidator.exe -V DepthPrepass.vert -o DepthPrepass.vert.spv
 glslangValidator.exe -V DepthPrepass.frag -o DepthPrepass.frag.spv
 glslangValidator.exe -V GBufferUber.vert -o GBufferUber.vert.spv